@@ -0,0 +1,51 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <string>
+#include <vector>
+
+#include "prepared_statement_wrapper.h"
+
+class worker;
+
+//A catalog storage engine. It owns the database connection, creates the statements and knows the SQL dialect,
+//so the worker only has to use the subset of SQL all backends share.
+class Backend {
+public:
+  virtual ~Backend() {}
+
+  //name as given to --backend
+  virtual const char* name() const = 0;
+  //executes a statement without result, throws SQLException on errors
+  //returns false if the connection was lost and the statement may be retried after reconnect()
+  virtual bool query(const std::string& sql) = 0;
+  //returns an unprepared statement, use PreparedStatementWrapper::create
+  virtual PreparedStatementWrapper* statement(worker* w, const std::string& sql, PreparedStatementWrapper::resultMode_t mode) = 0;
+  //tries to reestablish a lost connection, returns true on success
+  virtual bool reconnect() { return false; }
+  //makes all writes so far durable, backends batching writes into transactions commit them here
+  virtual void flush() {}
+  //stores the query plan of the statement sql as lines of text in plan, returns false if the backend has no planner
+  virtual bool explain(const std::string& sql __attribute__((unused)), std::vector<std::string>& plan __attribute__((unused))) { return false; }
+
+  //announces the tables the statements will use, called before any statement is prepared
+  virtual void useTables(const std::string& directoryTable __attribute__((unused)), const std::string& fileTable __attribute__((unused))) {}
+  //creates the directory and file tables if they do not exist
+  virtual void createTables(const std::string& directoryTable, const std::string& fileTable) = 0;
+  //creates the table of duplicate groups (grp, id, size, hash) if it does not exist
+  virtual void createDuplicatesTable(const std::string& table) = 0;
+  //deletes all rows of table
+  virtual void clearTable(const std::string& table) = 0;
+  //true if the hash column of fileTable stores digests instead of printed hashes (schema v3)
+  virtual bool binaryHashes(const std::string& fileTable __attribute__((unused))) { return false; }
+
+  //timestamps are passed to and read from the database as unix time
+  //returns an expression reading column as unix time
+  virtual std::string unixTime(const std::string& column) const = 0;
+  //returns an expression converting the unix time value for storage
+  virtual std::string fromUnixTime(const std::string& value) const = 0;
+  //returns the clause limiting a result, taking the offset and the number of rows as two parameters in this order
+  virtual std::string limit() const { return "LIMIT ?,?"; }
+};
+
+#endif //BACKEND_H
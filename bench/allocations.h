@@ -0,0 +1,10 @@
+#ifndef ALLOCATIONS_H
+#define ALLOCATIONS_H
+
+#include <stdint.h>
+
+//Heap allocations through operator new since the start of the program. The counting operators are defined in their
+//own translation unit, so the compiler never sees their malloc() and free() inlined into new and delete expressions.
+uint64_t allocationCount();
+
+#endif //ALLOCATIONS_H
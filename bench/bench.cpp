@@ -0,0 +1,171 @@
+//Benchmarks the crawler on a synthetic tree with an in-memory catalog, so the results only depend on the crawler and
+//the filesystem. Reports entries per second, read/write and stat calls and heap allocations of every phase.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <boost/program_options.hpp>
+#include <unistd.h>
+
+#include "allocations.h"
+#include "hasher.h"
+#include "kv_backend.h"
+#include "logger.h"
+#include "memory_store.h"
+#include "metrics.h"
+#include "tree_generator.h"
+#include "worker.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+//read and write system calls of the process so far, 0 if /proc/self/io is not readable
+static uint64_t readWriteCalls() {
+  ifstream io("/proc/self/io");
+  string key;
+  uint64_t value, calls = 0;
+  while (io >> key >> value)
+    if (key == "syscr:" || key == "syscw:")
+      calls += value;
+  return calls;
+}
+
+static uint64_t statCalls() {
+  static Histogram& statLatency = METRICS.histogram("fscrawl_stat_seconds", "Latency of stat calls on directory entries");
+  return statLatency.count();
+}
+
+//measures a phase from its construction until print()
+class Measurement {
+public:
+  Measurement(const string& name)
+    : p_name(name),
+      p_readWrite(readWriteCalls()),
+      p_stat(statCalls()),
+      p_allocations(allocationCount()),
+      p_start(chrono::steady_clock::now()) {}
+
+  //entries and bytes processed by the phase, 0 to leave the column empty
+  void print(uint64_t entries, uint64_t bytes) {
+    double seconds = chrono::duration<double>(chrono::steady_clock::now()-p_start).count();
+    uint64_t allocated = allocationCount()-p_allocations;
+    uint64_t readWrite = readWriteCalls()-p_readWrite;
+    char perSecond[32] = "", throughput[32] = "";
+    if (entries)
+      snprintf(perSecond, sizeof(perSecond), "%.0f", entries/seconds);
+    if (bytes)
+      snprintf(throughput, sizeof(throughput), "%.1f", bytes/seconds/(1 << 20));
+    printf("%-18s %9.3f %10llu %12s %10s %12llu %10llu %12llu\n", p_name.c_str(), seconds, (unsigned long long)entries,
+           perSecond, throughput, (unsigned long long)readWrite, (unsigned long long)(statCalls()-p_stat),
+           (unsigned long long)allocated);
+    fflush(stdout);
+  }
+
+private:
+  string p_name;
+  uint64_t p_readWrite;
+  uint64_t p_stat;
+  uint64_t p_allocations;
+  chrono::steady_clock::time_point p_start;
+};
+
+static string defaultScratch() {
+  //tmpfs keeps the disk out of the measurement
+  return access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+}
+
+static void crawl(worker& w, const string& root, uint64_t id, const string& name, uint64_t entries) {
+  w.resetStatistics();
+  Measurement m(name);
+  w.parseDirectory(root, id);
+  m.print(entries, 0);
+}
+
+int main(int argc, char* argv[]) {
+  treeConfig_t config;
+  string sizes, dir;
+  double churn;
+  po::options_description desc("Usage: fscrawl-bench [options]");
+  desc.add_options()
+    ("help,h", "Show this help")
+    ("dir", po::value<string>(&dir)->default_value(defaultScratch()), "Scratch directory the tree is generated in, preferably on tmpfs")
+    ("depth", po::value<unsigned int>(&config.depth)->default_value(3), "Levels of subdirectories")
+    ("fanout", po::value<unsigned int>(&config.fanout)->default_value(8), "Subdirectories per directory")
+    ("files", po::value<unsigned int>(&config.files)->default_value(20), "Files per directory")
+    ("sizes", po::value<string>(&sizes)->default_value("0:1,512:4,4K:4,64K:2,1M:1"), "File sizes with relative weights as SIZE:WEIGHT,...")
+    ("huge-dirs", po::value<unsigned int>(&config.hugeDirectories)->default_value(1), "Additional directories with --huge-files files each")
+    ("huge-files", po::value<unsigned int>(&config.hugeFiles)->default_value(10000), "Files in every huge directory")
+    ("hardlinks", po::value<double>(&config.hardlinks)->default_value(0.05), "Fraction of files created as hard links")
+    ("churn", po::value<double>(&churn)->default_value(0.01), "Fraction of files changed before the churn re-crawl")
+    ("seed", po::value<uint64_t>(&config.seed)->default_value(1), "Seed of the generator, the same seed gives the same tree")
+    ("keep", "Do not delete the generated tree");
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    config.sizes = TreeGenerator::parseSizes(sizes);
+  } catch (exception& e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+  if (vm.count("help")) {
+    cout << desc << endl;
+    return 0;
+  }
+
+  Logger::facility() = new LoggerFacilityConsole();
+  Logger::logLevel() = logWarning;
+
+  TreeGenerator generator(config);
+  const string root = dir+"/fscrawl-bench-"+to_string(getpid());
+  int result = 0;
+  try {
+    Measurement generation("generate");
+    generator.generate(root);
+    printf("%-18s %9s %10s %12s %10s %12s %10s %12s\n", "benchmark", "seconds", "entries", "entries/s", "MB/s",
+           "rw syscalls", "stat calls", "allocations");
+    generation.print(generator.files()+generator.directories(), generator.bytes());
+
+    worker w(new KvBackend(new MemoryStore()));
+    w.setTables("fscrawl_directories", "fscrawl_files");
+    //crawled below a fakepath like most catalogs, verifyTree deletes files without a parent directory
+    uint64_t id = w.descendPath("bench");
+    crawl(w, root, id, "initial crawl", generator.files()+generator.directories());
+    crawl(w, root, id, "unchanged crawl", generator.files()+generator.directories());
+    generator.churn(churn);
+    crawl(w, root, id, "churn crawl", generator.files()+generator.directories());
+
+    {
+      Measurement m("verify tree");
+      w.verifyTree();
+      m.print(generator.files()+generator.directories(), 0);
+    }
+
+    for (int type = Hasher::md5; type < Hasher::hashTypeCount; type++) {
+      Hasher hasher((Hasher::hashType_t)type);
+      Measurement m("hash "+Hasher::hashTypeToString(hasher.getHashType()));
+      string hash;
+      for (size_t i = 0; i < generator.paths().size(); i++)
+        if (hasher.hash(generator.paths()[i], hash) != Hasher::hashSuccess)
+          throw runtime_error("failed to hash "+generator.paths()[i]);
+      m.print(generator.paths().size(), generator.bytes());
+    }
+  } catch (exception& e) {
+    cerr << "Benchmark failed: " << e.what() << endl;
+    result = 1;
+  }
+  if (!vm.count("keep")) {
+    try {
+      generator.remove();
+    } catch (exception& e) {
+      cerr << e.what() << endl;
+      result = 1;
+    }
+  }
+  return result;
+}
@@ -0,0 +1,60 @@
+#include "memory_store.h"
+
+using namespace std;
+
+static kvSlice_t toSlice(const string& s) {
+  kvSlice_t slice = { s.data(), s.size() };
+  return slice;
+}
+
+MemoryStore::MemoryStore() : p_cursor(p_map.end()) {}
+
+const char* MemoryStore::name() const {
+  return "memory";
+}
+
+bool MemoryStore::get(const string& key, kvSlice_t& value) {
+  map_t::const_iterator it = p_map.find(key);
+  if (it == p_map.end())
+    return false;
+  value = toSlice(it->second);
+  return true;
+}
+
+void MemoryStore::put(const string& key, const string& value) {
+  p_map[key] = value;
+}
+
+bool MemoryStore::remove(const string& key) {
+  map_t::iterator it = p_map.find(key);
+  if (it == p_map.end())
+    return false;
+  if (p_cursor == it) //the backend repositions its scans after every modification
+    p_cursor = p_map.end();
+  p_map.erase(it);
+  return true;
+}
+
+bool MemoryStore::seek(const string& key, kvSlice_t& foundKey, kvSlice_t& value) {
+  p_cursor = p_map.lower_bound(key);
+  if (p_cursor == p_map.end())
+    return false;
+  foundKey = toSlice(p_cursor->first);
+  value = toSlice(p_cursor->second);
+  return true;
+}
+
+bool MemoryStore::next(kvSlice_t& key, kvSlice_t& value) {
+  if (p_cursor == p_map.end() || ++p_cursor == p_map.end())
+    return false;
+  key = toSlice(p_cursor->first);
+  value = toSlice(p_cursor->second);
+  return true;
+}
+
+void MemoryStore::commit() {
+}
+
+size_t MemoryStore::size() const {
+  return p_map.size();
+}
@@ -0,0 +1,30 @@
+#ifndef MEMORY_STORE_H
+#define MEMORY_STORE_H
+
+#include <map>
+#include <string>
+
+#include "kv_backend.h"
+
+//KvStore in a std::map, a catalog without any I/O for benchmarking the crawler itself. Commits do nothing.
+class MemoryStore : public KvStore {
+public:
+  MemoryStore();
+
+  const char* name() const;
+  bool get(const std::string& key, kvSlice_t& value);
+  void put(const std::string& key, const std::string& value);
+  bool remove(const std::string& key);
+  bool seek(const std::string& key, kvSlice_t& foundKey, kvSlice_t& value);
+  bool next(kvSlice_t& key, kvSlice_t& value);
+  void commit();
+
+  size_t size() const;
+
+private:
+  typedef std::map<std::string, std::string> map_t;
+  map_t p_map;
+  map_t::const_iterator p_cursor;
+};
+
+#endif //MEMORY_STORE_H
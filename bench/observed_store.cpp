@@ -0,0 +1,46 @@
+#include "observed_store.h"
+
+using namespace std;
+
+ObservedStore::ObservedStore(KvStore* store, const commitHook_t& hook) : p_store(store), p_hook(hook) {}
+
+ObservedStore::~ObservedStore() {
+  delete p_store;
+}
+
+const char* ObservedStore::name() const {
+  return p_store->name();
+}
+
+bool ObservedStore::get(const string& key, kvSlice_t& value) {
+  return p_store->get(key, value);
+}
+
+void ObservedStore::put(const string& key, const string& value) {
+  p_store->put(key, value);
+  p_written.push_back(key);
+}
+
+bool ObservedStore::remove(const string& key) {
+  if (!p_store->remove(key))
+    return false;
+  p_removed.push_back(key);
+  return true;
+}
+
+bool ObservedStore::seek(const string& key, kvSlice_t& foundKey, kvSlice_t& value) {
+  return p_store->seek(key, foundKey, value);
+}
+
+bool ObservedStore::next(kvSlice_t& key, kvSlice_t& value) {
+  return p_store->next(key, value);
+}
+
+void ObservedStore::commit() {
+  p_store->commit();
+  if (p_written.empty() && p_removed.empty())
+    return;
+  p_hook(p_written, p_removed);
+  p_written.clear();
+  p_removed.clear();
+}
@@ -0,0 +1,34 @@
+#ifndef OBSERVED_STORE_H
+#define OBSERVED_STORE_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "kv_backend.h"
+
+//Forwards to another store and passes the keys written and removed by every commit to a hook once the commit is
+//durable, so benchmarks can tell when a change reached the catalog. Like every store it is used by one thread.
+class ObservedStore : public KvStore {
+public:
+  typedef std::function<void(const std::vector<std::string>& written, const std::vector<std::string>& removed)> commitHook_t;
+
+  ObservedStore(KvStore* store, const commitHook_t& hook); //takes ownership of store
+  ~ObservedStore();
+
+  const char* name() const;
+  bool get(const std::string& key, kvSlice_t& value);
+  void put(const std::string& key, const std::string& value);
+  bool remove(const std::string& key);
+  bool seek(const std::string& key, kvSlice_t& foundKey, kvSlice_t& value);
+  bool next(kvSlice_t& key, kvSlice_t& value);
+  void commit();
+
+private:
+  KvStore* p_store;
+  commitHook_t p_hook;
+  std::vector<std::string> p_written;
+  std::vector<std::string> p_removed;
+};
+
+#endif //OBSERVED_STORE_H
@@ -0,0 +1,217 @@
+#include "tree_generator.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static runtime_error systemError(const string& msg) {
+  return runtime_error(msg+": "+strerror(errno));
+}
+
+TreeGenerator::TreeGenerator(const treeConfig_t& config)
+  : p_config(config),
+    p_state(config.seed ? config.seed : 1),
+    p_totalWeight(0),
+    p_directories(0),
+    p_bytes(0),
+    p_created(0) {
+  if (p_config.sizes.empty())
+    p_config.sizes.push_back(make_pair(0, 1));
+  for (size_t i = 0; i < p_config.sizes.size(); i++)
+    p_totalWeight += p_config.sizes[i].second;
+  p_content.resize(1 << 20);
+  for (size_t i = 0; i < p_content.size(); i += 8) {
+    uint64_t r = random();
+    memcpy(&p_content[i], &r, 8);
+  }
+}
+
+vector< pair<uint64_t, double> > TreeGenerator::parseSizes(const string& spec) {
+  vector< pair<uint64_t, double> > sizes;
+  size_t start = 0;
+  while (start < spec.size()) {
+    size_t end = spec.find(',', start);
+    if (end == string::npos)
+      end = spec.size();
+    const string item = spec.substr(start, end-start);
+    char* suffix;
+    uint64_t size = strtoull(item.c_str(), &suffix, 10);
+    switch (*suffix) {
+      case 'K' : size <<= 10; suffix++; break;
+      case 'M' : size <<= 20; suffix++; break;
+      case 'G' : size <<= 30; suffix++; break;
+    }
+    char* rest;
+    double weight = *suffix == ':' ? strtod(suffix+1, &rest) : -1;
+    if (suffix == item.c_str() || weight < 0 || *rest != '\0')
+      throw runtime_error("invalid file size \""+item+"\", expected SIZE:WEIGHT");
+    sizes.push_back(make_pair(size, weight));
+    start = end+1;
+  }
+  return sizes;
+}
+
+uint64_t TreeGenerator::random() {
+  //xorshift64*
+  p_state ^= p_state >> 12;
+  p_state ^= p_state << 25;
+  p_state ^= p_state >> 27;
+  return p_state * 2685821657736338717ULL;
+}
+
+uint64_t TreeGenerator::randomSize() {
+  double pick = (random() >> 11) * (1.0/(1ULL << 53)) * p_totalWeight;
+  for (size_t i = 0; i < p_config.sizes.size(); i++) {
+    pick -= p_config.sizes[i].second;
+    if (pick < 0)
+      return p_config.sizes[i].first;
+  }
+  return p_config.sizes.back().first;
+}
+
+void TreeGenerator::createDirectory(const string& path) {
+  if (mkdir(path.c_str(), 0755))
+    throw systemError("failed to create "+path);
+  p_directories++;
+}
+
+void TreeGenerator::createFile(const string& path, uint64_t size) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0)
+    throw systemError("failed to create "+path);
+  //every file starts at another offset of the content, so files of equal size differ
+  size_t offset = (p_created++ * 4099) % p_content.size();
+  for (uint64_t written = 0; written < size; ) {
+    size_t chunk = min<uint64_t>(size-written, p_content.size()-offset);
+    ssize_t ret = ::write(fd, p_content.data()+offset, chunk);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret < 0) {
+      runtime_error e = systemError("failed to write "+path);
+      close(fd);
+      throw e;
+    }
+    written += ret;
+    offset = (offset+ret) % p_content.size();
+  }
+  close(fd);
+  p_bytes += size;
+}
+
+void TreeGenerator::populate(const string& path, unsigned int files) {
+  for (unsigned int i = 0; i < files; i++) {
+    const string file = path+"/f"+to_string(i);
+    bool link = !p_files.empty() && (random() >> 11) * (1.0/(1ULL << 53)) < p_config.hardlinks;
+    if (link) {
+      const string& target = p_files[random() % p_files.size()];
+      if (::link(target.c_str(), file.c_str()))
+        throw systemError("failed to link "+file+" to "+target);
+      struct stat st;
+      if (stat(file.c_str(), &st) == 0)
+        p_bytes += st.st_size;
+    } else
+      createFile(file, randomSize());
+    p_files.push_back(file);
+  }
+}
+
+void TreeGenerator::generate(const string& root) {
+  p_root = root;
+  createDirectory(root);
+  p_directories = 0; //the root is not an entry of the catalog
+  vector<string> level(1, root);
+  for (unsigned int depth = 0; ; depth++) {
+    vector<string> next;
+    for (size_t i = 0; i < level.size(); i++) {
+      populate(level[i], p_config.files);
+      if (depth == p_config.depth)
+        continue;
+      for (unsigned int d = 0; d < p_config.fanout; d++) {
+        next.push_back(level[i]+"/d"+to_string(d));
+        createDirectory(next.back());
+      }
+    }
+    if (next.empty())
+      break;
+    level.swap(next);
+  }
+  for (unsigned int i = 0; i < p_config.hugeDirectories; i++) {
+    const string path = root+"/huge"+to_string(i);
+    createDirectory(path);
+    populate(path, p_config.hugeFiles);
+  }
+}
+
+void TreeGenerator::churn(double fraction) {
+  size_t count = max<size_t>(1, p_files.size()*fraction);
+  for (size_t i = 0; i < count && !p_files.empty(); i++) {
+    size_t index = random() % p_files.size();
+    const string file = p_files[index];
+    switch (i % 3) {
+      case 0 : { //grows, which changes size and mtime
+        int fd = open(file.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd < 0 || ::write(fd, p_content.data(), 4096) != 4096) {
+          runtime_error e = systemError("failed to append to "+file);
+          if (fd >= 0)
+            close(fd);
+          throw e;
+        }
+        close(fd);
+        p_bytes += 4096;
+        break;
+      }
+      case 1 : {
+        struct stat st;
+        if (stat(file.c_str(), &st) == 0)
+          p_bytes -= st.st_size;
+        if (unlink(file.c_str()))
+          throw systemError("failed to delete "+file);
+        p_files[index] = p_files.back();
+        p_files.pop_back();
+        break;
+      }
+      case 2 : {
+        const string added = file.substr(0, file.rfind('/'))+"/churn"+to_string(p_created);
+        createFile(added, randomSize());
+        p_files.push_back(added);
+        break;
+      }
+    }
+  }
+}
+
+static int removeEntry(const char* path, const struct stat* st __attribute__((unused)), int flag __attribute__((unused)), struct FTW* ftw __attribute__((unused))) {
+  return ::remove(path);
+}
+
+void TreeGenerator::remove() {
+  if (!p_root.empty() && nftw(p_root.c_str(), removeEntry, 64, FTW_DEPTH | FTW_PHYS))
+    throw systemError("failed to delete "+p_root);
+  p_root.clear();
+  p_files.clear();
+}
+
+uint64_t TreeGenerator::directories() const {
+  return p_directories;
+}
+
+uint64_t TreeGenerator::files() const {
+  return p_files.size();
+}
+
+uint64_t TreeGenerator::bytes() const {
+  return p_bytes;
+}
+
+const vector<string>& TreeGenerator::paths() const {
+  return p_files;
+}
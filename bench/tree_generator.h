@@ -0,0 +1,62 @@
+#ifndef TREE_GENERATOR_H
+#define TREE_GENERATOR_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+//shape of a synthetic tree, the same configuration always generates the same tree
+struct treeConfig_t {
+  unsigned int depth; //levels of subdirectories below the root
+  unsigned int fanout; //subdirectories per directory
+  unsigned int files; //files per directory
+  std::vector< std::pair<uint64_t, double> > sizes; //file sizes with their relative weights
+  unsigned int hugeDirectories; //additional directories in the root holding hugeFiles files each
+  unsigned int hugeFiles;
+  double hardlinks; //fraction of the files created as hard link to an earlier file
+  uint64_t seed;
+};
+
+//Creates a deterministic directory tree for benchmarks. Sizes and contents come from a seeded xorshift generator,
+//not from the standard distributions, whose results differ between standard libraries.
+class TreeGenerator {
+public:
+  TreeGenerator(const treeConfig_t& config);
+
+  //parses "size:weight,..." with sizes like 512, 16K or 4M, throws runtime_error on errors
+  static std::vector< std::pair<uint64_t, double> > parseSizes(const std::string& spec);
+
+  //creates the tree in root, which must not exist yet, throws runtime_error on errors
+  void generate(const std::string& root);
+  //changes fraction of the files in equal parts by appending to, deleting and adding files next to them
+  void churn(double fraction);
+  //deletes the tree
+  void remove();
+
+  uint64_t directories() const;
+  uint64_t files() const;
+  uint64_t bytes() const;
+  //paths of all files, hard links included
+  const std::vector<std::string>& paths() const;
+
+private:
+  uint64_t random();
+  uint64_t randomSize();
+  void createDirectory(const std::string& path);
+  void createFile(const std::string& path, uint64_t size);
+  void populate(const std::string& path, unsigned int files);
+
+  treeConfig_t p_config;
+  std::string p_root;
+  uint64_t p_state;
+  double p_totalWeight;
+  std::string p_content; //files are written from this buffer at varying offsets
+  std::vector<std::string> p_files; //regular files and hard links
+  uint64_t p_directories;
+  uint64_t p_bytes;
+  uint64_t p_created;
+};
+
+#endif //TREE_GENERATOR_H
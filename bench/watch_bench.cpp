@@ -0,0 +1,395 @@
+//Measures how fast and how completely watch mode carries filesystem changes into the catalog. While worker::watch runs
+//on a synthetic tree, a load generator creates, writes, renames and deletes files in bursts at a given rate. The
+//latency of an operation lasts from its system call until the commit that holds its catalog row; operations whose
+//row never arrives are reported as dropped, together with the overflows of the inotify queue.
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/program_options.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "hasher.h"
+#include "kv_backend.h"
+#include "logger.h"
+#include "memory_store.h"
+#include "metrics.h"
+#include "observed_store.h"
+#include "tree_generator.h"
+#include "worker.h"
+#ifdef WITH_LMDB
+#include "lmdb_store.h"
+#endif
+
+using namespace std;
+namespace po = boost::program_options;
+
+enum operation_t { opCreate, opWrite, opRename, opDelete, operationCount };
+static const char* const operationNames[] = { "create", "write", "rename", "delete" };
+
+//name of the file a key of the catalog belongs to, empty for keys of directories and secondary keys
+static string fileName(const string& key) {
+  char type;
+  string name;
+  if (!KvBackend::parseEntryKey(key, type, name) || type != 'f')
+    return string();
+  return name;
+}
+
+//parses "operation:weight,..." into weights by operation
+static vector<double> parseMix(const string& spec) {
+  vector<double> mix(operationCount, 0);
+  size_t start = 0;
+  while (start < spec.size()) {
+    size_t end = spec.find(',', start);
+    if (end == string::npos)
+      end = spec.size();
+    const string item = spec.substr(start, end-start);
+    size_t colon = item.find(':');
+    int op = 0;
+    while (op < operationCount && item.compare(0, colon, operationNames[op]) != 0)
+      op++;
+    char* rest = 0;
+    double weight = colon == string::npos ? -1 : strtod(item.c_str()+colon+1, &rest);
+    if (op == operationCount || weight < 0 || *rest != '\0')
+      throw runtime_error("invalid operation \""+item+"\", expected create, write, rename or delete with :WEIGHT");
+    mix[op] = weight;
+    start = end+1;
+  }
+  return mix;
+}
+
+class LoadGenerator {
+public:
+  LoadGenerator(const vector<string>& directories, const vector<string>& files, const vector<double>& mix,
+                uint64_t seed, size_t writeSize)
+    : p_directories(directories), p_idle(files), p_mix(mix), p_totalWeight(0), p_random(seed), p_created(0),
+      p_content(writeSize, 'x') {
+    for (int op = 0; op < operationCount; op++) {
+      p_totalWeight += p_mix[op];
+      p_issued[op] = p_committed[op] = p_failed[op] = 0;
+    }
+    if (p_totalWeight <= 0)
+      throw runtime_error("the operation mix has no weight");
+  }
+
+  //creates probe files until one reached the catalog, as the watcher sets up its watches some time after starting.
+  //Returns false if none did within timeout.
+  bool ready(chrono::seconds timeout) {
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now()+timeout;
+    for (unsigned int attempt = 0; chrono::steady_clock::now() < deadline; attempt++) {
+      const string probe = "probe"+to_string(attempt);
+      if (create(p_directories[0]+'/'+probe, false) && drain(chrono::milliseconds(100)))
+        return true;
+      lock_guard<mutex> lock(p_mutex);
+      p_pending.erase(probe);
+    }
+    return false;
+  }
+
+  //performs one randomly chosen operation
+  void step() {
+    double pick = uniform_real_distribution<double>(0, p_totalWeight)(p_random);
+    int op = 0;
+    while (op < operationCount-1 && (pick -= p_mix[op]) >= 0)
+      op++;
+    string path;
+    if (op != opCreate && !takeIdle(path))
+      op = opCreate; //no file is left to change
+    switch (op) {
+      case opCreate :
+        create(p_directories[p_random() % p_directories.size()]+"/c"+to_string(p_created++), true);
+        break;
+      case opWrite : {
+        track(path, opWrite, 1);
+        int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        bool ok = fd >= 0 && ::write(fd, p_content.data(), p_content.size()) == (ssize_t)p_content.size();
+        if (fd >= 0)
+          close(fd);
+        finish(path, opWrite, true, ok);
+        break;
+      }
+      case opRename : {
+        const string target = path.substr(0, path.rfind('/'))+"/r"+to_string(p_created++);
+        //the removal of the old name is expected as well, so no other operation takes the name until it arrived
+        track(path, opDelete, 1, false);
+        track(target, opRename, 1);
+        bool ok = rename(path.c_str(), target.c_str()) == 0;
+        finish(path, opDelete, false, ok);
+        finish(target, opRename, true, ok);
+        break;
+      }
+      case opDelete : {
+        track(path, opDelete, 1);
+        finish(path, opDelete, true, unlink(path.c_str()) == 0);
+        break;
+      }
+    }
+  }
+
+  //called with the keys of every commit, from the thread writing the catalog
+  void committed(const vector<string>& written, const vector<string>& removed) {
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    lock_guard<mutex> lock(p_mutex);
+    for (size_t i = 0; i < written.size(); i++)
+      arrived(fileName(written[i]), false, now);
+    for (size_t i = 0; i < removed.size(); i++)
+      arrived(fileName(removed[i]), true, now);
+    if (p_pending.empty())
+      p_drained.notify_all();
+  }
+
+  //waits until every operation reached the catalog, returns false if some did not within timeout
+  bool drain(chrono::steady_clock::duration timeout) {
+    unique_lock<mutex> lock(p_mutex);
+    return p_drained.wait_for(lock, timeout, [this]() { return p_pending.empty(); });
+  }
+
+  void report(double seconds) {
+    lock_guard<mutex> lock(p_mutex);
+    uint64_t dropped[operationCount] = { 0 };
+    for (auto it = p_pending.begin(); it != p_pending.end(); it++)
+      if (it->second.measured)
+        dropped[it->second.op]++;
+    uint64_t issued = 0;
+    printf("%-10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "operation", "issued", "committed", "dropped", "failed",
+           "p50 ms", "p90 ms", "p99 ms", "max ms");
+    for (int op = 0; op < operationCount; op++) {
+      issued += p_issued[op];
+      printf("%-10s %10llu %10llu %10llu %10llu %10.3f %10.3f %10.3f %10.3f\n", operationNames[op],
+             (unsigned long long)p_issued[op], (unsigned long long)p_committed[op], (unsigned long long)dropped[op],
+             (unsigned long long)p_failed[op], p_latency[op].quantile(0.5)*1000, p_latency[op].quantile(0.9)*1000,
+             p_latency[op].quantile(0.99)*1000, p_latency[op].max()*1000);
+    }
+    Counter& events = METRICS.counter("fscrawl_inotify_events_total", "inotify events handled");
+    Counter& overflows = METRICS.counter("fscrawl_inotify_overflows_total", "Overflows of the inotify event queue, each one lost events");
+    printf("%llu operations in %.1f seconds (%.0f/s), %llu inotify events handled, %llu queue overflows\n",
+           (unsigned long long)issued, seconds, issued/seconds, (unsigned long long)events.value(),
+           (unsigned long long)overflows.value());
+  }
+
+private:
+  struct pending_t {
+    operation_t op;
+    string path;
+    unsigned int rows; //catalog writes still expected
+    bool measured;
+    chrono::steady_clock::time_point issued;
+  };
+
+  //takes a file without pending operation out of the idle ones
+  bool takeIdle(string& path) {
+    lock_guard<mutex> lock(p_mutex);
+    //names are unique among pending operations, as commits only tell names, not directories
+    for (int attempt = 0; attempt < 8 && !p_idle.empty(); attempt++) {
+      size_t index = p_random() % p_idle.size();
+      if (p_pending.count(p_idle[index].substr(p_idle[index].rfind('/')+1)))
+        continue;
+      path = p_idle[index];
+      p_idle[index] = p_idle.back();
+      p_idle.pop_back();
+      return true;
+    }
+    return false;
+  }
+
+  //registers an operation before its system call, so its commit can not be missed
+  void track(const string& path, operation_t op, unsigned int rows, bool measured = true) {
+    lock_guard<mutex> lock(p_mutex);
+    pending_t& pending = p_pending[path.substr(path.rfind('/')+1)];
+    pending.op = op;
+    pending.path = path;
+    pending.rows = rows;
+    pending.measured = measured;
+    pending.issued = chrono::steady_clock::now();
+    if (measured)
+      p_issued[op]++;
+  }
+
+  //forgets a failed operation
+  void finish(const string& path, operation_t op, bool measured, bool ok) {
+    if (ok)
+      return;
+    if (measured) {
+      LOG(logWarning) << operationNames[op] << " of " << path << " failed: " << worker::errnoString();
+    }
+    lock_guard<mutex> lock(p_mutex);
+    if (measured)
+      p_failed[op]++;
+    p_pending.erase(path.substr(path.rfind('/')+1));
+  }
+
+  bool create(const string& path, bool measured) {
+    //IN_CREATE inserts the row, IN_CLOSE_WRITE updates it once the file is written
+    track(path, opCreate, 2, measured);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    bool ok = fd >= 0 && ::write(fd, p_content.data(), p_content.size()) == (ssize_t)p_content.size();
+    if (fd >= 0)
+      close(fd);
+    finish(path, opCreate, measured, ok);
+    return ok;
+  }
+
+  void arrived(const string& name, bool removed, chrono::steady_clock::time_point now) {
+    unordered_map<string, pending_t>::iterator it = p_pending.find(name);
+    if (it == p_pending.end() || removed != (it->second.op == opDelete) || --it->second.rows > 0)
+      return;
+    if (it->second.measured) {
+      p_latency[it->second.op].observe(now-it->second.issued);
+      p_committed[it->second.op]++;
+    }
+    if (!removed)
+      p_idle.push_back(it->second.path);
+    p_pending.erase(it);
+  }
+
+  vector<string> p_directories;
+  mutex p_mutex;
+  condition_variable p_drained;
+  unordered_map<string, pending_t> p_pending; //by file name
+  vector<string> p_idle; //files without pending operation
+  vector<double> p_mix;
+  double p_totalWeight;
+  mt19937_64 p_random;
+  uint64_t p_created;
+  string p_content; //written by creates and appended by writes
+  uint64_t p_issued[operationCount];
+  uint64_t p_committed[operationCount];
+  uint64_t p_failed[operationCount];
+  Histogram p_latency[operationCount];
+};
+
+int main(int argc, char* argv[]) {
+  treeConfig_t config;
+  string sizes, dir, mix, hash;
+  double rate, duration;
+  unsigned int burst, pause, timeout, writeSize;
+  int logLevel;
+  po::options_description desc("Usage: fscrawl-watch-bench [options]");
+  desc.add_options()
+    ("help,h", "Show this help")
+    ("dir", po::value<string>(&dir)->default_value(access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp"), "Scratch directory the tree is generated in")
+    ("dirs", po::value<unsigned int>(&config.fanout)->default_value(4), "Watched subdirectories")
+    ("files", po::value<unsigned int>(&config.files)->default_value(1000), "Files per directory before the load starts")
+    ("sizes", po::value<string>(&sizes)->default_value("0:1,4K:4,64K:1"), "Initial file sizes with relative weights as SIZE:WEIGHT,...")
+    ("mix", po::value<string>(&mix)->default_value("create:4,write:3,rename:2,delete:1"), "Operations with relative weights")
+    ("rate", po::value<double>(&rate)->default_value(1000), "Operations per second within a burst (0 for as fast as possible)")
+    ("burst", po::value<unsigned int>(&burst)->default_value(1000), "Operations per burst")
+    ("pause", po::value<unsigned int>(&pause)->default_value(1000), "Milliseconds between bursts")
+    ("duration", po::value<double>(&duration)->default_value(10), "Seconds of load")
+    ("write-size", po::value<unsigned int>(&writeSize)->default_value(4096), "Bytes written by creates and appended by writes")
+    ("hash", po::value<string>(&hash)->default_value("none"), "Hash written files in the watcher: none, md5, sha1 or tth")
+    ("timeout", po::value<unsigned int>(&timeout)->default_value(10), "Seconds to wait for outstanding operations after the load, the rest counts as dropped")
+#ifdef WITH_LMDB
+    ("db-file", po::value<string>(), "Write to an LMDB catalog in this file instead of memory")
+#endif
+    ("seed", po::value<uint64_t>(&config.seed)->default_value(1), "Seed of the tree and the operations")
+    ("loglevel,l", po::value<int>(&logLevel)->default_value(logWarning), "Log level of the watcher (0-4)")
+    ("keep", "Do not delete the generated tree");
+  po::variables_map vm;
+  Hasher::hashType_t hashType = Hasher::noHash;
+  vector<double> weights;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    config.sizes = TreeGenerator::parseSizes(sizes);
+    weights = parseMix(mix);
+    while (hash != "none" && hashType < Hasher::hashTypeCount && Hasher::hashTypeToString(hashType) != hash)
+      hashType = (Hasher::hashType_t)(hashType+1);
+    if (hashType == Hasher::hashTypeCount)
+      throw runtime_error("unknown hash type "+hash);
+  } catch (exception& e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+  if (vm.count("help")) {
+    cout << desc << endl;
+    return 0;
+  }
+
+  Logger::facility() = new LoggerFacilityConsole();
+  Logger::logLevel() = (logLevel_t)logLevel;
+
+  config.depth = 1;
+  config.hugeDirectories = 0;
+  config.hugeFiles = 0;
+  config.hardlinks = 0;
+  TreeGenerator generator(config);
+  const string root = dir+"/fscrawl-watch-bench-"+to_string(getpid());
+  int result = 0;
+  try {
+    generator.generate(root);
+    vector<string> directories(1, root);
+    for (unsigned int i = 0; i < config.fanout; i++)
+      directories.push_back(root+"/d"+to_string(i));
+    LoadGenerator load(directories, generator.paths(), weights, config.seed, writeSize);
+
+    KvStore* store = new MemoryStore();
+#ifdef WITH_LMDB
+    if (vm.count("db-file"))
+      store = new LmdbStore(vm["db-file"].as<string>());
+#endif
+    worker w(new KvBackend(new ObservedStore(store, [&load](const vector<string>& written, const vector<string>& removed) {
+      load.committed(written, removed);
+    })));
+    w.setTables("fscrawl_directories", "fscrawl_files");
+    if (hashType != Hasher::noHash)
+      w.setHasher(new Hasher(hashType));
+    uint64_t id = w.descendPath("bench");
+    w.parseDirectory(root, id);
+
+    thread watcher([&]() {
+      try {
+        w.watch(root, id);
+      } catch (exception& e) {
+        LOG(logError) << "Watching failed: " << e.what();
+      }
+    });
+    if (!load.ready(chrono::seconds(timeout))) {
+      w.abort();
+      watcher.join();
+      throw runtime_error("the watcher did not pick up a probe file");
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    chrono::steady_clock::time_point end = start+chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(duration));
+    chrono::steady_clock::duration interval = rate > 0 ? chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(1/rate)) : chrono::steady_clock::duration::zero();
+    chrono::steady_clock::time_point next = start;
+    while (chrono::steady_clock::now() < end) {
+      for (unsigned int i = 0; i < burst && next < end; i++, next += interval) {
+        this_thread::sleep_until(next);
+        load.step();
+      }
+      next += chrono::milliseconds(pause);
+      this_thread::sleep_until(min(next, end));
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+    load.drain(chrono::seconds(timeout));
+    w.abort();
+    watcher.join();
+    load.report(seconds);
+  } catch (exception& e) {
+    cerr << "Benchmark failed: " << e.what() << endl;
+    result = 1;
+  }
+  if (!vm.count("keep")) {
+    try {
+      generator.remove();
+    } catch (exception& e) {
+      cerr << e.what() << endl;
+      result = 1;
+    }
+  }
+  return result;
+}
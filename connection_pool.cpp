@@ -0,0 +1,329 @@
+#include "connection_pool.h"
+#include "logger.h"
+#include "sqlexception.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <errmsg.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+using namespace std;
+
+ConnectionPool::ConnectionPool(const dbConfig_t& primary, unsigned int size)
+  : p_primary(primary),
+    p_size(max(size, 1u)),
+    p_running(true) {
+  if( pipe2(p_wakePipe, O_NONBLOCK | O_CLOEXEC) )
+    throw runtime_error("failed to create wake pipe for connection pool");
+  addConnections(p_primary);
+  p_reactor = thread(&ConnectionPool::loop, this);
+}
+
+ConnectionPool::~ConnectionPool() {
+  {
+    lock_guard<mutex> lock(p_mutex);
+    p_running = false;
+  }
+  wake();
+  p_reactor.join(); //the reactor finishes all queued jobs first
+  for( vector<connection_t>::iterator it = p_connections.begin(); it != p_connections.end(); it++ ) {
+    for( map<string, MYSQL_STMT*>::iterator stmt = it->statements.begin(); stmt != it->statements.end(); stmt++ )
+      mysql_stmt_close(stmt->second);
+    mysql_close(it->con);
+  }
+  close(p_wakePipe[0]);
+  close(p_wakePipe[1]);
+}
+
+unsigned int ConnectionPool::size() const {
+  return p_size;
+}
+
+MYSQL* ConnectionPool::connect(const dbConfig_t& config, bool nonBlocking) {
+  MYSQL* con = mysql_init(0);
+  if( !con )
+    throw SQLException("mysql_init failed");
+
+  //no MYSQL_OPT_RECONNECT, an implicit reconnect silently drops the prepared statements. Lost connections are
+  //replaced by MysqlBackend::reconnect and ConnectionPool::fail, which prepare the statements again.
+  mysql_optionsv(con, MYSQL_OPT_COMPRESS, 0);
+  if( nonBlocking )
+    mysql_options(con, MYSQL_OPT_NONBLOCK, 0);
+
+  if( !mysql_real_connect(con,
+        config.host.c_str(),
+        config.user.c_str(),
+        config.password.c_str(),
+        config.database.c_str(),
+        0, /* port number, 0 for default */
+        NULL, /* socket file or named pipe name */
+        CLIENT_FOUND_ROWS | CLIENT_MULTI_STATEMENTS) ) {
+    SQLException e("mysql_real_connect to "+config.host+" failed", con);
+    mysql_close(con);
+    throw e;
+  }
+  return con;
+}
+
+future<queryResult_t> ConnectionPool::query(const string& sql, const vector<uint64_t>& parameters) {
+  job_t* job = new job_t;
+  job->sql = sql;
+  job->parameters = parameters;
+  future<queryResult_t> result = job->promise.get_future();
+  {
+    lock_guard<mutex> lock(p_mutex);
+    p_jobs.push_back(job);
+  }
+  wake();
+  return result;
+}
+
+void ConnectionPool::addConnections(const dbConfig_t& config) {
+  LOG(logDetailed) << "Opening " << p_size << " pooled connections to " << config.host;
+  p_connections.resize(p_size);
+  for( vector<connection_t>::iterator it = p_connections.begin(); it != p_connections.end(); it++ ) {
+    it->con = connect(config, true);
+    it->state = stateIdle;
+    it->status = 0;
+    it->error = 0;
+    it->stmt = 0;
+    it->job = 0;
+  }
+}
+
+void ConnectionPool::wake() {
+  char c = 0;
+  if( write(p_wakePipe[1], &c, 1) < 0 ) {} //pipe full: the reactor is going to wake up anyway
+}
+
+bool ConnectionPool::takeJob(connection_t& c) {
+  lock_guard<mutex> lock(p_mutex);
+  if( p_jobs.empty() )
+    return false;
+  c.job = p_jobs.front();
+  p_jobs.pop_front();
+  return true;
+}
+
+//prepares the statement of the job of connection c, unless the connection has prepared its SQL before
+void ConnectionPool::start(connection_t& c) {
+  c.state = statePrepare;
+  c.status = 0;
+  c.error = 0;
+  map<string, MYSQL_STMT*>::iterator it = c.statements.find(c.job->sql);
+  if( it != c.statements.end() ) {
+    c.stmt = it->second;
+    advance(c, 0);
+    return;
+  }
+  c.stmt = mysql_stmt_init(c.con);
+  if( !c.stmt ) {
+    fail(c, SQLException("mysql_stmt_init failed for pooled query", c.con), mysql_errno(c.con));
+    return;
+  }
+  my_bool updateMaxLength = 1; //sizes the result buffers in finish()
+  mysql_stmt_attr_set(c.stmt, STMT_ATTR_UPDATE_MAX_LENGTH, &updateMaxLength);
+  c.status = mysql_stmt_prepare_start(&c.error, c.stmt, c.job->sql.c_str(), c.job->sql.length());
+  if( c.status == 0 )
+    advance(c, 0);
+}
+
+void ConnectionPool::loop() {
+  vector<pollfd> fds;
+  vector<connection_t*> busy;
+  while( true ) {
+    //start queued jobs on idle connections
+    for( vector<connection_t>::iterator it = p_connections.begin(); it != p_connections.end(); it++ )
+      if( it->state == stateIdle && takeJob(*it) )
+        start(*it);
+
+    fds.assign(1, pollfd());
+    fds[0].fd = p_wakePipe[0];
+    fds[0].events = POLLIN;
+    busy.clear();
+    int timeout = -1;
+    for( vector<connection_t>::iterator it = p_connections.begin(); it != p_connections.end(); it++ ) {
+      if( it->state == stateIdle )
+        continue;
+      pollfd fd = { .fd = mysql_get_socket(it->con), .events = 0, .revents = 0 };
+      if( it->status & MYSQL_WAIT_READ )
+        fd.events |= POLLIN;
+      if( it->status & MYSQL_WAIT_WRITE )
+        fd.events |= POLLOUT;
+      if( it->status & MYSQL_WAIT_EXCEPT )
+        fd.events |= POLLPRI;
+      if( it->status & MYSQL_WAIT_TIMEOUT ) {
+        int ms = mysql_get_timeout_value_ms(it->con);
+        timeout = timeout < 0 ? ms : min(timeout, ms);
+      }
+      fds.push_back(fd);
+      busy.push_back(&*it);
+    }
+
+    if( busy.empty() ) {
+      lock_guard<mutex> lock(p_mutex);
+      if( !p_running && p_jobs.empty() )
+        break;
+    }
+
+    int ret = poll(fds.data(), fds.size(), timeout);
+    if( ret < 0 && errno != EINTR ) {
+      LOG(logError) << "Connection pool poll failed: " << strerror(errno);
+      continue;
+    }
+    if( fds[0].revents & POLLIN ) {
+      char buffer[64];
+      while( read(p_wakePipe[0], buffer, sizeof(buffer)) > 0 );
+    }
+    for( size_t i = 0; i < busy.size(); i++ ) {
+      int events = 0;
+      if( fds[i+1].revents & (POLLIN | POLLHUP | POLLERR) )
+        events |= MYSQL_WAIT_READ;
+      if( fds[i+1].revents & POLLOUT )
+        events |= MYSQL_WAIT_WRITE;
+      if( fds[i+1].revents & POLLPRI )
+        events |= MYSQL_WAIT_EXCEPT;
+      if( ret == 0 && (busy[i]->status & MYSQL_WAIT_TIMEOUT) )
+        events |= MYSQL_WAIT_TIMEOUT;
+      if( events )
+        advance(*busy[i], events);
+    }
+  }
+}
+
+//continues the operation of connection c, events are the MYSQL_WAIT_* flags that occured (0 if it just finished)
+void ConnectionPool::advance(connection_t& c, int events) {
+  if( events ) {
+    if( c.state == statePrepare )
+      c.status = mysql_stmt_prepare_cont(&c.error, c.stmt, events);
+    else if( c.state == stateExecute )
+      c.status = mysql_stmt_execute_cont(&c.error, c.stmt, events);
+    else
+      c.status = mysql_stmt_store_result_cont(&c.error, c.stmt, events);
+    if( c.status )
+      return;
+  }
+  while( true ) {
+    if( c.error ) {
+      fail(c, SQLException("pooled query failed", c.stmt), mysql_stmt_errno(c.stmt));
+      return;
+    }
+    if( c.state == statePrepare ) {
+      c.statements[c.job->sql] = c.stmt;
+      vector<uint64_t>& parameters = c.job->parameters;
+      if( mysql_stmt_param_count(c.stmt) != parameters.size() ) {
+        fail(c, SQLException("pooled query \""+c.job->sql+"\" got "+to_string(parameters.size())+" parameters"), 0);
+        return;
+      }
+      c.params.assign(parameters.size(), MYSQL_BIND());
+      for( size_t i = 0; i < parameters.size(); i++ ) {
+        c.params[i].buffer_type = MYSQL_TYPE_LONGLONG;
+        c.params[i].buffer = &parameters[i];
+        c.params[i].is_unsigned = 1;
+      }
+      if( mysql_stmt_bind_param(c.stmt, c.params.data()) ) {
+        fail(c, SQLException("mysql_stmt_bind_param failed for pooled query", c.stmt), mysql_stmt_errno(c.stmt));
+        return;
+      }
+      c.state = stateExecute;
+      c.status = mysql_stmt_execute_start(&c.error, c.stmt);
+    } else if( c.state == stateExecute ) {
+      c.state = stateStore;
+      c.status = mysql_stmt_store_result_start(&c.error, c.stmt);
+    } else {
+      finish(c);
+      return;
+    }
+    if( c.status )
+      return;
+  }
+}
+
+//reads the stored result of connection c into the promise of its job, values are returned as strings
+void ConnectionPool::finish(connection_t& c) {
+  queryResult_t rows;
+  MYSQL_RES* metadata = mysql_stmt_result_metadata(c.stmt);
+  if( metadata ) {
+    unsigned int fields = mysql_num_fields(metadata);
+    MYSQL_FIELD* info = mysql_fetch_fields(metadata);
+    vector<MYSQL_BIND> binds(fields, MYSQL_BIND());
+    vector< vector<char> > buffers(fields);
+    vector<unsigned long> lengths(fields);
+    vector<my_bool> nulls(fields), errors(fields);
+    for( unsigned int i = 0; i < fields; i++ ) {
+      buffers[i].resize(max<unsigned long>(info[i].max_length, 32)+1);
+      binds[i].buffer_type = MYSQL_TYPE_STRING;
+      binds[i].buffer = buffers[i].data();
+      binds[i].buffer_length = buffers[i].size();
+      binds[i].length = &lengths[i];
+      binds[i].is_null = &nulls[i];
+      binds[i].error = &errors[i];
+    }
+    mysql_free_result(metadata);
+    if( mysql_stmt_bind_result(c.stmt, binds.data()) ) {
+      fail(c, SQLException("mysql_stmt_bind_result failed for pooled query", c.stmt), mysql_stmt_errno(c.stmt));
+      return;
+    }
+    rows.reserve(mysql_stmt_num_rows(c.stmt));
+    int ret;
+    while( (ret = mysql_stmt_fetch(c.stmt)) == 0 || ret == MYSQL_DATA_TRUNCATED ) { //does not block on stored results
+      rows.push_back(vector<string>(fields));
+      for( unsigned int i = 0; i < fields; i++ ) {
+        if( nulls[i] )
+          continue;
+        if( lengths[i] > buffers[i].size() ) { //not covered by max_length, fetch the column on its own
+          string& value = rows.back()[i];
+          value.resize(lengths[i]);
+          MYSQL_BIND bind = binds[i];
+          bind.buffer = &value[0];
+          bind.buffer_length = value.size();
+          if( mysql_stmt_fetch_column(c.stmt, &bind, i, 0) ) {
+            fail(c, SQLException("failed to fetch truncated column of pooled query", c.stmt), mysql_stmt_errno(c.stmt));
+            return;
+          }
+        } else
+          rows.back()[i].assign(buffers[i].data(), lengths[i]);
+      }
+    }
+    if( ret != MYSQL_NO_DATA ) {
+      fail(c, SQLException("mysql_stmt_fetch failed for pooled query", c.stmt), mysql_stmt_errno(c.stmt));
+      return;
+    }
+  }
+  mysql_stmt_free_result(c.stmt);
+  c.job->promise.set_value(rows);
+  delete c.job;
+  c.job = 0;
+  c.stmt = 0;
+  c.state = stateIdle;
+}
+
+void ConnectionPool::fail(connection_t& c, const SQLException& error, unsigned int errorCode) {
+  c.job->promise.set_exception(make_exception_ptr(error));
+  if( c.stmt ) {
+    mysql_stmt_free_result(c.stmt);
+    if( c.state == statePrepare && !c.statements.count(c.job->sql) ) //failed to prepare
+      mysql_stmt_close(c.stmt);
+  }
+  delete c.job;
+  c.job = 0;
+  c.stmt = 0;
+  c.state = stateIdle;
+  if( errorCode == CR_SERVER_GONE_ERROR || errorCode == CR_SERVER_LOST ) {
+    LOG(logWarning) << "Pooled connection to " << p_primary.host << " lost, reconnecting";
+    try {
+      MYSQL* con = connect(p_primary, true);
+      for( map<string, MYSQL_STMT*>::iterator it = c.statements.begin(); it != c.statements.end(); it++ )
+        mysql_stmt_close(it->second);
+      c.statements.clear();
+      mysql_close(c.con);
+      c.con = con;
+    } catch( SQLException& e ) {
+      LOG(logError) << e.what(); //keep the broken connection, its next query fails and tries again
+    }
+  }
+}
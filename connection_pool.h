@@ -0,0 +1,77 @@
+#ifndef CONNECTION_POOL_H
+#define CONNECTION_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <mysql.h>
+
+#include "query_pool.h"
+#include "sqlexception.h"
+
+//A pool of non-blocking connections to the primary server. Queries are prepared statements, queued and driven by a
+//single reactor thread through the MariaDB non-blocking API (mysql_stmt_*_start/_cont), so up to one query per
+//connection is in flight at the same time. Every connection prepares the SQL of a query the first time it runs it and
+//keeps the statement. Callers get a future and only block once they actually need the result.
+//The pooled lookups decide what the crawl inserts and deletes, so they never go to a replica: one lagging behind would
+//miss the rows just written to the primary.
+//Writes stay on the blocking connection of the backend, in the order the crawl makes them. An insert returns the id
+//of its row, which the children of a directory and the observers need right away, and a write in flight on another
+//connection would be missed by the lookups that decide the next writes.
+class ConnectionPool : public QueryPool {
+public:
+  ConnectionPool(const dbConfig_t& primary, unsigned int size);
+  ~ConnectionPool();
+  unsigned int size() const;
+
+  std::future<queryResult_t> query(const std::string& sql, const std::vector<uint64_t>& parameters);
+
+  //opens a connection, non-blocking connections can be used with both the blocking and the non-blocking API
+  //throws SQLException on failure
+  static MYSQL* connect(const dbConfig_t& config, bool nonBlocking = false);
+
+private:
+  struct job_t {
+    std::string sql;
+    std::vector<uint64_t> parameters;
+    std::promise<queryResult_t> promise;
+  };
+  enum state_t { stateIdle, statePrepare, stateExecute, stateStore };
+  struct connection_t {
+    MYSQL* con;
+    state_t state;
+    int status; //MYSQL_WAIT_* flags the current operation is waiting for
+    int error;
+    MYSQL_STMT* stmt; //of the current job
+    std::vector<MYSQL_BIND> params; //bound to the parameters of the current job
+    std::map<std::string, MYSQL_STMT*> statements; //prepared on this connection, by their SQL
+    job_t* job;
+  };
+
+  void addConnections(const dbConfig_t& config);
+  void loop();
+  bool takeJob(connection_t& c);
+  void start(connection_t& c);
+  void advance(connection_t& c, int events);
+  void finish(connection_t& c);
+  void fail(connection_t& c, const SQLException& error, unsigned int errorCode);
+  void wake();
+
+  dbConfig_t p_primary;
+  unsigned int p_size;
+  std::vector<connection_t> p_connections;
+
+  std::mutex p_mutex;
+  std::deque<job_t*> p_jobs;
+  bool p_running;
+  int p_wakePipe[2];
+  std::thread p_reactor;
+};
+
+#endif //CONNECTION_POOL_H
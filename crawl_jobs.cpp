@@ -0,0 +1,288 @@
+#include "crawl_jobs.h"
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <dirent.h>
+
+#include "logger.h"
+#include "options.h"
+#include "sqlexception.h"
+#include "worker.h"
+
+using namespace std;
+
+//fakepath with the slashes the crawler skips removed, so "/a//b/" becomes "a/b" and the root ""
+static string normalizedFakepath(const string& fakepath) {
+  string normalized;
+  istringstream elements(fakepath);
+  string element;
+  while (getline(elements, element, '/'))
+    if (!element.empty())
+      normalized += (normalized.empty() ? "" : "/")+element;
+  return normalized;
+}
+
+//true if the tree of fakepath a contains the one of b or the other way round
+static bool fakepathsOverlap(const string& a, const string& b) {
+  const string& shorter = a.size() < b.size() ? a : b;
+  const string& longer = a.size() < b.size() ? b : a;
+  return shorter.empty() || longer == shorter || longer.compare(0, shorter.size()+1, shorter+'/') == 0;
+}
+
+vector<crawlJob_t> parseJobFile(const string& file, const crawlJob_t& defaults) {
+  ifstream in(file.c_str());
+  if (!in)
+    throw runtime_error("failed to open job file "+file+": "+worker::errnoString());
+  vector<crawlJob_t> jobs;
+  vector<unsigned int> lines; //of the jobs
+  string line;
+  for (unsigned int number = 1; getline(in, line); number++) {
+    istringstream fields(line);
+    string field;
+    if (!(fields >> field) || field[0] == '#')
+      continue;
+    const string where = file+':'+to_string(number)+": ";
+    crawlJob_t job = defaults;
+    job.basedir = field;
+    while (job.basedir.size() > 1 && job.basedir[job.basedir.size()-1] == '/')
+      job.basedir.erase(job.basedir.size()-1);
+    while (fields >> field) {
+      size_t equals = field.find('=');
+      const string key = field.substr(0, equals);
+      const string value = equals == string::npos ? string() : field.substr(equals+1);
+      if (key == "fakepath")
+        job.fakepath = value;
+      else if (key == "hash") {
+        job.hashType = Hasher::noHash;
+        while (value != "none" && job.hashType < Hasher::hashTypeCount && Hasher::hashTypeToString(job.hashType) != value)
+          job.hashType = (Hasher::hashType_t)(job.hashType+1);
+        if (job.hashType == Hasher::hashTypeCount)
+          throw runtime_error(where+"unknown hash type \""+value+"\", use md5, sha1, tth or none");
+      } else if (key == "tables") {
+        size_t comma = value.find(',');
+        if (comma == string::npos || comma == 0 || comma == value.size()-1)
+          throw runtime_error(where+"tables need to be given as DIRTABLE,FILETABLE");
+        job.directoryTable = value.substr(0, comma);
+        job.fileTable = value.substr(comma+1);
+      } else if (key == "schedule") {
+        if (!options::parseDuration(value, job.interval) || job.interval == 0)
+          throw runtime_error(where+"invalid schedule \""+value+"\", e.g. 30m, 6h or 1d");
+      } else
+        throw runtime_error(where+"unknown field \""+field+"\", expected fakepath=, hash=, tables= or schedule=");
+    }
+    //a crawl deletes everything below its fakepath that is not in its basedir, including the trees of other jobs
+    for (size_t i = 0; i < jobs.size(); i++)
+      if (jobs[i].directoryTable == job.directoryTable && jobs[i].fileTable == job.fileTable &&
+          fakepathsOverlap(normalizedFakepath(jobs[i].fakepath), normalizedFakepath(job.fakepath)))
+        throw runtime_error(where+"fakepath \""+job.fakepath+"\" overlaps with fakepath \""+jobs[i].fakepath+"\" of line "+
+                            to_string(lines[i])+", jobs in the same tables need separate fakepaths that are not empty or nested");
+    jobs.push_back(job);
+    lines.push_back(number);
+  }
+  return jobs;
+}
+
+//returns true if path holds nothing besides . and .., throws runtime_error if it can not be read
+static bool directoryEmpty(const string& path) {
+  DIR* dir = opendir(path.c_str());
+  if (!dir)
+    throw runtime_error("failed to read directory "+path+": "+worker::errnoString());
+  int n = 0;
+  while (n <= 2 && readdir(dir))
+    n++;
+  closedir(dir);
+  return n <= 2;
+}
+
+CrawlJobRunner::CrawlJobRunner(const vector<crawlJob_t>& jobs, const vector<Backend*>& backends, QueryPool* pool,
+                               const configure_t& configure)
+  : p_backends(backends),
+    p_pool(pool),
+    p_configure(configure),
+    p_abortRequested(false),
+    p_aborted(false),
+    p_threads(0) {
+  chrono::steady_clock::time_point now = chrono::steady_clock::now();
+  for (size_t i = 0; i < jobs.size(); i++) {
+    state_t state = { jobs[i], now, false, false, 0, 0, 0, 0, 0, 0, 0, string() };
+    p_jobs.push_back(state);
+  }
+}
+
+void CrawlJobRunner::run() {
+  LOG(logInfo) << "Crawling " << p_jobs.size() << " roots, " << p_backends.size() << " at a time";
+  vector<std::thread> threads;
+  p_threads = p_backends.size();
+  for (size_t i = 0; i < p_backends.size(); i++)
+    threads.push_back(std::thread(&CrawlJobRunner::thread, this, p_backends[i]));
+  {
+    //abort() may run in a signal handler and must not lock p_mutex, so the crawls are stopped from here
+    unique_lock<mutex> lock(p_mutex);
+    while (p_threads > 0) {
+      p_changed.wait_for(lock, chrono::milliseconds(100));
+      if (p_abortRequested && !p_aborted)
+        abortCrawls();
+    }
+  }
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+}
+
+void CrawlJobRunner::abort() {
+  p_abortRequested = true;
+}
+
+void CrawlJobRunner::abortCrawls() {
+  LOG(logInfo) << "Aborting the running crawls";
+  p_aborted = true;
+  for (size_t i = 0; i < p_jobs.size(); i++)
+    if (p_jobs[i].crawler)
+      p_jobs[i].crawler->abort();
+  p_changed.notify_all();
+}
+
+void CrawlJobRunner::thread(Backend* backend) {
+  size_t index;
+  while (next(index))
+    crawl(backend, index);
+  lock_guard<mutex> lock(p_mutex);
+  p_threads--;
+  p_changed.notify_all();
+}
+
+bool CrawlJobRunner::next(size_t& index) {
+  unique_lock<mutex> lock(p_mutex);
+  for (;;) {
+    if (p_aborted || p_abortRequested)
+      return false;
+    bool pending = false;
+    index = p_jobs.size();
+    for (size_t i = 0; i < p_jobs.size(); i++) {
+      if (p_jobs[i].done)
+        continue;
+      pending = true;
+      if (!p_jobs[i].running && (index == p_jobs.size() || p_jobs[i].due < p_jobs[index].due))
+        index = i;
+    }
+    if (!pending)
+      return false;
+    if (index == p_jobs.size()) //the remaining jobs are being crawled by other threads
+      p_changed.wait(lock);
+    else if (p_jobs[index].due > chrono::steady_clock::now())
+      p_changed.wait_until(lock, p_jobs[index].due);
+    else {
+      p_jobs[index].running = true;
+      return true;
+    }
+  }
+}
+
+void CrawlJobRunner::crawl(Backend* backend, size_t index) {
+  state_t& state = p_jobs[index];
+  const crawlJob_t& job = state.job; //not changed after construction
+  worker crawler(backend);
+  crawler.setConnectionPool(p_pool);
+  crawler.setTables(job.directoryTable, job.fileTable);
+  p_configure(&crawler);
+  Hasher hasher(job.hashType);
+  if (job.hashType != Hasher::noHash)
+    crawler.setHasher(&hasher);
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  {
+    lock_guard<mutex> lock(p_mutex);
+    state.crawler = &crawler;
+    if (p_aborted) //aborted after next() picked the job
+      crawler.abort();
+  }
+
+  LOG(logInfo) << "Crawling " << job.basedir << (job.fakepath.empty() ? string() : " into fakepath \""+job.fakepath+'"');
+  string error;
+  try {
+    if (directoryEmpty(job.basedir) && !OPTS.allowEmpty())
+      throw runtime_error("basedir "+job.basedir+" is empty, use --allow-empty if intended");
+    uint64_t id = 0;
+    if (!job.fakepath.empty()) {
+      lock_guard<mutex> lock(p_descendMutex);
+      id = crawler.descendPath(job.fakepath);
+    }
+    crawler.parseDirectory(job.basedir, id);
+  } catch (SQLException& e) {
+    error = string("SQL Exception: ")+e.what();
+  } catch (exception& e) {
+    error = e.what();
+  }
+  double seconds = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+  {
+    lock_guard<mutex> lock(p_mutex);
+    if (p_aborted && error.empty())
+      error = "aborted";
+  }
+  if (error.empty()) {
+    LOG(logInfo) << "Crawled " << job.basedir << ": " << crawler.getStatistics().files << " files and "
+                 << crawler.getStatistics().directories << " directories in " << fixed << setprecision(1) << seconds << 's';
+  } else
+    LOG(logError) << "Crawling " << job.basedir << " failed: " << error;
+
+  lock_guard<mutex> lock(p_mutex);
+  state.crawler = 0;
+  state.running = false;
+  state.runs++;
+  state.totalSeconds += seconds;
+  if (error.empty()) {
+    state.files = crawler.getStatistics().files;
+    state.directories = crawler.getStatistics().directories;
+    state.seconds = seconds;
+  } else {
+    state.failures++;
+    state.error = error;
+  }
+  if (job.interval == 0)
+    state.done = true;
+  else
+    state.due = start+chrono::seconds(job.interval);
+  p_changed.notify_all();
+}
+
+void CrawlJobRunner::logStatistics() const {
+  lock_guard<mutex> lock(p_mutex);
+  for (size_t i = 0; i < p_jobs.size(); i++) {
+    const state_t& state = p_jobs[i];
+    ostringstream os;
+    os << state.job.basedir;
+    if (!state.job.fakepath.empty())
+      os << " (" << state.job.fakepath << ')';
+    os << ": " << state.runs << (state.runs == 1 ? " crawl" : " crawls");
+    if (state.failures)
+      os << ", " << state.failures << " failed (last: " << state.error << ')';
+    if (state.runs > state.failures)
+      os << ", last " << state.files << " files and " << state.directories << " directories in "
+         << fixed << setprecision(1) << state.seconds << 's';
+    os << ", " << fixed << setprecision(1) << state.totalSeconds << "s in total";
+    if (state.failures) {
+      LOG(logWarning) << os.str();
+    } else
+      LOG(logInfo) << os.str();
+  }
+}
+
+unsigned int CrawlJobRunner::failures() const {
+  lock_guard<mutex> lock(p_mutex);
+  unsigned int failures = 0;
+  for (size_t i = 0; i < p_jobs.size(); i++)
+    failures += p_jobs[i].failures;
+  return failures;
+}
+
+worker::statistics CrawlJobRunner::totals() const {
+  lock_guard<mutex> lock(p_mutex);
+  worker::statistics totals = { 0, 0 };
+  for (size_t i = 0; i < p_jobs.size(); i++) {
+    totals.files += p_jobs[i].files;
+    totals.directories += p_jobs[i].directories;
+  }
+  return totals;
+}
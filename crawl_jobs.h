@@ -0,0 +1,92 @@
+#ifndef CRAWL_JOBS_H
+#define CRAWL_JOBS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "hasher.h"
+#include "worker.h"
+
+//a root crawled by --jobs
+struct crawlJob_t {
+  std::string basedir;
+  std::string fakepath;
+  Hasher::hashType_t hashType;
+  std::string directoryTable;
+  std::string fileTable;
+  uint64_t interval; //seconds from the start of a crawl to the next one, 0 to crawl once
+};
+
+//Reads a job file with one root per line: BASEDIR followed by optional fakepath=PATH, hash=md5|sha1|tth|none,
+//tables=DIRTABLE,FILETABLE and schedule=INTERVAL (e.g. 30m, 6h). Empty lines and lines starting with # are skipped.
+//Missing fields are taken from defaults. The fakepaths of jobs in the same tables must not be equal or nested, an empty
+//one contains all others, as a crawl removes what it does not find below its fakepath. Throws runtime_error naming the
+//line of an error.
+std::vector<crawlJob_t> parseJobFile(const std::string& file, const crawlJob_t& defaults);
+
+//Crawls jobs concurrently, one thread per backend. Every crawl gets a fresh worker on the backend of its thread, so
+//connections are opened once and shared by all jobs. Jobs with a schedule are crawled again once their interval has
+//passed, so run() only returns by itself if no job has one.
+class CrawlJobRunner {
+public:
+  //applies the command line settings (dry run, progress, threads) to the worker of a crawl
+  typedef std::function<void(worker*)> configure_t;
+
+  CrawlJobRunner(const std::vector<crawlJob_t>& jobs, const std::vector<Backend*>& backends, QueryPool* pool,
+                 const configure_t& configure);
+
+  //returns when all jobs are done or abort() was called
+  void run();
+  //stops the running crawls and starts no new ones. Only sets a flag, so it can be called from a signal handler, the
+  //crawls are stopped by run() within a tenth of a second.
+  void abort();
+  //logs files, directories, duration and failures of every root
+  void logStatistics() const;
+  //number of crawls that failed
+  unsigned int failures() const;
+  //files and directories of the last successful crawl of every root
+  worker::statistics totals() const;
+
+private:
+  struct state_t {
+    crawlJob_t job;
+    std::chrono::steady_clock::time_point due;
+    bool running;
+    bool done;
+    worker* crawler; //while running
+    unsigned int runs;
+    unsigned int failures;
+    uint64_t files; //of the last successful crawl
+    uint64_t directories;
+    double seconds;
+    double totalSeconds;
+    std::string error; //of the last failed crawl
+  };
+
+  void thread(Backend* backend);
+  //picks the job due next and waits for it, returns false once all jobs are done or aborted
+  bool next(size_t& index);
+  void crawl(Backend* backend, size_t index);
+  //called by run() with p_mutex held once abort() was called
+  void abortCrawls();
+
+  std::vector<state_t> p_jobs;
+  std::vector<Backend*> p_backends;
+  QueryPool* p_pool;
+  configure_t p_configure;
+  std::atomic<bool> p_abortRequested; //set by abort()
+  bool p_aborted; //the crawls have been told to stop
+  unsigned int p_threads; //still running
+  mutable std::mutex p_mutex;
+  std::condition_variable p_changed;
+  std::mutex p_descendMutex; //jobs below the same fakepath must not create its directories twice
+};
+
+#endif //CRAWL_JOBS_H
@@ -2,22 +2,81 @@
 #include <iostream>
 #include <string>
 #include <csignal>
+#include <cstdlib>
 #include <dirent.h>
-
-#include <mysql.h>
+#include <unistd.h>
 
 #include "worker.h"
+#include "crawl_jobs.h"
 #include "logger.h"
 #include "hasher.h"
 #include "options.h"
 #include "sqlexception.h"
+#include "throttle.h"
+#include "metrics.h"
+#include "trace.h"
+#include "connection_pool.h"
+#include "mysql_backend.h"
+#include "sqlite_backend.h"
+#include "kv_backend.h"
+#include "snapshot.h"
+#include "tree_index.h"
+#include "query_server.h"
+#include "name_index.h"
+#ifdef WITH_LMDB
+#include "lmdb_store.h"
+#endif
+#ifdef WITH_PG
+#include "pg_backend.h"
+#endif
 
 using namespace std;
 
 static worker* w = 0;
-static MYSQL* con = 0;
+static Backend* backend = 0;
+static QueryPool* pool = 0;
+static Snapshot* snapshot = 0;
+static MetricsReporter* metricsReporter = 0;
+static CrawlJobRunner* jobRunner = 0;
+static vector<Backend*> jobBackends; //connections of --jobs besides backend
+static NameIndexWriter* names = 0; //--index-names
+
+//operations that only read the catalog may use --replica-host, the lookups of crawls decide about writes and must
+//see everything written before
+bool replicaOperation() {
+  switch (OPTS.getOperation()) {
+    case options::opPrint :
+    case options::opCheck :
+    case options::opExportSnapshot :
+    case options::opDiff :
+      return OPTS.count("replica-host");
+    default :
+      return false;
+  }
+}
+
+Backend* openBackend(const string& type, const string& file) {
+  if (type == "sqlite") {
+    LOG(logInfo) << "Opening catalog " << file;
+    return new SqliteBackend(file);
+  }
+#ifdef WITH_LMDB
+  if (type == "lmdb") {
+    LOG(logInfo) << "Opening catalog " << file;
+    return new KvBackend(new LmdbStore(file));
+  }
+#endif
+  dbConfig_t config = { replicaOperation() ? OPT_STR("replica-host") : OPT_STR("host"), OPT_STR("user"), OPT_STR("password"), OPT_STR("database") };
+  LOG(logInfo) << "Connecting to SQL server " << config.host;
+#ifdef WITH_PG
+  if (type == "postgres")
+    return new PgBackend(config);
+#endif
+  MysqlBackend::partitions() = OPTS["partitions"].as<unsigned int>();
+  return new MysqlBackend(config);
+}
 
-void initFakepath(worker* w, uint32_t& fakepathId, const string& fakepath) {
+void initFakepath(worker* w, uint64_t& fakepathId, const string& fakepath) {
   if( !fakepath.empty() ) {
     LOG(logInfo) << "Using fakepath \"" << fakepath << '\"';
     fakepathId = w->descendPath(fakepath);
@@ -25,29 +84,119 @@ void initFakepath(worker* w, uint32_t& fakepathId, const string& fakepath) {
   }
 }
 
+//node of fakepath in the snapshot, fakepath is relative to the directory the snapshot was exported from
+uint32_t snapshotNode(const Snapshot* snapshot, const string& fakepath) {
+  uint32_t node = snapshot->lookup(fakepath);
+  if (node == Snapshot::none || !snapshot->isDirectory(node))
+    throw runtime_error("fakepath \""+fakepath+"\" is no directory of the snapshot");
+  return node;
+}
+
+//loads the name index of --index-names if it matches the catalog, so a crawl only has to apply its own changes
+bool loadNameIndex(worker* w, NameIndexWriter& names) {
+  const string& file = OPT_STR("index-names");
+  if (access(file.c_str(), F_OK))
+    return false;
+  try {
+    NameIndex index(file);
+    worker::catalogCounts_t counts;
+    if (!w->countCatalog(counts) || counts.directories != index.directories() || counts.maxDirectoryId != index.maxDirectoryId() ||
+        counts.files != index.entries()-index.directories() || counts.maxFileId != index.maxFileId()) {
+      LOG(logInfo) << "Name index " << file << " does not match the catalog, rebuilding it after the crawl";
+      return false;
+    }
+    names.load(index);
+    return true;
+  } catch (exception& e) {
+    LOG(logWarning) << e.what() << ", rebuilding it after the crawl";
+    return false;
+  }
+}
+
+bool isTableSource(const string& spec) {
+  return spec.compare(0, 7, "tables:") == 0;
+}
+
+//opens a side of --diff: a snapshot file, or tables:DIRTABLE,FILETABLE of the catalog exported to a temporary snapshot
+Snapshot* openDiffSource(const string& spec) {
+  if (!isTableSource(spec)) {
+    LOG(logInfo) << "Opening snapshot " << spec;
+    return new Snapshot(spec);
+  }
+  size_t comma = spec.find(',');
+  if (comma == string::npos)
+    throw runtime_error("invalid table pair \""+spec+"\", use tables:DIRTABLE,FILETABLE");
+  const char* tmpdir = getenv("TMPDIR");
+  string file = string(tmpdir && *tmpdir ? tmpdir : "/tmp")+"/fscrawl-diff-XXXXXX";
+  int fd = mkstemp(&file[0]);
+  if (fd < 0)
+    throw runtime_error("failed to create a temporary snapshot: "+worker::errnoString());
+  close(fd);
+  Snapshot* result = 0;
+  try {
+    worker exporter(backend);
+    exporter.setTables(spec.substr(7, comma-7), spec.substr(comma+1));
+    exporter.exportSnapshot(file);
+    result = new Snapshot(file);
+  } catch (...) {
+    unlink(file.c_str());
+    throw;
+  }
+  unlink(file.c_str()); //the mapping stays valid
+  return result;
+}
+
 void cleanup() {
+  THROTTLE.stop();
   if (w) {
     delete w;
     w = 0;
   }
-  if (con) {
-    mysql_close(con);
-    con = 0;
+  if (jobRunner) {
+    delete jobRunner;
+    jobRunner = 0;
+  }
+  if (names) {
+    delete names;
+    names = 0;
+  }
+  for (size_t i = 0; i < jobBackends.size(); i++)
+    delete jobBackends[i];
+  jobBackends.clear();
+  if (pool) {
+    delete pool;
+    pool = 0;
+  }
+  if (backend) {
+    delete backend;
+    backend = 0;
+  }
+  if (snapshot) {
+    delete snapshot;
+    snapshot = 0;
+  }
+  TRACER.stop();
+  if (metricsReporter) { //last, so the textfile includes the writes of the closed backend
+    delete metricsReporter;
+    metricsReporter = 0;
   }
 }
 
-void signalHandler(int signum) {
-  static int interruptsReceived = 0;
+//only async-signal-safe calls: the aborts set atomic flags, which the crawls check outside of the signal context
+void signalHandler(int signum __attribute__((unused))) {
+  static volatile sig_atomic_t interruptsReceived = 0;
   switch (interruptsReceived) {
     case 0 :
-      LOG(logDebug) << "Signal " << signum << " received. Sending abort to worker.";
-      w->abort();
-      break;
-    default :
-      LOG(logWarning) << "Second interrupt received, terminating";
-      cleanup();
-      exit(1);
+      if (jobRunner)
+        jobRunner->abort();
+      else
+        w->abort();
       break;
+    default : {
+      static const char message[] = "Second interrupt received, terminating\n";
+      if (write(STDERR_FILENO, message, sizeof(message)-1) < 0) {} //nothing left to report it to
+      _exit(1);
+    }
   }
   interruptsReceived++;
 }
@@ -72,6 +221,31 @@ bool directoryEmpty(const string& path) {
     return false;
 }
 
+//Crawls the roots of the job file, returns false if any crawl failed. Server backends get a connection per concurrent
+//job, opened once for all of them; sqlite and lmdb catalogs have a single writer, so their jobs take turns.
+bool crawlJobs() {
+  crawlJob_t defaults = { string(), string(), OPTS.hashType(), OPT_STR("dir-table"), OPT_STR("file-table"), 0 };
+  vector<crawlJob_t> jobs = parseJobFile(OPT_STR("jobs"), defaults);
+  vector<Backend*> backends(1, backend);
+  if (OPTS.backend() == "mysql" || OPTS.backend() == "postgres")
+    while (backends.size() < min<size_t>(OPTS.concurrentJobs(), jobs.size())) {
+      jobBackends.push_back(openBackend(OPTS.backend(), OPT_STR("db-file")));
+      backends.push_back(jobBackends.back());
+    }
+  THROTTLE.setMaxReaders(OPTS.threads());
+  //the postgres pipeline belongs to the connection of backend, only the mysql pool serves several workers
+  jobRunner = new CrawlJobRunner(jobs, backends, OPTS.backend() == "mysql" ? pool : 0, [](worker* crawler) {
+    crawler->setDuplicatesTable(OPT_STR("dup-table"));
+    crawler->setThreads(OPTS.threads());
+    crawler->setProgressInterval(OPTS.progressInterval());
+    crawler->setProgress(OPTS.count("progress"));
+    crawler->setDryRun(OPTS.dryRun());
+  });
+  jobRunner->run();
+  jobRunner->logStatistics();
+  return jobRunner->failures() == 0;
+}
+
 int main(int argc, char* argv[]) {
   switch (OPTS.parse(argc, argv)) {
     case 1 : return 0; // immediate quit (help, version)
@@ -81,49 +255,88 @@ int main(int argc, char* argv[]) {
   string basedir = OPT_STR("basedir");
   string fakepath = OPT_STR("fakepath");
 
+  PreparedStatementWrapper::prefetchRows() = OPTS["prefetch-rows"].as<unsigned long>();
+  PreparedStatementWrapper::maxRetries() = OPTS["db-retries"].as<unsigned int>();
+  PreparedStatementWrapper::slowThreshold() = OPTS["slow-statements"].as<double>()/1000;
+  SqliteBackend::cacheSize() = OPTS.sqliteCacheSize();
+  SqliteBackend::mmapSize() = OPTS.sqliteMmapSize();
+
+  if (OPTS.count("trace")) {
+    try {
+      TRACER.start(OPT_STR("trace"));
+    } catch (exception& e) {
+      LOG(logError) << e.what();
+      return 1;
+    }
+  }
+
   try {
-    LOG(logInfo) << "Connecting to SQL server";
-    con = mysql_init(0);
-
-    bool reconnect = 1;
-    mysql_optionsv(con, MYSQL_OPT_RECONNECT, &reconnect);
-    mysql_optionsv(con, MYSQL_OPT_COMPRESS, 0);
-
-    con = mysql_real_connect(con,
-      OPT_STR("host").c_str(),
-      OPT_STR("user").c_str(),
-      OPT_STR("password").c_str(),
-      OPT_STR("database").c_str(),
-      0, /* port number, 0 for default */
-      NULL, /* socket file or named pipe name */
-      CLIENT_FOUND_ROWS | CLIENT_MULTI_STATEMENTS);
-    if (!con)
-      throw runtime_error("mysql_real_connect failed: "+string(mysql_error(con)));
+    if (OPTS.count("snapshot")) { //no database access at all
+      LOG(logInfo) << "Opening snapshot " << OPT_STR("snapshot");
+      snapshot = new Snapshot(OPT_STR("snapshot"));
+    } else if (OPTS.getOperation() != options::opFind && //reads the name index only
+               (OPTS.getOperation() != options::opDiff || isTableSource(OPTS.diffSources()[0]) || isTableSource(OPTS.diffSources()[1])))
+      backend = openBackend(OPTS.backend(), OPT_STR("db-file"));
+
+    //only crawls look up directories, the other operations scan the tables
+    unsigned int poolSize = backend && OPTS.getOperation() == options::opCrawl ? OPTS["pool-size"].as<unsigned int>() : 0;
+    if (OPTS.backend() == "mysql" && poolSize > 0) {
+      dbConfig_t primary = { OPT_STR("host"), OPT_STR("user"), OPT_STR("password"), OPT_STR("database") };
+      pool = new ConnectionPool(primary, poolSize);
+    }
+#ifdef WITH_PG
+    if (OPTS.backend() == "postgres" && poolSize > 0) {
+      //the pipelined lookups have to see the rows just written by backend, so they go to the primary as well
+      dbConfig_t config = { OPT_STR("host"), OPT_STR("user"), OPT_STR("password"), OPT_STR("database") };
+      pool = new PgPipeline(config, poolSize, static_cast<PgBackend*>(backend));
+    }
+#endif
   } catch( exception& e ) {
-    LOG(logError) << "Failed to connect: " << e.what();
+    LOG(logError) << "Failed to open catalog: " << e.what();
     exit(1);
   }
 
   LOG(logDebug) << "setting up worker";
-  w = new worker(con);
+  w = new worker(backend);
+  w->setConnectionPool(pool);
   w->setTables(OPT_STR("dir-table"),OPT_STR("file-table"));
+  w->setDuplicatesTable(OPT_STR("dup-table"));
+  w->setThreads(OPTS.threads());
+  w->setProgressInterval(OPTS.progressInterval());
+  w->setProgress(OPTS.count("progress"));
+  if (OPTS.count("status-file"))
+    w->setStatusFile(OPT_STR("status-file"));
   w->setDryRun(options::getInstance().count("dry-run"));
+  w->setExplain(OPTS.count("explain"));
+  w->setReadOnly(replicaOperation());
 
   signal(SIGINT, signalHandler);
   signal(SIGTERM, signalHandler);
+  metricsReporter = new MetricsReporter(OPTS.count("metrics-file") ? OPT_STR("metrics-file") : string(), OPTS["metrics-interval"].as<unsigned int>());
+
+  THROTTLE.setMaxReadRate(OPTS.maxReadRate());
+  THROTTLE.setMaxIops(OPTS.maxIops());
+  if (OPTS.adaptiveIo())
+    THROTTLE.enableAdaptive(OPTS.threads(), OPTS.stallTarget());
 
   Hasher::hashType_t hashType = OPTS.hashType();
   if (hashType != Hasher::noHash)
     w->setHasher(new Hasher(hashType));
 
-  uint32_t fakepathId = 0; //if no fakepath is used, 0 is the root parent directory id
+  uint64_t fakepathId = 0; //if no fakepath is used, 0 is the root parent directory id
 
   //Save starting time
   time_t start = time(0);
+  int exitCode = 0;
 
   try {
     switch (OPTS.getOperation()) {
-      case options::opCrawl :
+      case options::opCrawl : {
+        if (OPTS.count("jobs")) {
+          if (!crawlJobs())
+            exitCode = 1;
+          break;
+        }
         if( directoryEmpty(basedir) ) {
           if (!OPTS.allowEmpty()) {
             LOG(logError) << "Basedir " << basedir << " is empty. Use --allow-empty if intended or --clear to delete all files";
@@ -132,31 +345,101 @@ int main(int argc, char* argv[]) {
             LOG(logWarning) << "Basedir " << basedir << " is empty, will remove all files.";
           }
         }
+        bool namesFollowed = false;
+        if (OPTS.count("index-names")) {
+          names = new NameIndexWriter(OPT_STR("index-names"));
+          namesFollowed = loadNameIndex(w, *names);
+          if (namesFollowed)
+            w->addObserver(names);
+        }
         initFakepath(w, fakepathId, fakepath);
         LOG(logInfo) << "Parsing directory \"" << basedir << '\"';
         w->parseDirectory(basedir, fakepathId);
+        if (names && !namesFollowed && w->loadNames(*names)) {
+          namesFollowed = true;
+          w->addObserver(names); //for watching
+        }
+        if (names && namesFollowed) {
+          LOG(logInfo) << "Wrote " << names->save() << " names to " << OPT_STR("index-names");
+        }
         break;
+      }
       case options::opCheck :
-        initFakepath(w, fakepathId, fakepath);
         LOG(logInfo) << "Checking hashes of files in directory \"" << basedir << '\"';
-        w->hashCheck(basedir, fakepathId);
+        if (snapshot) {
+          w->hashCheck(basedir, *snapshot, snapshotNode(snapshot, fakepath), OPTS.count("check-report") ? OPT_STR("check-report") : string());
+          break;
+        }
+        initFakepath(w, fakepathId, fakepath);
+        w->hashCheck(basedir, fakepathId, OPTS.count("check-report") ? OPT_STR("check-report") : string());
         break;
       case options::opVerify :
         LOG(logInfo) << "Verifying tree";
         w->verifyTree();
         LOG(logInfo) << "Tree verified";
         break;
-      case options::opPrint :
-        initFakepath(w, fakepathId, fakepath);
+      case options::opPrint : {
         LOG(logInfo) << "Printing tree";
-        w->printTree(fakepathId);
+        PrintWriter out(OPTS.count("print-sums") ? PrintWriter::formatSums : PrintWriter::parseFormat(OPT_STR("print-format")),
+                        OPTS.count("print-output") ? OPT_STR("print-output") : string());
+        if (snapshot)
+          w->printSnapshot(out, *snapshot, snapshotNode(snapshot, fakepath));
+        else {
+          initFakepath(w, fakepathId, fakepath);
+          w->printTree(out, fakepathId);
+        }
         LOG(logInfo) << "Tree printed";
         break;
+      }
       case options::opClear :
         initFakepath(w, fakepathId, fakepath);
         LOG(logWarning) << "Deleting everything on fakepath \"" << fakepath << '\"';
         w->deleteDirectory(fakepathId);
         break;
+      case options::opDuplicates :
+        initFakepath(w, fakepathId, fakepath);
+        LOG(logInfo) << "Searching duplicates in directory \"" << basedir << '\"';
+        w->findDuplicates(basedir, fakepathId, OPTS.sampleSize());
+        break;
+      case options::opScrub :
+        initFakepath(w, fakepathId, fakepath);
+        LOG(logInfo) << "Scrubbing files in directory \"" << basedir << '\"';
+        w->scrub(basedir, fakepathId, OPTS.timeBudget(), OPTS.byteBudget(), OPTS.count("check-report") ? OPT_STR("check-report") : string());
+        break;
+      case options::opConvert : {
+        LOG(logInfo) << "Converting catalog to " << OPT_STR("convert");
+        Backend* target = openBackend(OPTS.convertTarget(), OPTS.convertFile());
+        worker* targetWorker = new worker(target);
+        targetWorker->setTables(OPT_STR("dir-table"),OPT_STR("file-table"));
+        targetWorker->setDryRun(OPTS.dryRun());
+        w->copyCatalog(targetWorker);
+        delete targetWorker;
+        delete target;
+        break;
+      }
+      case options::opExportSnapshot :
+        initFakepath(w, fakepathId, fakepath);
+        LOG(logInfo) << "Exporting snapshot to " << OPT_STR("export-snapshot");
+        w->exportSnapshot(OPT_STR("export-snapshot"), fakepathId);
+        break;
+      case options::opDiff : {
+        LOG(logInfo) << "Comparing " << OPTS.diffSources()[0] << " to " << OPTS.diffSources()[1];
+        Snapshot* oldSnapshot = openDiffSource(OPTS.diffSources()[0]);
+        Snapshot* newSnapshot = openDiffSource(OPTS.diffSources()[1]);
+        w->diffSnapshots(*oldSnapshot, snapshotNode(oldSnapshot, fakepath), *newSnapshot, snapshotNode(newSnapshot, fakepath));
+        delete oldSnapshot;
+        delete newSnapshot;
+        break;
+      }
+      case options::opFind : {
+        NameIndex index(OPT_STR("index-names"));
+        uint64_t found = index.find(OPT_STR("find"), [&index](uint32_t entry) {
+          cout << index.path(entry) << '\n';
+        });
+        cout.flush();
+        LOG(logInfo) << "Found " << found << " of " << index.entries() << " names";
+        break;
+      }
       case options::opPurge :
         LOG(logWarning) << "Clearing database";
         w->clearDatabase();
@@ -173,17 +456,31 @@ int main(int argc, char* argv[]) {
       duration -= 3600;
     for(minutes = 0; duration > 60; minutes++)
       duration -= 60;
+    worker::statistics processed = jobRunner ? jobRunner->totals() : w->getStatistics();
     LOG(logInfo) << "Processed "
-                << w->getStatistics().files << " files and "
-                << w->getStatistics().directories << " directories in "
+                << processed.files << " files and "
+                << processed.directories << " directories in "
                 << hours << "h"
                 << minutes << "m"
                 << duration << "s";
 
-    if (OPTS.getOperation() == options::opCrawl && OPTS.watch()) {
+    if (OPTS.getOperation() == options::opCrawl && OPTS.daemon()) {
+      //the index follows the catalog through the worker, the server only reads it
+      TreeIndex index;
+      w->loadIndex(index);
+      w->addObserver(&index);
+      QueryServer server(OPT_STR("daemon"), index);
       LOG(logInfo) << "Entering watch mode on " << basedir;
       w->watch(basedir, fakepathId);
+      w->removeObserver(&index);
       LOG(logInfo) << "Finished watching";
+    } else if (OPTS.getOperation() == options::opCrawl && OPTS.watch()) {
+      LOG(logInfo) << "Entering watch mode on " << basedir;
+      w->watch(basedir, fakepathId);
+      LOG(logInfo) << "Finished watching";
+    }
+    if (names && OPTS.watch()) {
+      LOG(logInfo) << "Wrote " << names->save() << " names to " << OPT_STR("index-names");
     }
   } catch( SQLException& e ) {
     LOG(logError) << "SQL Exception: " << e.what();
@@ -193,7 +490,8 @@ int main(int argc, char* argv[]) {
     exit(1);
   }
 
+  PreparedStatementWrapper::logStatistics();
   cleanup();
 
-  return 0;
+  return exitCode;
 }
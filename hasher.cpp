@@ -1,11 +1,21 @@
 #include "hasher.h"
 
+#include <cctype>
 #include <cerrno>
 #include <cstring>
+#include <vector>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <rhash.h>
 
 #include "logger.h"
+#include "metrics.h"
+#include "throttle.h"
+
+static const char* base32Alphabet = "abcdefghijklmnopqrstuvwxyz234567"; //lower case like rhash prints it
+static const char* hexAlphabet = "0123456789abcdef";
 
 Hasher::Hasher(hashType_t type) : p_hashType(type) {
   LOG(logDebug) << "Initializing hasher library, rhash";
@@ -21,33 +31,97 @@ Hasher::hashType_t Hasher::getHashType() const {
 }
 
 Hasher::hashStatus_t Hasher::hash(const string& filename, string& hash) {
-  unsigned rhashType;
-  switch( p_hashType ) {
-    case tth: rhashType = RHASH_TTH; break;
-    case md5: rhashType = RHASH_MD5; break;
-    case sha1: rhashType = RHASH_SHA1; break;
-    default:
-      LOG(logError) << "Hasher called with no hash algorithm selected";
-      return noHashSelected;
+  return hashFile(filename, 0, hash, "");
+}
+
+Hasher::hashStatus_t Hasher::hashSample(const string& filename, uint64_t sampleSize, string& hash) {
+  return hashFile(filename, max<uint64_t>(sampleSize, 1), hash, "sample ");
+}
+
+Hasher::hashStatus_t Hasher::hashFile(const string& filename, uint64_t sampleSize, string& hash, const char* kind) {
+  unsigned rhashType = rhashId();
+  if( rhashType == 0 ) {
+    LOG(logError) << "Hasher called with no hash algorithm selected";
+    return noHashSelected;
   }
 
-  unsigned char digest[64];
-  int res = rhash_file(rhashType, filename.c_str(), digest);
-  if( res < 0 ) {
-    LOG(logError) << "LibRHash error: " << strerror(errno);
+  IoThrottle::Reader reader; //holds a reader slot while the file is read
+  THROTTLE.operation();
+  int fd = open(filename.c_str(), O_RDONLY);
+  struct stat64 fileStat;
+  if( fd < 0 || fstat64(fd, &fileStat) ) {
+    LOG(logError) << "Failed to open " << filename << " for hashing: " << strerror(errno);
+    if( fd >= 0 )
+      close(fd);
     return hashError;
   }
 
+  //read the whole file or the head and, if it does not overlap, the tail of the file
+  uint64_t size = fileStat.st_size;
+  uint64_t headLength = sampleSize ? min(size, sampleSize) : size;
+  uint64_t tailOffset = max(headLength, size > sampleSize ? size-sampleSize : 0);
+  uint64_t ranges[2][2] = { { 0, headLength }, { tailOffset, size-tailOffset } };
+  if( !sampleSize )
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  static Counter& hashedBytes = METRICS.counter("fscrawl_hashed_bytes_total", "Bytes read for hashing");
+  static Counter& hashedFiles = METRICS.counter("fscrawl_hashed_files_total", "Files read for hashing, including samples");
+  hashedFiles.add();
+  vector<char> buffer(sampleSize ? 65536 : 1048576);
+  rhash ctx = rhash_init(rhashType);
+  bool ok = ctx != 0;
+  for( int r = 0; ok && r < 2; r++ ) {
+    uint64_t offset = ranges[r][0];
+    uint64_t remaining = ranges[r][1];
+    while( remaining > 0 ) {
+      ssize_t len = pread64(fd, buffer.data(), min<uint64_t>(remaining, buffer.size()), offset);
+      if( len <= 0 ) {
+        LOG(logError) << "Failed to read " << filename << " for hashing: " << (len < 0 ? strerror(errno) : "unexpected end of file");
+        ok = false;
+        break;
+      }
+      THROTTLE.read(len);
+      hashedBytes.add(len);
+      rhash_update(ctx, buffer.data(), len);
+      offset += len;
+      remaining -= len;
+    }
+  }
+  close(fd);
+
+  if( !ok ) {
+    if( ctx )
+      rhash_free(ctx);
+    return hashError;
+  }
+
+  unsigned char digest[64];
+  rhash_final(ctx, digest);
+  rhash_free(ctx);
+  hash = printDigest(digest);
+
+  logLevel_t level = sampleSize ? logDebug : logDetailed;
+  LOG(level) << "Calculated " << rhash_get_name(rhashType) << ' ' << kind << "hash of file " << filename << ": " << hash;
+  return hashSuccess;
+}
+
+unsigned Hasher::rhashId() const {
+  switch( p_hashType ) {
+    case tth: return RHASH_TTH;
+    case md5: return RHASH_MD5;
+    case sha1: return RHASH_SHA1;
+    default: return 0;
+  }
+}
+
+string Hasher::printDigest(const unsigned char* digest) const {
   char output[130];
   size_t length = 0;
   if( p_hashType == tth )
-    length = rhash_print_bytes(output, digest, rhash_get_digest_size(rhashType), RHPR_BASE32);
+    length = rhash_print_bytes(output, digest, rhash_get_digest_size(rhashId()), RHPR_BASE32);
   else
-    length = rhash_print_bytes(output, digest, rhash_get_digest_size(rhashType), RHPR_HEX);
-  hash = string(output, length);
-
-  LOG(logDetailed) << "Calculated " << rhash_get_name(rhashType) << " hash of file " << filename << ": " << hash;
-  return hashSuccess;
+    length = rhash_print_bytes(output, digest, rhash_get_digest_size(rhashId()), RHPR_HEX);
+  return string(output, length);
 }
 
 string Hasher::hashTypeToString(hashType_t type) {
@@ -59,3 +133,69 @@ string Hasher::hashTypeToString(hashType_t type) {
     default : return "invalid";
   }
 }
+
+size_t Hasher::digestSize(hashType_t type) {
+  switch (type) {
+    case Hasher::md5 : return 16;
+    case Hasher::sha1 : return 20;
+    case Hasher::tth : return 24;
+    default : return 0;
+  }
+}
+
+Hasher::hashType_t Hasher::printedHashType(const string& hash) {
+  switch (hash.length()) {
+    case 32 : return Hasher::md5;
+    case 40 : return Hasher::sha1;
+    case 39 : return Hasher::tth;
+    default : return Hasher::noHash;
+  }
+}
+
+string Hasher::toBinary(const string& hash) {
+  hashType_t type = printedHashType(hash);
+  string digest;
+  if (type == Hasher::tth) {
+    unsigned int buffer = 0, bits = 0;
+    for (string::const_iterator it = hash.begin(); it != hash.end(); it++) {
+      const char* digit = *it ? strchr(base32Alphabet, tolower(*it)) : 0;
+      if (!digit)
+        return string();
+      buffer = (buffer << 5) | (digit-base32Alphabet);
+      if ((bits += 5) >= 8) {
+        digest += (char)(buffer >> (bits-8));
+        bits -= 8;
+      }
+    }
+  } else if (type != Hasher::noHash) {
+    for (size_t i = 0; i < hash.length(); i += 2) {
+      const char* high = hash[i] ? strchr(hexAlphabet, tolower(hash[i])) : 0;
+      const char* low = hash[i+1] ? strchr(hexAlphabet, tolower(hash[i+1])) : 0;
+      if (!high || !low)
+        return string();
+      digest += (char)(((high-hexAlphabet) << 4) | (low-hexAlphabet));
+    }
+  }
+  return digest.length() == digestSize(type) ? digest : string();
+}
+
+string Hasher::toPrinted(const string& digest) {
+  const unsigned char* bytes = (const unsigned char*)digest.data();
+  string printed;
+  if (digest.length() == digestSize(Hasher::tth)) {
+    unsigned int buffer = 0, bits = 0;
+    for (size_t i = 0; i < digest.length(); i++) {
+      buffer = (buffer << 8) | bytes[i];
+      for (bits += 8; bits >= 5; bits -= 5)
+        printed += base32Alphabet[(buffer >> (bits-5)) & 31];
+    }
+    if (bits)
+      printed += base32Alphabet[(buffer << (5-bits)) & 31];
+  } else if (digest.length() == digestSize(Hasher::md5) || digest.length() == digestSize(Hasher::sha1)) {
+    for (size_t i = 0; i < digest.length(); i++) {
+      printed += hexAlphabet[bytes[i] >> 4];
+      printed += hexAlphabet[bytes[i] & 15];
+    }
+  }
+  return printed;
+}
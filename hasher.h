@@ -2,6 +2,7 @@
 #define HASHER_H
 
 #include <string>
+#include <stdint.h>
 
 using namespace std;
 
@@ -15,11 +16,26 @@ public:
   hashType_t getHashType() const;
 
   hashStatus_t hash(const string& filename, string& hash);
+  //hashes only the first and the last sampleSize bytes of filename, used to cheaply tell apart files of equal size
+  hashStatus_t hashSample(const string& filename, uint64_t sampleSize, string& hash);
 
   static string hashTypeToString(hashType_t type);
+  //bytes of a digest of type, 0 for noHash
+  static size_t digestSize(hashType_t type);
+  //type of a hash as printed by hash(), told by its length: hex for md5 and sha1, base32 for tth
+  static hashType_t printedHashType(const string& hash);
+  //converts a printed hash into its digest, returns an empty string if it is no valid hash
+  static string toBinary(const string& hash);
+  //prints a digest like hash() does, the type is told by its size, returns an empty string for unknown sizes
+  static string toPrinted(const string& digest);
 
 private:
+  //hashes the whole file if sampleSize is 0, reading through the I/O throttle
+  hashStatus_t hashFile(const string& filename, uint64_t sampleSize, string& hash, const char* kind);
+  unsigned rhashId() const;
+  string printDigest(const unsigned char* digest) const;
+
   hashType_t p_hashType;
 };
 
-#endif //HASHER_H
\ No newline at end of file
+#endif //HASHER_H
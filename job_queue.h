@@ -0,0 +1,60 @@
+#ifndef JOB_QUEUE_H
+#define JOB_QUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+//bounded blocking queue handing jobs from a producer to a pool of reader threads
+template <typename T>
+class JobQueue {
+public:
+  JobQueue(size_t capacity = 1024) : p_capacity(capacity), p_closed(false) {}
+
+  //blocks while the queue is full, returns false if the queue has been closed
+  bool push(const T& job) {
+    std::unique_lock<std::mutex> lock(p_mutex);
+    p_notFull.wait(lock, [this] { return p_closed || p_jobs.size() < p_capacity; });
+    if( p_closed )
+      return false;
+    p_jobs.push_back(job);
+    p_notEmpty.notify_one();
+    return true;
+  }
+
+  //blocks until a job is available, returns false once the queue is closed and drained
+  bool pop(T& job) {
+    std::unique_lock<std::mutex> lock(p_mutex);
+    p_notEmpty.wait(lock, [this] { return p_closed || !p_jobs.empty(); });
+    if( p_jobs.empty() )
+      return false;
+    job = p_jobs.front();
+    p_jobs.pop_front();
+    p_notFull.notify_one();
+    return true;
+  }
+
+  //no more jobs will be accepted, waiting readers drain the queue and return
+  void close() {
+    std::lock_guard<std::mutex> lock(p_mutex);
+    p_closed = true;
+    p_notEmpty.notify_all();
+    p_notFull.notify_all();
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(p_mutex);
+    return p_jobs.size();
+  }
+
+private:
+  const size_t p_capacity;
+  bool p_closed;
+  std::deque<T> p_jobs;
+  mutable std::mutex p_mutex;
+  std::condition_variable p_notEmpty;
+  std::condition_variable p_notFull;
+};
+
+#endif //JOB_QUEUE_H
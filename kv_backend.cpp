@@ -0,0 +1,631 @@
+#include "kv_backend.h"
+#include "logger.h"
+#include "sqlexception.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+//keys: 'e' parent(4, big endian) type name -> entry, 'i' type id(4, big endian) -> entry key, 's' type -> last id
+//big endian ids keep the children of a parent together and in id order
+
+static void appendId(string& key, uint32_t id) {
+  key += (char)(id >> 24);
+  key += (char)(id >> 16);
+  key += (char)(id >> 8);
+  key += (char)id;
+}
+
+static uint32_t readId(const char* data) {
+  const unsigned char* d = (const unsigned char*)data;
+  return (uint32_t)d[0] << 24 | (uint32_t)d[1] << 16 | (uint32_t)d[2] << 8 | d[3];
+}
+
+static const size_t entryKeyPrefix = 6; //'e', parent, type
+static const size_t valueHeader = sizeof(uint32_t)+3*sizeof(uint64_t); //id, size, date, last verified; the hash follows
+
+KvBackend::KvBackend(KvStore* store)
+  : p_store(store),
+    p_generation(0),
+    p_cursorOwner(0),
+    p_writes(0) {
+  for (int i = 0; i < 2; i++) {
+    kvSlice_t value;
+    p_lastId[i] = p_store->get(string("s")+(i ? 'f' : 'd'), value) && value.size == 4 ? readId(value.data) : 0;
+  }
+}
+
+KvBackend::~KvBackend() {
+  try {
+    flush();
+  } catch (exception& e) {
+    LOG(logError) << "Failed to commit last changes: " << e.what();
+  }
+  delete p_store;
+}
+
+unsigned int& KvBackend::batchSize() {
+  static unsigned int writes = 10000;
+  return writes;
+}
+
+const char* KvBackend::name() const {
+  return p_store->name();
+}
+
+bool KvBackend::query(const string& sql) {
+  //the only statement without parameters the worker issues besides table creation is dropping the tables
+  if (sql.compare(0, 11, "DROP TABLE ") == 0) {
+    clearTable(sql.substr(11));
+    return true;
+  }
+  throw SQLException(string("statement not supported by the ")+name()+" backend: "+sql);
+}
+
+PreparedStatementWrapper* KvBackend::statement(worker* w, const string& sql, PreparedStatementWrapper::resultMode_t mode) {
+  return new KvStatement(w, this, sql, mode);
+}
+
+void KvBackend::flush() {
+  p_store->commit();
+  p_generation++;
+  if (p_writes) {
+    LOG(logDebug) << "committed " << p_writes << " writes";
+  }
+  p_writes = 0;
+}
+
+void KvBackend::useTables(const string& directoryTable, const string& fileTable) {
+  p_directoryTable = directoryTable;
+  p_fileTable = fileTable;
+}
+
+void KvBackend::createTables(const string& directoryTable __attribute__((unused)), const string& fileTable __attribute__((unused))) {
+  //both tables share the key space of the store
+}
+
+void KvBackend::createDuplicatesTable(const string& table __attribute__((unused))) {
+  throw SQLException(string("duplicate groups can not be stored by the ")+name()+" backend");
+}
+
+void KvBackend::clearTable(const string& table) {
+  char type = tableType(table);
+  vector<uint32_t> ids;
+  scan_t scan;
+  row_t row;
+  startScan(scan, type, 0, true);
+  while (nextScan(scan, type, row))
+    ids.push_back(row.id);
+  for (vector<uint32_t>::const_iterator it = ids.begin(); it != ids.end(); it++)
+    removeById(type, *it);
+  beginWrite();
+  p_store->remove(string("s")+type);
+  p_lastId[type == 'f'] = 0;
+  p_generation++;
+  endWrite();
+}
+
+string KvBackend::unixTime(const string& column) const {
+  return column;
+}
+
+string KvBackend::fromUnixTime(const string& value) const {
+  return value;
+}
+
+char KvBackend::tableType(const string& table) const {
+  if (table == p_directoryTable)
+    return 'd';
+  if (table == p_fileTable)
+    return 'f';
+  throw SQLException(string("unknown table ")+table+" for the "+name()+" backend");
+}
+
+string KvBackend::entryKey(uint32_t parent, char type, const string& name) {
+  string key;
+  key.reserve(entryKeyPrefix+name.size());
+  key += 'e';
+  appendId(key, parent);
+  key += type;
+  key += name;
+  return key;
+}
+
+bool KvBackend::parseEntryKey(const string& key, char& type, string& name) {
+  if (key.size() < entryKeyPrefix || key[0] != 'e')
+    return false;
+  type = key[entryKeyPrefix-1];
+  name.assign(key, entryKeyPrefix, string::npos);
+  return true;
+}
+
+string KvBackend::idKey(char type, uint32_t id) {
+  string key("i");
+  key += type;
+  appendId(key, id);
+  return key;
+}
+
+string KvBackend::encode(const row_t& row) {
+  string value(valueHeader, '\0');
+  char* d = &value[0];
+  memcpy(d, &row.id, sizeof(row.id));
+  memcpy(d+4, &row.size, sizeof(row.size));
+  memcpy(d+12, &row.date, sizeof(row.date));
+  memcpy(d+20, &row.lastVerified, sizeof(row.lastVerified));
+  value += row.hash;
+  return value;
+}
+
+void KvBackend::decode(const kvSlice_t& key, const kvSlice_t& value, row_t& row) {
+  if (key.size < entryKeyPrefix || value.size < valueHeader)
+    throw SQLException("corrupt catalog entry");
+  row.parent = readId(key.data+1);
+  row.name.assign(key.data+entryKeyPrefix, key.size-entryKeyPrefix); //reuses the row's buffers, no allocation per row
+  memcpy(&row.id, value.data, sizeof(row.id));
+  memcpy(&row.size, value.data+4, sizeof(row.size));
+  memcpy(&row.date, value.data+12, sizeof(row.date));
+  memcpy(&row.lastVerified, value.data+20, sizeof(row.lastVerified));
+  row.hash.assign(value.data+valueHeader, value.size-valueHeader);
+}
+
+bool KvBackend::getByName(char type, uint32_t parent, const string& name, row_t& row) {
+  string key = entryKey(parent, type, name);
+  kvSlice_t value;
+  if (!p_store->get(key, value))
+    return false;
+  kvSlice_t keySlice = { key.data(), key.size() };
+  decode(keySlice, value, row);
+  return true;
+}
+
+bool KvBackend::getById(char type, uint32_t id, row_t& row) {
+  kvSlice_t key, value;
+  if (!p_store->get(idKey(type, id), key))
+    return false;
+  string entry(key.data, key.size); //the slice is only valid until the next access
+  if (!p_store->get(entry, value))
+    return false;
+  key.data = entry.data();
+  decode(key, value, row);
+  return true;
+}
+
+void KvBackend::startScan(scan_t& scan, char type, uint32_t parent, bool allParents) {
+  scan.prefix = allParents ? string("e") : entryKey(parent, type, string());
+  scan.lastKey.clear();
+  scan.started = false;
+  scan.generation = p_generation;
+}
+
+bool KvBackend::nextScan(scan_t& scan, char type, row_t& row) {
+  kvSlice_t key, value;
+  for (;;) {
+    bool found;
+    if (!scan.started) {
+      found = p_store->seek(scan.prefix, key, value);
+    } else if (p_cursorOwner == &scan && scan.generation == p_generation) {
+      found = p_store->next(key, value);
+    } else {
+      //another scan moved the cursor or the store changed in between, continue after the last key
+      found = p_store->seek(scan.lastKey, key, value);
+      if (found && key.size == scan.lastKey.size() && memcmp(key.data, scan.lastKey.data(), key.size) == 0)
+        found = p_store->next(key, value);
+    }
+    scan.started = true;
+    scan.generation = p_generation;
+    p_cursorOwner = &scan;
+    if (!found || key.size < scan.prefix.size() || memcmp(key.data, scan.prefix.data(), scan.prefix.size()) != 0)
+      return false;
+    scan.lastKey.assign(key.data, key.size);
+    if (key.size >= entryKeyPrefix && key.data[entryKeyPrefix-1] == type)
+      break; //scans over all parents skip the entries of the other type
+  }
+  decode(key, value, row);
+  return true;
+}
+
+void KvBackend::beginWrite() {
+  if (p_writes == 0)
+    p_transactionStart = chrono::steady_clock::now();
+}
+
+void KvBackend::endWrite() {
+  if (++p_writes >= batchSize() || chrono::steady_clock::now()-p_transactionStart >= chrono::seconds(1))
+    flush();
+}
+
+uint32_t KvBackend::insert(char type, row_t& row) {
+  //names are unique below a parent and ids are unique, like the keys of the sql backends
+  string key = entryKey(row.parent, type, row.name);
+  kvSlice_t existing;
+  if (p_store->get(key, existing))
+    throw SQLException("duplicate entry \""+row.name+"\" below parent "+to_string(row.parent)+" in the "+name()+" backend");
+  if (row.id != 0 && p_store->get(idKey(type, row.id), existing))
+    throw SQLException("duplicate id "+to_string(row.id)+" in the "+name()+" backend");
+
+  beginWrite();
+  uint32_t& lastId = p_lastId[type == 'f'];
+  //keys hold 4 byte ids, unlike the 8 byte ids of the sql backends
+  if (row.id == 0 && lastId == 0xffffffff)
+    throw SQLException(string("ids exhausted in the ")+name()+" backend");
+  if (row.id == 0)
+    row.id = lastId+1;
+  if (row.id > lastId) {
+    lastId = row.id;
+    string value;
+    appendId(value, lastId);
+    p_store->put(string("s")+type, value);
+  }
+
+  p_store->put(key, encode(row));
+  p_store->put(idKey(type, row.id), key);
+  p_generation++;
+  endWrite();
+  return row.id;
+}
+
+void KvBackend::update(char type, const row_t& row) {
+  beginWrite();
+  p_store->put(entryKey(row.parent, type, row.name), encode(row));
+  p_generation++;
+  endWrite();
+}
+
+void KvBackend::removeById(char type, uint32_t id) {
+  kvSlice_t entry;
+  string key = idKey(type, id);
+  if (!p_store->get(key, entry))
+    return;
+  beginWrite();
+  p_store->remove(string(entry.data, entry.size));
+  p_store->remove(key);
+  p_generation++;
+  endWrite();
+}
+
+void KvBackend::removeByParent(char type, uint32_t parent) {
+  vector<uint32_t> ids;
+  scan_t scan;
+  row_t row;
+  startScan(scan, type, parent, false);
+  while (nextScan(scan, type, row))
+    ids.push_back(row.id);
+  for (vector<uint32_t>::const_iterator it = ids.begin(); it != ids.end(); it++)
+    removeById(type, *it);
+}
+
+KvStatement::KvStatement(worker* w, KvBackend* backend, const string& sql, resultMode_t mode)
+  : PreparedStatementWrapper(w, sql, mode),
+    p_backend(backend),
+    p_operation(opSelect),
+    p_type('f'),
+    p_scanning(false),
+    p_pending(false),
+    p_rowValid(false),
+    p_lastInsertId(0)
+{}
+
+void KvStatement::reprepare() {
+  p_columns.clear();
+  p_where.clear();
+  parse();
+  size_t count = p_where.size();
+  if (p_operation == opInsert || p_operation == opUpdate)
+    count += p_columns.size();
+  p_params.assign(count, param_t());
+  release();
+}
+
+void KvStatement::close() {
+  release();
+}
+
+//splits a statement into words, '?' and the punctuation , ( ) =
+static vector<string> tokenize(const string& sql) {
+  vector<string> tokens;
+  string token;
+  for (string::const_iterator it = sql.begin(); it != sql.end(); it++) {
+    if (isspace(*it) || *it == ',' || *it == '(' || *it == ')' || *it == '=') {
+      if (!token.empty())
+        tokens.push_back(token);
+      token.clear();
+      if (!isspace(*it))
+        tokens.push_back(string(1, *it));
+    } else {
+      token += *it;
+    }
+  }
+  if (!token.empty())
+    tokens.push_back(token);
+  return tokens;
+}
+
+static bool isWord(const string& token, const char* word) {
+  return strcasecmp(token.c_str(), word) == 0;
+}
+
+void KvStatement::parse() {
+  vector<string> tokens = tokenize(p_query);
+  size_t pos = 0;
+  auto unsupported = [&]() {
+    return SQLException(string("statement not supported by the ")+p_backend->name()+" backend: "+p_query);
+  };
+  auto token = [&]() -> const string& {
+    if (pos >= tokens.size())
+      throw unsupported();
+    return tokens[pos++];
+  };
+  auto expect = [&](const char* word) {
+    if (!isWord(token(), word))
+      throw unsupported();
+  };
+  auto accept = [&](const char* word) {
+    if (pos < tokens.size() && isWord(tokens[pos], word)) {
+      pos++;
+      return true;
+    }
+    return false;
+  };
+  auto column = [&]() {
+    const string& name = token();
+    static const char* names[] = { "id", "name", "parent", "size", "date", "hash", "last_verified" };
+    for (unsigned int i = 0; i < sizeof(names)/sizeof(*names); i++)
+      if (isWord(name, names[i]))
+        return (KvBackend::column_t)i;
+    throw unsupported();
+  };
+  auto where = [&]() {
+    if (!accept("WHERE"))
+      return;
+    do {
+      p_where.push_back(column());
+      expect("=");
+      expect("?");
+    } while (accept("AND"));
+  };
+
+  const string& verb = token();
+  if (isWord(verb, "SELECT")) {
+    p_operation = opSelect;
+    do
+      p_columns.push_back(column());
+    while (accept(","));
+    expect("FROM");
+    p_type = p_backend->tableType(token());
+    where();
+    if (accept("ORDER")) { //table scans return entries ordered by parent anyway
+      expect("BY");
+      expect("parent");
+    }
+  } else if (isWord(verb, "INSERT")) {
+    p_operation = opInsert;
+    expect("INTO");
+    p_type = p_backend->tableType(token());
+    expect("(");
+    do
+      p_columns.push_back(column());
+    while (accept(","));
+    expect(")");
+    expect("VALUES");
+    expect("(");
+    for (size_t i = 0; i < p_columns.size(); i++) {
+      if (i)
+        expect(",");
+      expect("?");
+    }
+    expect(")");
+    if (find(p_columns.begin(), p_columns.end(), KvBackend::colName) == p_columns.end() ||
+        find(p_columns.begin(), p_columns.end(), KvBackend::colParent) == p_columns.end())
+      throw unsupported();
+  } else if (isWord(verb, "UPDATE")) {
+    p_operation = opUpdate;
+    p_type = p_backend->tableType(token());
+    expect("SET");
+    do {
+      p_columns.push_back(column());
+      if (p_columns.back() == KvBackend::colId || p_columns.back() == KvBackend::colName || p_columns.back() == KvBackend::colParent)
+        throw unsupported(); //would move the entry to another key
+      expect("=");
+      expect("?");
+    } while (accept(","));
+    where();
+  } else if (isWord(verb, "DELETE")) {
+    p_operation = opDelete;
+    expect("FROM");
+    p_type = p_backend->tableType(token());
+    where();
+  } else {
+    throw unsupported();
+  }
+  if (pos != tokens.size())
+    throw unsupported();
+
+  //lookups by id, by parent and name, listings by parent and (for SELECT) full scans
+  auto whereHas = [&](KvBackend::column_t c) { return find(p_where.begin(), p_where.end(), c) != p_where.end(); };
+  bool byId = p_where.size() == 1 && whereHas(KvBackend::colId);
+  bool byParent = p_where.size() == 1 && whereHas(KvBackend::colParent);
+  bool byName = p_where.size() == 2 && whereHas(KvBackend::colParent) && whereHas(KvBackend::colName);
+  switch (p_operation) {
+    case opSelect : if (p_where.empty() || byId || byParent || byName) return; break;
+    case opInsert : if (p_where.empty()) return; break;
+    case opUpdate : if (byId) return; break;
+    case opDelete : if (byId || byParent) return; break;
+  }
+  throw unsupported();
+}
+
+KvStatement::param_t& KvStatement::param(unsigned int parameterIndex) {
+  if (parameterIndex == 0 || parameterIndex > p_params.size())
+    throw out_of_range("parameter index out of range");
+  param_t& p = p_params[parameterIndex-1];
+  p.isNull = false;
+  return p;
+}
+
+const KvStatement::param_t* KvStatement::whereParam(KvBackend::column_t column) const {
+  size_t offset = p_operation == opUpdate ? p_columns.size() : 0;
+  for (size_t i = 0; i < p_where.size(); i++)
+    if (p_where[i] == column)
+      return &p_params[offset+i];
+  return 0;
+}
+
+void KvStatement::assign(KvBackend::row_t& row, KvBackend::column_t column, const param_t& value) const {
+  switch (column) {
+    case KvBackend::colId :
+    case KvBackend::colParent :
+      if (value.number > 0xffffffff)
+        throw SQLException("id "+to_string(value.number)+" exceeds the ids of the "+p_backend->name()+" backend");
+      (column == KvBackend::colId ? row.id : row.parent) = value.number;
+      break;
+    case KvBackend::colName : row.name = value.str; break;
+    case KvBackend::colSize : row.size = value.number; break;
+    case KvBackend::colDate : row.date = value.number; break;
+    case KvBackend::colHash : row.hash = value.isNull ? string() : value.str; break;
+    case KvBackend::colLastVerified : row.lastVerified = value.isNull ? 0 : value.number; break;
+  }
+}
+
+bool KvStatement::execute() {
+  Timer timer(this, false);
+  release();
+  const param_t* id = whereParam(KvBackend::colId);
+  const param_t* parent = whereParam(KvBackend::colParent);
+  const param_t* name = whereParam(KvBackend::colName);
+  switch (p_operation) {
+    case opSelect :
+      if (id) {
+        p_pending = p_backend->getById(p_type, id->number, p_row);
+      } else if (name) {
+        p_pending = p_backend->getByName(p_type, parent->number, name->str, p_row);
+      } else {
+        p_backend->startScan(p_scan, p_type, parent ? parent->number : 0, !parent);
+        p_scanning = true;
+      }
+      break;
+    case opInsert : {
+      KvBackend::row_t row = KvBackend::row_t();
+      for (size_t i = 0; i < p_columns.size(); i++)
+        assign(row, p_columns[i], p_params[i]);
+      p_lastInsertId = p_backend->insert(p_type, row);
+      break;
+    }
+    case opUpdate :
+      if (p_backend->getById(p_type, id->number, p_row)) {
+        for (size_t i = 0; i < p_columns.size(); i++)
+          assign(p_row, p_columns[i], p_params[i]);
+        p_backend->update(p_type, p_row);
+      }
+      break;
+    case opDelete :
+      if (id)
+        p_backend->removeById(p_type, id->number);
+      else
+        p_backend->removeByParent(p_type, parent->number);
+      break;
+  }
+  return false;
+}
+
+int KvStatement::executeQuery() {
+  execute();
+  return 0;
+}
+
+string KvStatement::boundQuery() const {
+  //inserts and updates take the values of p_columns first, the compared columns follow
+  const size_t assigned = p_operation == opInsert || p_operation == opUpdate ? p_columns.size() : 0;
+  vector<string> literals(p_params.size());
+  for (size_t i = 0; i < p_params.size(); i++) {
+    KvBackend::column_t column = i < assigned ? p_columns[i] : p_where[i-assigned];
+    if (p_params[i].isNull)
+      literals[i] = "NULL";
+    else if (column == KvBackend::colName || column == KvBackend::colHash)
+      literals[i] = quote(p_params[i].str);
+    else
+      literals[i] = to_string(p_params[i].number);
+  }
+  return substitute(p_query, literals);
+}
+
+void KvStatement::setInt(unsigned int parameterIndex, int32_t value) {
+  param(parameterIndex).number = value;
+}
+
+void KvStatement::setUInt(unsigned int parameterIndex, uint32_t value) {
+  param(parameterIndex).number = value;
+}
+
+void KvStatement::setInt64(unsigned int parameterIndex, int64_t value) {
+  param(parameterIndex).number = value;
+}
+
+void KvStatement::setUInt64(unsigned int parameterIndex, uint64_t value) {
+  param(parameterIndex).number = value;
+}
+
+void KvStatement::setNull(unsigned int parameterIndex, int sqlType __attribute__((unused))) {
+  param(parameterIndex).isNull = true;
+}
+
+void KvStatement::setString(unsigned int parameterIndex, const string& value) {
+  param(parameterIndex).str.assign(value);
+}
+
+void KvStatement::checkColumn(unsigned int index) const {
+  if (!p_rowValid)
+    throw out_of_range("no result row available");
+  if (index == 0 || index > p_columns.size())
+    throw out_of_range("field index out of range");
+}
+
+uint64_t KvStatement::getUInt64(unsigned int index) {
+  checkColumn(index);
+  switch (p_columns[index-1]) {
+    case KvBackend::colId : return p_row.id;
+    case KvBackend::colName : return strtoull(p_row.name.c_str(), 0, 10);
+    case KvBackend::colParent : return p_row.parent;
+    case KvBackend::colSize : return p_row.size;
+    case KvBackend::colDate : return p_row.date;
+    case KvBackend::colHash : return strtoull(p_row.hash.c_str(), 0, 10);
+    case KvBackend::colLastVerified : return p_row.lastVerified;
+  }
+  return 0;
+}
+
+string KvStatement::getString(unsigned int index) {
+  checkColumn(index);
+  switch (p_columns[index-1]) {
+    case KvBackend::colName : return p_row.name;
+    case KvBackend::colHash : return p_row.hash;
+    case KvBackend::colLastVerified : return p_row.lastVerified ? to_string(p_row.lastVerified) : string(); //0 is NULL
+    default : return to_string(getUInt64(index));
+  }
+}
+
+bool KvStatement::next() {
+  Timer timer(this, true);
+  if (p_scanning) {
+    p_rowValid = p_backend->nextScan(p_scan, p_type, p_row);
+    p_scanning = p_rowValid;
+  } else {
+    p_rowValid = p_pending;
+    p_pending = false;
+  }
+  return p_rowValid;
+}
+
+void KvStatement::release() {
+  p_scanning = false;
+  p_pending = false;
+  p_rowValid = false;
+}
+
+uint64_t KvStatement::lastInsertId() {
+  return p_lastInsertId;
+}
@@ -0,0 +1,164 @@
+#ifndef KV_BACKEND_H
+#define KV_BACKEND_H
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "backend.h"
+
+//points into memory owned by the store, valid until the store is modified or committed
+struct kvSlice_t {
+  const char* data;
+  size_t size;
+};
+
+//Ordered key-value store with a single cursor
+class KvStore {
+public:
+  virtual ~KvStore() {}
+
+  virtual const char* name() const = 0;
+  virtual bool get(const std::string& key, kvSlice_t& value) = 0;
+  virtual void put(const std::string& key, const std::string& value) = 0;
+  virtual bool remove(const std::string& key) = 0;
+  //positions the cursor on the first key >= key, returns false if there is none
+  virtual bool seek(const std::string& key, kvSlice_t& foundKey, kvSlice_t& value) = 0;
+  //advances the cursor, returns false at the end of the store
+  virtual bool next(kvSlice_t& key, kvSlice_t& value) = 0;
+  //makes all writes durable
+  virtual void commit() = 0;
+};
+
+//Catalog on an ordered key-value store. Entries are keyed by parent|type|name, so looking up a name is a single get
+//and listing a directory a range scan. Values hold the packed id, size, mtime, last verification and hash.
+//A secondary key per id points back to the entry. Only the simple statement shapes used for crawling, watching,
+//checking, printing and verifying are understood, anything else fails when it is prepared.
+class KvBackend : public Backend {
+public:
+  KvBackend(KvStore* store); //takes ownership of store
+  ~KvBackend(); //commits
+
+  enum column_t { colId, colName, colParent, colSize, colDate, colHash, colLastVerified };
+  struct row_t {
+    uint32_t id;
+    std::string name;
+    uint32_t parent;
+    uint64_t size;
+    uint64_t date;
+    uint64_t lastVerified;
+    std::string hash;
+  };
+
+  //writes per transaction, an open transaction is committed after one second as well
+  static unsigned int& batchSize();
+
+  const char* name() const;
+  bool query(const std::string& sql);
+  PreparedStatementWrapper* statement(worker* w, const std::string& sql, PreparedStatementWrapper::resultMode_t mode);
+  void flush();
+
+  void useTables(const std::string& directoryTable, const std::string& fileTable);
+  void createTables(const std::string& directoryTable, const std::string& fileTable);
+  void createDuplicatesTable(const std::string& table);
+  void clearTable(const std::string& table);
+
+  std::string unixTime(const std::string& column) const;
+  std::string fromUnixTime(const std::string& value) const;
+
+  //entry type of a table ('d' or 'f'), throws for unknown tables
+  char tableType(const std::string& table) const;
+  //type and name of the entry a key of the store belongs to, false for secondary keys
+  static bool parseEntryKey(const std::string& key, char& type, std::string& name);
+
+  //record access of the statements
+  bool getByName(char type, uint32_t parent, const std::string& name, row_t& row);
+  bool getById(char type, uint32_t id, row_t& row);
+  //iterates the entries of type below parent (or of all parents if allParents) in key order, state belongs to the caller
+  struct scan_t {
+    std::string prefix;
+    std::string lastKey;
+    bool started;
+    uint64_t generation;
+  };
+  void startScan(scan_t& scan, char type, uint32_t parent, bool allParents);
+  bool nextScan(scan_t& scan, char type, row_t& row);
+  //inserts row, assigns the next free id if row.id is 0
+  uint32_t insert(char type, row_t& row);
+  //rewrites the entry of row.id, name and parent must not change
+  void update(char type, const row_t& row);
+  void removeById(char type, uint32_t id);
+  void removeByParent(char type, uint32_t parent);
+
+private:
+  static std::string entryKey(uint32_t parent, char type, const std::string& name);
+  static std::string idKey(char type, uint32_t id);
+  static std::string encode(const row_t& row);
+  static void decode(const kvSlice_t& key, const kvSlice_t& value, row_t& row);
+  void beginWrite();
+  void endWrite();
+
+  KvStore* p_store;
+  std::string p_directoryTable;
+  std::string p_fileTable;
+  uint32_t p_lastId[2]; //directories, files
+  uint64_t p_generation; //counts modifications, scans reposition their cursor when it changed
+  const void* p_cursorOwner;
+  unsigned int p_writes; //writes since the last commit
+  std::chrono::steady_clock::time_point p_transactionStart;
+};
+
+class KvStatement : public PreparedStatementWrapper {
+public:
+  KvStatement(worker* w, KvBackend* backend, const std::string& sql, resultMode_t mode);
+
+  void reprepare();
+  void close();
+
+  bool execute();
+  int executeQuery();
+  std::string boundQuery() const;
+
+  void setInt(unsigned int parameterIndex, int32_t value);
+  void setUInt(unsigned int parameterIndex, uint32_t value);
+  void setInt64(unsigned int parameterIndex, int64_t value);
+  void setUInt64(unsigned int parameterIndex, uint64_t value);
+  void setNull(unsigned int parameterIndex, int sqlType);
+  void setString(unsigned int parameterIndex, const std::string& value);
+
+  uint64_t getUInt64(unsigned int index);
+  std::string getString(unsigned int index);
+  bool next();
+  void release();
+  uint64_t lastInsertId();
+
+private:
+  enum operation_t { opSelect, opInsert, opUpdate, opDelete };
+  struct param_t {
+    uint64_t number;
+    std::string str;
+    bool isNull;
+  };
+  void parse();
+  param_t& param(unsigned int parameterIndex);
+  //value of the parameter compared to column in the WHERE clause
+  const param_t* whereParam(KvBackend::column_t column) const;
+  void assign(KvBackend::row_t& row, KvBackend::column_t column, const param_t& value) const;
+  void checkColumn(unsigned int index) const;
+
+  KvBackend* p_backend;
+  operation_t p_operation;
+  char p_type;
+  std::vector<KvBackend::column_t> p_columns; //selected, inserted or updated columns, in parameter order for the latter
+  std::vector<KvBackend::column_t> p_where; //columns compared to parameters following p_columns' parameters
+  std::vector<param_t> p_params;
+
+  KvBackend::row_t p_row;
+  KvBackend::scan_t p_scan;
+  bool p_scanning; //the result is read by a range scan, otherwise p_pending holds the single row
+  bool p_pending;
+  bool p_rowValid;
+  uint64_t p_lastInsertId;
+};
+
+#endif //KV_BACKEND_H
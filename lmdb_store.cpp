@@ -0,0 +1,136 @@
+#include "lmdb_store.h"
+#include "logger.h"
+#include "sqlexception.h"
+
+using namespace std;
+
+static void check(int ret, const string& msg) {
+  if (ret != MDB_SUCCESS)
+    throw SQLException(msg+": "+mdb_strerror(ret));
+}
+
+static MDB_val toVal(const string& s) {
+  MDB_val val = { s.size(), (void*)s.data() };
+  return val;
+}
+
+static kvSlice_t toSlice(const MDB_val& val) {
+  kvSlice_t slice = { (const char*)val.mv_data, val.mv_size };
+  return slice;
+}
+
+LmdbStore::LmdbStore(const string& file) : p_env(0), p_dbi(0), p_txn(0), p_cursor(0), p_write(false) {
+  check(mdb_env_create(&p_env), "mdb_env_create failed");
+  try {
+    check(mdb_env_set_mapsize(p_env, mapSize()), "mdb_env_set_mapsize failed");
+    //a single file like the sqlite catalog, the meta page is synced with the next commit only
+    check(mdb_env_open(p_env, file.c_str(), MDB_NOSUBDIR | MDB_NOMETASYNC, 0644), "failed to open "+file);
+    begin(true);
+    check(mdb_dbi_open(p_txn, 0, 0, &p_dbi), "mdb_dbi_open failed");
+    commit();
+  } catch (...) {
+    mdb_env_close(p_env);
+    throw;
+  }
+  LOG(logDebug) << "opened lmdb database " << file << " with a map of " << mapSize() << " bytes";
+}
+
+LmdbStore::~LmdbStore() {
+  if (p_txn) { //the owning KvBackend has committed already, this only ends a read transaction
+    if (p_cursor)
+      mdb_cursor_close(p_cursor);
+    mdb_txn_abort(p_txn);
+  }
+  mdb_env_close(p_env);
+}
+
+uint64_t& LmdbStore::mapSize() {
+  static uint64_t size = 1ULL << 40;
+  return size;
+}
+
+const char* LmdbStore::name() const {
+  return "lmdb";
+}
+
+void LmdbStore::begin(bool write) {
+  if (p_txn && (p_write || !write))
+    return;
+  if (p_txn) { //a thread can only have one transaction, so the read transaction is ended to start writing
+    if (p_cursor)
+      mdb_cursor_close(p_cursor);
+    mdb_txn_abort(p_txn);
+  }
+  p_cursor = 0;
+  p_txn = 0;
+  check(mdb_txn_begin(p_env, 0, write ? 0 : MDB_RDONLY, &p_txn), "mdb_txn_begin failed");
+  p_write = write;
+}
+
+bool LmdbStore::get(const string& key, kvSlice_t& value) {
+  begin(false);
+  MDB_val k = toVal(key), v;
+  int ret = mdb_get(p_txn, p_dbi, &k, &v);
+  if (ret == MDB_NOTFOUND)
+    return false;
+  check(ret, "mdb_get failed");
+  value = toSlice(v);
+  return true;
+}
+
+void LmdbStore::put(const string& key, const string& value) {
+  begin(true);
+  MDB_val k = toVal(key), v = toVal(value);
+  check(mdb_put(p_txn, p_dbi, &k, &v, 0), "mdb_put failed");
+}
+
+bool LmdbStore::remove(const string& key) {
+  begin(true);
+  MDB_val k = toVal(key);
+  int ret = mdb_del(p_txn, p_dbi, &k, 0);
+  if (ret == MDB_NOTFOUND)
+    return false;
+  check(ret, "mdb_del failed");
+  return true;
+}
+
+bool LmdbStore::seek(const string& key, kvSlice_t& foundKey, kvSlice_t& value) {
+  begin(false);
+  if (!p_cursor)
+    check(mdb_cursor_open(p_txn, p_dbi, &p_cursor), "mdb_cursor_open failed");
+  MDB_val k = toVal(key), v;
+  int ret = mdb_cursor_get(p_cursor, &k, &v, MDB_SET_RANGE);
+  if (ret == MDB_NOTFOUND)
+    return false;
+  check(ret, "mdb_cursor_get failed");
+  foundKey = toSlice(k);
+  value = toSlice(v);
+  return true;
+}
+
+bool LmdbStore::next(kvSlice_t& key, kvSlice_t& value) {
+  if (!p_cursor)
+    return false;
+  MDB_val k, v;
+  int ret = mdb_cursor_get(p_cursor, &k, &v, MDB_NEXT);
+  if (ret == MDB_NOTFOUND)
+    return false;
+  check(ret, "mdb_cursor_get failed");
+  key = toSlice(k);
+  value = toSlice(v);
+  return true;
+}
+
+void LmdbStore::commit() {
+  if (!p_txn)
+    return;
+  if (p_cursor)
+    mdb_cursor_close(p_cursor);
+  p_cursor = 0;
+  MDB_txn* txn = p_txn;
+  p_txn = 0;
+  if (p_write)
+    check(mdb_txn_commit(txn), "mdb_txn_commit failed");
+  else
+    mdb_txn_abort(txn); //ends the snapshot, the next read sees the changes of other processes
+}
@@ -0,0 +1,38 @@
+#ifndef LMDB_STORE_H
+#define LMDB_STORE_H
+
+#include <string>
+
+#include <lmdb.h>
+
+#include "kv_backend.h"
+
+//KvStore in a memory mapped LMDB file. Reads run in a read-only transaction until the first write upgrades it,
+//so other processes only wait for the writer while a batch is being written.
+class LmdbStore : public KvStore {
+public:
+  LmdbStore(const std::string& file);
+  ~LmdbStore();
+
+  //maximum size of the database, only address space is reserved
+  static uint64_t& mapSize();
+
+  const char* name() const;
+  bool get(const std::string& key, kvSlice_t& value);
+  void put(const std::string& key, const std::string& value);
+  bool remove(const std::string& key);
+  bool seek(const std::string& key, kvSlice_t& foundKey, kvSlice_t& value);
+  bool next(kvSlice_t& key, kvSlice_t& value);
+  void commit();
+
+private:
+  void begin(bool write);
+
+  MDB_env* p_env;
+  MDB_dbi p_dbi;
+  MDB_txn* p_txn;
+  MDB_cursor* p_cursor;
+  bool p_write;
+};
+
+#endif //LMDB_STORE_H
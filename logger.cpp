@@ -1,23 +1,48 @@
 #include "logger.h"
 
+#include <chrono>
+#include <cstdlib>
 #include <ctime>
 
+static const char* const levelNames[] = { "ERROR", "WARNING", "INFO", "DETAIL", "DEBUG" };
+
+//stream reused by all messages of a thread, saving its allocations
+struct threadStream_t {
+  std::ostringstream os;
+  bool busy;
+};
+static thread_local threadStream_t threadStream;
+
 Logger::Logger()
+  : p_os(threadStream.busy ? new std::ostringstream : &threadStream.os),
+    p_ownStream(threadStream.busy)
 {
+  if( !p_ownStream ) {
+    threadStream.busy = true;
+    p_os->str(std::string());
+    p_os->clear();
+    p_os->flags(std::ios_base::dec | std::ios_base::skipws); //undo manipulators of the previous message
+    p_os->precision(6);
+    p_os->fill(' ');
+  }
 }
 
 std::ostringstream& Logger::getLogger(logLevel_t level)
 {
-  os << getTime();
-  os << " " << toString(level) << ": ";
-  os << std::string(level > logDebug ? level - logDebug : 0, '\t');
-  return os;
+  *p_os << getTime() << ' ' << levelNames[level > logDebug ? logDebug : level] << ": ";
+  if( level > logDebug )
+    *p_os << std::string(level - logDebug, '\t');
+  return *p_os;
 }
 
 Logger::~Logger()
 {
-  os << std::endl;
-  facility()->output(os.str());
+  *p_os << '\n';
+  facility()->output(p_os->str());
+  if( p_ownStream )
+    delete p_os;
+  else
+    threadStream.busy = false;
 }
 
 LoggerFacility*& Logger::facility()
@@ -42,11 +67,17 @@ logLevel_t Logger::fromString(const std::string& level)
     return logInfo;
 }
 
-inline std::string Logger::getTime()
+const char* Logger::getTime()
 {
-  char buffer[11];
+  static thread_local time_t second = -1;
+  static thread_local char buffer[16];
   time_t t = time(0);
-  strftime(buffer, sizeof(buffer), "%X", localtime(&t));
+  if( t != second ) {
+    struct tm local;
+    localtime_r(&t, &local);
+    strftime(buffer, sizeof(buffer), "%X", &local);
+    second = t;
+  }
   return buffer;
 }
 
@@ -58,8 +89,7 @@ logLevel_t& Logger::logLevel()
 
 std::string Logger::toString(logLevel_t level)
 {
-  static const char* const buffer[] = { "ERROR", "WARNING", "INFO", "DETAIL", "DEBUG" };
-  return buffer[level];
+  return levelNames[level];
 }
 
 LoggerFacility::~LoggerFacility()
@@ -76,9 +106,10 @@ inline std::ostream& LoggerFacilityConsole::stream()
   return *pStream;
 }
 
-inline void LoggerFacilityConsole::output(const std::string& msg)
+void LoggerFacilityConsole::output(const std::string& msg)
 {
-  stream() << msg;
+  std::lock_guard<std::mutex> lock(p_mutex);
+  stream().write(msg.data(), msg.size());
 }
 
 LoggerFacilityFile::~LoggerFacilityFile()
@@ -105,6 +136,128 @@ bool LoggerFacilityFile::openLogFile(const std::string& path, bool truncate)
 
 void LoggerFacilityFile::output(const std::string& msg)
 {
-  p_fs << msg;
+  std::lock_guard<std::mutex> lock(p_mutex);
+  p_fs.write(msg.data(), msg.size());
   p_fs.flush();
 }
+
+static void stopAsyncLogging()
+{
+  LoggerFacilityAsync* async = dynamic_cast<LoggerFacilityAsync*>(Logger::facility());
+  if( async )
+    async->stop();
+}
+
+LoggerFacilityAsync::LoggerFacilityAsync(LoggerFacility* target)
+  : p_target(target),
+    p_slots(new slot_t[capacity]),
+    p_head(0),
+    p_tail(0),
+    p_running(true),
+    p_sleeping(false),
+    p_producers(0)
+{
+  static std::once_flag registered;
+  std::call_once(registered, []() { atexit(stopAsyncLogging); });
+  for( size_t i = 0; i < capacity; i++ )
+    p_slots[i].sequence.store(i, std::memory_order_relaxed);
+  p_thread = std::thread(&LoggerFacilityAsync::run, this);
+}
+
+LoggerFacilityAsync::~LoggerFacilityAsync()
+{
+  stop();
+  delete[] p_slots;
+  delete p_target;
+}
+
+void LoggerFacilityAsync::output(const std::string& msg)
+{
+  //announced before checking p_running, so stop() either sees this producer or the producer sees it stopping
+  p_producers.fetch_add(1);
+  if( !p_running.load() ) {
+    p_producers.fetch_sub(1);
+    p_target->output(msg);
+    return;
+  }
+  size_t position = p_head.load(std::memory_order_relaxed);
+  for( ;; ) {
+    slot_t& slot = p_slots[position & (capacity-1)];
+    size_t sequence = slot.sequence.load(std::memory_order_acquire);
+    if( sequence == position ) {
+      if( p_head.compare_exchange_weak(position, position+1, std::memory_order_relaxed) ) {
+        slot.msg.assign(msg);
+        slot.sequence.store(position+1, std::memory_order_release);
+        break;
+      }
+    } else if( sequence < position ) { //full, wait for the writer to catch up
+      p_wake.notify_one();
+      std::this_thread::yield();
+      position = p_head.load(std::memory_order_relaxed);
+    } else
+      position = p_head.load(std::memory_order_relaxed);
+  }
+  if( p_sleeping.exchange(false) ) {
+    std::lock_guard<std::mutex> lock(p_mutex);
+    p_wake.notify_one();
+  }
+  p_producers.fetch_sub(1);
+}
+
+void LoggerFacilityAsync::stop()
+{
+  if( !p_thread.joinable() )
+    return;
+  {
+    std::lock_guard<std::mutex> lock(p_mutex);
+    p_running.store(false);
+    p_wake.notify_one();
+  }
+  p_thread.join();
+  //producers that saw p_running set may still be filling a slot, or waiting for space in a full ring
+  std::string batch;
+  for( ;; ) {
+    while( pop(batch) ) ;
+    if( !batch.empty() ) {
+      p_target->output(batch);
+      batch.clear();
+    } else if( p_producers.load() == 0 )
+      break;
+    else
+      std::this_thread::yield();
+  }
+}
+
+bool LoggerFacilityAsync::pop(std::string& batch)
+{
+  slot_t& slot = p_slots[p_tail & (capacity-1)];
+  if( slot.sequence.load(std::memory_order_acquire) != p_tail+1 )
+    return false;
+  batch.append(slot.msg);
+  slot.sequence.store(p_tail+capacity, std::memory_order_release);
+  p_tail++;
+  return true;
+}
+
+void LoggerFacilityAsync::run()
+{
+  std::string batch;
+  batch.reserve(batchSize+4096);
+  for( ;; ) {
+    bool stopping = !p_running.load(std::memory_order_acquire);
+    batch.clear();
+    while( batch.size() < batchSize && pop(batch) ) ;
+    if( !batch.empty() ) {
+      p_target->output(batch);
+      continue;
+    }
+    if( stopping )
+      break;
+    //sleep until a producer finds p_sleeping set, the timeout covers a message filled in after the check below
+    std::unique_lock<std::mutex> lock(p_mutex);
+    p_sleeping.store(true);
+    if( p_running.load(std::memory_order_acquire) && p_slots[p_tail & (capacity-1)].sequence.load(std::memory_order_acquire) != p_tail+1 )
+      p_wake.wait_for(lock, std::chrono::milliseconds(100));
+    p_sleeping.store(false);
+  }
+}
@@ -5,10 +5,14 @@
     if (level > Logger::logLevel()) ; \
     else Logger().getLogger(level)
 
+#include <atomic>
+#include <condition_variable>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 
 enum logLevel_t { logError = 0, logWarning, logInfo, logDetailed, logDebug };
 
@@ -24,15 +28,18 @@ public:
   static logLevel_t& logLevel();
   static std::string toString(logLevel_t level);
   static logLevel_t fromString(const std::string& level);
-  inline std::string getTime();
+  //time of day, formatted once per second and thread
+  static const char* getTime();
 protected:
-  std::ostringstream os;
+  std::ostringstream* p_os; //the stream of the thread, or an own one for messages logged while composing another
+  bool p_ownStream;
 };
 
 class LoggerFacility
 {
 public:
   virtual ~LoggerFacility();
+  //msg holds one or more complete lines
   virtual void output(const std::string& msg) = 0;
 };
 
@@ -42,6 +49,9 @@ public:
   virtual ~LoggerFacilityConsole();
   std::ostream& stream();
   void output(const std::string& msg);
+
+private:
+  std::mutex p_mutex;
 };
 
 class LoggerFacilityFile : public LoggerFacility
@@ -53,7 +63,44 @@ public:
   void output(const std::string& msg);
 
 private:
+  std::mutex p_mutex;
   std::fstream p_fs;
 };
 
+//Passes messages to a background thread through a lock-free ring buffer, the thread writes them to the target facility
+//in batches. Logging threads only copy their message into a slot, unless the ring is full, then they wait for space.
+//Messages still queued at exit are written by an atexit handler. Stopping waits for the producers still inside output(),
+//so no message is lost and no slot is written after the ring is freed.
+class LoggerFacilityAsync : public LoggerFacility
+{
+public:
+  LoggerFacilityAsync(LoggerFacility* target); //takes ownership of target
+  virtual ~LoggerFacilityAsync(); //writes the queued messages
+  void output(const std::string& msg);
+  //writes the queued messages and stops the background thread, later messages are written synchronously
+  void stop();
+
+private:
+  static const size_t capacity = 4096; //slots, a power of two
+  static const size_t batchSize = 1 << 16; //bytes written at once
+  struct slot_t {
+    std::atomic<size_t> sequence; //position the slot is free for, or position+1 once it is filled
+    std::string msg;
+  };
+  //appends the next message to batch, returns false if there is none
+  bool pop(std::string& batch);
+  void run();
+
+  LoggerFacility* p_target;
+  slot_t* p_slots;
+  std::atomic<size_t> p_head; //next position to fill
+  size_t p_tail; //next position to write, only used by the background thread
+  std::atomic<bool> p_running;
+  std::atomic<bool> p_sleeping;
+  std::atomic<unsigned int> p_producers; //threads inside output() that may still write a slot
+  std::mutex p_mutex;
+  std::condition_variable p_wake;
+  std::thread p_thread;
+};
+
 #endif //LOGGER_H
@@ -0,0 +1,268 @@
+#include "metrics.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+
+#include <unistd.h>
+
+using namespace std;
+
+Metric::~Metric() {
+}
+
+//appends name{labels} value
+static void appendSample(string& out, const string& name, const string& labels, const string& value) {
+  out += name;
+  if (!labels.empty())
+    out += '{'+labels+'}';
+  out += ' '+value+'\n';
+}
+
+static string formatDouble(double value) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.9g", value);
+  return buffer;
+}
+
+Counter::Counter()
+  : p_value(0) {
+}
+
+uint64_t Counter::value() const {
+  return p_value.load(memory_order_relaxed);
+}
+
+void Counter::render(string& out, const string& name, const string& labels) const {
+  appendSample(out, name, labels, to_string(value()));
+}
+
+Gauge::Gauge()
+  : p_value(0) {
+}
+
+int64_t Gauge::value() const {
+  return p_value.load(memory_order_relaxed);
+}
+
+void Gauge::render(string& out, const string& name, const string& labels) const {
+  appendSample(out, name, labels, to_string(value()));
+}
+
+const double Histogram::bounds[Histogram::bucketCount] = {
+  0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+Histogram::Histogram()
+  : p_sumNanoseconds(0),
+    p_maxNanoseconds(0) {
+  for (unsigned int i = 0; i <= bucketCount; i++)
+    p_buckets[i].store(0, memory_order_relaxed);
+  for (unsigned int i = 0; i < fineBucketCount; i++)
+    p_fineBuckets[i].store(0, memory_order_relaxed);
+}
+
+unsigned int Histogram::fineBucket(uint64_t nanoseconds) {
+  if (nanoseconds < subBuckets)
+    return nanoseconds;
+  unsigned int exponent = 63-__builtin_clzll(nanoseconds); //at least 3
+  return (exponent-2)*subBuckets + ((nanoseconds >> (exponent-3)) & (subBuckets-1));
+}
+
+uint64_t Histogram::fineBucketLimit(unsigned int bucket) {
+  if (bucket < subBuckets)
+    return bucket;
+  unsigned int exponent = bucket/subBuckets+2;
+  return ((uint64_t)(subBuckets+bucket%subBuckets+1) << (exponent-3))-1;
+}
+
+void Histogram::observe(double seconds) {
+  unsigned int bucket = 0;
+  while (bucket < bucketCount && seconds > bounds[bucket])
+    bucket++;
+  p_buckets[bucket].fetch_add(1, memory_order_relaxed);
+  uint64_t nanoseconds = seconds > 0 ? (uint64_t)(seconds*1e9) : 0;
+  p_fineBuckets[fineBucket(nanoseconds)].fetch_add(1, memory_order_relaxed);
+  p_sumNanoseconds.fetch_add(nanoseconds, memory_order_relaxed);
+  uint64_t largest = p_maxNanoseconds.load(memory_order_relaxed);
+  while (nanoseconds > largest && !p_maxNanoseconds.compare_exchange_weak(largest, nanoseconds, memory_order_relaxed)) ;
+}
+
+double Histogram::max() const {
+  return p_maxNanoseconds.load(memory_order_relaxed)/1e9;
+}
+
+double Histogram::quantile(double q) const {
+  uint64_t total = 0;
+  for (unsigned int i = 0; i < fineBucketCount; i++)
+    total += p_fineBuckets[i].load(memory_order_relaxed);
+  if (!total)
+    return 0;
+  uint64_t rank = std::max<uint64_t>(1, (uint64_t)(q*total+0.5)), seen = 0;
+  for (unsigned int i = 0; i < fineBucketCount; i++) {
+    seen += p_fineBuckets[i].load(memory_order_relaxed);
+    if (seen >= rank)
+      return std::min(fineBucketLimit(i), p_maxNanoseconds.load(memory_order_relaxed))/1e9;
+  }
+  return max();
+}
+
+void Histogram::observe(chrono::steady_clock::duration duration) {
+  observe(chrono::duration<double>(duration).count());
+}
+
+uint64_t Histogram::count() const {
+  uint64_t count = 0;
+  for (unsigned int i = 0; i <= bucketCount; i++)
+    count += p_buckets[i].load(memory_order_relaxed);
+  return count;
+}
+
+double Histogram::sum() const {
+  return p_sumNanoseconds.load(memory_order_relaxed)/1e9;
+}
+
+void Histogram::render(string& out, const string& name, const string& labels) const {
+  const string prefix = labels.empty() ? string() : labels+',';
+  uint64_t cumulative = 0;
+  for (unsigned int i = 0; i <= bucketCount; i++) {
+    cumulative += p_buckets[i].load(memory_order_relaxed);
+    appendSample(out, name+"_bucket", prefix+"le=\""+(i < bucketCount ? formatDouble(bounds[i]) : string("+Inf"))+'"', to_string(cumulative));
+  }
+  appendSample(out, name+"_sum", labels, formatDouble(sum()));
+  appendSample(out, name+"_count", labels, to_string(cumulative));
+}
+
+Metrics::Metrics() {
+  gauge("fscrawl_start_time_seconds", "Start time of the process since the epoch").set(time(0));
+}
+
+Metrics::~Metrics() {
+  for (map<string, family_t>::iterator family = p_families.begin(); family != p_families.end(); family++)
+    for (map<string, Metric*>::iterator it = family->second.series.begin(); it != family->second.series.end(); it++)
+      delete it->second;
+}
+
+Metrics& Metrics::getInstance() {
+  static Metrics self;
+  return self;
+}
+
+Metric*& Metrics::series(const string& name, const char* type, const string& help, const string& labels) {
+  family_t& family = p_families[name];
+  if (!family.type) {
+    family.type = type;
+    family.help = help;
+  }
+  return family.series[labels];
+}
+
+Counter& Metrics::counter(const string& name, const string& help, const string& labels) {
+  lock_guard<mutex> lock(p_mutex);
+  Metric*& metric = series(name, "counter", help, labels);
+  if (!metric)
+    metric = new Counter;
+  return *static_cast<Counter*>(metric);
+}
+
+Gauge& Metrics::gauge(const string& name, const string& help, const string& labels) {
+  lock_guard<mutex> lock(p_mutex);
+  Metric*& metric = series(name, "gauge", help, labels);
+  if (!metric)
+    metric = new Gauge;
+  return *static_cast<Gauge*>(metric);
+}
+
+Histogram& Metrics::histogram(const string& name, const string& help, const string& labels) {
+  lock_guard<mutex> lock(p_mutex);
+  Metric*& metric = series(name, "histogram", help, labels);
+  if (!metric)
+    metric = new Histogram;
+  return *static_cast<Histogram*>(metric);
+}
+
+string Metrics::label(const string& key, const string& value) {
+  string escaped;
+  escaped.reserve(value.size()+key.size()+3);
+  escaped += key+"=\"";
+  for (string::const_iterator it = value.begin(); it != value.end(); it++)
+    switch (*it) {
+      case '\\' : escaped += "\\\\"; break;
+      case '"' : escaped += "\\\""; break;
+      case '\n' : escaped += "\\n"; break;
+      default : escaped += *it;
+    }
+  return escaped+'"';
+}
+
+string Metrics::render() const {
+  lock_guard<mutex> lock(p_mutex);
+  string out;
+  for (map<string, family_t>::const_iterator family = p_families.begin(); family != p_families.end(); family++) {
+    out += "# HELP "+family->first+' '+family->second.help+'\n';
+    out += "# TYPE "+family->first+' '+family->second.type+'\n';
+    for (map<string, Metric*>::const_iterator it = family->second.series.begin(); it != family->second.series.end(); it++)
+      it->second->render(out, family->first, it->first);
+  }
+  return out;
+}
+
+bool Metrics::writeTextfile(const string& file) const {
+  const string temporary = file+".tmp";
+  {
+    ofstream os(temporary.c_str(), ios_base::out | ios_base::trunc);
+    os << render();
+    if (!os.good())
+      return false;
+  }
+  return rename(temporary.c_str(), file.c_str()) == 0;
+}
+
+static volatile sig_atomic_t dumpRequested = 0;
+
+MetricsReporter::MetricsReporter(const string& file, unsigned int interval)
+  : p_file(file),
+    p_interval(interval ? interval : 1),
+    p_finished(false) {
+  signal(SIGUSR1, signalHandler);
+  p_thread = thread(&MetricsReporter::run, this);
+}
+
+MetricsReporter::~MetricsReporter() {
+  {
+    lock_guard<mutex> lock(p_mutex);
+    p_finished = true;
+  }
+  p_wake.notify_one();
+  p_thread.join();
+  signal(SIGUSR1, SIG_DFL);
+  if (!p_file.empty() && !METRICS.writeTextfile(p_file)) {
+    LOG(logError) << "Failed to write metrics to " << p_file << ": " << strerror(errno);
+  }
+}
+
+void MetricsReporter::signalHandler(int signum __attribute__((unused))) {
+  dumpRequested = 1;
+}
+
+void MetricsReporter::run() {
+  //signal handlers can not wake the thread, so it looks for requested dumps every second
+  chrono::steady_clock::time_point next = chrono::steady_clock::now()+chrono::seconds(p_interval);
+  unique_lock<mutex> lock(p_mutex);
+  while (!p_wake.wait_for(lock, chrono::seconds(1), [this] { return p_finished; })) {
+    if (dumpRequested) {
+      dumpRequested = 0;
+      LOG(logInfo) << "Metrics:\n" << METRICS.render();
+    }
+    if (!p_file.empty() && chrono::steady_clock::now() >= next) {
+      if (!METRICS.writeTextfile(p_file)) {
+        LOG(logError) << "Failed to write metrics to " << p_file << ": " << strerror(errno);
+      }
+      next += chrono::seconds(p_interval);
+    }
+  }
+}
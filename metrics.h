@@ -0,0 +1,142 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <signal.h>
+#include <stdint.h>
+
+#define METRICS (Metrics::getInstance())
+
+//single value of a metric family, rendered in the Prometheus text format
+class Metric {
+public:
+  virtual ~Metric();
+  //appends the sample lines of the series name{labels}
+  virtual void render(std::string& out, const std::string& name, const std::string& labels) const = 0;
+};
+
+//monotonically increasing count
+class Counter : public Metric {
+public:
+  Counter();
+  void add(uint64_t n = 1) { p_value.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t value() const;
+  void render(std::string& out, const std::string& name, const std::string& labels) const;
+private:
+  std::atomic<uint64_t> p_value;
+};
+
+//value that may go up and down
+class Gauge : public Metric {
+public:
+  Gauge();
+  void set(int64_t value) { p_value.store(value, std::memory_order_relaxed); }
+  void add(int64_t n) { p_value.fetch_add(n, std::memory_order_relaxed); }
+  int64_t value() const;
+  void render(std::string& out, const std::string& name, const std::string& labels) const;
+private:
+  std::atomic<int64_t> p_value;
+};
+
+//distribution of durations in seconds, exported with buckets from 10us to 10s. Percentiles are taken from finer
+//log-linear buckets: every power of two of nanoseconds is split into 8 sub-buckets, so they are accurate to 12.5%.
+class Histogram : public Metric {
+public:
+  static const unsigned int bucketCount = 19;
+  static const double bounds[bucketCount]; //upper bounds, +Inf is implied
+
+  Histogram();
+  void observe(double seconds);
+  void observe(std::chrono::steady_clock::duration duration);
+  uint64_t count() const;
+  double sum() const;
+  double max() const;
+  //value in seconds below which fraction q (0..1) of the observations lie, 0 without observations
+  double quantile(double q) const;
+  void render(std::string& out, const std::string& name, const std::string& labels) const;
+private:
+  static const unsigned int subBuckets = 8;
+  static const unsigned int fineBucketCount = 64*subBuckets;
+  static unsigned int fineBucket(uint64_t nanoseconds);
+  static uint64_t fineBucketLimit(unsigned int bucket); //largest value of bucket
+
+  std::atomic<uint64_t> p_buckets[bucketCount+1]; //not cumulative, the last one counts values above all bounds
+  std::atomic<uint64_t> p_fineBuckets[fineBucketCount];
+  std::atomic<uint64_t> p_sumNanoseconds;
+  std::atomic<uint64_t> p_maxNanoseconds;
+};
+
+//observes the time from its construction to its destruction
+class ScopedTimer {
+public:
+  ScopedTimer(Histogram& histogram) : p_histogram(histogram), p_start(std::chrono::steady_clock::now()) {}
+  ~ScopedTimer() { p_histogram.observe(std::chrono::steady_clock::now()-p_start); }
+private:
+  Histogram& p_histogram;
+  std::chrono::steady_clock::time_point p_start;
+};
+
+//Registry of all metrics. Metrics are created on first use and live as long as the program, so callers keep references
+//to them, usually in function-static variables, and update them without any lookup.
+class Metrics {
+public:
+  static Metrics& getInstance();
+
+  //labels are given as rendered by label(), joined by commas
+  Counter& counter(const std::string& name, const std::string& help, const std::string& labels = std::string());
+  Gauge& gauge(const std::string& name, const std::string& help, const std::string& labels = std::string());
+  Histogram& histogram(const std::string& name, const std::string& help, const std::string& labels = std::string());
+  //key="value" with value escaped
+  static std::string label(const std::string& key, const std::string& value);
+
+  //all metrics in the Prometheus text exposition format
+  std::string render() const;
+  //writes render() to file through a temporary file renamed over it, as the node_exporter textfile collector expects.
+  //Returns false on failure.
+  bool writeTextfile(const std::string& file) const;
+
+private:
+  Metrics();
+  ~Metrics();
+  Metrics(const Metrics&) = delete;
+  Metrics& operator=(const Metrics&) = delete;
+
+  struct family_t {
+    const char* type;
+    std::string help;
+    std::map<std::string, Metric*> series; //by labels
+  };
+  Metric*& series(const std::string& name, const char* type, const std::string& help, const std::string& labels);
+
+  mutable std::mutex p_mutex;
+  std::map<std::string, family_t> p_families;
+};
+
+//Writes the metrics to a textfile every interval seconds and once more when it is destroyed. Logs all metrics when
+//the process receives SIGUSR1.
+class MetricsReporter {
+public:
+  //file may be empty to only react to SIGUSR1
+  MetricsReporter(const std::string& file, unsigned int interval);
+  ~MetricsReporter();
+
+private:
+  static void signalHandler(int signum);
+  void run();
+
+  std::string p_file;
+  unsigned int p_interval;
+  std::mutex p_mutex;
+  std::condition_variable p_wake;
+  bool p_finished;
+  std::thread p_thread;
+};
+
+#endif //METRICS_H
@@ -0,0 +1,480 @@
+#include "mysql_backend.h"
+#include "connection_pool.h"
+#include "logger.h"
+#include "worker.h"
+#include "sqlexception.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <strings.h>
+#include <thread>
+
+#include <errmsg.h>
+
+using namespace std;
+
+MysqlBackend::MysqlBackend(const dbConfig_t& config) : p_config(config), p_connection(ConnectionPool::connect(config)) {}
+
+MysqlBackend::~MysqlBackend() {
+  mysql_close(p_connection);
+}
+
+MYSQL* MysqlBackend::getConnection() const {
+  return p_connection;
+}
+
+const char* MysqlBackend::name() const {
+  return "mysql";
+}
+
+bool MysqlBackend::query(const string& sql) {
+  if (!mysql_query(p_connection, sql.c_str()))
+    return true;
+  unsigned int error = mysql_errno(p_connection);
+  if (error != CR_SERVER_GONE_ERROR && error != CR_SERVER_LOST)
+    throw SQLException("mysql_query failed", p_connection);
+  LOG(logWarning) << "Lost connection to database: " << mysql_error(p_connection);
+  return false;
+}
+
+void MysqlBackend::execute(const string& sql) {
+  if (!query(sql))
+    throw SQLException("mysql_query failed", p_connection);
+}
+
+PreparedStatementWrapper* MysqlBackend::statement(worker* w, const string& sql, PreparedStatementWrapper::resultMode_t mode) {
+  return new MysqlStatement(w, this, sql, mode);
+}
+
+bool MysqlBackend::explain(const string& sql, vector<string>& plan) {
+  //the server only explains complete statements, parameters are replaced by a constant of the right shape
+  execute("EXPLAIN "+PreparedStatementWrapper::substitute(sql, vector<string>(count(sql.begin(), sql.end(), '?'), "'0'")));
+  MYSQL_RES* result = mysql_store_result(p_connection);
+  if (!result)
+    throw SQLException("mysql_store_result failed", p_connection);
+  unsigned int fieldCount = mysql_num_fields(result);
+  MYSQL_FIELD* fields = mysql_fetch_fields(result);
+  while (MYSQL_ROW row = mysql_fetch_row(result)) {
+    string line;
+    for (unsigned int i = 0; i < fieldCount; i++) {
+      if (!row[i])
+        continue;
+      if (!line.empty())
+        line.push_back(' ');
+      line.append(fields[i].name).append(1, '=').append(row[i]);
+    }
+    plan.push_back(line);
+  }
+  mysql_free_result(result);
+  return true;
+}
+
+bool MysqlBackend::reconnect() {
+  MYSQL* connection;
+  try {
+    connection = ConnectionPool::connect(p_config);
+  } catch (SQLException& e) {
+    LOG(logWarning) << "Reconnect failed: " << e.what();
+    return false;
+  }
+  //closing detaches the prepared statements of the old connection, they are closed and prepared again on the new
+  //one by worker::databaseReconnected
+  mysql_close(p_connection);
+  p_connection = connection;
+  return true;
+}
+
+unsigned int& MysqlBackend::partitions() {
+  static unsigned int count = 0;
+  return count;
+}
+
+//schema v3, see sql/update-3.2-to-3.3.sql for migrating older tables
+void MysqlBackend::createTables(const string& directoryTable, const string& fileTable) {
+  //lookups by name and listings by parent both use the unique key, its parent prefix replaces the former INDEX(parent).
+  //Partitions keep the children of a directory together, so these statements only touch a single partition.
+  //MySQL requires the partitioning column in every unique key, so the primary key has to include it. Statements by
+  //id alone (lookups of a directory, updates, deletes and stamps of scrub) then probe the key of every partition, so
+  //partitioning helps the maintenance of very large tables rather than the speed of crawling.
+  const string keys = partitions() ? "PRIMARY KEY (id, parent), " : "PRIMARY KEY (id), ";
+  const string partitioning = partitions() ? " PARTITION BY KEY(parent) PARTITIONS "+to_string(partitions()) : string();
+  execute("CREATE TABLE IF NOT EXISTS "+directoryTable+" "
+        "(id BIGINT UNSIGNED NOT NULL AUTO_INCREMENT, "
+        "name VARCHAR(255) NOT NULL, "
+        "parent BIGINT UNSIGNED NOT NULL, "
+        "size BIGINT UNSIGNED, "
+        "date DATETIME DEFAULT NULL, "
+        +keys+
+        "UNIQUE KEY parent_name (parent, name)) "
+        "DEFAULT CHARACTER SET utf8 "
+        "COLLATE utf8_bin" //utf8_bin collation against errors with umlauts, e.g. two directories named "Moo" and "Möo"
+        +partitioning);
+  execute("CREATE TABLE IF NOT EXISTS "+fileTable+" "
+        "(id BIGINT UNSIGNED NOT NULL AUTO_INCREMENT, "
+        "name VARCHAR(255) NOT NULL, "
+        "parent BIGINT UNSIGNED NOT NULL, "
+        "size BIGINT UNSIGNED, "
+        "date DATETIME DEFAULT NULL, "
+        "hash VARBINARY(24) DEFAULT NULL, " //digest of any supported type: md5 16, sha1 20 or tth 24 bytes
+        "last_verified DATETIME DEFAULT NULL, " //last time the hash was checked by scrub
+        +keys+
+        "UNIQUE KEY parent_name (parent, name), "
+        "INDEX(last_verified)) "
+        "DEFAULT CHARACTER SET utf8 "
+        "COLLATE utf8_bin" //utf8_bin collation against errors with umlauts, e.g. two files named "Moo" and "Möo"
+        +partitioning);
+}
+
+void MysqlBackend::createDuplicatesTable(const string& table) {
+  execute("CREATE TABLE IF NOT EXISTS "+table+" "
+        "(grp INT UNSIGNED NOT NULL, "
+        "id BIGINT UNSIGNED NOT NULL, "
+        "size BIGINT UNSIGNED, "
+        "hash VARBINARY(40) DEFAULT NULL, " //stored like the hashes of the file table, printed or as digest
+        "INDEX(grp), "
+        "INDEX(id))");
+}
+
+bool MysqlBackend::binaryHashes(const string& fileTable) {
+  execute("SELECT DATA_TYPE FROM information_schema.COLUMNS "
+          "WHERE TABLE_SCHEMA=DATABASE() AND TABLE_NAME='"+fileTable+"' AND COLUMN_NAME='hash'");
+  MYSQL_RES* result = mysql_store_result(p_connection);
+  if (!result)
+    throw SQLException("mysql_store_result failed", p_connection);
+  MYSQL_ROW row = mysql_fetch_row(result);
+  bool binary = row && row[0] && (!strcasecmp(row[0], "binary") || !strcasecmp(row[0], "varbinary"));
+  mysql_free_result(result);
+  return binary;
+}
+
+void MysqlBackend::clearTable(const string& table) {
+  execute("TRUNCATE TABLE "+table);
+}
+
+string MysqlBackend::unixTime(const string& column) const {
+  return "UNIX_TIMESTAMP("+column+")";
+}
+
+string MysqlBackend::fromUnixTime(const string& value) const {
+  return "FROM_UNIXTIME("+value+")";
+}
+
+MysqlStatement::MysqlStatement(worker* w, MysqlBackend* backend, const string& sql, resultMode_t mode)
+  : PreparedStatementWrapper(w, sql, mode),
+    p_backend(backend),
+    p_stmt(0),
+    p_paramsDirty(true),
+    p_rowValid(false)
+{}
+
+MysqlStatement::~MysqlStatement() {
+  close();
+}
+
+bool MysqlStatement::retryAfterError(unsigned int attempt) {
+  unsigned int error = mysql_stmt_errno(p_stmt);
+  //CR_SERVER_GONE_ERROR: the statement could not be sent at all, CR_SERVER_LOST: it may have been executed
+  if (error != CR_SERVER_GONE_ERROR && !(error == CR_SERVER_LOST && p_idempotent))
+    return false;
+  if (attempt >= maxRetries())
+    return false;
+  LOG(logWarning) << "Lost connection to database (" << mysql_stmt_error(p_stmt) << "), reconnecting, attempt " << attempt+1 << " of " << maxRetries();
+  this_thread::sleep_for(chrono::seconds(attempt)); //back off if the server does not come back immediately
+  p_worker->reconnect(); //on failure the retry fails again with CR_SERVER_GONE_ERROR
+  return true;
+}
+
+void MysqlStatement::close() {
+  if (p_stmt) {
+    mysql_stmt_close(p_stmt);
+    p_stmt = 0;
+  }
+}
+
+void MysqlStatement::reprepare() {
+  close();
+
+  p_stmt = mysql_stmt_init(p_backend->getConnection());
+  if (!p_stmt)
+    throw SQLException("mysql_stmt_init failed", p_backend->getConnection());
+
+  int ret = mysql_stmt_prepare(p_stmt, p_query.c_str(), p_query.length());
+  if (ret)
+    throw SQLException("mysql_stmt_prepare failed: "+string(mysql_stmt_error(p_stmt)));
+
+  if (p_streamed) {
+    //Without mysql_stmt_store_result rows would be fetched unbuffered, but the connection could not run any other
+    //statement until the last row is read. Scans like verifyTree look up rows while they read, so they use a cursor,
+    //at the cost of the server materializing the whole result in a temporary table before the first row is sent.
+    unsigned long cursorType = CURSOR_TYPE_READ_ONLY;
+    unsigned long prefetch = prefetchRows();
+    if (mysql_stmt_attr_set(p_stmt, STMT_ATTR_CURSOR_TYPE, &cursorType) ||
+        mysql_stmt_attr_set(p_stmt, STMT_ATTR_PREFETCH_ROWS, &prefetch))
+      throw SQLException("failed to set up cursor", p_stmt);
+  }
+
+  //the bind arrays point into p_params and p_columns, so both are sized once here and never resized
+  //after a reconnect the parameters are kept, a retried statement executes with the values set before
+  if (p_binds.size() != mysql_stmt_param_count(p_stmt)) {
+    p_binds.assign(mysql_stmt_param_count(p_stmt), MYSQL_BIND());
+    p_params.assign(p_binds.size(), param_t());
+    for (size_t i = 0; i < p_binds.size(); i++) {
+      p_binds[i].buffer_type = MYSQL_TYPE_NULL;
+      p_binds[i].length = &p_params[i].length;
+      p_binds[i].is_null = &p_params[i].isNull;
+    }
+  }
+  p_paramsDirty = true;
+
+  bindResults();
+}
+
+void MysqlStatement::bindParams() {
+  int ret = mysql_stmt_bind_param(p_stmt, p_binds.data());
+  if (ret)
+    throw SQLException("mysql_stmt_bind_param failed", p_stmt);
+  p_paramsDirty = false;
+}
+
+void MysqlStatement::bindResults() {
+  p_resultBinds.clear();
+  p_columns.clear();
+  MYSQL_RES* meta = mysql_stmt_result_metadata(p_stmt);
+  if (!meta) //statement does not produce a result set
+    return;
+
+  unsigned int count = mysql_num_fields(meta);
+  MYSQL_FIELD* fields = mysql_fetch_fields(meta);
+  p_resultBinds.assign(count, MYSQL_BIND());
+  p_columns.assign(count, column_t());
+  for (unsigned int i = 0; i < count; i++) {
+    MYSQL_BIND& bind = p_resultBinds[i];
+    column_t& col = p_columns[i];
+    bind.length = &col.length;
+    bind.is_null = &col.isNull;
+    bind.error = &col.error;
+    switch (fields[i].type) {
+      case MYSQL_TYPE_TINY :
+      case MYSQL_TYPE_SHORT :
+      case MYSQL_TYPE_INT24 :
+      case MYSQL_TYPE_LONG :
+      case MYSQL_TYPE_LONGLONG :
+        bind.buffer_type = MYSQL_TYPE_LONGLONG;
+        bind.buffer = &col.number;
+        bind.buffer_length = sizeof(col.number);
+        bind.is_unsigned = true;
+        break;
+      default : //strings, decimals, dates: fetch their text representation
+        col.str.resize(256);
+        bind.buffer_type = MYSQL_TYPE_STRING;
+        bind.buffer = col.str.data();
+        bind.buffer_length = col.str.size();
+        break;
+    }
+  }
+  mysql_free_result(meta);
+
+  int ret = mysql_stmt_bind_result(p_stmt, p_resultBinds.data());
+  if (ret)
+    throw SQLException("mysql_stmt_bind_result failed", p_stmt);
+}
+
+bool MysqlStatement::execute() {
+  Timer timer(this, false);
+  if (p_resultLost) { //the handle belongs to the connection that was lost
+    p_resultLost = false;
+    reprepare();
+  }
+  p_resultOpen = false;
+  int ret;
+  for (unsigned int attempt = 0; ; attempt++) {
+    if (p_paramsDirty)
+      bindParams();
+    ret = mysql_stmt_execute(p_stmt);
+    if (!ret)
+      break;
+    if (!retryAfterError(attempt))
+      throw SQLException("mysql_stmt_execute failed", p_stmt);
+  }
+
+  p_rowValid = false;
+  return ret;
+}
+
+int MysqlStatement::executeQuery() {
+  for (unsigned int attempt = 0; ; attempt++) {
+    execute();
+    if (p_streamed) {
+      p_resultOpen = true;
+      return 0;
+    }
+    if (!mysql_stmt_store_result(p_stmt))
+      break;
+    if (!retryAfterError(attempt))
+      throw SQLException("mysql_stmt_store_result failed", p_stmt);
+  }
+
+  p_resultOpen = true;
+  return rowsCount();
+}
+
+string MysqlStatement::boundQuery() const {
+  static const char hex[] = "0123456789abcdef";
+  vector<string> literals(p_params.size());
+  for (size_t i = 0; i < p_params.size(); i++) {
+    const param_t& param = p_params[i];
+    const MYSQL_BIND& bind = p_binds[i];
+    switch (param.isNull ? MYSQL_TYPE_NULL : bind.buffer_type) {
+      case MYSQL_TYPE_LONG :
+        literals[i] = bind.is_unsigned ? to_string(param.value.u32) : to_string(param.value.i32);
+        break;
+      case MYSQL_TYPE_LONGLONG :
+        literals[i] = bind.is_unsigned ? to_string(param.value.u64) : to_string(param.value.i64);
+        break;
+      case MYSQL_TYPE_STRING :
+        literals[i] = quote(param.str.substr(0, param.length));
+        break;
+      case MYSQL_TYPE_BLOB :
+        literals[i] = "X'";
+        for (size_t j = 0; j < param.length; j++)
+          literals[i].append(1, hex[(unsigned char)param.str[j] >> 4]).push_back(hex[param.str[j] & 15]);
+        literals[i].push_back('\'');
+        break;
+      default :
+        literals[i] = "NULL";
+    }
+  }
+  return substitute(p_query, literals);
+}
+
+void MysqlStatement::setParam(unsigned int parameterIndex, enum_field_types type, bool isUnsigned) {
+  if (parameterIndex == 0 || parameterIndex > p_params.size())
+    throw out_of_range("parameter index out of range");
+  MYSQL_BIND& bind = p_binds[parameterIndex-1];
+  param_t& param = p_params[parameterIndex-1];
+  void* buffer = type == MYSQL_TYPE_STRING || type == MYSQL_TYPE_BLOB ? (void*)param.str.data() : (void*)&param.value;
+  if (bind.buffer_type != type || bind.buffer != buffer || bind.is_unsigned != isUnsigned) {
+    bind.buffer_type = type;
+    bind.buffer = buffer;
+    bind.is_unsigned = isUnsigned;
+    p_paramsDirty = true;
+  }
+  param.isNull = false;
+}
+
+void MysqlStatement::setInt(unsigned int parameterIndex, int32_t value) {
+  setParam(parameterIndex, MYSQL_TYPE_LONG, false);
+  p_params[parameterIndex-1].value.i32 = value;
+}
+
+void MysqlStatement::setUInt(unsigned int parameterIndex, uint32_t value) {
+  setParam(parameterIndex, MYSQL_TYPE_LONG, true);
+  p_params[parameterIndex-1].value.u32 = value;
+}
+
+void MysqlStatement::setInt64(unsigned int parameterIndex, int64_t value) {
+  setParam(parameterIndex, MYSQL_TYPE_LONGLONG, false);
+  p_params[parameterIndex-1].value.i64 = value;
+}
+
+void MysqlStatement::setUInt64(unsigned int parameterIndex, uint64_t value) {
+  setParam(parameterIndex, MYSQL_TYPE_LONGLONG, true);
+  p_params[parameterIndex-1].value.u64 = value;
+}
+
+void MysqlStatement::setNull(unsigned int parameterIndex, int sqlType __attribute__((unused))) {
+  if (parameterIndex == 0 || parameterIndex > p_params.size())
+    throw out_of_range("parameter index out of range");
+  p_params[parameterIndex-1].isNull = true; //keeps the bound type, no rebind needed
+}
+
+void MysqlStatement::setString(unsigned int parameterIndex, const string& value) {
+  param_t& param = p_params.at(parameterIndex-1);
+  param.str.assign(value); //reuses the string's capacity, the buffer only moves when it grows
+  param.length = value.length();
+  setParam(parameterIndex, MYSQL_TYPE_STRING, false);
+  p_binds[parameterIndex-1].buffer_length = param.length;
+}
+
+void MysqlStatement::setBinary(unsigned int parameterIndex, const string& value) {
+  param_t& param = p_params.at(parameterIndex-1);
+  param.str.assign(value);
+  param.length = value.length();
+  setParam(parameterIndex, MYSQL_TYPE_BLOB, false); //sent as is, without a conversion from the connection character set
+  p_binds[parameterIndex-1].buffer_length = param.length;
+}
+
+const MysqlStatement::column_t& MysqlStatement::column(unsigned int index) const {
+  if (!p_rowValid)
+    throw out_of_range("no result row available");
+  if (index == 0 || index > p_columns.size())
+    throw out_of_range("field index out of range");
+  return p_columns[index-1];
+}
+
+uint64_t MysqlStatement::getUInt64(unsigned int index) {
+  const column_t& col = column(index);
+  if (col.isNull)
+    return 0;
+  if (p_resultBinds[index-1].buffer_type == MYSQL_TYPE_LONGLONG)
+    return col.number;
+  return strtoull(string(col.str.data(), col.length).c_str(), 0, 10);
+}
+
+std::string MysqlStatement::getString(unsigned int index) {
+  const column_t& col = column(index);
+  if (col.isNull)
+    return string();
+  if (p_resultBinds[index-1].buffer_type == MYSQL_TYPE_LONGLONG)
+    return to_string(col.number);
+  return string(col.str.data(), col.length);
+}
+
+bool MysqlStatement::next() {
+  Timer timer(this, true);
+  checkCursor();
+  int ret = mysql_stmt_fetch(p_stmt);
+  if (ret == MYSQL_DATA_TRUNCATED) {
+    //grow the buffers of truncated columns, fetch them again and keep the larger buffers bound for the following rows
+    for (size_t i = 0; i < p_columns.size(); i++) {
+      column_t& col = p_columns[i];
+      if (!col.error || p_resultBinds[i].buffer_type != MYSQL_TYPE_STRING)
+        continue;
+      col.str.resize(col.length);
+      p_resultBinds[i].buffer = col.str.data();
+      p_resultBinds[i].buffer_length = col.str.size();
+      if (mysql_stmt_fetch_column(p_stmt, &p_resultBinds[i], i, 0))
+        throw SQLException("failed to fetch truncated column", p_stmt);
+    }
+    if (mysql_stmt_bind_result(p_stmt, p_resultBinds.data()))
+      throw SQLException("mysql_stmt_bind_result failed", p_stmt);
+    ret = 0;
+  }
+  if (ret == 1)
+    throw SQLException("mysql_stmt_fetch failed", p_stmt);
+  p_rowValid = ret == 0;
+  return p_rowValid;
+}
+
+void MysqlStatement::release() {
+  p_resultOpen = false;
+  if (p_resultLost) {
+    p_resultLost = false;
+    reprepare(); //frees the result along with the old handle
+    return;
+  }
+  mysql_stmt_free_result(p_stmt);
+  if (p_streamed)
+    mysql_stmt_reset(p_stmt); //close the server side cursor
+}
+
+int MysqlStatement::rowsCount() {
+  return mysql_stmt_num_rows(p_stmt);
+}
+
+uint64_t MysqlStatement::lastInsertId() {
+  return mysql_stmt_insert_id(p_stmt);
+}
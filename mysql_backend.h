@@ -0,0 +1,111 @@
+#ifndef MYSQL_BACKEND_H
+#define MYSQL_BACKEND_H
+
+#include <string>
+#include <vector>
+
+#include <mysql.h>
+
+#include "backend.h"
+#include "query_pool.h"
+
+//MySQL/MariaDB server backend, the connection is set up by ConnectionPool::connect
+class MysqlBackend : public Backend {
+public:
+  MysqlBackend(const dbConfig_t& config); //throws SQLException if the server cannot be reached
+  ~MysqlBackend();
+
+  MYSQL* getConnection() const;
+  //number of partitions of newly created tables, 0 for none
+  static unsigned int& partitions();
+
+  const char* name() const;
+  bool query(const std::string& sql);
+  PreparedStatementWrapper* statement(worker* w, const std::string& sql, PreparedStatementWrapper::resultMode_t mode);
+  bool explain(const std::string& sql, std::vector<std::string>& plan);
+  bool reconnect();
+
+  void createTables(const std::string& directoryTable, const std::string& fileTable);
+  void createDuplicatesTable(const std::string& table);
+  void clearTable(const std::string& table);
+  bool binaryHashes(const std::string& fileTable);
+
+  std::string unixTime(const std::string& column) const;
+  std::string fromUnixTime(const std::string& value) const;
+
+private:
+  //like query, but a lost connection is an error as well
+  void execute(const std::string& sql);
+
+  dbConfig_t p_config; //kept to reconnect
+  MYSQL* p_connection;
+};
+
+class MysqlStatement : public PreparedStatementWrapper {
+public:
+  MysqlStatement(worker* w, MysqlBackend* backend, const std::string& sql, resultMode_t mode);
+  ~MysqlStatement();
+
+  void reprepare();
+  void close();
+
+  bool execute();
+  //returns the number of rows of buffered results, 0 for streamed results
+  int executeQuery();
+  std::string boundQuery() const;
+
+  void setInt(unsigned int parameterIndex, int32_t value);
+  void setUInt(unsigned int parameterIndex, uint32_t value);
+  void setInt64(unsigned int parameterIndex, int64_t value);
+  void setUInt64(unsigned int parameterIndex, uint64_t value);
+  void setNull(unsigned int parameterIndex, int sqlType);
+  void setString(unsigned int parameterIndex, const std::string& value);
+  void setBinary(unsigned int parameterIndex, const std::string& value);
+
+  uint64_t getUInt64(unsigned int index);
+  std::string getString(unsigned int index);
+  bool next();
+  void release();
+  int rowsCount(); // only valid for buffered results
+  uint64_t lastInsertId();
+
+private:
+  //decides whether a failed operation is retried and reconnects if so, attempt counts from 0
+  bool retryAfterError(unsigned int attempt);
+
+  //parameter storage, bound once and only rebound if a buffer moves or changes its type
+  struct param_t {
+    union {
+      int32_t i32;
+      uint32_t u32;
+      int64_t i64;
+      uint64_t u64;
+    } value;
+    std::string str;
+    unsigned long length;
+    my_bool isNull;
+  };
+  //result column storage, numeric columns are fetched as 64 bit integers, all others as strings
+  struct column_t {
+    uint64_t number;
+    std::vector<char> str;
+    unsigned long length;
+    my_bool isNull;
+    my_bool error;
+  };
+  void bindParams();
+  void bindResults();
+  const column_t& column(unsigned int index) const;
+  void setParam(unsigned int parameterIndex, enum_field_types type, bool isUnsigned);
+
+  MysqlBackend* p_backend;
+  MYSQL_STMT* p_stmt;
+  std::vector<MYSQL_BIND> p_binds;
+  std::vector<param_t> p_params;
+  bool p_paramsDirty;
+  std::vector<MYSQL_BIND> p_resultBinds;
+  std::vector<column_t> p_columns;
+  bool p_rowValid;
+};
+
+#endif //MYSQL_BACKEND_H
@@ -0,0 +1,580 @@
+#include "name_index.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "name indexes are mapped as little endian"
+#endif
+
+using namespace std;
+
+const char NameIndex::magic[8] = { 'F', 'S', 'C', 'N', 'A', 'M', 'E', '\0' };
+const uint32_t NameIndex::none;
+const uint32_t NameIndex::version;
+
+static void appendVarint(string& buffer, uint64_t value) {
+  while (value >= 0x80) {
+    buffer += (char)(value | 0x80);
+    value >>= 7;
+  }
+  buffer += (char)value;
+}
+
+static uint64_t readVarint(const char* data, uint64_t end, uint64_t& pos) {
+  uint64_t value = 0;
+  for (unsigned int shift = 0; shift < 64; shift += 7) {
+    if (pos >= end)
+      break;
+    unsigned char byte = data[pos++];
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return value;
+  }
+  throw runtime_error("corrupt posting list in name index");
+}
+
+static uint32_t trigramAt(const string& name, size_t pos) {
+  return (uint32_t)(unsigned char)name[pos] << 16 | (uint32_t)(unsigned char)name[pos+1] << 8 | (unsigned char)name[pos+2];
+}
+
+NameIndex::NameIndex(const string& file) : p_data(0), p_length(0), p_header(0) {
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    throw runtime_error("failed to open name index "+file+": "+strerror(errno));
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(header_t)) {
+    close(fd);
+    throw runtime_error("name index "+file+" is truncated");
+  }
+  void* data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); //the mapping keeps the file open
+  if (data == MAP_FAILED)
+    throw runtime_error("failed to map name index "+file+": "+strerror(errno));
+  p_data = (const char*)data;
+  p_length = st.st_size;
+  p_header = (const header_t*)p_data;
+
+  const char* error = 0;
+  if (memcmp(p_header->magic, magic, sizeof(magic)))
+    error = "not a name index";
+  else if (p_header->version != version)
+    error = "unsupported name index version";
+  else if (p_header->directories > p_header->entries || p_header->entries == none)
+    error = "invalid name index header";
+  for (int s = 0; !error && s < sectionCount; s++) {
+    uint64_t offset = p_header->offsets[s];
+    if (offset % 8 || offset > p_length || sectionSize((section_t)s, *p_header) > p_length-offset)
+      error = "name index is truncated";
+  }
+  if (!error && section<uint64_t>(secNameIndex)[p_header->entries] != p_header->nameBytes)
+    error = "name index is truncated";
+  if (error) {
+    munmap(data, p_length);
+    throw runtime_error(string(error)+": "+file);
+  }
+  LOG(logDebug) << "mapped name index " << file << " with " << p_header->entries << " entries and " << p_header->trigrams << " trigrams";
+}
+
+NameIndex::~NameIndex() {
+  munmap((void*)p_data, p_length);
+}
+
+uint64_t NameIndex::sectionSize(section_t section, const header_t& header) {
+  switch (section) {
+    case secIds : return (uint64_t)header.entries*8;
+    case secParents : return (uint64_t)header.entries*4;
+    case secNameIndex : return ((uint64_t)header.entries+1)*8;
+    case secNames : return header.nameBytes;
+    case secTrigrams : return (uint64_t)header.trigrams*sizeof(trigram_t);
+    default : return header.postingBytes;
+  }
+}
+
+template<typename T> const T* NameIndex::section(section_t section) const {
+  return (const T*)(p_data+p_header->offsets[section]);
+}
+
+uint32_t NameIndex::entries() const {
+  return p_header->entries;
+}
+
+uint32_t NameIndex::directories() const {
+  return p_header->directories;
+}
+
+uint64_t NameIndex::maxDirectoryId() const {
+  return p_header->maxDirectoryId;
+}
+
+uint64_t NameIndex::maxFileId() const {
+  return p_header->maxFileId;
+}
+
+time_t NameIndex::created() const {
+  return p_header->created;
+}
+
+uint64_t NameIndex::id(uint32_t entry) const {
+  return section<uint64_t>(secIds)[entry];
+}
+
+uint32_t NameIndex::parent(uint32_t entry) const {
+  return section<uint32_t>(secParents)[entry];
+}
+
+string NameIndex::name(uint32_t entry) const {
+  const uint64_t* nameIndex = section<uint64_t>(secNameIndex);
+  if (nameIndex[entry] > nameIndex[entry+1] || nameIndex[entry+1] > p_header->nameBytes)
+    throw runtime_error("corrupt name in name index");
+  return string(section<char>(secNames)+nameIndex[entry], nameIndex[entry+1]-nameIndex[entry]);
+}
+
+string NameIndex::path(uint32_t entry) const {
+  vector<uint32_t> chain;
+  for (; entry != none; entry = parent(entry)) {
+    if (entry >= p_header->entries || chain.size() > p_header->directories) //parents are written before their children
+      throw runtime_error("corrupt parent in name index");
+    chain.push_back(entry);
+  }
+  string path;
+  for (vector<uint32_t>::reverse_iterator it = chain.rbegin(); it != chain.rend(); it++)
+    path.append(1, '/').append(name(*it));
+  return path;
+}
+
+const NameIndex::trigram_t* NameIndex::lookup(uint32_t trigram) const {
+  const trigram_t* first = section<trigram_t>(secTrigrams);
+  const trigram_t* last = first+p_header->trigrams;
+  const trigram_t* it = lower_bound(first, last, trigram, [](const trigram_t& t, uint32_t value) { return t.trigram < value; });
+  return it != last && it->trigram == trigram ? it : 0;
+}
+
+void NameIndex::intersect(const trigram_t& list, vector<uint32_t>& candidates, bool all) const {
+  const char* postings = section<char>(secPostings);
+  uint64_t pos = list.offset;
+  uint64_t entry = 0;
+  size_t kept = 0, next = 0;
+  if (all)
+    candidates.reserve(list.count);
+  for (uint32_t i = 0; i < list.count; i++) {
+    entry += readVarint(postings, p_header->postingBytes, pos);
+    if (all) {
+      candidates.push_back(entry);
+      continue;
+    }
+    while (next < candidates.size() && candidates[next] < entry)
+      next++;
+    if (next == candidates.size())
+      break;
+    if (candidates[next] == entry)
+      candidates[kept++] = candidates[next++];
+  }
+  if (!all)
+    candidates.resize(kept);
+}
+
+uint64_t NameIndex::find(const string& pattern, const function<void(uint32_t)>& output) const {
+  const string glob = pattern.find_first_of("*?[") == string::npos ? '*'+pattern+'*' : pattern;
+
+  //trigrams of the runs of literal characters, wildcards and bracket expressions end a run
+  vector<uint32_t> trigrams;
+  string run;
+  for (size_t i = 0; i <= glob.size(); i++) {
+    bool literal = i < glob.size();
+    if (literal && glob[i] == '\\' && i+1 < glob.size())
+      i++;
+    else if (literal && (glob[i] == '*' || glob[i] == '?'))
+      literal = false;
+    else if (literal && glob[i] == '[') {
+      size_t close = glob.find(']', i+(glob.compare(i+1, 1, "!") ? 2 : 3));
+      if (close != string::npos) {
+        i = close;
+        literal = false;
+      }
+    }
+    if (literal) {
+      run += glob[i];
+      continue;
+    }
+    for (size_t pos = 0; pos+3 <= run.size(); pos++)
+      trigrams.push_back(trigramAt(run, pos));
+    run.clear();
+  }
+  sort(trigrams.begin(), trigrams.end());
+  trigrams.erase(unique(trigrams.begin(), trigrams.end()), trigrams.end());
+
+  vector<const trigram_t*> lists;
+  for (size_t i = 0; i < trigrams.size(); i++) {
+    const trigram_t* list = lookup(trigrams[i]);
+    if (!list) //no name contains it
+      return 0;
+    lists.push_back(list);
+  }
+  sort(lists.begin(), lists.end(), [](const trigram_t* a, const trigram_t* b) { return a->count < b->count; });
+
+  uint64_t matches = 0;
+  auto check = [&](uint32_t entry) {
+    if (fnmatch(glob.c_str(), name(entry).c_str(), 0) == 0) {
+      output(entry);
+      matches++;
+    }
+  };
+  if (lists.empty()) { //too short to use the index, match every name
+    for (uint32_t entry = 0; entry < p_header->entries; entry++)
+      check(entry);
+    return matches;
+  }
+  vector<uint32_t> candidates;
+  for (size_t i = 0; i < lists.size() && (i == 0 || !candidates.empty()); i++) {
+    if (i > 0 && candidates.size()*32 < lists[i]->count) //matching the few candidates is cheaper than decoding the list
+      break;
+    intersect(*lists[i], candidates, i == 0);
+  }
+  LOG(logDebug) << "intersecting " << lists.size() << " posting lists left " << candidates.size() << " candidates";
+  for (size_t i = 0; i < candidates.size() && candidates[i] < p_header->entries; i++)
+    check(candidates[i]);
+  return matches;
+}
+
+NameIndexWriter::entry_t* NameIndexWriter::table_t::find(uint64_t id) {
+  sort();
+  vector<entry_t>::iterator it = lower_bound(entries.begin(), entries.end(), id, [](const entry_t& e, uint64_t value) { return e.id < value; });
+  return it != entries.end() && it->id == id ? &*it : 0;
+}
+
+void NameIndexWriter::table_t::sort() {
+  if (sorted)
+    return;
+  std::sort(entries.begin(), entries.end(), [](const entry_t& a, const entry_t& b) { return a.id < b.id; });
+  sorted = true;
+}
+
+NameIndexWriter::NameIndexWriter(const string& file, unsigned int saveInterval)
+  : p_file(file),
+    p_saveInterval(saveInterval),
+    p_saved(chrono::steady_clock::now()),
+    p_dirty(false),
+    p_writing(false) {
+  p_directories.sorted = true;
+  p_files.sorted = true;
+}
+
+NameIndexWriter::~NameIndexWriter() {
+  if (p_writer.joinable())
+    p_writer.join();
+}
+
+void NameIndexWriter::load(const NameIndex& index) {
+  unique_lock<mutex> lock(p_mutex);
+  p_idle.wait(lock, [this] { return !p_writing; });
+  p_names.assign(index.section<char>(NameIndex::secNames), index.p_header->nameBytes);
+  p_directories.entries.clear();
+  p_files.entries.clear();
+  const uint64_t* nameIndex = index.section<uint64_t>(NameIndex::secNameIndex);
+  for (uint32_t i = 0; i < index.entries(); i++) {
+    uint32_t parent = index.parent(i);
+    if (parent != NameIndex::none && parent >= index.directories())
+      throw runtime_error("corrupt parent in name index");
+    entry_t entry = { index.id(i), parent == NameIndex::none ? 0 : index.id(parent), nameIndex[i], (uint16_t)(nameIndex[i+1]-nameIndex[i]), false };
+    (index.isDirectory(i) ? p_directories : p_files).entries.push_back(entry);
+  }
+  //written in id order
+  p_directories.sorted = false;
+  p_files.sorted = false;
+  p_dirty = false;
+}
+
+void NameIndexWriter::clear() {
+  unique_lock<mutex> lock(p_mutex);
+  p_idle.wait(lock, [this] { return !p_writing; });
+  p_names.clear();
+  p_directories.entries.clear();
+  p_files.entries.clear();
+  p_directories.sorted = true;
+  p_files.sorted = true;
+  p_dirty = true;
+}
+
+void NameIndexWriter::add(uint64_t id, uint64_t parent, bool directory, const string& name) {
+  unique_lock<mutex> lock(p_mutex);
+  p_idle.wait(lock, [this] { return !p_writing; });
+  table_t& table = directory ? p_directories : p_files;
+  entry_t entry = { id, parent, p_names.size(), (uint16_t)name.size(), false };
+  if (!table.entries.empty() && table.entries.back().id >= id)
+    table.sorted = false;
+  table.entries.push_back(entry);
+  p_names += name;
+  p_dirty = true;
+}
+
+void NameIndexWriter::insert(string& names, table_t& table, uint64_t id, uint64_t parent, const string& name) {
+  entry_t entry = { id, parent, names.size(), (uint16_t)name.size(), false };
+  names += name;
+  entry_t* existing = table.find(id);
+  if (existing)
+    *existing = entry;
+  else if (table.entries.empty() || table.entries.back().id < id) //ids are handed out in ascending order
+    table.entries.push_back(entry);
+  else
+    table.entries.insert(lower_bound(table.entries.begin(), table.entries.end(), id, [](const entry_t& e, uint64_t value) { return e.id < value; }), entry);
+}
+
+void NameIndexWriter::remove(table_t& table, uint64_t id) {
+  entry_t* entry = table.find(id);
+  if (entry)
+    entry->deleted = true;
+}
+
+void NameIndexWriter::directoryInserted(uint64_t id, uint64_t parent, const string& name, uint64_t, time_t) {
+  lock_guard<mutex> lock(p_mutex);
+  insert(p_names, p_directories, id, parent, name);
+  changed(true, false, id, parent, name);
+}
+
+void NameIndexWriter::fileInserted(uint64_t id, uint64_t parent, const string& name, uint64_t, time_t, const string&) {
+  lock_guard<mutex> lock(p_mutex);
+  insert(p_names, p_files, id, parent, name);
+  changed(false, false, id, parent, name);
+}
+
+void NameIndexWriter::directoryDeleted(uint64_t id) {
+  lock_guard<mutex> lock(p_mutex);
+  remove(p_directories, id);
+  changed(true, true, id, 0, string());
+}
+
+void NameIndexWriter::fileDeleted(uint64_t id) {
+  lock_guard<mutex> lock(p_mutex);
+  remove(p_files, id);
+  changed(false, true, id, 0, string());
+}
+
+void NameIndexWriter::changed(bool directory, bool deleted, uint64_t id, uint64_t parent, const string& name) {
+  p_dirty = true;
+  if (p_writing) {
+    change_t change = { directory, deleted, id, parent, name };
+    p_changes.push_back(change);
+    return;
+  }
+  if (chrono::steady_clock::now()-p_saved < p_saveInterval)
+    return;
+  if (p_writer.joinable()) //done with the last write, it only frees the old names
+    p_writer.join();
+  //copying is a fraction of the encoding, which must not hold up the workers reporting changes
+  snapshot_t* snapshot = new snapshot_t;
+  snapshot->names = p_names;
+  snapshot->directories = p_directories;
+  snapshot->files = p_files;
+  p_writing = true;
+  p_dirty = false;
+  p_writer = thread(&NameIndexWriter::background, this, snapshot);
+}
+
+void NameIndexWriter::background(snapshot_t* snapshot) {
+  string error;
+  try {
+    write(p_file, snapshot->names, snapshot->directories, snapshot->files);
+  } catch (exception& e) {
+    error = e.what();
+  }
+  {
+    lock_guard<mutex> lock(p_mutex);
+    if (error.empty()) {
+      //continue with what was written, dropping the deleted entries and their names, plus the changes since
+      p_names.swap(snapshot->names);
+      swap(p_directories, snapshot->directories);
+      swap(p_files, snapshot->files);
+      for (size_t i = 0; i < p_changes.size(); i++) {
+        const change_t& change = p_changes[i];
+        table_t& table = change.directory ? p_directories : p_files;
+        if (change.deleted)
+          remove(table, change.id);
+        else
+          insert(p_names, table, change.id, change.parent, change.name);
+      }
+    } else { //the catalog changes themselves succeeded, try again with the next one after the save interval
+      LOG(logError) << error;
+      p_dirty = true;
+    }
+    p_changes.clear();
+    p_saved = chrono::steady_clock::now();
+    p_writing = false;
+  }
+  p_idle.notify_all();
+  delete snapshot; //the names and tables before the write
+}
+
+uint32_t NameIndexWriter::save() {
+  unique_lock<mutex> lock(p_mutex);
+  p_idle.wait(lock, [this] { return !p_writing; });
+  uint32_t entries = write(p_file, p_names, p_directories, p_files);
+  p_dirty = false;
+  p_saved = chrono::steady_clock::now();
+  return entries;
+}
+
+uint32_t NameIndexWriter::write(const string& file, string& allNames, table_t& directoryTable, table_t& fileTable) {
+  directoryTable.sort();
+  fileTable.sort();
+  vector<entry_t>& directories = directoryTable.entries;
+  vector<entry_t>& files = fileTable.entries;
+
+  //number the directories connected to the root, the ones below deleted directories are gone from the catalog
+  const uint32_t unknown = NameIndex::none, visiting = NameIndex::none-1, dead = NameIndex::none-2;
+  vector<uint32_t> numbers(directories.size(), unknown);
+  auto directory = [&](uint64_t id) -> size_t {
+    vector<entry_t>::iterator it = lower_bound(directories.begin(), directories.end(), id, [](const entry_t& e, uint64_t value) { return e.id < value; });
+    return it != directories.end() && it->id == id && !it->deleted ? it-directories.begin() : directories.size();
+  };
+  vector<size_t> chain;
+  vector<uint32_t> order; //directories by number, parents first
+  for (size_t i = 0; i < directories.size(); i++) {
+    size_t current = i;
+    while (current < directories.size() && numbers[current] == unknown && !directories[current].deleted) {
+      numbers[current] = visiting;
+      chain.push_back(current);
+      current = directories[current].parent ? directory(directories[current].parent) : directories.size()+1;
+    }
+    //the chain ends at the root, at a numbered directory or at a missing, deleted or looping one
+    bool alive = current == directories.size()+1 || (current < directories.size() && numbers[current] < dead);
+    for (vector<size_t>::reverse_iterator it = chain.rbegin(); it != chain.rend(); it++) {
+      numbers[*it] = alive ? order.size() : dead;
+      if (alive)
+        order.push_back(*it);
+    }
+    chain.clear();
+  }
+  const uint32_t directoryCount = order.size();
+
+  NameIndex::header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, NameIndex::magic, sizeof(header.magic));
+  header.version = NameIndex::version;
+  header.directories = directoryCount;
+  header.created = time(0);
+
+  vector<uint64_t> ids;
+  vector<uint32_t> parents;
+  vector<uint64_t> nameIndex;
+  string names;
+  auto append = [&](const entry_t& e, uint32_t parent) {
+    ids.push_back(e.id);
+    parents.push_back(parent);
+    nameIndex.push_back(names.size());
+    names.append(allNames, e.nameOffset, e.nameLength);
+  };
+  for (uint32_t number = 0; number < directoryCount; number++) {
+    const entry_t& e = directories[order[number]];
+    append(e, e.parent ? numbers[directory(e.parent)] : NameIndex::none);
+    header.maxDirectoryId = max(header.maxDirectoryId, e.id);
+  }
+  size_t parent = directories.size();
+  for (size_t i = 0; i < files.size(); i++) {
+    const entry_t& e = files[i];
+    if (e.parent && (i == 0 || e.parent != files[i-1].parent)) //files of a directory were mostly inserted together
+      parent = directory(e.parent);
+    if (e.deleted || (e.parent && (parent == directories.size() || numbers[parent] >= dead)))
+      continue;
+    append(e, e.parent ? numbers[parent] : NameIndex::none);
+    header.maxFileId = max(header.maxFileId, e.id);
+  }
+  nameIndex.push_back(names.size());
+  header.entries = ids.size();
+  header.nameBytes = names.size();
+
+  //posting lists are built in entry order, so every list is ascending without sorting. Trigrams are only 24 bits,
+  //a table of all of them finds the list of one faster than hashing it.
+  struct posting_t {
+    string gaps;
+    uint32_t count;
+    uint32_t last;
+  };
+  vector<posting_t> postings;
+  vector<uint32_t> slots(1 << 24, NameIndex::none); //trigram -> posting
+  for (uint32_t entry = 0; entry < header.entries; entry++) {
+    const uint64_t start = nameIndex[entry], end = nameIndex[entry+1];
+    for (uint64_t pos = start; pos+3 <= end; pos++) {
+      uint32_t& slot = slots[trigramAt(names, pos)];
+      if (slot == NameIndex::none) {
+        slot = postings.size();
+        postings.push_back(posting_t());
+        postings.back().count = 0;
+      }
+      posting_t& posting = postings[slot];
+      if (posting.count && posting.last == entry) //repeated in the name
+        continue;
+      appendVarint(posting.gaps, posting.count ? entry-posting.last : entry);
+      posting.count++;
+      posting.last = entry;
+    }
+  }
+  vector<NameIndex::trigram_t> trigrams;
+  trigrams.reserve(postings.size());
+  for (uint32_t trigram = 0; trigram < slots.size(); trigram++)
+    if (slots[trigram] != NameIndex::none) {
+      NameIndex::trigram_t t = { trigram, postings[slots[trigram]].count, slots[trigram] }; //offset set when written
+      trigrams.push_back(t);
+    }
+  header.trigrams = trigrams.size();
+
+  //written next to the destination and renamed, so readers never map a half written index
+  string temporary = file+".tmp";
+  ofstream out(temporary.c_str(), ios::binary | ios::trunc);
+  out.write((const char*)&header, sizeof(header));
+  auto put = [&](NameIndex::section_t section, const void* data, size_t length) {
+    static const char padding[8] = { 0 };
+    out.write(padding, (8-out.tellp()%8)%8);
+    header.offsets[section] = out.tellp();
+    out.write((const char*)data, length);
+  };
+  put(NameIndex::secIds, ids.data(), ids.size()*sizeof(uint64_t));
+  put(NameIndex::secParents, parents.data(), parents.size()*sizeof(uint32_t));
+  put(NameIndex::secNameIndex, nameIndex.data(), nameIndex.size()*sizeof(uint64_t));
+  put(NameIndex::secNames, names.data(), names.size());
+  put(NameIndex::secPostings, 0, 0);
+  for (size_t i = 0; i < trigrams.size(); i++) {
+    const string& gaps = postings[trigrams[i].offset].gaps;
+    trigrams[i].offset = header.postingBytes;
+    header.postingBytes += gaps.size();
+    out.write(gaps.data(), gaps.size());
+  }
+  put(NameIndex::secTrigrams, trigrams.data(), trigrams.size()*sizeof(NameIndex::trigram_t));
+  out.seekp(0);
+  out.write((const char*)&header, sizeof(header));
+  out.close();
+  if (out.fail() || rename(temporary.c_str(), file.c_str())) {
+    unlink(temporary.c_str());
+    throw runtime_error("failed to write name index "+file+": "+strerror(errno));
+  }
+
+  //continue with what was written, dropping the deleted entries and their names
+  vector<entry_t> writtenDirectories, writtenFiles;
+  writtenDirectories.reserve(directoryCount);
+  writtenFiles.reserve(header.entries-directoryCount);
+  for (uint32_t entry = 0; entry < header.entries; entry++) {
+    entry_t e = { ids[entry], parents[entry] == NameIndex::none ? 0 : ids[parents[entry]], nameIndex[entry],
+                  (uint16_t)(nameIndex[entry+1]-nameIndex[entry]), false };
+    (entry < directoryCount ? writtenDirectories : writtenFiles).push_back(e);
+  }
+  directories.swap(writtenDirectories);
+  files.swap(writtenFiles);
+  directoryTable.sorted = false; //numbered parents first
+  fileTable.sorted = true;
+  allNames.swap(names);
+  LOG(logDetailed) << "Wrote " << header.entries << " names with " << header.trigrams << " trigrams and " << header.postingBytes
+                   << " bytes of postings to " << file;
+  return header.entries;
+}
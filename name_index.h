@@ -0,0 +1,164 @@
+#ifndef NAME_INDEX_H
+#define NAME_INDEX_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+#include <time.h>
+
+#include "worker.h"
+
+//Read-only trigram index over the names of all directories and files of a catalog, used through mmap like a Snapshot.
+//Entries are numbered directories first, each with its catalog id, the entry of its parent directory and its name.
+//Every trigram (3 consecutive bytes) of a name has a posting list of the entries containing it, stored as varint
+//encoded gaps between ascending entry numbers. A search intersects the lists of the trigrams of the literal parts of
+//the pattern, starting with the shortest, and only matches the names of the remaining candidates.
+//The file records the number of rows and the highest id of both tables it was written from, so it can be told
+//apart from a catalog that changed without it.
+class NameIndex {
+public:
+  static const uint32_t none = 0xffffffff;
+  static const uint32_t version = 1;
+
+  //maps file, throws runtime_error if it is no valid name index
+  NameIndex(const std::string& file);
+  ~NameIndex();
+
+  uint32_t entries() const;
+  uint32_t directories() const; //entries below are directories, the rest files
+  uint64_t maxDirectoryId() const;
+  uint64_t maxFileId() const;
+  time_t created() const;
+
+  uint64_t id(uint32_t entry) const;
+  uint32_t parent(uint32_t entry) const; //none for entries in the root
+  bool isDirectory(uint32_t entry) const { return entry < directories(); };
+  std::string name(uint32_t entry) const;
+  //slash separated path from the root of the catalog
+  std::string path(uint32_t entry) const;
+
+  //Passes the entries whose name matches the shell pattern (fnmatch) to output in entry order, a pattern without
+  //wildcards matches names containing it. Returns the number of matches.
+  uint64_t find(const std::string& pattern, const std::function<void(uint32_t)>& output) const;
+
+private:
+  friend class NameIndexWriter;
+  enum section_t { secIds, secParents, secNameIndex, secNames, secTrigrams, secPostings, sectionCount };
+  struct header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t entries;
+    uint32_t directories;
+    uint32_t trigrams;
+    uint64_t maxDirectoryId;
+    uint64_t maxFileId;
+    uint64_t created;
+    uint64_t nameBytes;
+    uint64_t postingBytes;
+    uint64_t offsets[sectionCount];
+  };
+  struct trigram_t {
+    uint32_t trigram; //bytes in the order of the name, the first one highest
+    uint32_t count; //entries in the posting list
+    uint64_t offset; //of the list in the postings
+  };
+  static const char magic[8];
+  static uint64_t sectionSize(section_t section, const header_t& header);
+  template<typename T> const T* section(section_t section) const;
+  const trigram_t* lookup(uint32_t trigram) const;
+  //entries of a posting list that are in candidates, or all of them if all is set
+  void intersect(const trigram_t& list, std::vector<uint32_t>& candidates, bool all) const;
+
+  const char* p_data;
+  size_t p_length;
+  const header_t* p_header;
+};
+
+//Names of all directories and files of a catalog, kept up to date as a CatalogObserver of the workers changing it
+//and written as a NameIndex. The posting lists are encoded from scratch on every write, so entries only have to be
+//added and marked as deleted in memory. Directories deleted along with their parent are not reported by the worker,
+//so writing drops everything not connected to the root. Changes are written every saveInterval seconds, when one
+//arrives at least that long after the last write, so a long crawl or watch writes the index while it runs. Those
+//writes encode a copy of the names on a background thread, the observer calls only append to a list of the changes
+//made meanwhile, which are applied to the written entries once it is done. All public methods are thread-safe.
+class NameIndexWriter : public CatalogObserver {
+public:
+  NameIndexWriter(const std::string& file, unsigned int saveInterval = 300);
+  ~NameIndexWriter(); //waits for a background write
+
+  //replaces the names by the ones of an index
+  void load(const NameIndex& index);
+  void clear();
+  //adding the rows in any order, but each one only once, is faster than the observer calls
+  void add(uint64_t id, uint64_t parent, bool directory, const std::string& name);
+  //writes the file after a background write finished, replacing it atomically, and returns the number of entries;
+  //throws runtime_error on failure
+  uint32_t save();
+
+  void directoryInserted(uint64_t id, uint64_t parent, const std::string& name, uint64_t size, time_t mtime);
+  void fileInserted(uint64_t id, uint64_t parent, const std::string& name, uint64_t size, time_t mtime, const std::string& hash);
+  void directoryUpdated(uint64_t, uint64_t, time_t) {}
+  void fileUpdated(uint64_t, uint64_t, time_t, const std::string&) {}
+  void directoryDeleted(uint64_t id);
+  void fileDeleted(uint64_t id);
+
+private:
+  struct entry_t {
+    uint64_t id;
+    uint64_t parent;
+    uint64_t nameOffset; //in p_names
+    uint16_t nameLength;
+    bool deleted;
+  };
+  //table of directories or files, sorted by id unless sorted is false
+  struct table_t {
+    std::vector<entry_t> entries;
+    bool sorted;
+    entry_t* find(uint64_t id);
+    void sort();
+  };
+
+  //catalog change made while a background write runs
+  struct change_t {
+    bool directory;
+    bool deleted;
+    uint64_t id;
+    uint64_t parent;
+    std::string name;
+  };
+  //names and tables written by a background write
+  struct snapshot_t {
+    std::string names;
+    table_t directories;
+    table_t files;
+  };
+
+  static void insert(std::string& names, table_t& table, uint64_t id, uint64_t parent, const std::string& name);
+  static void remove(table_t& table, uint64_t id);
+  //records the change for a running background write, or starts one if the last write is older than the save interval
+  void changed(bool directory, bool deleted, uint64_t id, uint64_t parent, const std::string& name);
+  void background(snapshot_t* snapshot);
+  //writes names and tables to file, then leaves only the written entries and their names in them
+  static uint32_t write(const std::string& file, std::string& names, table_t& directories, table_t& files);
+
+  std::string p_file;
+  std::chrono::seconds p_saveInterval;
+  std::chrono::steady_clock::time_point p_saved;
+  bool p_dirty;
+  std::string p_names; //all names, including the ones of deleted entries until the next write
+  table_t p_directories;
+  table_t p_files;
+  bool p_writing; //a background write runs, and the changes meanwhile go to p_changes as well
+  std::vector<change_t> p_changes;
+  std::thread p_writer;
+  std::mutex p_mutex;
+  std::condition_variable p_idle; //p_writing was cleared
+};
+
+#endif //NAME_INDEX_H
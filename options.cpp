@@ -1,8 +1,11 @@
 #include "options.h"
 #include "logger.h"
+#include "print_writer.h"
 #include "version.h"
 
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 using namespace boost::program_options;
 using namespace std;
@@ -12,7 +15,12 @@ options::options()
     p_opts_required("Required parameters"),
     p_opts_optional("Optional parameters"),
     p_opts_all("Allowed arguments"),
-    p_operation(opNone) {
+    p_operation(opNone),
+    p_timeBudget(0),
+    p_byteBudget(0),
+    p_maxReadRate(0),
+    p_sqliteCacheSize(0),
+    p_sqliteMmapSize(0) {
   // Attention: order of p_opts_mode has to correspond to operation_t
   p_opts_mode.add_options()
     ("crawl", "Crawl for new and changed files (default)")
@@ -21,6 +29,12 @@ options::options()
     ("print,P", "Print the tree structure to standard output (files only)")
     ("clear", "Delete the tree for this fakepath, others will be kept")
     ("purge", "Delete all data from both tables completely")
+    ("duplicates", "Find duplicate files by size, sampled and full hash (requires -T/M/S)")
+    ("scrub", "Check the hashes of the files verified longest ago until the budget is used up (requires -T/M/S)")
+    ("convert", value<string>(), "Copy the catalog into an empty catalog of another backend, keeping all ids: mysql, postgres, sqlite:FILE or lmdb:FILE")
+    ("export-snapshot", value<string>(), "Write the tree to a binary snapshot FILE for read-only operations on other hosts")
+    ("diff", value< vector<string> >()->multitoken(), "Print the changes from snapshot OLD to NEW as JSON lines, both given as snapshot FILE or tables:DIRTABLE,FILETABLE of the catalog")
+    ("find", value<string>(), "Print the paths of all directories and files whose name matches the shell PATTERN (or contains it, without wildcards), using the name index of --index-names")
     ("help,h", "Display this help and exit")
     ("version,V", "Print the version and exit")
   ;
@@ -34,6 +48,13 @@ options::options()
     ("logfile,L", value<string>(), "Log to file instead of stderr")
     ("fakepath,f", value<string>()->default_value(""), "Instead of having basedir as absolute root directory, parse all files as if they were unter this fakepath")
     ("watch,w", "Watch the given BASEDIR after crawling (program will block)")
+    ("index-names", value<string>(), "Keep a trigram index of all names in FILE for --find, rebuilt after a crawl if the catalog changed without it and updated by crawl and watch otherwise")
+    ("daemon", value<string>(), "Watch like --watch and answer queries on an in-memory index of the tree over the Unix domain socket SOCKET, one per line: lookup PATH, path directory|file ID, children PATH or size PATH")
+    ("backend", value<string>()->default_value("mysql"), "Catalog storage: mysql, postgres, sqlite or lmdb")
+    ("db-file", value<string>()->default_value("fscrawl.db"), "Database file of the sqlite and lmdb backends")
+    ("snapshot", value<string>(), "Read the tree from a snapshot file written by --export-snapshot instead of the database (print and check only)")
+    ("sqlite-cache", value<string>()->default_value("64M"), "Page cache size of the sqlite backend")
+    ("sqlite-mmap", value<string>()->default_value("256M"), "Bytes of the sqlite database file accessed through mmap")
     ("database,d", value<string>()->default_value("fscrawl"), "Database to use")
     ("host,m", value<string>()->default_value("localhost"), "Database host to connect to")
     ("user,u", value<string>()->default_value("root"), "Specify database user")
@@ -44,15 +65,41 @@ options::options()
     ("force-hashing,F", "Force recalculation of every hash (use when changing algorithm)")
     ("file-table", value<string>()->default_value("fscrawl_files"), "Table to use for files")
     ("dir-table", value<string>()->default_value("fscrawl_directories"), "Table to use for directories")
-    ("print-sums", "When printing the tree structure, additionally print the hash of every file")
+    ("print-sums", "Same as --print-format sums")
+    ("print-format", value<string>()->default_value("lines"), "Format of --print: lines, nul (NUL terminated paths), jsonl (path, size, mtime and hash) or sums (hash and relative path, checkable by sha1sum -c)")
+    ("print-output", value<string>(), "Write --print to FILE instead of standard output, gzip compressed if FILE ends with .gz")
     ("allow-empty", "Allow basedir to be empty, resulting in removing all files from db")
+    ("dup-table", value<string>()->default_value("fscrawl_duplicates"), "Table to store duplicate groups in")
+    ("sample-size", value<uint64_t>()->default_value(65536), "Bytes read from head and tail of each file to pre-filter duplicates")
+    ("threads,j", value<unsigned int>()->default_value(4), "Number of parallel reader threads for hashing (per device when checking, for all roots of --jobs)")
+    ("jobs", value<string>(), "Crawl the roots listed in FILE concurrently, one per line: BASEDIR [fakepath=PATH] [hash=md5|sha1|tth|none] [tables=DIRTABLE,FILETABLE] [schedule=INTERVAL]")
+    ("concurrent-jobs", value<unsigned int>()->default_value(4), "Roots of --jobs crawled at the same time, each on its own database connection")
+    ("check-report", value<string>(), "Write the result of every checked file to this file as JSON lines")
+    ("budget", value<string>(), "Time budget for scrubbing, e.g. 6h, 90m or 3600s")
+    ("byte-budget", value<string>(), "Read budget for scrubbing, e.g. 2T, 500G")
+    ("max-read-rate", value<string>(), "Limit reading file contents to this many bytes per second, e.g. 50M")
+    ("max-iops", value<uint64_t>()->default_value(0), "Limit reads and metadata operations (stat, opendir) per second")
+    ("adaptive-io", value<unsigned int>()->implicit_value(10), "Back off concurrent readers when the I/O pressure stall share exceeds this percentage (default 10)")
+    ("partitions", value<unsigned int>()->default_value(0), "Partition newly created mysql tables by parent directory into this many partitions (0 to disable), statements by id then probe every partition")
+    ("pool-size", value<unsigned int>()->default_value(4), "Number of additional connections to the primary used to pipeline lookups while crawling and watching, for postgres the lookups kept in flight on a single pipelined connection (0 to disable)")
+    ("replica-host", value<string>(), "Run the read-only operations print, check, export-snapshot and diff on this replica of the database host, crawls always read from the primary")
+    ("db-retries", value<unsigned int>()->default_value(3), "Reconnect and retry this many times when the database connection is lost")
+    ("prefetch-rows", value<unsigned long>()->default_value(1000), "Rows fetched per round trip when streaming table scans")
+    ("progress-interval", value<unsigned int>()->default_value(10), "Seconds between progress reports")
+    ("progress", "Count the entries of the crawled subtree in the catalog before crawling, so progress reports show the expected entries and an ETA without hashing as well (one recursive query per crawl, implied by --status-file)")
+    ("status-file", value<string>(), "Write the progress of crawls with the expected entries, rates and ETA as JSON to FILE every progress interval")
+    ("metrics-file", value<string>(), "Write metrics in the Prometheus text format to FILE, e.g. for the node_exporter textfile collector (SIGUSR1 logs them)")
+    ("metrics-interval", value<unsigned int>()->default_value(15), "Seconds between writes of --metrics-file")
+    ("slow-statements", value<double>()->default_value(0), "Log database statements and row fetches taking longer than this many milliseconds with their parameters (0 to disable)")
+    ("explain", "Log the query plan of every prepared statement at startup")
+    ("trace", value<string>(), "Record the phases of crawling, hashing and database statements per directory to FILE in the Chrome trace event format (chrome://tracing, ui.perfetto.dev)")
     ("dry-run,N", "Test run only, don't change anything")
   ;
 
   p_opts_all.add(p_opts_mode).add(p_opts_required).add(p_opts_optional);
 
   Logger::logLevel() = logInfo;
-  Logger::facility() = new LoggerFacilityConsole;
+  Logger::facility() = new LoggerFacilityAsync(new LoggerFacilityConsole);
 }
 
 options::~options() {}
@@ -109,10 +156,30 @@ int options::parse(int argc, char** argv) {
   if (p_operation == opNone) // if no explicit mode was set
     p_operation = opCrawl; // take opCrawl as default
 
-  //crawl and check modes require a basedir
+  if (count("jobs")) {
+    if (p_operation != opCrawl || watch() || !p_basedir.empty() || !OPT_STR("fakepath").empty()) {
+      LOG(logError) << "--jobs only crawls and takes basedirs and fakepaths from the job file";
+      return 2;
+    }
+    if (concurrentJobs() == 0) {
+      LOG(logError) << "At least one concurrent job is required";
+      return 2;
+    }
+  }
+
+  if (count("index-names") && (p_operation != opCrawl || count("jobs")) && p_operation != opFind) {
+    LOG(logError) << "--index-names is only kept by crawls without --jobs and used by --find";
+    return 2;
+  }
+  if (p_operation == opFind && !count("index-names")) {
+    LOG(logError) << "--find requires the name index of --index-names";
+    return 2;
+  }
+
+  //crawl, check, duplicates and scrub modes require a basedir
   if (p_basedir.empty()) {
-    if (p_operation == opCrawl || p_operation == opCheck) {
-      LOG(logError) << "Operations crawl and check require a basedir";
+    if ((p_operation == opCrawl && !count("jobs")) || p_operation == opCheck || p_operation == opDuplicates || p_operation == opScrub) {
+      LOG(logError) << "Operations crawl, check, duplicates and scrub require a basedir";
       printUsage();
       return 2;
     }
@@ -132,7 +199,7 @@ int options::parse(int argc, char** argv) {
     }
   }
 
-  if( (p_operation == opCheck || OPTS.forceHashing()) && p_hashType == Hasher::noHash ) {
+  if( (p_operation == opCheck || p_operation == opDuplicates || p_operation == opScrub || OPTS.forceHashing()) && p_hashType == Hasher::noHash ) {
     LOG(logError) << "Hashing algorithm required but none selected";
     printUsage();
     return 2;
@@ -144,6 +211,62 @@ int options::parse(int argc, char** argv) {
     return 2;
   }
 
+  if (count("budget") && !parseDuration(OPT_STR("budget"), p_timeBudget)) {
+    LOG(logError) << "Invalid time budget \"" << OPT_STR("budget") << '\"';
+    return 2;
+  }
+  if (count("byte-budget") && !parseByteSize(OPT_STR("byte-budget"), p_byteBudget)) {
+    LOG(logError) << "Invalid byte budget \"" << OPT_STR("byte-budget") << '\"';
+    return 2;
+  }
+
+  if (count("max-read-rate") && !parseByteSize(OPT_STR("max-read-rate"), p_maxReadRate)) {
+    LOG(logError) << "Invalid read rate \"" << OPT_STR("max-read-rate") << '\"';
+    return 2;
+  }
+
+  try {
+    PrintWriter::parseFormat(OPT_STR("print-format"));
+  } catch (const runtime_error& e) {
+    LOG(logError) << e.what();
+    return 2;
+  }
+
+  if (count("snapshot") && p_operation != opPrint && p_operation != opCheck) {
+    LOG(logError) << "Only print and check can read from a snapshot";
+    return 2;
+  }
+
+  if (p_operation == opDiff && diffSources().size() != 2) {
+    LOG(logError) << "--diff requires two snapshots, OLD and NEW";
+    return 2;
+  }
+
+  if (!validBackend(backend())) {
+    LOG(logError) << "Unknown backend \"" << backend() << '\"';
+    return 2;
+  }
+  if (p_operation == opConvert) {
+    string target = convertTarget();
+    if (!validBackend(target) || (target != "mysql" && target != "postgres" && convertFile().empty())) {
+      LOG(logError) << "Invalid conversion target \"" << OPT_STR("convert") << "\", use mysql, postgres, sqlite:FILE or lmdb:FILE";
+      return 2;
+    }
+    if (target == backend()) {
+      LOG(logError) << "Conversion target uses the same backend";
+      return 2;
+    }
+  }
+  if (!parseByteSize(OPT_STR("sqlite-cache"), p_sqliteCacheSize) || !parseByteSize(OPT_STR("sqlite-mmap"), p_sqliteMmapSize)) {
+    LOG(logError) << "Invalid sqlite cache or mmap size";
+    return 2;
+  }
+
+  if (threads() == 0) {
+    LOG(logError) << "At least one thread is required";
+    return 2;
+  }
+
   printVersion();
   if (p_hashType != Hasher::noHash) {
     LOG(logDetailed) << "Selected hash type: " << Hasher::hashTypeToString(p_hashType);
@@ -151,6 +274,80 @@ int options::parse(int argc, char** argv) {
   return 0;
 }
 
+bool options::validBackend(const string& name) {
+#ifdef WITH_LMDB
+  if (name == "lmdb")
+    return true;
+#else
+  if (name == "lmdb") {
+    LOG(logError) << "fscrawl was built without lmdb support, rebuild with make WITH_LMDB=1";
+    return false;
+  }
+#endif
+#ifdef WITH_PG
+  if (name == "postgres")
+    return true;
+#else
+  if (name == "postgres") {
+    LOG(logError) << "fscrawl was built without postgres support, rebuild with make WITH_PG=1";
+    return false;
+  }
+#endif
+  return name == "mysql" || name == "sqlite";
+}
+
+string options::convertTarget() const {
+  const string& spec = OPT_STR("convert");
+  return spec.substr(0, spec.find(':'));
+}
+
+string options::convertFile() const {
+  const string& spec = OPT_STR("convert");
+  size_t colon = spec.find(':');
+  return colon == string::npos ? string() : spec.substr(colon+1);
+}
+
+const vector<string>& options::diffSources() const {
+  return (*this)["diff"].as< vector<string> >();
+}
+
+bool options::parseDuration(const string& text, uint64_t& seconds) {
+  size_t end = 0;
+  try {
+    seconds = stoull(text, &end);
+  } catch (exception&) {
+    return false;
+  }
+  string unit = text.substr(end);
+  if (unit == "d")
+    seconds *= 86400;
+  else if (unit == "h")
+    seconds *= 3600;
+  else if (unit == "m")
+    seconds *= 60;
+  else if (!unit.empty() && unit != "s")
+    return false;
+  return true;
+}
+
+bool options::parseByteSize(const string& text, uint64_t& bytes) {
+  size_t end = 0;
+  try {
+    bytes = stoull(text, &end);
+  } catch (exception&) {
+    return false;
+  }
+  string unit = text.substr(end);
+  const string units = "KMGTP";
+  if (unit.empty())
+    return true;
+  size_t exponent = units.find(toupper(unit[0]));
+  if (exponent == string::npos || unit.size() > 1)
+    return false;
+  bytes <<= 10*(exponent+1);
+  return true;
+}
+
 void options::printUsage() const {
   printVersion();
   LOG(logInfo) << "Usage: fscrawl [MODE] [OPTIONS] [BASEDIR]";
@@ -177,7 +374,7 @@ int options::setLogLevel() {
       return 1;
     }
     delete Logger::facility();
-    Logger::facility() = lff;
+    Logger::facility() = new LoggerFacilityAsync(lff);
   }
 
   return 0;
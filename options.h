@@ -3,6 +3,7 @@
 
 #include <boost/program_options.hpp>
 #include <string>
+#include <vector>
 
 #include "hasher.h"
 
@@ -20,17 +21,41 @@ public:
   bool verifyTree() const { return count("verify"); };
   bool hashCheck() const { return count("check"); };
   bool forceHashing() const { return count("force-hashing"); };
-  bool watch() const { return count("watch"); };
+  bool watch() const { return count("watch") || daemon(); };
+  bool daemon() const { return count("daemon"); };
   const string& basedir() const { return p_basedir; };
   Hasher::hashType_t hashType() const { return p_hashType; };
   bool allowEmpty() const { return count("allow-empty"); };
   bool dryRun() const { return count("dry-run"); };
+  unsigned int threads() const { return (*this)["threads"].as<unsigned int>(); };
+  unsigned int progressInterval() const { return (*this)["progress-interval"].as<unsigned int>(); };
+  uint64_t timeBudget() const { return p_timeBudget; };
+  uint64_t byteBudget() const { return p_byteBudget; };
+  uint64_t maxReadRate() const { return p_maxReadRate; };
+  uint64_t maxIops() const { return (*this)["max-iops"].as<uint64_t>(); };
+  bool adaptiveIo() const { return count("adaptive-io"); };
+  unsigned int stallTarget() const { return (*this)["adaptive-io"].as<unsigned int>(); };
+  const string& backend() const { return OPT_STR("backend"); };
+  //backend type and file of --convert TYPE[:FILE]
+  string convertTarget() const;
+  string convertFile() const;
+  //OLD and NEW of --diff
+  const std::vector<string>& diffSources() const;
+  uint64_t sqliteCacheSize() const { return p_sqliteCacheSize; };
+  uint64_t sqliteMmapSize() const { return p_sqliteMmapSize; };
+  uint64_t sampleSize() const { return (*this)["sample-size"].as<uint64_t>(); };
+  unsigned int concurrentJobs() const { return (*this)["concurrent-jobs"].as<unsigned int>(); };
 
-  enum operation_t { opNone, opCrawl, opCheck, opVerify, opPrint, opClear, opPurge };
+  enum operation_t { opNone, opCrawl, opCheck, opVerify, opPrint, opClear, opPurge, opDuplicates, opScrub, opConvert, opExportSnapshot, opDiff, opFind };
   operation_t getOperation() const { return p_operation; };
+  //parse a number followed by an optional unit suffix, returns false on invalid input
+  static bool parseDuration(const string& text, uint64_t& seconds);
+  static bool parseByteSize(const string& text, uint64_t& bytes);
 private:
   options();
   int setLogLevel();
+  //returns false for unknown backends and the ones not compiled in
+  static bool validBackend(const string& name);
 
   boost::program_options::options_description p_opts_mode;
   boost::program_options::options_description p_opts_required;
@@ -40,6 +65,11 @@ private:
   Hasher::hashType_t p_hashType;
   string p_basedir;
   operation_t p_operation;
+  uint64_t p_timeBudget;
+  uint64_t p_byteBudget;
+  uint64_t p_maxReadRate;
+  uint64_t p_sqliteCacheSize;
+  uint64_t p_sqliteMmapSize;
 };
 
 #endif //OPTIONS_H
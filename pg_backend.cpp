@@ -0,0 +1,870 @@
+#include "pg_backend.h"
+#include "logger.h"
+#include "worker.h"
+#include "sqlexception.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include <strings.h>
+
+using namespace std;
+
+//type oids of pg_type, libpq does not export them
+enum pgType_t { typeInt8 = 20, typeInt2 = 21, typeInt4 = 23, typeText = 25, typeBpchar = 1042, typeVarchar = 1043, typeTimestamptz = 1184 };
+
+static string trimmed(const char* message) {
+  string str(message);
+  while (!str.empty() && isspace(str[str.length()-1]))
+    str.erase(str.length()-1); //libpq terminates its messages with a newline
+  return str;
+}
+
+static SQLException pgError(const string& msg, PGconn* conn) {
+  return SQLException(msg+": "+trimmed(PQerrorMessage(conn)));
+}
+
+//libpq numbers its parameters, the ? markers outside of quotes become $1, $2, ...
+static string numberedParameters(const string& sql, unsigned int& count) {
+  string numbered;
+  bool quoted = false;
+  count = 0;
+  for (string::const_iterator it = sql.begin(); it != sql.end(); it++) {
+    if (*it == '\'')
+      quoted = !quoted;
+    if (*it == '?' && !quoted)
+      numbered += '$'+to_string(++count);
+    else
+      numbered += *it;
+  }
+  return numbered;
+}
+
+static void logNotice(void* arg __attribute__((unused)), const char* message) {
+  LOG(logDebug) << "postgres: " << trimmed(message);
+}
+
+static vector<string> tokenize(const string& sql) {
+  vector<string> tokens;
+  string token;
+  for (string::const_iterator it = sql.begin(); it != sql.end(); it++) {
+    if (isspace(*it) || *it == ',' || *it == '(' || *it == ')' || *it == '=') {
+      if (!token.empty())
+        tokens.push_back(token);
+      token.clear();
+      if (!isspace(*it))
+        tokens.push_back(string(1, *it));
+    } else {
+      token += *it;
+    }
+  }
+  if (!token.empty())
+    tokens.push_back(token);
+  return tokens;
+}
+
+static bool isWord(const string& token, const char* word) {
+  return strcasecmp(token.c_str(), word) == 0;
+}
+
+//whether sql mentions table as a whole word
+static bool mentions(const string& sql, const string& table) {
+  for (size_t pos = sql.find(table); pos != string::npos; pos = sql.find(table, pos+1)) {
+    size_t end = pos+table.length();
+    if ((pos == 0 || !(isalnum(sql[pos-1]) || sql[pos-1] == '_')) &&
+        (end == sql.length() || !(isalnum(sql[end]) || sql[end] == '_')))
+      return true;
+  }
+  return false;
+}
+
+static void appendBigEndian(string& buffer, uint64_t value, unsigned int bytes) {
+  for (int shift = (bytes-1)*8; shift >= 0; shift -= 8)
+    buffer += (char)(value >> shift);
+}
+
+PgBackend::PgBackend(const dbConfig_t& config) : p_config(config), p_conn(connect(config)), p_names(0), p_cursors(0) {}
+
+PgBackend::~PgBackend() {
+  try {
+    flush();
+  } catch (exception& e) {
+    LOG(logError) << "Failed to write last changes: " << e.what();
+  }
+  PQfinish(p_conn);
+}
+
+PGconn* PgBackend::getConnection() const {
+  return p_conn;
+}
+
+PGconn* PgBackend::connect(const dbConfig_t& config) {
+  //empty values are ignored by libpq, so its defaults and the PG* environment variables apply
+  const char* keywords[] = { "host", "user", "password", "dbname", "application_name", 0 };
+  const char* values[] = { config.host.c_str(), config.user.c_str(), config.password.c_str(), config.database.c_str(), "fscrawl", 0 };
+  PGconn* conn = PQconnectdbParams(keywords, values, 0);
+  if (!conn)
+    throw SQLException("PQconnectdbParams failed");
+  if (PQstatus(conn) != CONNECTION_OK) {
+    SQLException e = pgError("connecting to "+config.host+" failed", conn);
+    PQfinish(conn);
+    throw e;
+  }
+  PQsetNoticeProcessor(conn, logNotice, 0); //e.g. "relation already exists, skipping"
+  return conn;
+}
+
+unsigned int& PgBackend::batchSize() {
+  static unsigned int rows = 10000;
+  return rows;
+}
+
+const char* PgBackend::name() const {
+  return "postgres";
+}
+
+bool PgBackend::query(const string& sql) {
+  flushTables(sql);
+  PGresult* result = PQexec(p_conn, sql.c_str());
+  ExecStatusType status = PQresultStatus(result);
+  string error = trimmed(PQresultErrorMessage(result));
+  PQclear(result);
+  if (status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK)
+    return true;
+  if (PQstatus(p_conn) != CONNECTION_BAD)
+    throw SQLException("PQexec failed: "+error);
+  LOG(logWarning) << "Lost connection to database: " << error;
+  return false;
+}
+
+PGresult* PgBackend::exec(const string& sql, ExecStatusType expected) {
+  PGresult* result = PQexec(p_conn, sql.c_str());
+  if (PQresultStatus(result) != expected) {
+    SQLException e("PQexec failed for \""+sql+"\": "+trimmed(PQresultErrorMessage(result)));
+    PQclear(result);
+    throw e;
+  }
+  return result;
+}
+
+PreparedStatementWrapper* PgBackend::statement(worker* w, const string& sql, PreparedStatementWrapper::resultMode_t mode) {
+  return new PgStatement(w, this, sql, mode);
+}
+
+bool PgBackend::explain(const string& sql, vector<string>& plan) {
+  //generic plans of prepared statements need PostgreSQL 16, so parameters are replaced by an untyped constant
+  PGresult* result = exec("EXPLAIN "+PreparedStatementWrapper::substitute(sql, vector<string>(count(sql.begin(), sql.end(), '?'), "'0'")), PGRES_TUPLES_OK);
+  for (int i = 0; i < PQntuples(result); i++)
+    plan.push_back(PQgetvalue(result, i, 0));
+  PQclear(result);
+  return true;
+}
+
+bool PgBackend::reconnect() {
+  PQreset(p_conn);
+  if (PQstatus(p_conn) != CONNECTION_OK) {
+    LOG(logWarning) << "Reconnect failed: " << trimmed(PQerrorMessage(p_conn));
+    return false;
+  }
+  //prepared statements, cursors and temporary tables are gone, the statements recreate them when they are reprepared
+  p_cursors = 0;
+  return true;
+}
+
+void PgBackend::flush() {
+  flushPending(0);
+}
+
+void PgBackend::createTables(const string& directoryTable, const string& fileTable) {
+  PQclear(exec("CREATE TABLE IF NOT EXISTS "+directoryTable+" "
+               "(id BIGSERIAL PRIMARY KEY, "
+               "name TEXT NOT NULL, "
+               "parent BIGINT NOT NULL, "
+               "size BIGINT, "
+               "date TIMESTAMPTZ DEFAULT NULL, "
+               "UNIQUE (parent, name))", PGRES_COMMAND_OK)); //its index serves lookups by name and listings by parent
+  PQclear(exec("CREATE TABLE IF NOT EXISTS "+fileTable+" "
+               "(id BIGSERIAL PRIMARY KEY, "
+               "name TEXT NOT NULL, "
+               "parent BIGINT NOT NULL, "
+               "size BIGINT, "
+               "date TIMESTAMPTZ DEFAULT NULL, "
+               "hash VARCHAR(40) DEFAULT NULL, "
+               "last_verified TIMESTAMPTZ DEFAULT NULL, "
+               "UNIQUE (parent, name))", PGRES_COMMAND_OK));
+  //scrub reads the files never verified first, in the order of this index
+  PQclear(exec("CREATE INDEX IF NOT EXISTS "+fileTable+"_last_verified ON "+fileTable+" (last_verified NULLS FIRST, id)", PGRES_COMMAND_OK));
+}
+
+void PgBackend::createDuplicatesTable(const string& table) {
+  PQclear(exec("CREATE TABLE IF NOT EXISTS "+table+" "
+               "(grp INTEGER NOT NULL, "
+               "id BIGINT NOT NULL, "
+               "size BIGINT, "
+               "hash VARCHAR(40) DEFAULT NULL)", PGRES_COMMAND_OK));
+  PQclear(exec("CREATE INDEX IF NOT EXISTS "+table+"_grp ON "+table+" (grp)", PGRES_COMMAND_OK));
+  PQclear(exec("CREATE INDEX IF NOT EXISTS "+table+"_id ON "+table+" (id)", PGRES_COMMAND_OK));
+}
+
+void PgBackend::clearTable(const string& table) {
+  flushTables(table);
+  PQclear(exec("TRUNCATE TABLE "+table, PGRES_COMMAND_OK));
+}
+
+string PgBackend::unixTime(const string& column) const {
+  return "EXTRACT(EPOCH FROM "+column+")::bigint";
+}
+
+string PgBackend::fromUnixTime(const string& value) const {
+  return "to_timestamp("+value+")";
+}
+
+string PgBackend::limit() const {
+  return "OFFSET ? LIMIT ?";
+}
+
+string PgBackend::uniqueName(const string& prefix) {
+  return prefix+'_'+to_string(++p_names);
+}
+
+string PgBackend::idSequence(const string& table) {
+  map<string, string>::const_iterator it = p_sequences.find(table);
+  if (it != p_sequences.end())
+    return it->second;
+  PGresult* result = exec("SELECT pg_get_serial_sequence('"+table+"','id')", PGRES_TUPLES_OK);
+  string sequence = PQgetisnull(result, 0, 0) ? string() : PQgetvalue(result, 0, 0);
+  PQclear(result);
+  p_sequences[table] = sequence;
+  return sequence;
+}
+
+uint64_t PgBackend::reserveId(const string& sequence) {
+  deque<uint64_t>& ids = p_reservedIds[sequence];
+  if (ids.empty()) {
+    //ids that are not used before the program ends are lost, the sequence just skips them
+    PGresult* result = exec("SELECT nextval('"+sequence+"') FROM generate_series(1,"+to_string(batchSize())+")", PGRES_TUPLES_OK);
+    for (int i = 0; i < PQntuples(result); i++)
+      ids.push_back(strtoull(PQgetvalue(result, i, 0), 0, 10));
+    PQclear(result);
+  }
+  uint64_t id = ids.front();
+  ids.pop_front();
+  return id;
+}
+
+void PgBackend::addPending(PgStatement* statement) {
+  if (find(p_pending.begin(), p_pending.end(), statement) == p_pending.end())
+    p_pending.push_back(statement);
+}
+
+void PgBackend::removePending(PgStatement* statement) {
+  p_pending.erase(remove(p_pending.begin(), p_pending.end(), statement), p_pending.end());
+}
+
+void PgBackend::flushTables(const string& sql) {
+  if (!p_pending.empty())
+    flushPending(&sql);
+}
+
+void PgBackend::flushPending(const string* sql) {
+  //an update may refer to a row whose insert is still buffered
+  for (int inserts = 1; inserts >= 0; inserts--) {
+    vector<PgStatement*> pending(p_pending); //flushing removes the statement
+    for (vector<PgStatement*>::iterator it = pending.begin(); it != pending.end(); it++)
+      if ((*it)->isBulkInsert() == (inserts == 1) && (!sql || mentions(*sql, (*it)->table())))
+        (*it)->flushRows();
+  }
+}
+
+void PgBackend::openCursor() {
+  if (p_cursors++ == 0)
+    PQclear(exec("BEGIN", PGRES_COMMAND_OK));
+}
+
+void PgBackend::closeCursor() {
+  if (p_cursors == 0 || --p_cursors > 0)
+    return;
+  PGTransactionStatusType status = PQtransactionStatus(p_conn);
+  if (status == PQTRANS_INTRANS)
+    PQclear(exec("COMMIT", PGRES_COMMAND_OK));
+  else if (status == PQTRANS_INERROR)
+    PQclear(PQexec(p_conn, "ROLLBACK")); //the statement that failed has thrown already
+}
+
+PgStatement::PgStatement(worker* w, PgBackend* backend, const string& sql, resultMode_t mode)
+  : PreparedStatementWrapper(w, sql, mode),
+    p_backend(backend),
+    p_result(0),
+    p_row(-1),
+    p_cursorDone(false),
+    p_lastInsertId(0),
+    p_bulk(bulkNone),
+    p_idType(0),
+    p_explicitIds(false)
+{}
+
+PgStatement::~PgStatement() {
+  try {
+    flushRows();
+  } catch (exception& e) {
+    LOG(logError) << "Failed to write buffered rows of " << p_table << ": " << e.what();
+  }
+  p_backend->removePending(this);
+  close();
+}
+
+bool PgStatement::isBulkInsert() const {
+  return p_bulk == bulkInsert;
+}
+
+const string& PgStatement::table() const {
+  return p_table;
+}
+
+void PgStatement::close() {
+  release();
+  PGconn* conn = p_backend->getConnection();
+  //outside of a transaction a failing DEALLOCATE does no harm, within one it would abort it
+  if (!p_name.empty() && PQstatus(conn) == CONNECTION_OK && PQtransactionStatus(conn) == PQTRANS_IDLE)
+    PQclear(PQexec(conn, ("DEALLOCATE "+p_name).c_str()));
+  p_name.clear();
+}
+
+void PgStatement::reprepare() {
+  close();
+
+  unsigned int params;
+  p_sql = numberedParameters(p_query, params);
+  //after a reconnect the parameters are kept, a retried statement executes with the values set before
+  if (p_values.size() != params) {
+    p_values.assign(params, string());
+    p_nulls.assign(params, true);
+  }
+
+  parseBulk();
+  if (p_bulk != bulkNone)
+    prepareBulk();
+  if (p_bulk != bulkNone || p_streamed) //cursors are declared with the statement text
+    return;
+
+  p_name = p_backend->uniqueName("fscrawl_stmt");
+  PGresult* result = PQprepare(p_backend->getConnection(), p_name.c_str(), p_sql.c_str(), 0, 0);
+  if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+    SQLException e("PQprepare failed for \""+p_query+"\": "+trimmed(PQresultErrorMessage(result)));
+    PQclear(result);
+    p_name.clear();
+    throw e;
+  }
+  PQclear(result);
+}
+
+void PgStatement::parseBulk() {
+  p_bulk = bulkNone;
+  p_table.clear();
+  p_columns.clear();
+  p_timestamps.clear();
+
+  vector<string> tokens = tokenize(p_query);
+  size_t pos = 0;
+  auto accept = [&](const char* word) {
+    if (pos < tokens.size() && isWord(tokens[pos], word)) {
+      pos++;
+      return true;
+    }
+    return false;
+  };
+  auto identifier = [&](string& name) {
+    if (pos >= tokens.size() || !(isalpha(tokens[pos][0]) || tokens[pos][0] == '_'))
+      return false;
+    name = tokens[pos++];
+    return true;
+  };
+  //a parameter, optionally converted to a timestamp
+  auto value = [&]() {
+    if (accept("?")) {
+      p_timestamps.push_back(false);
+      return true;
+    }
+    if (accept("to_timestamp") && accept("(") && accept("?") && accept(")")) {
+      p_timestamps.push_back(true);
+      return true;
+    }
+    return false;
+  };
+
+  bulk_t bulk = bulkNone;
+  if (accept("INSERT")) {
+    if (!accept("INTO") || !identifier(p_table) || !accept("("))
+      return;
+    do {
+      string column;
+      if (!identifier(column))
+        return;
+      p_columns.push_back(column);
+    } while (accept(","));
+    if (!accept(")") || !accept("VALUES") || !accept("("))
+      return;
+    for (size_t i = 0; i < p_columns.size(); i++)
+      if ((i && !accept(",")) || !value())
+        return;
+    if (!accept(")"))
+      return;
+    bulk = bulkInsert;
+  } else if (accept("UPDATE")) {
+    if (!identifier(p_table) || !accept("SET"))
+      return;
+    do {
+      string column;
+      if (!identifier(column) || isWord(column, "id") || !accept("=") || !value())
+        return;
+      p_columns.push_back(column);
+    } while (accept(","));
+    if (!accept("WHERE") || !accept("id") || !accept("=") || !accept("?"))
+      return;
+    p_columns.push_back("id");
+    p_timestamps.push_back(false);
+    bulk = bulkUpdate;
+  }
+  if (pos == tokens.size()) //anything else, e.g. RETURNING, is executed as is
+    p_bulk = bulk;
+}
+
+void PgStatement::prepareBulk() {
+  PGresult* result = p_backend->exec("SELECT * FROM "+p_table+" LIMIT 0", PGRES_TUPLES_OK);
+  p_types.clear();
+  for (size_t i = 0; i < p_columns.size() && p_bulk != bulkNone; i++) {
+    int field = PQfnumber(result, p_columns[i].c_str());
+    Oid type = field < 0 ? 0 : PQftype(result, field);
+    bool supported = p_timestamps[i] ? type == typeTimestamptz :
+                     type == typeInt2 || type == typeInt4 || type == typeInt8 || type == typeText || type == typeBpchar || type == typeVarchar;
+    if (!supported) {
+      LOG(logDebug) << "column " << p_columns[i] << " of " << p_table << " cannot be copied, executing \"" << p_query << "\" row by row";
+      p_bulk = bulkNone;
+    }
+    p_types.push_back(type);
+  }
+  int idField = PQfnumber(result, "id");
+  p_idType = idField < 0 ? 0 : PQftype(result, idField);
+  PQclear(result);
+
+  if (p_bulk == bulkInsert) {
+    p_explicitIds = find(p_columns.begin(), p_columns.end(), "id") != p_columns.end();
+    p_sequence = p_idType == typeInt4 || p_idType == typeInt8 ? p_backend->idSequence(p_table) : string();
+  } else if (p_bulk == bulkUpdate) {
+    string columns;
+    for (size_t i = 0; i < p_columns.size(); i++)
+      columns += (i ? "," : "")+p_columns[i];
+    //lives as long as the connection, rows are merged from it with a single UPDATE and truncated afterwards
+    p_mergeTable = p_backend->uniqueName(p_table+"_merge");
+    PQclear(p_backend->exec("CREATE TEMPORARY TABLE "+p_mergeTable+" AS SELECT "+columns+" FROM "+p_table+" LIMIT 0", PGRES_COMMAND_OK));
+  }
+}
+
+void PgStatement::appendField(string& tuple, unsigned int column, const string* value) const {
+  if (!value) {
+    appendBigEndian(tuple, (uint32_t)-1, 4);
+    return;
+  }
+  switch (p_types[column]) {
+    case typeInt2 :
+      appendBigEndian(tuple, 2, 4);
+      appendBigEndian(tuple, strtoll(value->c_str(), 0, 10), 2);
+      break;
+    case typeInt4 :
+      appendBigEndian(tuple, 4, 4);
+      appendBigEndian(tuple, strtoll(value->c_str(), 0, 10), 4);
+      break;
+    case typeInt8 :
+      appendBigEndian(tuple, 8, 4);
+      appendBigEndian(tuple, strtoull(value->c_str(), 0, 10), 8);
+      break;
+    case typeTimestamptz : //microseconds since 2000-01-01 00:00 UTC
+      appendBigEndian(tuple, 8, 4);
+      appendBigEndian(tuple, (strtoll(value->c_str(), 0, 10)-946684800LL)*1000000, 8);
+      break;
+    default : //text types are sent as they are
+      appendBigEndian(tuple, value->length(), 4);
+      tuple += *value;
+      break;
+  }
+}
+
+void PgStatement::bufferRow() {
+  string tuple;
+  bool reserveId = p_bulk == bulkInsert && !p_explicitIds && !p_sequence.empty();
+  appendBigEndian(tuple, p_columns.size()+(reserveId ? 1 : 0), 2);
+  if (reserveId) {
+    p_lastInsertId = p_backend->reserveId(p_sequence);
+    appendBigEndian(tuple, p_idType == typeInt8 ? 8 : 4, 4);
+    appendBigEndian(tuple, p_lastInsertId, p_idType == typeInt8 ? 8 : 4);
+  }
+  for (size_t i = 0; i < p_columns.size(); i++)
+    appendField(tuple, i, p_nulls[i] ? 0 : &p_values[i]);
+
+  if (p_tuples.empty())
+    p_backend->addPending(this);
+  if (p_bulk == bulkUpdate) {
+    uint64_t id = strtoull(p_values.back().c_str(), 0, 10);
+    unordered_map<uint64_t, size_t>::iterator it = p_updatedIds.find(id);
+    if (it != p_updatedIds.end()) {
+      p_tuples[it->second].swap(tuple);
+      return;
+    }
+    p_updatedIds[id] = p_tuples.size();
+  }
+  p_tuples.push_back(tuple);
+  if (p_tuples.size() >= PgBackend::batchSize())
+    flushRows();
+}
+
+void PgStatement::copy(const string& table, const string& columns) {
+  PGconn* conn = p_backend->getConnection();
+  PQclear(p_backend->exec("COPY "+table+" ("+columns+") FROM STDIN (FORMAT binary)", PGRES_COPY_IN));
+
+  string header("PGCOPY\n\377\r\n\0", 11);
+  appendBigEndian(header, 0, 4); //flags
+  appendBigEndian(header, 0, 4); //header extension length
+  bool ok = PQputCopyData(conn, header.data(), header.length()) == 1;
+  for (vector<string>::const_iterator it = p_tuples.begin(); ok && it != p_tuples.end(); it++)
+    ok = PQputCopyData(conn, it->data(), it->length()) == 1; //libpq buffers the tuples into larger messages
+  string trailer;
+  appendBigEndian(trailer, (uint16_t)-1, 2);
+  ok = ok && PQputCopyData(conn, trailer.data(), trailer.length()) == 1;
+  ok = PQputCopyEnd(conn, ok ? 0 : "failed to send data") == 1 && ok;
+
+  string error;
+  PGresult* result;
+  while ((result = PQgetResult(conn))) {
+    if (PQresultStatus(result) != PGRES_COMMAND_OK)
+      error = trimmed(PQresultErrorMessage(result));
+    PQclear(result);
+  }
+  if (!ok || !error.empty())
+    throw SQLException("COPY into "+table+" failed: "+(error.empty() ? trimmed(PQerrorMessage(conn)) : error));
+}
+
+void PgStatement::flushRows() {
+  if (p_tuples.empty())
+    return;
+  ScopedTimer timer(METRICS.histogram("fscrawl_bulk_write_seconds", "Time to write the buffered rows of bulk statements", Metrics::label("statement", p_query)));
+  string columns;
+  for (size_t i = 0; i < p_columns.size(); i++)
+    columns += (i ? "," : "")+p_columns[i];
+
+  if (p_bulk == bulkInsert) {
+    if (!p_explicitIds && !p_sequence.empty())
+      columns = "id,"+columns;
+    copy(p_table, columns);
+    if (p_explicitIds && !p_sequence.empty()) //inserts without id continue after the copied ones
+      PQclear(p_backend->exec("SELECT setval('"+p_sequence+"', GREATEST((SELECT MAX(id) FROM "+p_table+"), 1))", PGRES_TUPLES_OK));
+  } else {
+    copy(p_mergeTable, columns);
+    string assignments;
+    for (size_t i = 0; i+1 < p_columns.size(); i++)
+      assignments += (i ? ", " : "")+p_columns[i]+"=u."+p_columns[i];
+    PQclear(p_backend->exec("UPDATE "+p_table+" SET "+assignments+" FROM "+p_mergeTable+" u WHERE "+p_table+".id=u.id", PGRES_COMMAND_OK));
+    PQclear(p_backend->exec("TRUNCATE "+p_mergeTable, PGRES_COMMAND_OK));
+  }
+  LOG(logDebug) << "copied " << p_tuples.size() << (p_bulk == bulkInsert ? " new" : " changed") << " rows into " << p_table;
+  p_tuples.clear();
+  p_updatedIds.clear();
+  p_backend->removePending(this);
+}
+
+bool PgStatement::retryAfterError(unsigned int attempt) {
+  //errors reported by the server fail the statement, only a lost connection is worth a retry
+  if (PQstatus(p_backend->getConnection()) != CONNECTION_BAD || !p_idempotent)
+    return false;
+  if (attempt >= maxRetries())
+    return false;
+  LOG(logWarning) << "Lost connection to database, reconnecting, attempt " << attempt+1 << " of " << maxRetries();
+  this_thread::sleep_for(chrono::seconds(attempt)); //back off if the server does not come back immediately
+  p_worker->reconnect(); //on failure the retry fails again
+  return true;
+}
+
+bool PgStatement::execute() {
+  Timer timer(this, false); //bulk statements only buffer the row here, their writes are timed when flushed
+  release(); //a new execution discards the rest of the previous result
+  if (p_bulk != bulkNone) {
+    bufferRow();
+    return false;
+  }
+  p_backend->flushTables(p_query);
+
+  for (unsigned int attempt = 0; ; attempt++) {
+    vector<const char*> values(p_values.size());
+    for (size_t i = 0; i < values.size(); i++)
+      values[i] = p_nulls[i] ? 0 : p_values[i].c_str();
+    PGconn* conn = p_backend->getConnection();
+    ExecStatusType status;
+    if (p_streamed) {
+      //a cursor keeps the connection usable for other statements while the result is being read
+      p_backend->openCursor();
+      p_cursor = p_backend->uniqueName("fscrawl_cursor");
+      p_result = PQexecParams(conn, ("DECLARE "+p_cursor+" NO SCROLL CURSOR FOR "+p_sql).c_str(), values.size(), 0, values.data(), 0, 0, 0);
+      status = PQresultStatus(p_result);
+      if (status == PGRES_COMMAND_OK) {
+        PQclear(p_result);
+        p_result = 0;
+        p_cursorDone = false;
+        return false;
+      }
+    } else {
+      p_result = PQexecPrepared(conn, p_name.c_str(), values.size(), values.data(), 0, 0, 0);
+      status = PQresultStatus(p_result);
+      if (status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK)
+        return false;
+    }
+    string error = trimmed(PQresultErrorMessage(p_result));
+    release();
+    if (!retryAfterError(attempt))
+      throw SQLException("executing \""+p_query+"\" failed: "+error);
+  }
+}
+
+int PgStatement::executeQuery() {
+  execute();
+  p_resultOpen = true;
+  if (p_streamed || !p_result)
+    return 0;
+  return PQntuples(p_result);
+}
+
+string PgStatement::boundQuery() const {
+  vector<string> literals(p_values.size());
+  for (size_t i = 0; i < p_values.size(); i++)
+    literals[i] = p_nulls[i] ? string("NULL") : quote(p_values[i]);
+  return substitute(p_query, literals);
+}
+
+void PgStatement::setParam(unsigned int parameterIndex, const string& value) {
+  if (parameterIndex == 0 || parameterIndex > p_values.size())
+    throw out_of_range("parameter index out of range");
+  p_values[parameterIndex-1].assign(value); //reuses the string's capacity
+  p_nulls[parameterIndex-1] = false;
+}
+
+void PgStatement::setInt(unsigned int parameterIndex, int32_t value) {
+  setParam(parameterIndex, to_string(value));
+}
+
+void PgStatement::setUInt(unsigned int parameterIndex, uint32_t value) {
+  setParam(parameterIndex, to_string(value));
+}
+
+void PgStatement::setInt64(unsigned int parameterIndex, int64_t value) {
+  setParam(parameterIndex, to_string(value));
+}
+
+void PgStatement::setUInt64(unsigned int parameterIndex, uint64_t value) {
+  setParam(parameterIndex, to_string(value));
+}
+
+void PgStatement::setNull(unsigned int parameterIndex, int sqlType __attribute__((unused))) {
+  if (parameterIndex == 0 || parameterIndex > p_nulls.size())
+    throw out_of_range("parameter index out of range");
+  p_nulls[parameterIndex-1] = true;
+}
+
+void PgStatement::setString(unsigned int parameterIndex, const string& value) {
+  setParam(parameterIndex, value);
+}
+
+void PgStatement::checkColumn(unsigned int index) const {
+  if (!p_result || p_row < 0 || p_row >= PQntuples(p_result))
+    throw out_of_range("no result row available");
+  if (index == 0 || index > (unsigned int)PQnfields(p_result))
+    throw out_of_range("field index out of range");
+}
+
+uint64_t PgStatement::getUInt64(unsigned int index) {
+  checkColumn(index);
+  if (PQgetisnull(p_result, p_row, index-1))
+    return 0;
+  return strtoull(PQgetvalue(p_result, p_row, index-1), 0, 10);
+}
+
+string PgStatement::getString(unsigned int index) {
+  checkColumn(index);
+  return string(PQgetvalue(p_result, p_row, index-1), PQgetlength(p_result, p_row, index-1)); //NULL is an empty string
+}
+
+void PgStatement::fetch() {
+  PQclear(p_result);
+  p_result = 0;
+  p_row = -1;
+  p_result = p_backend->exec("FETCH FORWARD "+to_string(prefetchRows())+" FROM "+p_cursor, PGRES_TUPLES_OK);
+  if (PQntuples(p_result) < (int)prefetchRows())
+    p_cursorDone = true;
+}
+
+bool PgStatement::next() {
+  Timer timer(this, true);
+  checkCursor();
+  for (;;) {
+    if (p_result && p_row+1 < PQntuples(p_result)) {
+      p_row++;
+      return true;
+    }
+    if (p_cursor.empty() || p_cursorDone) {
+      p_row = p_result ? PQntuples(p_result) : -1;
+      return false;
+    }
+    fetch();
+  }
+}
+
+void PgStatement::release() {
+  PQclear(p_result);
+  p_result = 0;
+  p_row = -1;
+  if (!p_cursor.empty() && !p_resultLost) { //a lost cursor went with its transaction, which the backend no longer counts
+    PGconn* conn = p_backend->getConnection();
+    if (PQtransactionStatus(conn) == PQTRANS_INTRANS) //cursors only exist within the transaction
+      PQclear(PQexec(conn, ("CLOSE "+p_cursor).c_str()));
+    p_backend->closeCursor();
+  }
+  p_cursor.clear();
+  p_resultOpen = false;
+  if (p_resultLost) { //its prepared statement is gone with the old connection
+    p_resultLost = false;
+    reprepare();
+  }
+}
+
+uint64_t PgStatement::lastInsertId() {
+  if (p_bulk == bulkInsert)
+    return p_lastInsertId;
+  PGresult* result = p_backend->exec("SELECT lastval()", PGRES_TUPLES_OK);
+  uint64_t id = strtoull(PQgetvalue(result, 0, 0), 0, 10);
+  PQclear(result);
+  return id;
+}
+
+PgPipeline::PgPipeline(const dbConfig_t& config, unsigned int depth, PgBackend* backend)
+  : p_config(config),
+    p_conn(PgBackend::connect(config)),
+    p_depth(max(depth, 1u)),
+    p_backend(backend),
+    p_running(true) {
+  if (!PQenterPipelineMode(p_conn)) {
+    SQLException e = pgError("failed to enter pipeline mode", p_conn);
+    PQfinish(p_conn);
+    throw e;
+  }
+  p_thread = thread(&PgPipeline::loop, this);
+}
+
+PgPipeline::~PgPipeline() {
+  {
+    lock_guard<mutex> lock(p_mutex);
+    p_running = false;
+  }
+  p_wake.notify_one();
+  p_thread.join(); //the thread finishes all queued jobs first
+  PQfinish(p_conn);
+}
+
+unsigned int PgPipeline::size() const {
+  return p_depth;
+}
+
+future<queryResult_t> PgPipeline::query(const string& sql, const vector<uint64_t>& parameters) {
+  if (p_backend) //the pipeline has a connection of its own, it has to see the buffered rows
+    p_backend->flushTables(sql);
+  job_t* job = new job_t;
+  unsigned int count;
+  job->sql = numberedParameters(sql, count);
+  for (size_t i = 0; i < parameters.size(); i++)
+    job->parameters.push_back(to_string(parameters[i]));
+  future<queryResult_t> result = job->promise.get_future();
+  {
+    lock_guard<mutex> lock(p_mutex);
+    p_jobs.push_back(job);
+  }
+  p_wake.notify_one();
+  return result;
+}
+
+void PgPipeline::loop() {
+  unique_lock<mutex> lock(p_mutex);
+  while (true) {
+    p_wake.wait(lock, [this]() { return !p_jobs.empty() || !p_running; });
+    if (p_jobs.empty())
+      break;
+    //everything queued in the meantime goes out in a single batch
+    vector<job_t*> jobs(p_jobs.begin(), p_jobs.end());
+    p_jobs.clear();
+    lock.unlock();
+    run(jobs);
+    for (vector<job_t*>::iterator it = jobs.begin(); it != jobs.end(); it++)
+      delete *it;
+    lock.lock();
+  }
+}
+
+void PgPipeline::run(vector<job_t*>& jobs) {
+  if (PQstatus(p_conn) == CONNECTION_BAD) {
+    LOG(logWarning) << "Lost pipeline connection to database, reconnecting";
+    PQreset(p_conn);
+    if (PQstatus(p_conn) == CONNECTION_OK)
+      PQenterPipelineMode(p_conn);
+  }
+
+  size_t sent = 0;
+  for (; sent < jobs.size(); sent++) {
+    vector<const char*> values;
+    for (size_t i = 0; i < jobs[sent]->parameters.size(); i++)
+      values.push_back(jobs[sent]->parameters[i].c_str());
+    //pipelines need the extended protocol, the server parses the query and binds the parameters to it
+    if (!PQsendQueryParams(p_conn, jobs[sent]->sql.c_str(), values.size(), 0, values.data(), 0, 0, 0))
+      break;
+  }
+  if (sent > 0)
+    PQpipelineSync(p_conn);
+
+  //every query's results are followed by a NULL, the batch is terminated by the result of the sync
+  for (size_t i = 0; i < sent; i++) {
+    queryResult_t rows;
+    string error = "no result";
+    PGresult* result;
+    while ((result = PQgetResult(p_conn))) {
+      if (PQresultStatus(result) == PGRES_TUPLES_OK) {
+        error.clear();
+        int fields = PQnfields(result);
+        for (int row = 0; row < PQntuples(result); row++) {
+          rows.push_back(vector<string>(fields));
+          for (int field = 0; field < fields; field++)
+            rows.back()[field].assign(PQgetvalue(result, row, field), PQgetlength(result, row, field));
+        }
+      } else if (PQresultStatus(result) == PGRES_PIPELINE_ABORTED) {
+        error = "aborted after an earlier query of the pipeline failed";
+      } else {
+        error = trimmed(PQresultErrorMessage(result));
+      }
+      PQclear(result);
+    }
+    if (error.empty())
+      jobs[i]->promise.set_value(rows);
+    else
+      jobs[i]->promise.set_exception(make_exception_ptr(SQLException("pipelined query failed: "+error)));
+    if (PQstatus(p_conn) == CONNECTION_BAD) //no more results will arrive
+      break;
+  }
+  if (sent > 0 && PQstatus(p_conn) != CONNECTION_BAD)
+    PQclear(PQgetResult(p_conn)); //PGRES_PIPELINE_SYNC
+
+  string error = trimmed(PQerrorMessage(p_conn));
+  for (size_t i = 0; i < jobs.size(); i++) { //queries that could not be sent or whose results were lost with the connection
+    try {
+      jobs[i]->promise.set_exception(make_exception_ptr(SQLException("pipelined query failed: "+error)));
+    } catch (future_error&) {} //already satisfied
+  }
+}
@@ -0,0 +1,183 @@
+#ifndef PG_BACKEND_H
+#define PG_BACKEND_H
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <libpq-fe.h>
+
+#include "backend.h"
+#include "query_pool.h"
+
+class PgStatement;
+
+//PostgreSQL server backend. Lookups run as prepared statements, inserts and updates by id are buffered and written
+//in bulk: new rows through COPY FROM STDIN in binary format, with ids reserved from the table's sequence in advance,
+//changed rows through COPY into a temporary table merged by a single UPDATE ... FROM.
+//Buffered rows are written before any other statement mentioning their table runs, so reads always see them.
+class PgBackend : public Backend {
+public:
+  PgBackend(const dbConfig_t& config);
+  ~PgBackend(); //writes the buffered rows
+
+  PGconn* getConnection() const;
+  //opens a connection, throws SQLException on failure
+  static PGconn* connect(const dbConfig_t& config);
+  //rows buffered per statement before they are written, also the number of ids reserved at once
+  static unsigned int& batchSize();
+
+  const char* name() const;
+  bool query(const std::string& sql);
+  PreparedStatementWrapper* statement(worker* w, const std::string& sql, PreparedStatementWrapper::resultMode_t mode);
+  bool explain(const std::string& sql, std::vector<std::string>& plan);
+  bool reconnect();
+  void flush();
+
+  void createTables(const std::string& directoryTable, const std::string& fileTable);
+  void createDuplicatesTable(const std::string& table);
+  void clearTable(const std::string& table);
+
+  std::string unixTime(const std::string& column) const;
+  std::string fromUnixTime(const std::string& value) const;
+  std::string limit() const;
+
+  //runs sql and returns its result, which has to be cleared by the caller, throws SQLException unless it has status expected
+  PGresult* exec(const std::string& sql, ExecStatusType expected);
+  //unique name for prepared statements, cursors and temporary tables of this connection
+  std::string uniqueName(const std::string& prefix);
+  //sequence of the id column of table, empty if it has none
+  std::string idSequence(const std::string& table);
+  //returns the next value of sequence, values are fetched batchSize() at a time
+  uint64_t reserveId(const std::string& sequence);
+
+  //statements with buffered rows register here to be written before any statement mentioning their table
+  void addPending(PgStatement* statement);
+  void removePending(PgStatement* statement);
+  void flushTables(const std::string& sql);
+
+  //cursors only live within a transaction, it is committed when the last cursor is closed
+  void openCursor();
+  void closeCursor();
+
+private:
+  //writes the pending rows of the statements selected by mentioned (all if sql is null), inserts before updates
+  void flushPending(const std::string* sql);
+
+  dbConfig_t p_config;
+  PGconn* p_conn;
+  unsigned int p_names;
+  std::map<std::string, std::string> p_sequences;
+  std::map< std::string, std::deque<uint64_t> > p_reservedIds;
+  std::vector<PgStatement*> p_pending;
+  unsigned int p_cursors;
+};
+
+class PgStatement : public PreparedStatementWrapper {
+public:
+  PgStatement(worker* w, PgBackend* backend, const std::string& sql, resultMode_t mode);
+  ~PgStatement();
+
+  void reprepare();
+  void close();
+
+  bool execute();
+  //returns the number of rows of buffered results, 0 for streamed results
+  int executeQuery();
+  std::string boundQuery() const;
+
+  void setInt(unsigned int parameterIndex, int32_t value);
+  void setUInt(unsigned int parameterIndex, uint32_t value);
+  void setInt64(unsigned int parameterIndex, int64_t value);
+  void setUInt64(unsigned int parameterIndex, uint64_t value);
+  void setNull(unsigned int parameterIndex, int sqlType);
+  void setString(unsigned int parameterIndex, const std::string& value);
+
+  uint64_t getUInt64(unsigned int index);
+  std::string getString(unsigned int index);
+  bool next();
+  void release();
+  uint64_t lastInsertId();
+
+  bool isBulkInsert() const;
+  const std::string& table() const;
+  //writes the buffered rows
+  void flushRows();
+
+private:
+  enum bulk_t { bulkNone, bulkInsert, bulkUpdate };
+  //recognizes INSERT INTO t (...) VALUES (...) and UPDATE t SET ... WHERE id=? with plain parameters as values
+  void parseBulk();
+  //looks up the column types, the id sequence and creates the temporary table of updates
+  void prepareBulk();
+  void bufferRow();
+  void appendField(std::string& tuple, unsigned int column, const std::string* value) const;
+  void copy(const std::string& table, const std::string& columns);
+  bool retryAfterError(unsigned int attempt);
+  void setParam(unsigned int parameterIndex, const std::string& value);
+  void checkColumn(unsigned int index) const;
+  void fetch();
+
+  PgBackend* p_backend;
+  std::string p_sql; //p_query with $n placeholders
+  std::string p_name; //of the prepared statement
+  std::vector<std::string> p_values;
+  std::vector<char> p_nulls;
+  PGresult* p_result;
+  int p_row;
+  std::string p_cursor; //open cursor of a streamed result
+  bool p_cursorDone;
+  uint64_t p_lastInsertId;
+
+  bulk_t p_bulk;
+  std::string p_table;
+  std::vector<std::string> p_columns; //in parameter order, the id of updates comes last
+  std::vector<char> p_timestamps; //the parameter is converted by to_timestamp()
+  std::vector<Oid> p_types;
+  std::string p_sequence; //ids of inserted rows are reserved from it
+  Oid p_idType;
+  bool p_explicitIds; //inserts set the id, the sequence has to be moved past them
+  std::string p_mergeTable;
+  std::vector<std::string> p_tuples; //encoded COPY tuples
+  std::unordered_map<uint64_t, size_t> p_updatedIds; //tuple of every id, the last update of a row wins
+};
+
+//Runs queries on a connection of its own in pipeline mode: all queued queries are sent at once and their results
+//are read as they arrive, so a batch of lookups costs a single round trip. The connection has to go to the primary
+//the backend writes to, the lookups decide about the next writes.
+class PgPipeline : public QueryPool {
+public:
+  //backend writes its buffered rows before a query reads them
+  PgPipeline(const dbConfig_t& config, unsigned int depth, PgBackend* backend);
+  ~PgPipeline();
+
+  unsigned int size() const;
+  std::future<queryResult_t> query(const std::string& sql, const std::vector<uint64_t>& parameters);
+
+private:
+  struct job_t {
+    std::string sql;
+    std::vector<std::string> parameters;
+    std::promise<queryResult_t> promise;
+  };
+  void loop();
+  void run(std::vector<job_t*>& jobs);
+
+  dbConfig_t p_config;
+  PGconn* p_conn;
+  unsigned int p_depth;
+  PgBackend* p_backend;
+
+  std::mutex p_mutex;
+  std::condition_variable p_wake;
+  std::deque<job_t*> p_jobs;
+  bool p_running;
+  std::thread p_thread;
+};
+
+#endif //PG_BACKEND_H
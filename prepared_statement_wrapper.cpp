@@ -1,254 +1,187 @@
-#include "logger.h"
 #include "prepared_statement_wrapper.h"
-#include "worker.h"
+#include "backend.h"
+#include "hasher.h"
+#include "logger.h"
+#include "metrics.h"
 #include "sqlexception.h"
+#include "trace.h"
+#include "worker.h"
 
-PreparedStatementWrapper::PreparedStatementWrapper()
-  : p_reconnectAttempts(0),
-    p_stmt(0)
-{}
+#include <cctype>
+#include <cstdio>
+#include <map>
+#include <mutex>
+
+using namespace std;
+
+//latencies of all statements by their SQL, for logStatistics()
+struct statementLatency_t {
+  Histogram* execute;
+  Histogram* fetch;
+};
+static mutex latenciesMutex;
+static map<string, statementLatency_t> latencies;
+
+PreparedStatementWrapper::PreparedStatementWrapper(worker* w, const string& sql, resultMode_t mode)
+  : p_worker(w),
+    p_query(sql),
+    p_streamed(mode == resultStreamed || (mode == resultAuto && isTableScan(sql))),
+    p_idempotent(sql.compare(0, 7, "INSERT ") != 0), //a repeated insert would duplicate the row
+    p_resultOpen(false),
+    p_resultLost(false),
+    p_latency(&METRICS.histogram("fscrawl_statement_seconds", "Execution time of prepared statements", Metrics::label("statement", sql))),
+    p_fetchLatency(&METRICS.histogram("fscrawl_statement_fetch_seconds", "Time to fetch a result row of prepared statements", Metrics::label("statement", sql)))
+{
+  lock_guard<mutex> lock(latenciesMutex);
+  statementLatency_t& latency = latencies[sql];
+  latency.execute = p_latency;
+  latency.fetch = p_fetchLatency;
+}
 
 PreparedStatementWrapper::~PreparedStatementWrapper() {
-  close();
+  p_worker->unregisterStatement(this);
 }
 
-PreparedStatementWrapper* PreparedStatementWrapper::create(worker* w, const string& sql) {
-  PreparedStatementWrapper* psw = new PreparedStatementWrapper();
-  psw->p_worker = w;
-  psw->p_query = sql;
-  psw->reprepare();
+PreparedStatementWrapper* PreparedStatementWrapper::create(worker* w, const string& sql, resultMode_t mode) {
+  PreparedStatementWrapper* psw = w->getBackend()->statement(w, sql, mode);
+  w->registerStatement(psw);
+  try {
+    psw->reprepare();
+  } catch (...) {
+    delete psw;
+    throw;
+  }
   return psw;
 }
 
-void PreparedStatementWrapper::testConnection() {
-  if (mysql_stat(p_worker->getConnection()) == 0) {
-    LOG(logDetailed) << "Connection timed out, reconnecting...";
-    LOG(logWarning) << "db reconnect not implemented yet";
+void PreparedStatementWrapper::checkCursor() const {
+  if (p_resultLost && p_streamed)
+    throw SQLException("connection lost while reading the result of \""+p_query+"\", the scan is incomplete");
+}
+
+unsigned long& PreparedStatementWrapper::prefetchRows() {
+  static unsigned long rows = 1000;
+  return rows;
+}
+
+unsigned int& PreparedStatementWrapper::maxRetries() {
+  static unsigned int retries = 3;
+  return retries;
+}
+
+double& PreparedStatementWrapper::slowThreshold() {
+  static double seconds = 0;
+  return seconds;
+}
+
+void PreparedStatementWrapper::logStatistics() {
+  lock_guard<mutex> lock(latenciesMutex);
+  bool header = false;
+  for (map<string, statementLatency_t>::const_iterator it = latencies.begin(); it != latencies.end(); it++)
+    for (int fetch = 0; fetch < 2; fetch++) {
+      const Histogram& histogram = fetch ? *it->second.fetch : *it->second.execute;
+      if (histogram.count() == 0)
+        continue;
+      if (!header) {
+        LOG(logDetailed) << "     calls   p50 ms   p90 ms   p99 ms   max ms     total s  statement";
+        header = true;
+      }
+      char row[96];
+      snprintf(row, sizeof(row), "%10llu %8.3f %8.3f %8.3f %8.3f %11.3f  ", (unsigned long long)histogram.count(),
+               histogram.quantile(0.5)*1000, histogram.quantile(0.9)*1000, histogram.quantile(0.99)*1000, histogram.max()*1000, histogram.sum());
+      LOG(logDetailed) << row << (fetch ? "fetch " : "") << it->first;
+    }
+}
+
+string PreparedStatementWrapper::substitute(const string& sql, const vector<string>& literals) {
+  string result;
+  result.reserve(sql.size());
+  char quoteChar = 0;
+  size_t parameter = 0;
+  for (string::const_iterator it = sql.begin(); it != sql.end(); it++) {
+    if (quoteChar) {
+      if (*it == quoteChar)
+        quoteChar = 0; //a doubled quote closes and reopens the literal
+    } else if (*it == '\'' || *it == '"' || *it == '`')
+      quoteChar = *it;
+    else if (*it == '?') {
+      result.append(parameter < literals.size() ? literals[parameter] : string("NULL"));
+      parameter++;
+      continue;
+    }
+    result.push_back(*it);
   }
+  return result;
 }
 
-void PreparedStatementWrapper::close() {
-  if (p_stmt) {
-    mysql_stmt_close(p_stmt);
-    p_stmt = 0;
+string PreparedStatementWrapper::quote(const string& value) {
+  string result(1, '\'');
+  for (string::const_iterator it = value.begin(); it != value.end(); it++) {
+    if (*it == '\'')
+      result.push_back('\'');
+    result.push_back(*it);
   }
+  result.push_back('\'');
+  return result;
 }
 
-void PreparedStatementWrapper::reprepare() {
-  if (p_stmt)
-     mysql_stmt_reset(p_stmt);
-
-  p_stmt = mysql_stmt_init(p_worker->getConnection());
-
-  int ret = mysql_stmt_prepare(p_stmt, p_query.c_str(), p_query.length());
-  if (ret)
-    throw SQLException("mysql_stmt_prepare failed: "+string(mysql_stmt_error(p_stmt)));
-
-  p_binds.clear();
-  p_binds.resize(mysql_stmt_param_count(p_stmt));
-
-  p_params.clear();
-  p_params.resize(mysql_stmt_param_count(p_stmt));
-}
-
-// PROXIED FUNCTIONS
-
-// bool PreparedStatementWrapper::execute(const string& sql) {
-//   testConnection();
-//   return p_stmt->execute(sql);
-// }
-
-bool PreparedStatementWrapper::execute() {
-  testConnection();
-
-  int ret = mysql_stmt_bind_param(p_stmt, p_binds.data());
-  if (ret)
-    throw SQLException("mysql_stmt_bind_param failed", p_stmt);
-
-  ret = mysql_stmt_execute(p_stmt);
-  if (ret)
-    throw SQLException("mysql_stmt_execute failed", p_stmt);
-
-  p_rowValid = false;
-  return ret;
-}
-
-// sql::ResultSet* PreparedStatementWrapper::executeQuery(const string& sql) {
-//   testConnection();
-//   return p_stmt->executeQuery(sql);
-// }
-
-int PreparedStatementWrapper::executeQuery() {
-  int ret = execute();
-
-  ret = mysql_stmt_store_result(p_stmt);
-  if (ret)
-    throw SQLException("mysql_stmt_store_result failed", p_stmt);
-
-  return rowsCount();
-}
-
-// int PreparedStatementWrapper::executeUpdate(const string& sql) {
-//   testConnection();
-//   return p_stmt->executeUpdate(sql);
-// }
-
-// int PreparedStatementWrapper::executeUpdate() {
-//   testConnection();
-//   return p_stmt->executeUpdate();
-// }
-
-// sql::ResultSetMetaData* PreparedStatementWrapper::getMetaData() {
-//   testConnection();
-//   return p_stmt->getMetaData();
-// }
-
-// sql::ParameterMetaData* PreparedStatementWrapper::getParameterMetaData() {
-//   testConnection();
-//   return p_stmt->getParameterMetaData();
-// }
-
-// bool PreparedStatementWrapper::getMoreResults() {
-//   testConnection();
-//   return p_stmt->getMoreResults();
-// }
-
-// void PreparedStatementWrapper::setBigInt(unsigned int parameterIndex, const string& value) {
-//   testConnection();
-//   return p_stmt->setBigInt(parameterIndex, value);
-// }
-
-// void PreparedStatementWrapper::setBlob(unsigned int parameterIndex, std::istream * blob) {
-//   testConnection();
-//   return p_stmt->setBlob(parameterIndex, blob);
-// }
-
-// void PreparedStatementWrapper::setBoolean(unsigned int parameterIndex, bool value) {
-//   testConnection();
-//   return p_stmt->setBoolean(parameterIndex, value);
-// }
-
-// void PreparedStatementWrapper::setDateTime(unsigned int parameterIndex, const string& value) {
-//   testConnection();
-//   return p_stmt->setDateTime(parameterIndex, value);
-// }
-
-// void PreparedStatementWrapper::setDouble(unsigned int parameterIndex, double value) {
-//   testConnection();
-//   return p_stmt->setDouble(parameterIndex, value);
-// }
-
-void PreparedStatementWrapper::setInt(unsigned int parameterIndex, int32_t value) {
-  int32_t* tmp = new int32_t(value);
-  p_binds[parameterIndex-1].buffer_type = MYSQL_TYPE_LONG;
-  p_binds[parameterIndex-1].buffer = tmp;
-  p_binds[parameterIndex-1].is_unsigned = false;
-  p_params[parameterIndex-1].reset(tmp);
-}
-
-void PreparedStatementWrapper::setUInt(unsigned int parameterIndex, uint32_t value) {
-  uint32_t* tmp = new uint32_t(value);
-  p_binds[parameterIndex-1].buffer_type = MYSQL_TYPE_LONG;
-  p_binds[parameterIndex-1].buffer = tmp;
-  p_binds[parameterIndex-1].is_unsigned = true;
-  p_params[parameterIndex-1].reset(tmp);
-}
-
-void PreparedStatementWrapper::setUInt64(unsigned int parameterIndex, uint64_t value) {
-  uint64_t* tmp = new uint64_t(value);
-  p_binds[parameterIndex-1].buffer_type = MYSQL_TYPE_LONGLONG;
-  p_binds[parameterIndex-1].buffer = tmp;
-  p_binds[parameterIndex-1].is_unsigned = true;
-  p_params[parameterIndex-1].reset(tmp);
-}
-
-void PreparedStatementWrapper::setNull(unsigned int parameterIndex, int sqlType __attribute__((unused))) {
-  p_binds[parameterIndex-1].buffer_type = MYSQL_TYPE_NULL;
-  p_binds[parameterIndex-1].buffer = 0;
-  p_params[parameterIndex-1].reset();
-}
-
-void PreparedStatementWrapper::setString(unsigned int parameterIndex, const string& value) {
-  string* tmp = new string(value);
-  p_binds[parameterIndex-1].buffer_type = MYSQL_TYPE_STRING;
-  p_binds[parameterIndex-1].buffer = const_cast<char*>(tmp->c_str());
-  p_binds[parameterIndex-1].buffer_length = tmp->length();
-  p_params[parameterIndex-1].reset(tmp);
-}
-
-// sql::PreparedStatement* PreparedStatementWrapper::setResultSetType(sql::ResultSet::enum_type type) {
-//   testConnection();
-//   return p_stmt->setResultSetType(type);
-// }
-
-uint32_t PreparedStatementWrapper::getUInt(unsigned int index) {
-  if (!p_rowValid)
-    throw out_of_range("no result row available");
-  if (index > mysql_stmt_field_count(p_stmt))
-    throw out_of_range("field index out of range");
-
-  uint32_t tmp;
-  MYSQL_BIND bind = {};
-  bind.buffer_type = MYSQL_TYPE_LONG;
-  bind.buffer = &tmp;
-  bind.buffer_length = sizeof(tmp);
-  bind.is_unsigned = true;
-
-  int ret = mysql_stmt_fetch_column(p_stmt, &bind, index-1, 0);
-  if (ret)
-    throw SQLException("failed to getUInt", p_stmt);
+PreparedStatementWrapper::Timer::Timer(PreparedStatementWrapper* statement, bool fetch)
+  : p_statement(statement),
+    p_fetch(fetch),
+    p_start(chrono::steady_clock::now())
+{}
 
-  return tmp;
+PreparedStatementWrapper::Timer::~Timer() {
+  chrono::steady_clock::time_point end = chrono::steady_clock::now();
+  chrono::steady_clock::duration duration = end-p_start;
+  (p_fetch ? p_statement->p_fetchLatency : p_statement->p_latency)->observe(duration);
+  if (!p_fetch && Tracer::enabled()) //fetches would add an event per row
+    TRACER.record("db", "execute", p_start, end, Tracer::arg("statement", p_statement->p_query));
+  double seconds = chrono::duration<double>(duration).count();
+  if (slowThreshold() > 0 && seconds >= slowThreshold()) {
+    LOG(logWarning) << "Slow statement " << (p_fetch ? "fetch" : "execution") << " took " << seconds*1000 << " ms: " << p_statement->boundQuery();
+  }
 }
 
-uint64_t PreparedStatementWrapper::getUInt64(unsigned int index) {
-  if (!p_rowValid)
-    throw out_of_range("no result row available");
-  if (index > mysql_stmt_field_count(p_stmt))
-    throw out_of_range("field index out of range");
-
-  uint64_t tmp;
-  MYSQL_BIND bind = {};
-  bind.buffer_type = MYSQL_TYPE_LONGLONG;
-  bind.buffer = &tmp;
-  bind.buffer_length = sizeof(tmp);
-  bind.is_unsigned = true;
-
-  int ret = mysql_stmt_fetch_column(p_stmt, &bind, index-1, 0);
-  if (ret)
-    throw SQLException("failed to getUInt64", p_stmt);
-
-  return tmp;
+bool PreparedStatementWrapper::isTableScan(const string& sql) {
+  //only look at the outermost query, subqueries and function calls are inside parentheses
+  string topLevel;
+  int depth = 0;
+  for (string::const_iterator it = sql.begin(); it != sql.end(); it++) {
+    if (*it == '(')
+      depth++;
+    else if (*it == ')')
+      depth--;
+    else if (depth == 0)
+      topLevel += toupper(*it);
+  }
+  return topLevel.compare(0, 7, "SELECT ") == 0 &&
+         topLevel.find(" FROM ") != string::npos &&
+         topLevel.find(" WHERE ") == string::npos &&
+         topLevel.find(" LIMIT ") == string::npos;
 }
 
-std::string PreparedStatementWrapper::getString(unsigned int index) {
-  if (!p_rowValid)
-    throw out_of_range("no result row available");
-  if (index > mysql_stmt_field_count(p_stmt))
-    throw out_of_range("field index out of range");
-
-  char tmp[256] = {};
-  MYSQL_BIND bind = {};
-  bind.buffer_type = MYSQL_TYPE_STRING;
-  bind.buffer = tmp;
-  bind.buffer_length = sizeof(tmp);
-
-  int ret = mysql_stmt_fetch_column(p_stmt, &bind, index-1, 0);
-  if (ret)
-    throw SQLException("failed to getString", p_stmt);
-
-  return string(tmp);
+bool PreparedStatementWrapper::isStreamed() const {
+  return p_streamed;
 }
 
-bool PreparedStatementWrapper::next() {
-  p_rowValid = mysql_stmt_fetch(p_stmt) == 0;
-  return p_rowValid;
+const string& PreparedStatementWrapper::getQuery() const {
+  return p_query;
 }
 
-void PreparedStatementWrapper::release() {
-  mysql_stmt_free_result(p_stmt);
+void PreparedStatementWrapper::setHash(unsigned int parameterIndex, const string& hash) {
+  if (!p_worker->binaryHashes()) {
+    setString(parameterIndex, hash);
+    return;
+  }
+  string digest = Hasher::toBinary(hash);
+  if (digest.empty()) {
+    LOG(logWarning) << "Storing invalid hash \"" << hash << "\" as NULL";
+    setNull(parameterIndex, 0);
+  } else
+    setBinary(parameterIndex, digest);
 }
 
-int PreparedStatementWrapper::rowsCount() {
-  return mysql_stmt_num_rows(p_stmt);
+string PreparedStatementWrapper::getHash(unsigned int index) {
+  return p_worker->binaryHashes() ? Hasher::toPrinted(getString(index)) : getString(index);
 }
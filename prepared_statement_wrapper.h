@@ -1,82 +1,110 @@
 #ifndef PREPARED_STATEMENT_WRAPPER_H
 #define PREPARED_STATEMENT_WRAPPER_H
 
-#include <memory>
+#include <chrono>
 #include <string>
-#include <vector>
 #include <cstdint>
+#include <vector>
 
-#include <mysql.h>
-
+class Histogram;
 class worker;
 
+//Backend independent prepared statement, created by the worker's Backend. Parameter and field indices start at 1.
 class PreparedStatementWrapper {
 public:
-  ~PreparedStatementWrapper();
-  static PreparedStatementWrapper* create(worker* w, const std::string& sql);
-
-  void reprepare();
-  void close();
-
-  // bool execute(const std::string& sql);
-  bool execute();
-
-  // sql::ResultSet* executeQuery(const std::string& sql);
-  int executeQuery();
+  //resultStreamed fetches rows through a read-only server side cursor, prefetchRows() at a time, instead of
+  //buffering the whole result in client memory. MySQL materializes the result of a cursor in a temporary table on the
+  //server, in exchange the connection stays usable for other statements while the rows are read. resultAuto streams table scans (no WHERE or LIMIT) and buffers everything else.
+  //Embedded backends read their results row by row anyway and ignore the mode.
+  enum resultMode_t { resultAuto, resultBuffered, resultStreamed };
 
-  // int executeUpdate(const std::string& sql);
-  // int executeUpdate();
+  virtual ~PreparedStatementWrapper();
+  static PreparedStatementWrapper* create(worker* w, const std::string& sql, resultMode_t mode = resultAuto);
+  //number of rows fetched per round trip by streamed statements
+  static unsigned long& prefetchRows();
+  //number of reconnects and retries when the connection to the server is lost
+  static unsigned int& maxRetries();
+  //executions and fetches taking longer than this many seconds are logged with their parameters, 0 disables the log
+  static double& slowThreshold();
+  //logs the number of calls and the latency percentiles of every statement used so far
+  static void logStatistics();
 
-  // sql::ResultSetMetaData * getMetaData();
+  virtual void reprepare() = 0;
+  virtual void close() = 0;
 
-  // sql::ParameterMetaData * getParameterMetaData();
+  //A reconnect reprepares every statement except the ones with an open result, which are told connectionLost().
+  //Buffered rows stay readable, but the cursor of a streamed result is gone with the old connection, so its next()
+  //throws instead of ending the scan early. Such a statement is reprepared when it is released or executed again.
+  bool hasOpenResult() const { return p_resultOpen; }
+  void connectionLost() { p_resultLost = true; }
 
-  // bool getMoreResults();
+  virtual bool execute() = 0;
 
-  // void setBigInt(unsigned int parameterIndex, const std::string& value);
+  //returns the number of rows if the backend knows it in advance, 0 otherwise
+  virtual int executeQuery() = 0;
+  bool isStreamed() const;
+  const std::string& getQuery() const;
+  //the query with the current parameters filled in, for logging only
+  virtual std::string boundQuery() const { return p_query; }
 
-  // void setBlob(unsigned int parameterIndex, std::istream * blob);
+  virtual void setInt(unsigned int parameterIndex, int32_t value) = 0;
 
-  // void setBoolean(unsigned int parameterIndex, bool value);
+  virtual void setUInt(unsigned int parameterIndex, uint32_t value) = 0;
 
-  // void setDateTime(unsigned int parameterIndex, const std::string& value);
+  virtual void setInt64(unsigned int parameterIndex, int64_t value) = 0;
 
-  // void setDouble(unsigned int parameterIndex, double value);
+  virtual void setUInt64(unsigned int parameterIndex, uint64_t value) = 0;
 
-  void setInt(unsigned int parameterIndex, int32_t value);
+  virtual void setNull(unsigned int parameterIndex, int sqlType) = 0;
 
-  void setUInt(unsigned int parameterIndex, uint32_t value);
+  virtual void setString(unsigned int parameterIndex, const std::string& value) = 0;
 
-  void setInt64(unsigned int parameterIndex, int64_t value);
+  //binary data, backends without a distinct binary type store it like a string
+  virtual void setBinary(unsigned int parameterIndex, const std::string& value) { setString(parameterIndex, value); }
 
-  void setUInt64(unsigned int parameterIndex, uint64_t value);
-
-  void setNull(unsigned int parameterIndex, int sqlType);
-
-  void setString(unsigned int parameterIndex, const std::string& value);
-
-  // sql::PreparedStatement* setResultSetType(sql::ResultSet::enum_type type);
+  //hashes are passed as printed by the Hasher, catalogs with binary hash columns store their digests
+  void setHash(unsigned int parameterIndex, const std::string& hash);
 
   // emulate sql::ResultSet
-  uint32_t getUInt(unsigned int index);
-  uint64_t getUInt64(unsigned int index);
-  std::string getString(unsigned int index);
-  bool next();
-  void release(); // delete cached result data
-  int rowsCount();
-
-private:
-  PreparedStatementWrapper();
-
-  void testConnection();
-  int p_reconnectAttempts;
+  virtual uint64_t getUInt64(unsigned int index) = 0;
+  virtual std::string getString(unsigned int index) = 0;
+  std::string getHash(unsigned int index);
+  virtual bool next() = 0;
+  virtual void release() = 0; // delete cached result data, closes the cursor of streamed results
+  virtual uint64_t lastInsertId() = 0; // id generated by the last execution of an INSERT statement
+
+  //replaces the parameter markers outside of quotes by the given literals, markers without a literal by NULL
+  static std::string substitute(const std::string& sql, const std::vector<std::string>& literals);
+  //value as quoted SQL string literal
+  static std::string quote(const std::string& value);
+
+protected:
+  PreparedStatementWrapper(worker* w, const std::string& sql, resultMode_t mode);
+
+  //observes the time from its construction to its destruction in the execution or fetch latency of the statement,
+  //backends put one into execute() and next()
+  class Timer {
+  public:
+    Timer(PreparedStatementWrapper* statement, bool fetch);
+    ~Timer();
+  private:
+    PreparedStatementWrapper* p_statement;
+    bool p_fetch;
+    std::chrono::steady_clock::time_point p_start;
+  };
+
+  static bool isTableScan(const std::string& sql);
+  //throws if the cursor of a streamed result was lost with the connection, called by the backends in next()
+  void checkCursor() const;
 
   worker* p_worker;
-  MYSQL_STMT* p_stmt;
   std::string p_query;
-  std::vector<MYSQL_BIND> p_binds;
-  std::vector<std::shared_ptr<void>> p_params;
-  bool p_rowValid;
+  bool p_streamed;
+  bool p_idempotent; //may be repeated if the connection broke while it was executed
+  bool p_resultOpen; //between executeQuery() and release(), maintained by the backends that reconnect
+  bool p_resultLost; //the connection was replaced while the result was open
+  Histogram* p_latency; //execute(), which executeQuery() calls as well
+  Histogram* p_fetchLatency; //next()
 };
 
 #endif //PREPARED_STATEMENT_WRAPPER_H
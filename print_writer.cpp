@@ -0,0 +1,129 @@
+#include "print_writer.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "worker.h"
+
+using namespace std;
+
+PrintWriter::format_t PrintWriter::parseFormat(const string& name) {
+  if (name == "lines")
+    return formatLines;
+  if (name == "nul")
+    return formatNul;
+  if (name == "jsonl")
+    return formatJson;
+  if (name == "sums")
+    return formatSums;
+  throw runtime_error("unknown print format "+name+", expected lines, nul, jsonl or sums");
+}
+
+PrintWriter::PrintWriter(format_t format, const string& file)
+  : p_format(format),
+    p_file(file.empty() ? string("standard output") : file),
+    p_fd(file.empty() ? STDOUT_FILENO : -1),
+    p_gz(0) {
+  if (!file.empty()) {
+    if (file.size() > 3 && file.compare(file.size()-3, 3, ".gz") == 0)
+      p_gz = gzopen(file.c_str(), "wb6");
+    else
+      p_fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (!p_gz && p_fd < 0)
+      throw runtime_error("failed to open "+file+": "+strerror(errno));
+    if (p_gz)
+      gzbuffer(p_gz, bufferSize);
+  }
+  p_buffer.reserve(bufferSize+4096);
+}
+
+PrintWriter::~PrintWriter() {
+  if (p_gz)
+    gzclose(p_gz);
+  else if (p_fd > STDOUT_FILENO)
+    ::close(p_fd);
+}
+
+bool PrintWriter::add(const string& path, uint64_t size, time_t mtime, const string& hash) {
+  switch (p_format) {
+    case formatLines :
+      p_buffer.append(path).push_back('\n');
+      break;
+    case formatNul :
+      p_buffer.append(path).push_back('\0');
+      break;
+    case formatJson : {
+      char number[48];
+      p_buffer.append("{\"path\":").append(worker::jsonString(path));
+      p_buffer.append(number, snprintf(number, sizeof(number), ",\"size\":%llu,\"mtime\":%lld", (unsigned long long)size, (long long)mtime));
+      if (!hash.empty())
+        p_buffer.append(",\"hash\":\"").append(hash).push_back('"');
+      p_buffer.append("}\n");
+      break;
+    }
+    case formatSums : {
+      if (hash.empty())
+        return false;
+      //like sha1sum, names containing a backslash or newline are escaped and the line is marked by a leading backslash
+      const size_t skip = path.empty() || path[0] != '/' ? 0 : 1;
+      if (path.find_first_of("\\\n", skip) == string::npos) {
+        p_buffer.append(hash).append("  ").append(path, skip, string::npos).push_back('\n');
+        break;
+      }
+      p_buffer.append(1, '\\').append(hash).append("  ");
+      for (size_t i = skip; i < path.size(); i++)
+        if (path[i] == '\\')
+          p_buffer.append("\\\\");
+        else if (path[i] == '\n')
+          p_buffer.append("\\n");
+        else
+          p_buffer.push_back(path[i]);
+      p_buffer.push_back('\n');
+      break;
+    }
+  }
+  if (p_buffer.size() >= bufferSize)
+    write();
+  return true;
+}
+
+void PrintWriter::close() {
+  write();
+  if (p_gz) {
+    int result = gzclose(p_gz);
+    p_gz = 0;
+    if (result != Z_OK)
+      throw runtime_error("failed to write "+p_file);
+  } else if (p_fd > STDOUT_FILENO) {
+    int result = ::close(p_fd);
+    p_fd = -1;
+    if (result != 0)
+      throw runtime_error("failed to write "+p_file+": "+strerror(errno));
+  }
+}
+
+void PrintWriter::write() {
+  if (p_buffer.empty())
+    return;
+  if (p_gz) {
+    if (gzwrite(p_gz, p_buffer.data(), p_buffer.size()) != (int)p_buffer.size()) {
+      int error;
+      throw runtime_error("failed to write "+p_file+": "+gzerror(p_gz, &error));
+    }
+  } else {
+    for (size_t written = 0; written < p_buffer.size(); ) {
+      ssize_t result = ::write(p_fd, p_buffer.data()+written, p_buffer.size()-written);
+      if (result < 0 && errno == EINTR)
+        continue;
+      if (result < 0)
+        throw runtime_error("failed to write "+p_file+": "+strerror(errno));
+      written += result;
+    }
+  }
+  p_buffer.clear();
+}
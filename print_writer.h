@@ -0,0 +1,43 @@
+#ifndef PRINT_WRITER_H
+#define PRINT_WRITER_H
+
+#include <string>
+
+#include <stdint.h>
+#include <time.h>
+#include <zlib.h>
+
+//Formats the files printed by --print into a large buffer, which is written to standard output or a file in big
+//chunks instead of once per line. Files ending with .gz are written gzip compressed.
+class PrintWriter {
+public:
+  enum format_t {
+    formatLines, //path per line
+    formatNul, //path terminated by NUL, for xargs -0
+    formatJson, //JSON object per line with path, size, mtime and hash
+    formatSums //"hash  path" relative to the crawled directory, checkable by sha1sum -c and the like
+  };
+  //parses the name of a format, throws runtime_error for unknown names
+  static format_t parseFormat(const std::string& name);
+
+  //writes to standard output if file is empty, throws runtime_error if file can not be opened
+  PrintWriter(format_t format, const std::string& file = std::string());
+  ~PrintWriter(); //closes without reporting errors
+
+  //path starts with a slash, hash may be empty. Returns false if the file was skipped, as sums can not list files without hash.
+  bool add(const std::string& path, uint64_t size, time_t mtime, const std::string& hash);
+  //writes what is buffered and closes the output, throws runtime_error on failure
+  void close();
+
+private:
+  static const size_t bufferSize = 1 << 20;
+  void write();
+
+  format_t p_format;
+  std::string p_file;
+  int p_fd; //-1 if writing through p_gz
+  gzFile p_gz;
+  std::string p_buffer;
+};
+
+#endif //PRINT_WRITER_H
@@ -0,0 +1,31 @@
+#ifndef QUERY_POOL_H
+#define QUERY_POOL_H
+
+#include <future>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+struct dbConfig_t {
+  std::string host;
+  std::string user;
+  std::string password;
+  std::string database;
+};
+
+//rows of a text protocol result, NULL values are returned as empty strings
+typedef std::vector< std::vector<std::string> > queryResult_t;
+
+//Runs read-only queries asynchronously on connections besides the one of the backend
+class QueryPool {
+public:
+  virtual ~QueryPool() {}
+
+  //number of queries worth keeping in flight
+  virtual unsigned int size() const = 0;
+  //queues the prepared query sql with its ? markers bound to parameters, the future throws SQLException if it failed
+  virtual std::future<queryResult_t> query(const std::string& sql, const std::vector<uint64_t>& parameters) = 0;
+};
+
+#endif //QUERY_POOL_H
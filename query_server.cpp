@@ -0,0 +1,242 @@
+#include "query_server.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "logger.h"
+#include "metrics.h"
+
+using namespace std;
+
+static const size_t maxLineLength = 65536;
+static const size_t maxPendingOutput = 1 << 20; //stop reading commands of a client not reading its answers
+
+static sockaddr_un socketAddress(const string& path) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address.sun_path))
+    throw runtime_error("invalid socket path \""+path+"\", it has to be shorter than "+to_string(sizeof(address.sun_path))+" characters");
+  memcpy(address.sun_path, path.c_str(), path.size());
+  return address;
+}
+
+QueryServer::QueryServer(const string& socketPath, const TreeIndex& index)
+  : p_socketPath(socketPath),
+    p_index(index) {
+  sockaddr_un address = socketAddress(socketPath);
+
+  //a socket file nobody is listening on is left over by a process that died, anything else must not be replaced
+  int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (probe < 0)
+    throw runtime_error("failed to create socket: "+worker::errnoString());
+  bool inUse = connect(probe, (sockaddr*)&address, sizeof(address)) == 0;
+  close(probe);
+  if (inUse)
+    throw runtime_error("socket "+socketPath+" is in use by another process");
+  if (unlink(socketPath.c_str()) && errno != ENOENT)
+    throw runtime_error("failed to remove stale socket "+socketPath+": "+worker::errnoString());
+
+  p_listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (p_listener < 0)
+    throw runtime_error("failed to create socket: "+worker::errnoString());
+  if (bind(p_listener, (sockaddr*)&address, sizeof(address)) || listen(p_listener, 64)) {
+    string error = worker::errnoString();
+    close(p_listener);
+    throw runtime_error("failed to listen on "+socketPath+": "+error);
+  }
+  if (pipe2(p_wakePipe, O_NONBLOCK | O_CLOEXEC)) {
+    close(p_listener);
+    unlink(socketPath.c_str());
+    throw runtime_error("failed to create wake pipe for query server");
+  }
+  p_thread = thread(&QueryServer::loop, this);
+  LOG(logInfo) << "Answering queries on " << socketPath;
+}
+
+QueryServer::~QueryServer() {
+  char c = 0;
+  if (write(p_wakePipe[1], &c, 1) < 0) {} //pipe full: the thread is going to wake up anyway
+  p_thread.join();
+  for (size_t i = 0; i < p_clients.size(); i++)
+    close(p_clients[i].fd);
+  close(p_listener);
+  close(p_wakePipe[0]);
+  close(p_wakePipe[1]);
+  unlink(p_socketPath.c_str());
+}
+
+void QueryServer::loop() {
+  vector<pollfd> fds;
+  while (true) {
+    fds.assign(2, pollfd());
+    fds[0].fd = p_wakePipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = p_listener;
+    fds[1].events = POLLIN;
+    for (size_t i = 0; i < p_clients.size(); i++) {
+      pollfd fd = { p_clients[i].fd, 0, 0 };
+      if (!p_clients[i].closing && p_clients[i].out.size() < maxPendingOutput)
+        fd.events |= POLLIN;
+      if (!p_clients[i].out.empty())
+        fd.events |= POLLOUT;
+      fds.push_back(fd);
+    }
+    if (poll(&fds[0], fds.size(), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      LOG(logError) << "Query server failed to poll: " << worker::errnoString();
+      return;
+    }
+    if (fds[0].revents) //woken up by the destructor
+      return;
+    if (fds[1].revents & POLLIN)
+      accept();
+
+    //clients accepted just now come after fds and are polled next time
+    size_t polled = fds.size()-2;
+    vector<client_t> remaining;
+    for (size_t i = 0; i < p_clients.size(); i++) {
+      client_t& client = p_clients[i];
+      short events = i < polled ? fds[i+2].revents : 0;
+      bool keep = true;
+      if (events & POLLIN)
+        keep = receive(client);
+      else if (events & (POLLHUP | POLLERR))
+        client.closing = true;
+      if (keep && (events & POLLOUT))
+        keep = send(client);
+      if (keep && client.closing && client.out.empty())
+        keep = false;
+      if (keep)
+        remaining.push_back(std::move(client));
+      else {
+        LOG(logDebug) << "Query client " << client.fd << " disconnected";
+        close(client.fd);
+      }
+    }
+    p_clients.swap(remaining);
+  }
+}
+
+void QueryServer::accept() {
+  while (true) {
+    int fd = accept4(p_listener, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+        LOG(logWarning) << "Query server failed to accept a client: " << worker::errnoString();
+      }
+      return;
+    }
+    LOG(logDebug) << "Query client " << fd << " connected";
+    client_t client = { fd, string(), string(), false };
+    p_clients.push_back(client);
+  }
+}
+
+bool QueryServer::receive(client_t& client) {
+  char buffer[16384];
+  ssize_t n = read(client.fd, buffer, sizeof(buffer));
+  if (n < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  if (n == 0) {
+    client.closing = true;
+    return true;
+  }
+  client.in.append(buffer, n);
+  size_t start = 0, end;
+  while ((end = client.in.find('\n', start)) != string::npos) {
+    size_t length = end-start;
+    if (length && client.in[end-1] == '\r')
+      length--;
+    if (length)
+      client.out += answer(client.in.substr(start, length))+'\n';
+    start = end+1;
+  }
+  client.in.erase(0, start);
+  if (client.in.size() > maxLineLength) {
+    client.out += "{\"error\":\"command too long\"}\n";
+    client.in.clear();
+    client.closing = true;
+  }
+  return send(client);
+}
+
+bool QueryServer::send(client_t& client) {
+  while (!client.out.empty()) {
+    ssize_t n = ::send(client.fd, client.out.data(), client.out.size(), MSG_NOSIGNAL);
+    if (n < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    client.out.erase(0, n);
+  }
+  return true;
+}
+
+static void writeEntry(ostringstream& os, const TreeIndex::entry_t& entry) {
+  os << "{\"id\":" << entry.id << ",\"parent\":" << entry.parent << ",\"name\":" << worker::jsonString(entry.name)
+     << ",\"type\":\"" << (entry.directory ? "directory" : "file") << "\",\"size\":" << entry.size << ",\"mtime\":" << entry.mtime;
+  if (entry.directory)
+    os << ",\"files\":" << entry.files << ",\"directories\":" << entry.directories;
+  else if (!entry.hash.empty())
+    os << ",\"hash\":" << worker::jsonString(entry.hash);
+  os << '}';
+}
+
+static string error(const string& message) {
+  return "{\"error\":"+worker::jsonString(message)+'}';
+}
+
+string QueryServer::answer(const string& command) const {
+  size_t space = command.find(' ');
+  const string verb = command.substr(0, space);
+  const string argument = space == string::npos ? string() : command.substr(space+1);
+  static Histogram& lookups = METRICS.histogram("fscrawl_daemon_query_seconds", "Time to answer a query of the daemon", Metrics::label("command", "lookup"));
+  static Histogram& paths = METRICS.histogram("fscrawl_daemon_query_seconds", "Time to answer a query of the daemon", Metrics::label("command", "path"));
+  static Histogram& children = METRICS.histogram("fscrawl_daemon_query_seconds", "Time to answer a query of the daemon", Metrics::label("command", "children"));
+  static Histogram& sizes = METRICS.histogram("fscrawl_daemon_query_seconds", "Time to answer a query of the daemon", Metrics::label("command", "size"));
+
+  ostringstream os;
+  if (verb == "lookup" || verb == "size") {
+    ScopedTimer timer(verb == "lookup" ? lookups : sizes);
+    TreeIndex::entry_t entry;
+    if (!p_index.lookup(argument, entry))
+      return error("no such path");
+    if (verb == "lookup")
+      writeEntry(os, entry);
+    else
+      os << "{\"size\":" << entry.size << ",\"files\":" << entry.files << ",\"directories\":" << entry.directories << '}';
+  } else if (verb == "path") {
+    ScopedTimer timer(paths);
+    istringstream arguments(argument);
+    string type;
+    uint64_t id;
+    if (!(arguments >> type >> id) || (type != "directory" && type != "file"))
+      return error("usage: path directory|file ID");
+    string path;
+    if (!p_index.path(id, type == "directory", path))
+      return error("no such "+type);
+    os << "{\"path\":" << worker::jsonString(path) << '}';
+  } else if (verb == "children") {
+    ScopedTimer timer(children);
+    vector<TreeIndex::entry_t> entries;
+    if (!p_index.children(argument, entries))
+      return error("no such directory");
+    os << "{\"entries\":[";
+    for (size_t i = 0; i < entries.size(); i++) {
+      if (i)
+        os << ',';
+      writeEntry(os, entries[i]);
+    }
+    os << "]}";
+  } else
+    return error("unknown command \""+verb+"\", use lookup, path, children or size");
+  return os.str();
+}
@@ -0,0 +1,50 @@
+#ifndef QUERY_SERVER_H
+#define QUERY_SERVER_H
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tree_index.h"
+
+//Answers queries on a TreeIndex over a Unix domain socket. Clients send one command per line and get one JSON object
+//per line back, in order:
+//  lookup PATH              entry of a path below the root
+//  path directory|file ID   path of an id
+//  children PATH            entries directly below a directory
+//  size PATH                size, files and directories of the subtree at path
+//Failed queries are answered with {"error":"..."}. All clients are served by a single poll thread, an answer never
+//waits for the database.
+class QueryServer {
+public:
+  //listens on socketPath, replacing a stale socket file; throws runtime_error if it is in use or can not be created
+  QueryServer(const std::string& socketPath, const TreeIndex& index);
+  //disconnects all clients and removes the socket file
+  ~QueryServer();
+
+  //answer to a single command line, without the trailing newline
+  std::string answer(const std::string& command) const;
+
+private:
+  struct client_t {
+    int fd;
+    std::string in;
+    std::string out;
+    bool closing; //the client shut down its side, close once out is sent
+  };
+
+  void loop();
+  void accept();
+  //reads and answers all complete lines, returns false if the client has to be dropped
+  bool receive(client_t& client);
+  bool send(client_t& client);
+
+  std::string p_socketPath;
+  const TreeIndex& p_index;
+  int p_listener;
+  int p_wakePipe[2];
+  std::vector<client_t> p_clients; //owned by the poll thread
+  std::thread p_thread;
+};
+
+#endif //QUERY_SERVER_H
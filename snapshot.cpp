@@ -0,0 +1,410 @@
+#include "snapshot.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "snapshots are mapped as little endian"
+#endif
+
+using namespace std;
+
+const char Snapshot::magic[8] = { 'F', 'S', 'C', 'S', 'N', 'A', 'P', '\0' };
+const uint32_t Snapshot::none;
+const uint32_t Snapshot::version;
+
+static atomic<uint64_t> snapshotSerial(0);
+
+//last name decoded by this thread, per snapshot
+struct nameCache_t {
+  uint64_t serial;
+  uint32_t node;
+  uint64_t end; //position in the name blob after node
+  string name;
+};
+static const unsigned int nameCacheSlots = 4; //a diff reads two snapshots alternately
+static thread_local nameCache_t nameCaches[nameCacheSlots];
+static thread_local unsigned int nameCacheNext = 0;
+
+static void appendVarint(string& buffer, uint64_t value) {
+  while (value >= 0x80) {
+    buffer += (char)(value | 0x80);
+    value >>= 7;
+  }
+  buffer += (char)value;
+}
+
+static uint64_t readVarint(const char* data, uint64_t end, uint64_t& pos) {
+  uint64_t value = 0;
+  for (unsigned int shift = 0; shift < 64; shift += 7) {
+    if (pos >= end)
+      break;
+    unsigned char byte = data[pos++];
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return value;
+  }
+  throw runtime_error("corrupt name in snapshot");
+}
+
+Snapshot::Snapshot(const string& file) : p_data(0), p_length(0), p_header(0), p_serial(++snapshotSerial) {
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    throw runtime_error("failed to open snapshot "+file+": "+strerror(errno));
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(header_t)) {
+    close(fd);
+    throw runtime_error("snapshot "+file+" is truncated");
+  }
+  void* data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); //the mapping keeps the file open
+  if (data == MAP_FAILED)
+    throw runtime_error("failed to map snapshot "+file+": "+strerror(errno));
+  p_data = (const char*)data;
+  p_length = st.st_size;
+  p_header = (const header_t*)p_data;
+
+  const char* error = 0;
+  if (memcmp(p_header->magic, magic, sizeof(magic)))
+    error = "not a snapshot";
+  else if (p_header->version != version)
+    error = "unsupported snapshot version";
+  else if (p_header->nodes == 0 || p_header->restartInterval == 0 || p_header->hashType >= Hasher::hashTypeCount ||
+           p_header->hashWidth != Hasher::digestSize((Hasher::hashType_t)p_header->hashType))
+    error = "invalid snapshot header";
+  for (int s = 0; !error && s < sectionCount; s++) {
+    uint64_t offset = p_header->offsets[s];
+    if (offset % 8 || offset > p_length || sectionSize((section_t)s, *p_header) > p_length-offset)
+      error = "snapshot is truncated";
+  }
+  //the accessors index with the links as they are, so a corrupt file must not get past here
+  const section_t links[] = { secParent, secFirstChild, secNextSibling };
+  for (int l = 0; !error && l < 3; l++) {
+    const uint32_t* link = section<uint32_t>(links[l]);
+    for (uint32_t node = 0; node < p_header->nodes; node++)
+      if (link[node] >= p_header->nodes && link[node] != none) {
+        error = "corrupt link in snapshot";
+        break;
+      }
+  }
+  if (error) {
+    munmap(data, p_length);
+    throw runtime_error(string(error)+": "+file);
+  }
+  madvise(data, p_length, MADV_WILLNEED); //traversals touch most of the file anyway
+  LOG(logDebug) << "mapped snapshot " << file << " with " << p_header->nodes << " nodes";
+}
+
+Snapshot::~Snapshot() {
+  munmap((void*)p_data, p_length);
+}
+
+uint64_t Snapshot::sectionSize(section_t section, const header_t& header) {
+  switch (section) {
+    case secNameIndex : return ((uint64_t)header.nodes+header.restartInterval-1)/header.restartInterval*8;
+    case secNames : return header.nameBytes;
+    case secFlags : return header.nodes;
+    case secId :
+    case secSize :
+    case secMtime :
+    case secLatest : return (uint64_t)header.nodes*8;
+    case secHashes : return (uint64_t)header.nodes*header.hashWidth;
+    default : return (uint64_t)header.nodes*4;
+  }
+}
+
+template<typename T> const T* Snapshot::section(section_t section) const {
+  return (const T*)(p_data+p_header->offsets[section]);
+}
+
+uint32_t Snapshot::nodes() const {
+  return p_header->nodes;
+}
+
+time_t Snapshot::created() const {
+  return p_header->created;
+}
+
+Hasher::hashType_t Snapshot::hashType() const {
+  return (Hasher::hashType_t)p_header->hashType;
+}
+
+uint32_t Snapshot::parent(uint32_t node) const {
+  return section<uint32_t>(secParent)[node];
+}
+
+uint32_t Snapshot::firstChild(uint32_t node) const {
+  return section<uint32_t>(secFirstChild)[node];
+}
+
+uint32_t Snapshot::nextSibling(uint32_t node) const {
+  return section<uint32_t>(secNextSibling)[node];
+}
+
+uint64_t Snapshot::id(uint32_t node) const {
+  return section<uint64_t>(secId)[node];
+}
+
+bool Snapshot::isDirectory(uint32_t node) const {
+  return section<uint8_t>(secFlags)[node] & flagDirectory;
+}
+
+uint64_t Snapshot::size(uint32_t node) const {
+  return section<uint64_t>(secSize)[node];
+}
+
+time_t Snapshot::mtime(uint32_t node) const {
+  return section<int64_t>(secMtime)[node];
+}
+
+uint32_t Snapshot::entries(uint32_t node) const {
+  return section<uint32_t>(secEntries)[node];
+}
+
+time_t Snapshot::latest(uint32_t node) const {
+  return section<int64_t>(secLatest)[node];
+}
+
+string Snapshot::name(uint32_t node) const {
+  const uint32_t interval = p_header->restartInterval;
+  const char* names = section<char>(secNames);
+  const uint64_t end = p_header->nameBytes;
+  nameCache_t* cache = 0;
+  for (unsigned int i = 0; i < nameCacheSlots && !cache; i++)
+    if (nameCaches[i].serial == p_serial)
+      cache = &nameCaches[i];
+  if (!cache) {
+    cache = &nameCaches[nameCacheNext++%nameCacheSlots];
+    cache->serial = p_serial;
+    cache->node = none;
+  }
+  uint32_t current;
+  uint64_t pos;
+  if (cache->node != none && node > cache->node && node/interval == cache->node/interval) { //continue from the last name
+    current = cache->node+1;
+    pos = cache->end;
+  } else {
+    current = node-node%interval;
+    pos = section<uint64_t>(secNameIndex)[node/interval];
+    cache->name.clear();
+  }
+  cache->node = none; //in case the name is corrupt
+  for (; current <= node; current++) {
+    uint64_t shared = current%interval ? readVarint(names, end, pos) : 0;
+    uint64_t length = readVarint(names, end, pos);
+    if (shared > cache->name.length() || length > end-pos)
+      throw runtime_error("corrupt name in snapshot");
+    cache->name.resize(shared);
+    cache->name.append(names+pos, length);
+    pos += length;
+  }
+  cache->node = node;
+  cache->end = pos;
+  return cache->name;
+}
+
+string Snapshot::hash(uint32_t node) const {
+  if (!(section<uint8_t>(secFlags)[node] & flagHash))
+    return string();
+  return Hasher::toPrinted(string(section<char>(secHashes)+(uint64_t)node*p_header->hashWidth, p_header->hashWidth));
+}
+
+uint32_t Snapshot::lookup(const string& path) const {
+  uint32_t node = 0;
+  size_t start = 0;
+  while (start < path.length()) {
+    size_t end = path.find('/', start);
+    if (end == string::npos)
+      end = path.length();
+    if (end > start) { //skip empty components of duplicate slashes
+      string component = path.substr(start, end-start);
+      uint32_t child = firstChild(node);
+      while (child != none && name(child) != component)
+        child = nextSibling(child);
+      if (child == none)
+        return none;
+      node = child;
+    }
+    start = end+1;
+  }
+  return node;
+}
+
+SnapshotWriter::SnapshotWriter() {}
+
+void SnapshotWriter::add(uint64_t id, uint64_t parent, bool directory, const string& name, uint64_t size, time_t mtime, const string& hash) {
+  entry_t entry = { .id = id, .parent = parent, .directory = directory, .name = name, .size = size, .mtime = mtime, .hash = hash };
+  p_entries.push_back(entry);
+}
+
+uint32_t SnapshotWriter::write(const string& file, uint64_t root) {
+  //siblings sorted by name, directories of the same name as a file first
+  vector<uint32_t> order(p_entries.size());
+  for (uint32_t i = 0; i < order.size(); i++)
+    order[i] = i;
+  sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+    const entry_t& x = p_entries[a];
+    const entry_t& y = p_entries[b];
+    if (x.parent != y.parent)
+      return x.parent < y.parent;
+    int cmp = x.name.compare(y.name);
+    return cmp ? cmp < 0 : x.directory > y.directory;
+  });
+  unordered_map< uint64_t, pair<uint32_t,uint32_t> > children; //parent -> range in order
+  for (uint32_t i = 0; i < order.size(); ) {
+    uint64_t parent = p_entries[order[i]].parent;
+    uint32_t first = i;
+    while (i < order.size() && p_entries[order[i]].parent == parent)
+      i++;
+    children[parent] = make_pair(first, i);
+  }
+
+  //breadth first, so the children of every node are adjacent
+  vector<uint32_t> nodes(1, Snapshot::none); //entry of every node, none for the root
+  vector<uint32_t> parents(1, Snapshot::none), firstChildren, nextSiblings;
+  unordered_set<uint64_t> visited;
+  visited.insert(root);
+  for (uint32_t node = 0; node < nodes.size(); node++) {
+    firstChildren.push_back(Snapshot::none);
+    nextSiblings.push_back(Snapshot::none);
+    if (node > 0 && !p_entries[nodes[node]].directory)
+      continue;
+    uint64_t dirId = node ? p_entries[nodes[node]].id : root;
+    if (node > 0 && !visited.insert(dirId).second) { //loop in the tree, verifyTree will clean it up
+      LOG(logWarning) << "Directory " << dirId << " is part of a loop, skipping it";
+      continue;
+    }
+    unordered_map< uint64_t, pair<uint32_t,uint32_t> >::const_iterator range = children.find(dirId);
+    if (range == children.end())
+      continue;
+    firstChildren.back() = nodes.size();
+    for (uint32_t i = range->second.first; i < range->second.second; i++) {
+      nodes.push_back(order[i]);
+      parents.push_back(node);
+    }
+  }
+  for (uint32_t node = 1; node+1 < nodes.size(); node++)
+    if (parents[node+1] == parents[node])
+      nextSiblings[node] = node+1;
+  const uint32_t count = nodes.size();
+
+  //the most common hash type wins, files hashed differently are written without a hash
+  unsigned int hashTypes[Hasher::hashTypeCount] = { 0 };
+  for (uint32_t node = 1; node < count; node++)
+    hashTypes[Hasher::printedHashType(p_entries[nodes[node]].hash)]++;
+  Hasher::hashType_t hashType = Hasher::noHash;
+  for (int type = Hasher::md5; type < Hasher::hashTypeCount; type++)
+    if (hashTypes[type] > hashTypes[hashType] || (hashType == Hasher::noHash && hashTypes[type] > 0))
+      hashType = (Hasher::hashType_t)type;
+  const size_t hashWidth = Hasher::digestSize(hashType);
+
+  Snapshot::header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, Snapshot::magic, sizeof(header.magic));
+  header.version = Snapshot::version;
+  header.nodes = count;
+  header.hashType = hashType;
+  header.hashWidth = hashWidth;
+  header.restartInterval = 16;
+  header.created = time(0);
+
+  string names;
+  vector<uint64_t> nameIndex;
+  vector<uint64_t> ids(count);
+  vector<uint8_t> flags(count);
+  vector<uint64_t> sizes(count);
+  vector<int64_t> mtimes(count);
+  string hashes(count*hashWidth, '\0');
+  string previous, binary;
+  uint32_t skippedHashes = 0;
+  for (uint32_t node = 0; node < count; node++) {
+    static const entry_t rootEntry = { .id = 0, .parent = 0, .directory = true, .name = string(), .size = 0, .mtime = 0, .hash = string() };
+    const entry_t& e = node ? p_entries[nodes[node]] : rootEntry;
+    if (node % header.restartInterval == 0) {
+      nameIndex.push_back(names.length());
+      appendVarint(names, e.name.length());
+      names += e.name;
+    } else {
+      size_t shared = 0;
+      while (shared < previous.length() && shared < e.name.length() && previous[shared] == e.name[shared])
+        shared++;
+      appendVarint(names, shared);
+      appendVarint(names, e.name.length()-shared);
+      names.append(e.name, shared, string::npos);
+    }
+    previous = e.name;
+    ids[node] = node ? e.id : root;
+    flags[node] = e.directory ? Snapshot::flagDirectory : 0;
+    sizes[node] = e.directory ? 0 : e.size;
+    mtimes[node] = e.mtime;
+    if (!e.directory && !e.hash.empty()) {
+      binary = Hasher::toBinary(e.hash);
+      if (Hasher::printedHashType(e.hash) == hashType && !binary.empty()) {
+        flags[node] |= Snapshot::flagHash;
+        hashes.replace(node*hashWidth, hashWidth, binary);
+      } else {
+        skippedHashes++;
+      }
+    }
+  }
+  header.nameBytes = names.length();
+
+  //children are numbered after their parents, so a single backwards pass sums up every subtree
+  vector<uint32_t> entries(count, 0);
+  vector<int64_t> latest(mtimes);
+  for (uint32_t node = count-1; node > 0; node--) {
+    uint32_t parent = parents[node];
+    sizes[parent] += sizes[node];
+    entries[parent] += entries[node]+1;
+    latest[parent] = max(latest[parent], latest[node]);
+  }
+
+  if (skippedHashes > 0) {
+    LOG(logWarning) << "Skipped " << skippedHashes << " hashes that are no " << Hasher::hashTypeToString(hashType) << " hashes";
+  }
+
+  //written next to the destination and renamed, so readers never map a half written snapshot
+  string temporary = file+".tmp";
+  ofstream out(temporary.c_str(), ios::binary | ios::trunc);
+  out.write((const char*)&header, sizeof(header));
+  auto put = [&](Snapshot::section_t section, const void* data, size_t length) {
+    static const char padding[8] = { 0 };
+    out.write(padding, (8-out.tellp()%8)%8);
+    header.offsets[section] = out.tellp();
+    out.write((const char*)data, length);
+  };
+  put(Snapshot::secNameIndex, nameIndex.data(), nameIndex.size()*sizeof(uint64_t));
+  put(Snapshot::secNames, names.data(), names.length());
+  put(Snapshot::secParent, parents.data(), count*sizeof(uint32_t));
+  put(Snapshot::secFirstChild, firstChildren.data(), count*sizeof(uint32_t));
+  put(Snapshot::secNextSibling, nextSiblings.data(), count*sizeof(uint32_t));
+  put(Snapshot::secId, ids.data(), count*sizeof(uint64_t));
+  put(Snapshot::secFlags, flags.data(), count);
+  put(Snapshot::secSize, sizes.data(), count*sizeof(uint64_t));
+  put(Snapshot::secMtime, mtimes.data(), count*sizeof(int64_t));
+  put(Snapshot::secEntries, entries.data(), count*sizeof(uint32_t));
+  put(Snapshot::secLatest, latest.data(), count*sizeof(int64_t));
+  put(Snapshot::secHashes, hashes.data(), hashes.length());
+  out.seekp(0);
+  out.write((const char*)&header, sizeof(header));
+  out.close();
+  if (out.fail() || rename(temporary.c_str(), file.c_str())) {
+    unlink(temporary.c_str());
+    throw runtime_error("failed to write snapshot "+file+": "+strerror(errno));
+  }
+  return count-1;
+}
@@ -0,0 +1,98 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <time.h>
+
+#include "hasher.h"
+
+//Read-only image of a catalog tree in a single file, used through mmap without any parsing.
+//Node 0 is the exported root, its children are the top level entries. Nodes are numbered breadth first and
+//siblings are adjacent and sorted by name, so the names can be front coded: every restartInterval-th name is
+//stored in full, the others as the length of the prefix shared with the previous name plus the remaining bytes.
+//All integers are little endian and every section is 8 byte aligned, so the file can be copied between hosts.
+//Every directory carries aggregates of its subtree (total size, number of entries, latest mtime), so comparisons of
+//two snapshots can skip unchanged subtrees without descending into them.
+class Snapshot {
+public:
+  static const uint32_t none = 0xffffffff;
+  static const uint32_t version = 3;
+
+  //maps file, throws runtime_error if it is no valid snapshot
+  Snapshot(const std::string& file);
+  ~Snapshot();
+
+  uint32_t nodes() const;
+  time_t created() const;
+  Hasher::hashType_t hashType() const;
+
+  uint32_t parent(uint32_t node) const;
+  uint32_t firstChild(uint32_t node) const;
+  uint32_t nextSibling(uint32_t node) const;
+  uint64_t id(uint32_t node) const; //catalog id, directories and files are numbered separately
+  bool isDirectory(uint32_t node) const;
+  uint64_t size(uint32_t node) const; //of directories the sum of all files below
+  time_t mtime(uint32_t node) const;
+  uint32_t entries(uint32_t node) const; //number of files and directories below node
+  time_t latest(uint32_t node) const; //latest mtime of node and everything below
+  //decoding sequences of siblings is cheap, every thread caches the last name it decoded of each snapshot
+  std::string name(uint32_t node) const;
+  //hash as printed by the Hasher, empty if the file has none
+  std::string hash(uint32_t node) const;
+  //node of a slash separated path below the root, none if there is none
+  uint32_t lookup(const std::string& path) const;
+
+private:
+  friend class SnapshotWriter;
+  enum section_t { secNameIndex, secNames, secParent, secFirstChild, secNextSibling, secId, secFlags, secSize, secMtime, secEntries, secLatest, secHashes, sectionCount };
+  enum flag_t { flagDirectory = 1, flagHash = 2 };
+  struct header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t nodes;
+    uint32_t hashType;
+    uint32_t hashWidth; //bytes per hash
+    uint32_t restartInterval;
+    uint32_t reserved;
+    uint64_t created;
+    uint64_t nameBytes;
+    uint64_t offsets[sectionCount];
+  };
+  static const char magic[8];
+  //bytes of section for nodes entries
+  static uint64_t sectionSize(section_t section, const header_t& header);
+  template<typename T> const T* section(section_t section) const;
+
+  const char* p_data;
+  size_t p_length;
+  const header_t* p_header;
+  uint64_t p_serial; //tells the name caches of snapshots apart, even if one is mapped where another was before
+};
+
+//Collects the entries of a catalog and writes them as a Snapshot
+class SnapshotWriter {
+public:
+  SnapshotWriter();
+
+  void add(uint64_t id, uint64_t parent, bool directory, const std::string& name, uint64_t size, time_t mtime, const std::string& hash);
+  //writes the subtree below directory root (0 for the whole catalog) to file, replacing it atomically
+  //returns the number of entries written, throws runtime_error on failure
+  uint32_t write(const std::string& file, uint64_t root);
+
+private:
+  struct entry_t {
+    uint64_t id;
+    uint64_t parent;
+    bool directory;
+    std::string name;
+    uint64_t size;
+    int64_t mtime;
+    std::string hash;
+  };
+  std::vector<entry_t> p_entries;
+};
+
+#endif //SNAPSHOT_H
@@ -0,0 +1 @@
+ALTER TABLE fscrawl_files ADD last_verified DATETIME DEFAULT NULL, ADD INDEX(last_verified);
@@ -0,0 +1,134 @@
+-- Migration to 64 bit ids, binary hashes and unique (parent, name) keys.
+-- Stop every fscrawl process using the tables (crawls, watches and daemons) before running it, changes made while
+-- the rows are copied would be lost. The rows are copied into new tables in chunks, then the tables are swapped
+-- atomically. The old tables remain as *_v2 until dropped by hand.
+-- Nothing is copied if a directory contains two entries of the same name, which the new unique key does not allow.
+-- Those are listed instead, remove the extra rows and run it again.
+-- Set the table names below (--dir-table, --file-table and --dup-table), then run it with the mysql client, e.g.
+-- mysql fscrawl < update-3.2-to-3.3.sql
+
+SET @dir_table = 'fscrawl_directories';
+SET @file_table = 'fscrawl_files';
+SET @dup_table = 'fscrawl_duplicates';
+
+DROP FUNCTION IF EXISTS fscrawl_hash_digest;
+DROP PROCEDURE IF EXISTS fscrawl_run_v3;
+DROP PROCEDURE IF EXISTS fscrawl_check_v3;
+DROP PROCEDURE IF EXISTS fscrawl_copy_v3;
+DROP PROCEDURE IF EXISTS fscrawl_migrate_v3;
+
+DELIMITER //
+
+-- TTH hashes are printed as 39 characters of base32, md5 and sha1 as hex
+CREATE FUNCTION fscrawl_hash_digest(hash VARCHAR(40)) RETURNS VARBINARY(24) DETERMINISTIC
+BEGIN
+  DECLARE digest VARBINARY(24) DEFAULT '';
+  DECLARE buffer INT UNSIGNED DEFAULT 0;
+  DECLARE bits INT DEFAULT 0;
+  DECLARE i INT DEFAULT 1;
+  IF hash IS NULL OR CHAR_LENGTH(hash) <> 39 THEN
+    RETURN UNHEX(hash);
+  END IF;
+  WHILE i <= 39 DO
+    SET buffer = (buffer << 5) | (LOCATE(LOWER(SUBSTRING(hash, i, 1)), 'abcdefghijklmnopqrstuvwxyz234567') - 1);
+    SET bits = bits + 5;
+    IF bits >= 8 THEN
+      SET bits = bits - 8;
+      SET digest = CONCAT(digest, CHAR((buffer >> bits) & 255));
+      SET buffer = buffer & ((1 << bits) - 1);
+    END IF;
+    SET i = i + 1;
+  END WHILE;
+  RETURN digest;
+END//
+
+CREATE PROCEDURE fscrawl_run_v3(sqlText TEXT)
+BEGIN
+  SET @fscrawl_statement = sqlText;
+  PREPARE s FROM @fscrawl_statement;
+  EXECUTE s;
+  DEALLOCATE PREPARE s;
+END//
+
+-- lists the names occurring more than once in a directory and fails if there are any
+CREATE PROCEDURE fscrawl_check_v3(tableName VARCHAR(64))
+BEGIN
+  DECLARE duplicateNames BIGINT UNSIGNED;
+  SET @fscrawl_duplicates = CONCAT('FROM ', tableName, ' GROUP BY COALESCE(parent, 0), name HAVING COUNT(*) > 1');
+  CALL fscrawl_run_v3(CONCAT('SELECT COUNT(*) INTO @fscrawl_groups FROM (SELECT 1 ', @fscrawl_duplicates, ') d'));
+  SET duplicateNames = @fscrawl_groups;
+  IF duplicateNames > 0 THEN
+    CALL fscrawl_run_v3(CONCAT('SELECT \'', tableName, '\' AS \'table\', COALESCE(parent, 0) AS parent, name, ',
+                               'COUNT(*) AS entries, GROUP_CONCAT(id ORDER BY id) AS ids ', @fscrawl_duplicates));
+    SET @fscrawl_message = CONCAT(duplicateNames, ' names occur more than once in a directory of ', tableName, ', nothing was migrated');
+    SIGNAL SQLSTATE '45000' SET MESSAGE_TEXT = @fscrawl_message;
+  END IF;
+END//
+
+-- copies in chunks of ids, so no statement locks the old tables for long
+CREATE PROCEDURE fscrawl_copy_v3(tableName VARCHAR(64), columnList TEXT, source TEXT, chunk INT UNSIGNED)
+BEGIN
+  DECLARE start BIGINT UNSIGNED DEFAULT 0;
+  DECLARE last BIGINT UNSIGNED;
+  CALL fscrawl_run_v3(CONCAT('SELECT COALESCE(MAX(id), 0) INTO @fscrawl_last FROM ', tableName));
+  SET last = @fscrawl_last;
+  WHILE start <= last DO
+    CALL fscrawl_run_v3(CONCAT('INSERT INTO ', tableName, '_v3 (', columnList, ') SELECT ', source, ' FROM ', tableName,
+                               ' WHERE id >= ', start, ' AND id < ', start+chunk));
+    SET start = start+chunk;
+  END WHILE;
+END//
+
+CREATE PROCEDURE fscrawl_migrate_v3(dirTable VARCHAR(64), fileTable VARCHAR(64), dupTable VARCHAR(64), chunk INT UNSIGNED)
+BEGIN
+  CALL fscrawl_check_v3(dirTable);
+  CALL fscrawl_check_v3(fileTable);
+
+  -- left over by a run that failed while copying
+  CALL fscrawl_run_v3(CONCAT('DROP TABLE IF EXISTS ', dirTable, '_v3, ', fileTable, '_v3'));
+
+  CALL fscrawl_run_v3(CONCAT('CREATE TABLE ', dirTable, '_v3 ',
+    '(id BIGINT UNSIGNED NOT NULL AUTO_INCREMENT, ',
+    'name VARCHAR(255) NOT NULL, ',
+    'parent BIGINT UNSIGNED NOT NULL, ',
+    'size BIGINT UNSIGNED, ',
+    'date DATETIME DEFAULT NULL, ',
+    'PRIMARY KEY (id), ',
+    'UNIQUE KEY parent_name (parent, name)) ',
+    'DEFAULT CHARACTER SET utf8 ',
+    'COLLATE utf8_bin'));
+  CALL fscrawl_run_v3(CONCAT('CREATE TABLE ', fileTable, '_v3 ',
+    '(id BIGINT UNSIGNED NOT NULL AUTO_INCREMENT, ',
+    'name VARCHAR(255) NOT NULL, ',
+    'parent BIGINT UNSIGNED NOT NULL, ',
+    'size BIGINT UNSIGNED, ',
+    'date DATETIME DEFAULT NULL, ',
+    'hash VARBINARY(24) DEFAULT NULL, ',
+    'last_verified DATETIME DEFAULT NULL, ',
+    'PRIMARY KEY (id), ',
+    'UNIQUE KEY parent_name (parent, name), ',
+    'INDEX(last_verified)) ',
+    'DEFAULT CHARACTER SET utf8 ',
+    'COLLATE utf8_bin'));
+
+  CALL fscrawl_copy_v3(dirTable, 'id, name, parent, size, date',
+                       'id, name, COALESCE(parent, 0), size, date', chunk);
+  CALL fscrawl_copy_v3(fileTable, 'id, name, parent, size, date, hash, last_verified',
+                       'id, name, COALESCE(parent, 0), size, date, fscrawl_hash_digest(hash), last_verified', chunk);
+
+  CALL fscrawl_run_v3(CONCAT('RENAME TABLE ', dirTable, ' TO ', dirTable, '_v2, ', dirTable, '_v3 TO ', dirTable, ', ',
+                             fileTable, ' TO ', fileTable, '_v2, ', fileTable, '_v3 TO ', fileTable));
+
+  -- recreated with 64 bit ids by the next --duplicates run
+  CALL fscrawl_run_v3(CONCAT('DROP TABLE IF EXISTS ', dupTable));
+END//
+
+DELIMITER ;
+
+CALL fscrawl_migrate_v3(@dir_table, @file_table, @dup_table, 10000);
+
+DROP PROCEDURE fscrawl_migrate_v3;
+DROP PROCEDURE fscrawl_copy_v3;
+DROP PROCEDURE fscrawl_check_v3;
+DROP PROCEDURE fscrawl_run_v3;
+DROP FUNCTION fscrawl_hash_digest;
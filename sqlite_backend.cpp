@@ -0,0 +1,329 @@
+#include "sqlite_backend.h"
+#include "logger.h"
+#include "worker.h"
+#include "sqlexception.h"
+
+#include <stdexcept>
+
+using namespace std;
+
+static SQLException sqliteError(const string& msg, sqlite3* db) {
+  return SQLException(msg+": "+sqlite3_errmsg(db));
+}
+
+SqliteBackend::SqliteBackend(const string& file) : p_db(0), p_inTransaction(false), p_writes(0) {
+  //the connection is only used by the thread owning the worker, so sqlite does not need to serialize calls
+  if (sqlite3_open_v2(file.c_str(), &p_db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, 0) != SQLITE_OK) {
+    SQLException e = sqliteError("failed to open "+file, p_db);
+    sqlite3_close(p_db);
+    throw e;
+  }
+  sqlite3_busy_timeout(p_db, 5000); //another process may be writing to the catalog
+
+  //WAL lets readers (e.g. --print) run while a crawl writes, synchronous=NORMAL only syncs the WAL at checkpoints
+  query("PRAGMA journal_mode=WAL");
+  query("PRAGMA synchronous=NORMAL");
+  query("PRAGMA mmap_size="+to_string(mmapSize()));
+  query("PRAGMA cache_size=-"+to_string(cacheSize()/1024)); //negative values are KiB instead of pages
+  query("PRAGMA temp_store=MEMORY");
+  LOG(logDebug) << "opened sqlite database " << file << " with " << mmapSize() << " bytes mmap and " << cacheSize() << " bytes cache";
+}
+
+SqliteBackend::~SqliteBackend() {
+  try {
+    flush();
+  } catch (exception& e) {
+    LOG(logError) << "Failed to commit last changes: " << e.what();
+  }
+  sqlite3_close_v2(p_db); //statements still alive keep the connection open until they are finalized
+}
+
+sqlite3* SqliteBackend::getConnection() const {
+  return p_db;
+}
+
+uint64_t& SqliteBackend::mmapSize() {
+  static uint64_t size = 256ULL << 20;
+  return size;
+}
+
+uint64_t& SqliteBackend::cacheSize() {
+  static uint64_t size = 64ULL << 20;
+  return size;
+}
+
+unsigned int& SqliteBackend::batchSize() {
+  static unsigned int writes = 10000;
+  return writes;
+}
+
+const char* SqliteBackend::name() const {
+  return "sqlite";
+}
+
+bool SqliteBackend::query(const string& sql) {
+  char* error = 0;
+  if (sqlite3_exec(p_db, sql.c_str(), 0, 0, &error) != SQLITE_OK) {
+    string msg = error ? error : sqlite3_errmsg(p_db);
+    sqlite3_free(error);
+    throw SQLException("sqlite3_exec failed: "+msg);
+  }
+  return true; //there is no connection to lose
+}
+
+PreparedStatementWrapper* SqliteBackend::statement(worker* w, const string& sql, PreparedStatementWrapper::resultMode_t mode) {
+  return new SqliteStatement(w, this, sql, mode);
+}
+
+bool SqliteBackend::explain(const string& sql, vector<string>& plan) {
+  //the plan does not depend on the parameters, they stay unbound
+  const string explained = "EXPLAIN QUERY PLAN "+sql;
+  sqlite3_stmt* stmt;
+  if (sqlite3_prepare_v2(p_db, explained.c_str(), explained.length(), &stmt, 0) != SQLITE_OK)
+    throw sqliteError("sqlite3_prepare failed for \""+explained+'\"', p_db);
+  int ret;
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const unsigned char* detail = sqlite3_column_text(stmt, 3); //id, parent, notused, detail
+    plan.push_back(detail ? (const char*)detail : "");
+  }
+  sqlite3_finalize(stmt);
+  if (ret != SQLITE_DONE)
+    throw sqliteError("sqlite3_step failed for \""+explained+'\"', p_db);
+  return true;
+}
+
+void SqliteBackend::flush() {
+  if (!p_inTransaction)
+    return;
+  query("COMMIT");
+  p_inTransaction = false;
+  LOG(logDebug) << "committed " << p_writes << " writes";
+}
+
+void SqliteBackend::beginWrite() {
+  if (p_inTransaction)
+    return;
+  query("BEGIN");
+  p_inTransaction = true;
+  p_writes = 0;
+  p_transactionStart = chrono::steady_clock::now();
+}
+
+void SqliteBackend::endWrite() {
+  //every commit is a sync of the WAL, so a commit per statement would limit a crawl to a few hundred entries per second
+  if (++p_writes >= batchSize() || chrono::steady_clock::now()-p_transactionStart >= chrono::seconds(1))
+    flush();
+}
+
+void SqliteBackend::createTables(const string& directoryTable, const string& fileTable) {
+  //INTEGER PRIMARY KEY is the rowid, the default BINARY collation compares names bytewise like utf8_bin
+  query("CREATE TABLE IF NOT EXISTS "+directoryTable+" "
+        "(id INTEGER PRIMARY KEY, "
+        "name TEXT NOT NULL, "
+        "parent INTEGER NOT NULL, "
+        "size INTEGER, "
+        "date INTEGER DEFAULT NULL, "
+        "UNIQUE (parent, name))"); //its index serves lookups by name and listings by parent
+  query("CREATE TABLE IF NOT EXISTS "+fileTable+" "
+        "(id INTEGER PRIMARY KEY, "
+        "name TEXT NOT NULL, "
+        "parent INTEGER NOT NULL, "
+        "size INTEGER, "
+        "date INTEGER DEFAULT NULL, "
+        "hash TEXT DEFAULT NULL, "
+        "last_verified INTEGER DEFAULT NULL, "
+        "UNIQUE (parent, name))");
+  query("CREATE INDEX IF NOT EXISTS "+fileTable+"_last_verified ON "+fileTable+" (last_verified)");
+}
+
+void SqliteBackend::createDuplicatesTable(const string& table) {
+  query("CREATE TABLE IF NOT EXISTS "+table+" "
+        "(grp INTEGER NOT NULL, "
+        "id INTEGER NOT NULL, "
+        "size INTEGER, "
+        "hash TEXT DEFAULT NULL)");
+  query("CREATE INDEX IF NOT EXISTS "+table+"_grp ON "+table+" (grp)");
+  query("CREATE INDEX IF NOT EXISTS "+table+"_id ON "+table+" (id)");
+}
+
+void SqliteBackend::clearTable(const string& table) {
+  query("DELETE FROM "+table);
+}
+
+string SqliteBackend::unixTime(const string& column) const {
+  return column;
+}
+
+string SqliteBackend::fromUnixTime(const string& value) const {
+  return value;
+}
+
+SqliteStatement::SqliteStatement(worker* w, SqliteBackend* backend, const string& sql, resultMode_t mode)
+  : PreparedStatementWrapper(w, sql, mode),
+    p_backend(backend),
+    p_stmt(0),
+    p_readOnly(true),
+    p_active(false),
+    p_pending(-1),
+    p_rowValid(false)
+{}
+
+SqliteStatement::~SqliteStatement() {
+  close();
+}
+
+void SqliteStatement::close() {
+  if (p_stmt) {
+    sqlite3_finalize(p_stmt);
+    p_stmt = 0;
+  }
+  p_active = false;
+}
+
+void SqliteStatement::reprepare() {
+  close();
+
+  //the statements of the worker live as long as the connection, PERSISTENT keeps them out of the lookaside memory
+  if (sqlite3_prepare_v3(p_backend->getConnection(), p_query.c_str(), p_query.length(), SQLITE_PREPARE_PERSISTENT, &p_stmt, 0) != SQLITE_OK)
+    throw sqliteError("sqlite3_prepare failed for \""+p_query+'\"', p_backend->getConnection());
+  p_readOnly = sqlite3_stmt_readonly(p_stmt);
+  p_strings.assign(sqlite3_bind_parameter_count(p_stmt), string());
+  p_pending = -1;
+  p_rowValid = false;
+}
+
+void SqliteStatement::reset() {
+  if (p_active) {
+    sqlite3_reset(p_stmt);
+    p_active = false;
+  }
+  p_pending = -1;
+  p_rowValid = false;
+}
+
+bool SqliteStatement::execute() {
+  Timer timer(this, false);
+  reset();
+  if (!p_readOnly)
+    p_backend->beginWrite();
+
+  int ret = sqlite3_step(p_stmt);
+  p_active = true;
+  if (!p_readOnly)
+    while (ret == SQLITE_ROW) //results of a modifying statement are not used
+      ret = sqlite3_step(p_stmt);
+  if (ret != SQLITE_ROW && ret != SQLITE_DONE) {
+    SQLException e = sqliteError("sqlite3_step failed", p_backend->getConnection());
+    reset();
+    throw e;
+  }
+
+  if (!p_readOnly) {
+    reset(); //releases the statement before the transaction may be committed
+    p_backend->endWrite();
+  } else {
+    p_pending = ret;
+  }
+  return false;
+}
+
+int SqliteStatement::executeQuery() {
+  execute();
+  return 0;
+}
+
+string SqliteStatement::boundQuery() const {
+  char* sql = p_stmt ? sqlite3_expanded_sql(p_stmt) : 0;
+  if (!sql)
+    return p_query;
+  string result(sql);
+  sqlite3_free(sql);
+  return result;
+}
+
+void SqliteStatement::checkBind(int ret) {
+  if (ret == SQLITE_RANGE)
+    throw out_of_range("parameter index out of range");
+  if (ret != SQLITE_OK)
+    throw sqliteError("sqlite3_bind failed", p_backend->getConnection());
+}
+
+void SqliteStatement::setInt(unsigned int parameterIndex, int32_t value) {
+  reset();
+  checkBind(sqlite3_bind_int64(p_stmt, parameterIndex, value));
+}
+
+void SqliteStatement::setUInt(unsigned int parameterIndex, uint32_t value) {
+  reset();
+  checkBind(sqlite3_bind_int64(p_stmt, parameterIndex, value));
+}
+
+void SqliteStatement::setInt64(unsigned int parameterIndex, int64_t value) {
+  reset();
+  checkBind(sqlite3_bind_int64(p_stmt, parameterIndex, value));
+}
+
+void SqliteStatement::setUInt64(unsigned int parameterIndex, uint64_t value) {
+  reset();
+  checkBind(sqlite3_bind_int64(p_stmt, parameterIndex, value)); //sizes stay far below 2^63
+}
+
+void SqliteStatement::setNull(unsigned int parameterIndex, int sqlType __attribute__((unused))) {
+  reset();
+  checkBind(sqlite3_bind_null(p_stmt, parameterIndex));
+}
+
+void SqliteStatement::setString(unsigned int parameterIndex, const string& value) {
+  reset();
+  if (parameterIndex == 0 || parameterIndex > p_strings.size())
+    throw out_of_range("parameter index out of range");
+  string& str = p_strings[parameterIndex-1];
+  str.assign(value); //reuses the string's capacity
+  checkBind(sqlite3_bind_text(p_stmt, parameterIndex, str.data(), str.length(), SQLITE_STATIC));
+}
+
+void SqliteStatement::checkColumn(unsigned int index) const {
+  if (!p_rowValid)
+    throw out_of_range("no result row available");
+  if (index == 0 || index > (unsigned int)sqlite3_column_count(p_stmt))
+    throw out_of_range("field index out of range");
+}
+
+uint64_t SqliteStatement::getUInt64(unsigned int index) {
+  checkColumn(index);
+  return sqlite3_column_int64(p_stmt, index-1); //NULL is converted to 0
+}
+
+string SqliteStatement::getString(unsigned int index) {
+  checkColumn(index);
+  const unsigned char* text = sqlite3_column_text(p_stmt, index-1);
+  if (!text)
+    return string();
+  return string((const char*)text, sqlite3_column_bytes(p_stmt, index-1));
+}
+
+bool SqliteStatement::next() {
+  if (!p_active)
+    return false;
+  Timer timer(this, true);
+  int ret = p_pending;
+  p_pending = -1;
+  if (ret == -1)
+    ret = sqlite3_step(p_stmt);
+  if (ret == SQLITE_DONE) {
+    reset(); //stepping a finished statement again would restart it
+    return false;
+  }
+  if (ret != SQLITE_ROW)
+    throw sqliteError("sqlite3_step failed", p_backend->getConnection());
+  p_rowValid = true;
+  return true;
+}
+
+void SqliteStatement::release() {
+  reset();
+}
+
+uint64_t SqliteStatement::lastInsertId() {
+  return sqlite3_last_insert_rowid(p_backend->getConnection());
+}
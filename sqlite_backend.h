@@ -0,0 +1,91 @@
+#ifndef SQLITE_BACKEND_H
+#define SQLITE_BACKEND_H
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <sqlite3.h>
+
+#include "backend.h"
+
+//Embedded catalog in a single SQLite file. Timestamps are stored as unix time, writes are batched into transactions.
+class SqliteBackend : public Backend {
+public:
+  SqliteBackend(const std::string& file);
+  ~SqliteBackend(); //commits the open transaction
+
+  sqlite3* getConnection() const;
+
+  //bytes of the database file accessed through mmap instead of read calls
+  static uint64_t& mmapSize();
+  //bytes of the page cache
+  static uint64_t& cacheSize();
+  //writes per transaction, an open transaction is committed after one second as well
+  static unsigned int& batchSize();
+
+  const char* name() const;
+  bool query(const std::string& sql);
+  PreparedStatementWrapper* statement(worker* w, const std::string& sql, PreparedStatementWrapper::resultMode_t mode);
+  bool explain(const std::string& sql, std::vector<std::string>& plan);
+  void flush();
+
+  void createTables(const std::string& directoryTable, const std::string& fileTable);
+  void createDuplicatesTable(const std::string& table);
+  void clearTable(const std::string& table);
+
+  std::string unixTime(const std::string& column) const;
+  std::string fromUnixTime(const std::string& value) const;
+
+  //called by statements around every execution that modifies the database
+  void beginWrite();
+  void endWrite();
+
+private:
+  sqlite3* p_db;
+  bool p_inTransaction;
+  unsigned int p_writes; //writes in the open transaction
+  std::chrono::steady_clock::time_point p_transactionStart;
+};
+
+class SqliteStatement : public PreparedStatementWrapper {
+public:
+  SqliteStatement(worker* w, SqliteBackend* backend, const std::string& sql, resultMode_t mode);
+  ~SqliteStatement();
+
+  void reprepare();
+  void close();
+
+  bool execute();
+  int executeQuery();
+  std::string boundQuery() const;
+
+  void setInt(unsigned int parameterIndex, int32_t value);
+  void setUInt(unsigned int parameterIndex, uint32_t value);
+  void setInt64(unsigned int parameterIndex, int64_t value);
+  void setUInt64(unsigned int parameterIndex, uint64_t value);
+  void setNull(unsigned int parameterIndex, int sqlType);
+  void setString(unsigned int parameterIndex, const std::string& value);
+
+  uint64_t getUInt64(unsigned int index);
+  std::string getString(unsigned int index);
+  bool next();
+  void release();
+  uint64_t lastInsertId();
+
+private:
+  //parameters can only be bound while the statement is not running
+  void reset();
+  void checkBind(int ret);
+  void checkColumn(unsigned int index) const;
+
+  SqliteBackend* p_backend;
+  sqlite3_stmt* p_stmt;
+  std::vector<std::string> p_strings; //string parameters are bound without copying them into sqlite
+  bool p_readOnly;
+  bool p_active; //stepped since the last reset
+  int p_pending; //result of the step done by execute, not yet consumed by next, or -1
+  bool p_rowValid;
+};
+
+#endif //SQLITE_BACKEND_H
@@ -0,0 +1,188 @@
+#include "throttle.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+TokenBucket::TokenBucket()
+  : p_rate(0),
+    p_tokens(0),
+    p_last(chrono::steady_clock::now()) {
+}
+
+void TokenBucket::setRate(uint64_t rate) {
+  lock_guard<mutex> lock(p_mutex);
+  p_rate = rate;
+  p_tokens = rate;
+  p_last = chrono::steady_clock::now();
+}
+
+uint64_t TokenBucket::getRate() const {
+  return p_rate;
+}
+
+void TokenBucket::acquire(uint64_t tokens) {
+  if( p_rate == 0 ) //unlimited
+    return;
+
+  double wait;
+  {
+    lock_guard<mutex> lock(p_mutex);
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    p_tokens = min<double>(p_rate, p_tokens + chrono::duration<double>(now-p_last).count()*p_rate);
+    p_last = now;
+    p_tokens -= tokens; //may become negative, later callers have to wait for the debt as well
+    wait = p_tokens < 0 ? -p_tokens/p_rate : 0;
+  }
+  if( wait > 0 )
+    this_thread::sleep_for(chrono::duration<double>(wait));
+}
+
+IoThrottle::IoThrottle()
+  : p_adaptive(false),
+    p_maxReaders(1),
+    p_stallTarget(10),
+    p_allowedReaders(1),
+    p_readerLimit(0),
+    p_activeReaders(0),
+    p_monitorRunning(false) {
+}
+
+IoThrottle::~IoThrottle() {
+  stop();
+}
+
+IoThrottle& IoThrottle::getInstance() {
+  static IoThrottle self;
+  return self;
+}
+
+void IoThrottle::setMaxReadRate(uint64_t bytesPerSecond) {
+  p_readRate.setRate(bytesPerSecond);
+}
+
+void IoThrottle::setMaxIops(uint64_t iops) {
+  p_iops.setRate(iops);
+}
+
+void IoThrottle::setMaxReaders(unsigned int readers) {
+  {
+    lock_guard<mutex> lock(p_readerMutex);
+    p_readerLimit = readers;
+  }
+  p_readerCondition.notify_all();
+}
+
+bool IoThrottle::enableAdaptive(unsigned int maxReaders, unsigned int stallTarget) {
+  //prefer the pressure of our own cgroup (v2), fall back to the system wide pressure
+  p_pressureFile = "/proc/pressure/io";
+  ifstream cgroup("/proc/self/cgroup");
+  string line;
+  while( getline(cgroup, line) )
+    if( line.compare(0, 3, "0::") == 0 ) {
+      string candidate = "/sys/fs/cgroup"+line.substr(3)+"/io.pressure";
+      if( ifstream(candidate.c_str()).good() )
+        p_pressureFile = candidate;
+    }
+
+  uint64_t total;
+  if( !readStallTotal(total) ) {
+    LOG(logError) << "Unable to read I/O pressure from " << p_pressureFile << ", adaptive throttling disabled";
+    return false;
+  }
+  LOG(logDetailed) << "Adaptive I/O throttling using " << p_pressureFile << " with a stall target of " << stallTarget << '%';
+
+  stop();
+  p_maxReaders = max(maxReaders, 1u);
+  p_allowedReaders = p_maxReaders;
+  p_stallTarget = stallTarget;
+  p_adaptive = true;
+  p_monitorRunning = true;
+  p_monitor = thread(&IoThrottle::monitor, this);
+  return true;
+}
+
+void IoThrottle::stop() {
+  {
+    lock_guard<mutex> lock(p_monitorMutex);
+    p_monitorRunning = false;
+  }
+  p_monitorCondition.notify_one();
+  if( p_monitor.joinable() )
+    p_monitor.join();
+  p_adaptive = false;
+  p_readerCondition.notify_all();
+}
+
+void IoThrottle::operation() {
+  p_iops.acquire(1);
+}
+
+void IoThrottle::read(uint64_t bytes) {
+  p_iops.acquire(1);
+  p_readRate.acquire(bytes);
+}
+
+void IoThrottle::acquireReader() {
+  unique_lock<mutex> lock(p_readerMutex);
+  p_readerCondition.wait(lock, [this] {
+    return (!p_adaptive || p_activeReaders < p_allowedReaders) && (p_readerLimit == 0 || p_activeReaders < p_readerLimit);
+  });
+  p_activeReaders++;
+}
+
+void IoThrottle::releaseReader() {
+  {
+    lock_guard<mutex> lock(p_readerMutex);
+    p_activeReaders--;
+  }
+  p_readerCondition.notify_one();
+}
+
+bool IoThrottle::readStallTotal(uint64_t& total) const {
+  //format: "some avg10=0.00 avg60=0.00 avg300=0.00 total=12345", total is in microseconds
+  ifstream pressure(p_pressureFile.c_str());
+  string line;
+  while( getline(pressure, line) ) {
+    if( line.compare(0, 5, "some ") != 0 )
+      continue;
+    size_t pos = line.find("total=");
+    if( pos == string::npos )
+      return false;
+    istringstream(line.substr(pos+6)) >> total;
+    return true;
+  }
+  return false;
+}
+
+void IoThrottle::monitor() {
+  uint64_t lastTotal = 0;
+  readStallTotal(lastTotal);
+  chrono::steady_clock::time_point last = chrono::steady_clock::now();
+
+  unique_lock<mutex> lock(p_monitorMutex);
+  while( !p_monitorCondition.wait_for(lock, chrono::seconds(1), [this] { return !p_monitorRunning; }) ) {
+    uint64_t total;
+    if( !readStallTotal(total) )
+      continue;
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    double stall = 100.0*(total-lastTotal)/max(chrono::duration<double>(now-last).count()*1e6, 1.0);
+    lastTotal = total;
+    last = now;
+
+    lock_guard<mutex> readerLock(p_readerMutex);
+    unsigned int allowed = p_allowedReaders;
+    if( stall > p_stallTarget )
+      allowed = max(allowed/2, 1u);
+    else if( stall < p_stallTarget/2.0 )
+      allowed = min(allowed+1, p_maxReaders);
+    if( allowed != p_allowedReaders ) {
+      LOG(logDetailed) << "I/O stall at " << stall << "%, allowing " << allowed << " concurrent readers";
+      p_allowedReaders = allowed;
+      p_readerCondition.notify_all();
+    }
+  }
+}
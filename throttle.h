@@ -0,0 +1,86 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <stdint.h>
+
+#define THROTTLE (IoThrottle::getInstance())
+
+//token bucket allowing "rate" tokens per second with a burst of one second, a rate of 0 disables it
+class TokenBucket {
+public:
+  TokenBucket();
+  void setRate(uint64_t rate);
+  uint64_t getRate() const;
+  //takes tokens from the bucket, sleeps until the bucket has recovered if it is exhausted
+  void acquire(uint64_t tokens);
+
+private:
+  std::mutex p_mutex;
+  std::atomic<uint64_t> p_rate;
+  double p_tokens;
+  std::chrono::steady_clock::time_point p_last;
+};
+
+//limits the I/O of crawling and hashing by read rate, IOPS and, in adaptive mode, by the number of concurrent readers
+//the adaptive mode watches the I/O pressure stall information (PSI) of our cgroup or the whole system
+//and halves the allowed readers whenever the stall share exceeds its target, recovering slowly once it drops
+class IoThrottle {
+public:
+  ~IoThrottle();
+  static IoThrottle& getInstance();
+
+  void setMaxReadRate(uint64_t bytesPerSecond);
+  void setMaxIops(uint64_t iops);
+  //limits the concurrent readers of all threads to readers, 0 for no limit. Adaptive mode may allow fewer.
+  void setMaxReaders(unsigned int readers);
+  //enables adaptive mode with at most maxReaders concurrent readers and the given stall target in percent
+  bool enableAdaptive(unsigned int maxReaders, unsigned int stallTarget);
+  void stop();
+
+  //account a metadata operation (stat, opendir)
+  void operation();
+  //account a read of "bytes" bytes
+  void read(uint64_t bytes);
+  //reader slots, held while a file is read
+  void acquireReader();
+  void releaseReader();
+
+  //RAII helper holding a reader slot
+  class Reader {
+  public:
+    Reader() { THROTTLE.acquireReader(); }
+    ~Reader() { THROTTLE.releaseReader(); }
+  };
+
+private:
+  IoThrottle();
+  void monitor();
+  bool readStallTotal(uint64_t& total) const;
+
+  TokenBucket p_readRate;
+  TokenBucket p_iops;
+
+  std::string p_pressureFile;
+  std::atomic<bool> p_adaptive;
+  unsigned int p_maxReaders;
+  unsigned int p_stallTarget;
+  unsigned int p_allowedReaders;
+  unsigned int p_readerLimit;
+  unsigned int p_activeReaders;
+  std::mutex p_readerMutex;
+  std::condition_variable p_readerCondition;
+
+  bool p_monitorRunning;
+  std::mutex p_monitorMutex;
+  std::condition_variable p_monitorCondition;
+  std::thread p_monitor;
+};
+
+#endif //THROTTLE_H
@@ -0,0 +1,78 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "worker.h"
+
+using namespace std;
+
+atomic<bool> Tracer::p_enabled(false);
+
+Tracer::Tracer() : p_file(0) {}
+
+Tracer::~Tracer() {
+  stop();
+}
+
+Tracer& Tracer::getInstance() {
+  static Tracer self;
+  return self;
+}
+
+void Tracer::start(const string& file) {
+  lock_guard<mutex> lock(p_mutex);
+  if (p_file)
+    throw runtime_error("a trace is already being recorded");
+  p_file = fopen(file.c_str(), "we");
+  if (!p_file)
+    throw runtime_error("failed to create "+file+": "+strerror(errno));
+  p_start = chrono::steady_clock::now();
+  p_buffer.reserve(bufferSize+4096);
+  char metadata[128];
+  p_buffer.assign("[\n");
+  p_buffer.append(metadata, snprintf(metadata, sizeof(metadata), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"fscrawl\"}}", (int)getpid()));
+  p_enabled.store(true, memory_order_relaxed);
+}
+
+void Tracer::stop() {
+  p_enabled.store(false, memory_order_relaxed);
+  lock_guard<mutex> lock(p_mutex);
+  if (!p_file)
+    return;
+  p_buffer.append("\n]\n");
+  write();
+  fclose(p_file);
+  p_file = 0;
+}
+
+void Tracer::record(const char* category, const char* name, chrono::steady_clock::time_point start,
+                    chrono::steady_clock::time_point end, const string& args) {
+  static thread_local long tid = syscall(SYS_gettid);
+  char event[192];
+  int length = snprintf(event, sizeof(event), ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%ld,\"args\":{",
+                        name, category, chrono::duration<double, micro>(start-p_start).count(),
+                        chrono::duration<double, micro>(end-start).count(), (int)getpid(), tid);
+  lock_guard<mutex> lock(p_mutex);
+  if (!p_file) //stopped while the span was open
+    return;
+  p_buffer.append(event, min<size_t>(length, sizeof(event)-1)).append(args).append("}}");
+  if (p_buffer.size() >= bufferSize)
+    write();
+}
+
+string Tracer::arg(const char* key, const string& value) {
+  return string(1, '"').append(key).append("\":").append(worker::jsonString(value));
+}
+
+void Tracer::write() {
+  //a failed write loses events of the trace, but must not disturb the crawl
+  if (fwrite(p_buffer.data(), 1, p_buffer.size(), p_file) != p_buffer.size())
+    p_enabled.store(false, memory_order_relaxed);
+  p_buffer.clear();
+}
@@ -0,0 +1,86 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+#include <stdint.h>
+
+#define TRACER (Tracer::getInstance())
+
+//Records spans of the crawl as Chrome trace events, viewable in chrome://tracing or ui.perfetto.dev. The file is a
+//JSON array that both accept even if it was cut off by a crash. While no trace is recorded, spans only cost a load
+//of the enabled flag.
+class Tracer {
+public:
+  ~Tracer(); //stops recording
+  static Tracer& getInstance();
+
+  static bool enabled() { return __builtin_expect(p_enabled.load(std::memory_order_relaxed), false); }
+  //starts recording to file, throws runtime_error if it can not be created
+  void start(const std::string& file);
+  //writes the buffered events and closes the file
+  void stop();
+
+  //args are the members of the args object, e.g. built by arg() and joined by commas
+  void record(const char* category, const char* name, std::chrono::steady_clock::time_point start,
+              std::chrono::steady_clock::time_point end, const std::string& args);
+  //"key":value with value as JSON string
+  static std::string arg(const char* key, const std::string& value);
+
+private:
+  Tracer();
+  Tracer(const Tracer&) = delete;
+  Tracer& operator=(const Tracer&) = delete;
+
+  static const size_t bufferSize = 1 << 20;
+  static std::atomic<bool> p_enabled;
+  void write();
+
+  std::mutex p_mutex;
+  FILE* p_file;
+  std::string p_buffer;
+  std::chrono::steady_clock::time_point p_start;
+};
+
+//records the time from its construction to its destruction as span, if the tracer is enabled
+class TraceSpan {
+public:
+  TraceSpan(const char* category, const char* name)
+    : p_category(category), p_name(name), p_active(Tracer::enabled()) {
+    if (p_active)
+      p_start = std::chrono::steady_clock::now();
+  }
+  ~TraceSpan() {
+    if (p_active)
+      TRACER.record(p_category, p_name, p_start, std::chrono::steady_clock::now(), p_args);
+  }
+  TraceSpan& arg(const char* key, const std::string& value) {
+    if (p_active)
+      append(Tracer::arg(key, value));
+    return *this;
+  }
+  TraceSpan& arg(const char* key, uint64_t value) {
+    if (p_active)
+      append('"'+std::string(key)+"\":"+std::to_string(value));
+    return *this;
+  }
+
+private:
+  void append(const std::string& arg) {
+    if (!p_args.empty())
+      p_args.push_back(',');
+    p_args.append(arg);
+  }
+
+  const char* p_category;
+  const char* p_name;
+  bool p_active;
+  std::chrono::steady_clock::time_point p_start;
+  std::string p_args;
+};
+
+#endif //TRACE_H
@@ -0,0 +1,339 @@
+#include "tree_index.h"
+
+#include <algorithm>
+
+#include "hasher.h"
+
+using namespace std;
+
+TreeIndex::TreeIndex() {
+  clear();
+}
+
+void TreeIndex::clear() {
+  lock_guard<mutex> lock(p_mutex);
+  p_directories.clear();
+  p_files.clear();
+  directory_t& root = p_directories[0];
+  root.parent = 0;
+  root.size = 0;
+  root.mtime = 0;
+  root.files = 0;
+  root.directories = 0;
+}
+
+void TreeIndex::addDirectory(uint64_t id, uint64_t parent, const string& name, uint64_t size, time_t mtime) {
+  lock_guard<mutex> lock(p_mutex);
+  if (id == 0)
+    return;
+  directory_t& directory = p_directories[id];
+  directory.parent = parent;
+  directory.name = name;
+  directory.size = size;
+  directory.mtime = mtime;
+  directory.files = 0;
+  directory.directories = 0;
+}
+
+void TreeIndex::addFile(uint64_t id, uint64_t parent, const string& name, uint64_t size, time_t mtime, const string& hash) {
+  lock_guard<mutex> lock(p_mutex);
+  file_t& file = p_files[id];
+  file.parent = parent;
+  file.name = name;
+  file.size = size;
+  file.mtime = mtime;
+  file.digest = Hasher::toBinary(hash);
+}
+
+template<typename T> bool TreeIndex::findChild(const vector<uint64_t>& children, const unordered_map<uint64_t, T>& table,
+                                                const string& name, size_t& position) {
+  position = lower_bound(children.begin(), children.end(), name, [&table](uint64_t id, const string& name) {
+    return table.find(id)->second.name < name;
+  }) - children.begin();
+  return position < children.size() && table.find(children[position])->second.name == name;
+}
+
+void TreeIndex::link() {
+  lock_guard<mutex> lock(p_mutex);
+  for (auto it = p_directories.begin(); it != p_directories.end(); it++) {
+    it->second.subdirectories.clear();
+    it->second.fileIds.clear();
+  }
+  for (auto it = p_directories.begin(); it != p_directories.end(); it++) {
+    auto parent = p_directories.find(it->second.parent);
+    if (it->first != 0 && it->first != it->second.parent && parent != p_directories.end())
+      parent->second.subdirectories.push_back(it->first);
+  }
+  for (auto it = p_files.begin(); it != p_files.end(); it++) {
+    auto parent = p_directories.find(it->second.parent);
+    if (parent != p_directories.end())
+      parent->second.fileIds.push_back(it->first);
+  }
+  for (auto it = p_directories.begin(); it != p_directories.end(); it++) {
+    sort(it->second.subdirectories.begin(), it->second.subdirectories.end(), [this](uint64_t a, uint64_t b) {
+      return p_directories.find(a)->second.name < p_directories.find(b)->second.name;
+    });
+    sort(it->second.fileIds.begin(), it->second.fileIds.end(), [this](uint64_t a, uint64_t b) {
+      return p_files.find(a)->second.name < p_files.find(b)->second.name;
+    });
+    //tables without the unique key may hold a name twice, only the first one is reachable by path
+    vector<uint64_t>& subdirectories = it->second.subdirectories;
+    subdirectories.erase(unique(subdirectories.begin(), subdirectories.end(), [this](uint64_t a, uint64_t b) {
+      return p_directories.find(a)->second.name == p_directories.find(b)->second.name;
+    }), subdirectories.end());
+    vector<uint64_t>& fileIds = it->second.fileIds;
+    fileIds.erase(unique(fileIds.begin(), fileIds.end(), [this](uint64_t a, uint64_t b) {
+      return p_files.find(a)->second.name == p_files.find(b)->second.name;
+    }), fileIds.end());
+  }
+
+  //count bottom up: visit all directories reachable from the root, then add them up in reverse order
+  vector<uint64_t> order(1, 0);
+  for (size_t i = 0; i < order.size(); i++) {
+    const directory_t& directory = p_directories[order[i]];
+    order.insert(order.end(), directory.subdirectories.begin(), directory.subdirectories.end());
+  }
+  for (auto it = order.rbegin(); it != order.rend(); it++) {
+    directory_t& directory = p_directories[*it];
+    directory.files = directory.fileIds.size();
+    directory.directories = directory.subdirectories.size();
+    for (auto sub = directory.subdirectories.begin(); sub != directory.subdirectories.end(); sub++) {
+      const directory_t& subdirectory = p_directories[*sub];
+      directory.files += subdirectory.files;
+      directory.directories += subdirectory.directories;
+    }
+  }
+}
+
+bool TreeIndex::resolve(const string& path, uint64_t& directory, uint64_t& file, bool& isFile) const {
+  directory = 0;
+  isFile = false;
+  size_t start = 0;
+  while (start < path.size()) {
+    size_t end = path.find('/', start);
+    if (end == string::npos)
+      end = path.size();
+    if (end > start) {
+      if (isFile) //a file has nothing below it
+        return false;
+      const directory_t& current = p_directories.find(directory)->second;
+      const string name = path.substr(start, end-start);
+      size_t position;
+      if (findChild(current.subdirectories, p_directories, name, position))
+        directory = current.subdirectories[position];
+      else if (findChild(current.fileIds, p_files, name, position)) {
+        file = current.fileIds[position];
+        isFile = true;
+      } else
+        return false;
+    }
+    start = end+1;
+  }
+  return true;
+}
+
+TreeIndex::entry_t TreeIndex::directoryEntry(uint64_t id, const directory_t& directory) const {
+  entry_t entry = { id, directory.parent, directory.name, true, directory.size, directory.mtime, string(),
+                    directory.files, directory.directories };
+  if (id == 0) { //the root has no row in the catalog, its size is that of the top level
+    entry.parent = 0;
+    for (auto it = directory.subdirectories.begin(); it != directory.subdirectories.end(); it++)
+      entry.size += p_directories.find(*it)->second.size;
+    for (auto it = directory.fileIds.begin(); it != directory.fileIds.end(); it++)
+      entry.size += p_files.find(*it)->second.size;
+  }
+  return entry;
+}
+
+TreeIndex::entry_t TreeIndex::fileEntry(uint64_t id, const file_t& file) const {
+  entry_t entry = { id, file.parent, file.name, false, file.size, file.mtime, Hasher::toPrinted(file.digest), 0, 0 };
+  return entry;
+}
+
+bool TreeIndex::lookup(const string& path, entry_t& entry) const {
+  lock_guard<mutex> lock(p_mutex);
+  uint64_t directory, file;
+  bool isFile;
+  if (!resolve(path, directory, file, isFile))
+    return false;
+  if (isFile)
+    entry = fileEntry(file, p_files.find(file)->second);
+  else
+    entry = directoryEntry(directory, p_directories.find(directory)->second);
+  return true;
+}
+
+bool TreeIndex::path(uint64_t id, bool directory, string& path) const {
+  lock_guard<mutex> lock(p_mutex);
+  vector<const string*> names;
+  if (!directory) {
+    auto file = p_files.find(id);
+    if (file == p_files.end())
+      return false;
+    names.push_back(&file->second.name);
+    id = file->second.parent;
+  }
+  while (id != 0) {
+    auto it = p_directories.find(id);
+    if (it == p_directories.end() || names.size() > p_directories.size()) //detached or a loop
+      return false;
+    names.push_back(&it->second.name);
+    id = it->second.parent;
+  }
+  path.clear();
+  for (auto it = names.rbegin(); it != names.rend(); it++)
+    path.append(1, '/').append(**it);
+  if (path.empty())
+    path = "/";
+  return true;
+}
+
+bool TreeIndex::children(const string& path, vector<entry_t>& entries) const {
+  lock_guard<mutex> lock(p_mutex);
+  uint64_t id, file;
+  bool isFile;
+  if (!resolve(path, id, file, isFile) || isFile)
+    return false;
+  const directory_t& directory = p_directories.find(id)->second;
+  entries.clear();
+  entries.reserve(directory.subdirectories.size()+directory.fileIds.size());
+  for (auto it = directory.subdirectories.begin(); it != directory.subdirectories.end(); it++)
+    entries.push_back(directoryEntry(*it, p_directories.find(*it)->second));
+  for (auto it = directory.fileIds.begin(); it != directory.fileIds.end(); it++)
+    entries.push_back(fileEntry(*it, p_files.find(*it)->second));
+  return true;
+}
+
+uint64_t TreeIndex::directories() const {
+  lock_guard<mutex> lock(p_mutex);
+  return p_directories.find(0)->second.directories;
+}
+
+uint64_t TreeIndex::files() const {
+  lock_guard<mutex> lock(p_mutex);
+  return p_directories.find(0)->second.files;
+}
+
+void TreeIndex::count(uint64_t id, int64_t files, int64_t directories) {
+  for (size_t steps = 0; steps <= p_directories.size(); steps++) {
+    auto it = p_directories.find(id);
+    if (it == p_directories.end())
+      return;
+    it->second.files += files;
+    it->second.directories += directories;
+    if (id == 0)
+      return;
+    id = it->second.parent;
+  }
+}
+
+void TreeIndex::erase(uint64_t id) {
+  vector<uint64_t> pending(1, id);
+  while (!pending.empty()) {
+    auto it = p_directories.find(pending.back());
+    pending.pop_back();
+    if (it == p_directories.end())
+      continue;
+    pending.insert(pending.end(), it->second.subdirectories.begin(), it->second.subdirectories.end());
+    for (auto file = it->second.fileIds.begin(); file != it->second.fileIds.end(); file++)
+      p_files.erase(*file);
+    p_directories.erase(it);
+  }
+}
+
+void TreeIndex::directoryInserted(uint64_t id, uint64_t parent, const string& name, uint64_t size, time_t mtime) {
+  lock_guard<mutex> lock(p_mutex);
+  unlinkDirectory(id); //an id is never reused while the old entry is still there, except by a catalog restored behind our back
+  auto parentDirectory = p_directories.find(parent);
+  if (id == 0 || parentDirectory == p_directories.end())
+    return;
+  size_t position;
+  if (findChild(parentDirectory->second.subdirectories, p_directories, name, position))
+    unlinkDirectory(parentDirectory->second.subdirectories[position]); //replaced without its delete being reported
+  directory_t& directory = p_directories[id];
+  directory.parent = parent;
+  directory.name = name;
+  directory.size = size;
+  directory.mtime = mtime;
+  directory.files = 0;
+  directory.directories = 0;
+  vector<uint64_t>& subdirectories = p_directories.find(parent)->second.subdirectories; //the insert may have rehashed
+  subdirectories.insert(subdirectories.begin()+position, id);
+  count(parent, 0, 1);
+}
+
+void TreeIndex::fileInserted(uint64_t id, uint64_t parent, const string& name, uint64_t size, time_t mtime, const string& hash) {
+  lock_guard<mutex> lock(p_mutex);
+  unlinkFile(id);
+  auto parentDirectory = p_directories.find(parent);
+  if (parentDirectory == p_directories.end())
+    return;
+  size_t position;
+  if (findChild(parentDirectory->second.fileIds, p_files, name, position))
+    unlinkFile(parentDirectory->second.fileIds[position]);
+  file_t& file = p_files[id];
+  file.parent = parent;
+  file.name = name;
+  file.size = size;
+  file.mtime = mtime;
+  file.digest = Hasher::toBinary(hash);
+  parentDirectory->second.fileIds.insert(parentDirectory->second.fileIds.begin()+position, id);
+  count(parent, 1, 0);
+}
+
+void TreeIndex::directoryUpdated(uint64_t id, uint64_t size, time_t mtime) {
+  lock_guard<mutex> lock(p_mutex);
+  auto it = p_directories.find(id);
+  if (id == 0 || it == p_directories.end())
+    return;
+  it->second.size = size;
+  it->second.mtime = mtime;
+}
+
+void TreeIndex::fileUpdated(uint64_t id, uint64_t size, time_t mtime, const string& hash) {
+  lock_guard<mutex> lock(p_mutex);
+  auto it = p_files.find(id);
+  if (it == p_files.end())
+    return;
+  it->second.size = size;
+  it->second.mtime = mtime;
+  it->second.digest = Hasher::toBinary(hash);
+}
+
+void TreeIndex::directoryDeleted(uint64_t id) {
+  lock_guard<mutex> lock(p_mutex);
+  unlinkDirectory(id);
+}
+
+void TreeIndex::fileDeleted(uint64_t id) {
+  lock_guard<mutex> lock(p_mutex);
+  unlinkFile(id);
+}
+
+void TreeIndex::unlinkDirectory(uint64_t id) {
+  auto it = p_directories.find(id);
+  if (id == 0 || it == p_directories.end())
+    return;
+  auto parent = p_directories.find(it->second.parent);
+  size_t position;
+  if (parent != p_directories.end() && findChild(parent->second.subdirectories, p_directories, it->second.name, position) &&
+      parent->second.subdirectories[position] == id) {
+    parent->second.subdirectories.erase(parent->second.subdirectories.begin()+position);
+    count(it->second.parent, -(int64_t)it->second.files, -(int64_t)it->second.directories-1);
+  }
+  erase(id);
+}
+
+void TreeIndex::unlinkFile(uint64_t id) {
+  auto it = p_files.find(id);
+  if (it == p_files.end())
+    return;
+  auto parent = p_directories.find(it->second.parent);
+  size_t position;
+  if (parent != p_directories.end() && findChild(parent->second.fileIds, p_files, it->second.name, position) &&
+      parent->second.fileIds[position] == id) {
+    parent->second.fileIds.erase(parent->second.fileIds.begin()+position);
+    count(it->second.parent, -1, 0);
+  }
+  p_files.erase(it);
+}
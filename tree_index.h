@@ -0,0 +1,97 @@
+#ifndef TREE_INDEX_H
+#define TREE_INDEX_H
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <stdint.h>
+#include <time.h>
+
+#include "worker.h"
+
+//In-memory copy of the catalog tree, answering lookups by path and id without any database round trip. It is filled
+//by worker::loadIndex and then follows the catalog through the observer calls of the worker. Every directory carries
+//the number of files and directories below it, kept up to date along the ancestors on every insert and delete.
+//Each name is stored once, in the record of its entry. Directories refer to their children by id, in vectors sorted
+//by name that are searched in O(log n). That keeps a file at roughly 130 bytes plus names longer than 15 bytes and the
+//digest, about 14 GB for 100 million files, so large catalogs need a host sized for it.
+//All public methods are thread-safe.
+class TreeIndex : public CatalogObserver {
+public:
+  struct entry_t {
+    uint64_t id;
+    uint64_t parent;
+    std::string name;
+    bool directory;
+    uint64_t size; //of directories the size of the subtree as stored in the catalog
+    time_t mtime;
+    std::string hash; //printed, files only
+    uint64_t files; //below, directories only
+    uint64_t directories;
+  };
+
+  TreeIndex();
+
+  //loading: rows may come in any order, link() connects them and counts the subtrees
+  void clear();
+  void addDirectory(uint64_t id, uint64_t parent, const std::string& name, uint64_t size, time_t mtime);
+  void addFile(uint64_t id, uint64_t parent, const std::string& name, uint64_t size, time_t mtime, const std::string& hash);
+  void link();
+
+  //entry of a slash separated path below the root, "/" or "" is the root itself
+  bool lookup(const std::string& path, entry_t& entry) const;
+  //path of a directory or file, "/" for the root
+  bool path(uint64_t id, bool directory, std::string& path) const;
+  //directories and then files directly below path, sorted by name
+  bool children(const std::string& path, std::vector<entry_t>& entries) const;
+  uint64_t directories() const;
+  uint64_t files() const;
+
+  void directoryInserted(uint64_t id, uint64_t parent, const std::string& name, uint64_t size, time_t mtime);
+  void fileInserted(uint64_t id, uint64_t parent, const std::string& name, uint64_t size, time_t mtime, const std::string& hash);
+  void directoryUpdated(uint64_t id, uint64_t size, time_t mtime);
+  void fileUpdated(uint64_t id, uint64_t size, time_t mtime, const std::string& hash);
+  void directoryDeleted(uint64_t id);
+  void fileDeleted(uint64_t id);
+
+private:
+  struct directory_t {
+    uint64_t parent;
+    std::string name;
+    uint64_t size;
+    time_t mtime;
+    uint64_t files; //below
+    uint64_t directories;
+    std::vector<uint64_t> subdirectories; //sorted by name
+    std::vector<uint64_t> fileIds;
+  };
+  struct file_t {
+    uint64_t parent;
+    std::string name;
+    uint64_t size;
+    time_t mtime;
+    std::string digest; //binary, saving half the memory of printed hashes
+  };
+
+  //directory of a path, 0 (the root) for an empty path; sets file instead if the last element is a file
+  bool resolve(const std::string& path, uint64_t& directory, uint64_t& file, bool& isFile) const;
+  //position of name in children sorted by name, or of the first child with a greater name if false is returned
+  template<typename T> static bool findChild(const std::vector<uint64_t>& children, const std::unordered_map<uint64_t, T>& table,
+                                             const std::string& name, size_t& position);
+  //adds files and directories to all directories from id up to the root
+  void count(uint64_t id, int64_t files, int64_t directories);
+  void erase(uint64_t id); //directory and everything below, not counted
+  //remove an entry from its parent and the counts, and from the index; the mutex has to be held
+  void unlinkDirectory(uint64_t id);
+  void unlinkFile(uint64_t id);
+  entry_t directoryEntry(uint64_t id, const directory_t& directory) const;
+  entry_t fileEntry(uint64_t id, const file_t& file) const;
+
+  mutable std::mutex p_mutex;
+  std::unordered_map<uint64_t, directory_t> p_directories; //id 0 is the root
+  std::unordered_map<uint64_t, file_t> p_files;
+};
+
+#endif //TREE_INDEX_H
@@ -1,3 +1,3 @@
 #ifndef VERSION
-  #define VERSION "3.1"
+  #define VERSION "3.3"
 #endif
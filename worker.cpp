@@ -3,31 +3,59 @@
 #include "hasher.h"
 #include "options.h"
 #include "sqlexception.h"
+#include "job_queue.h"
+#include "metrics.h"
+#include "throttle.h"
+#include "trace.h"
+#include "name_index.h"
+#include "tree_index.h"
 
 #include <algorithm>
 #include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
 #include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <list>
+#include <mutex>
 #include <sstream>
+#include <thread>
 
 #include <dirent.h>
 #include <unistd.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <poll.h>
 
-worker::worker(MYSQL* dbConnection) : p_databaseInitialized(false),
+worker::worker(Backend* backend) : p_databaseInitialized(false),
+                                      p_binaryHashes(false),
                                       p_directoryTable("fscrawl_directories"),
                                       p_fileTable("fscrawl_files"),
+                                      p_duplicatesTable("fscrawl_duplicates"),
                                       p_inheritMTime(false),
                                       p_inheritSize(true),
                                       p_watchDescriptor(0),
                                       p_forceHashing(0),
                                       p_run(true),
                                       p_dryRun(false),
+                                      p_explain(false),
+                                      p_readOnly(false),
+                                      p_threads(1),
+                                      p_progressInterval(10),
+                                      p_progress(false),
+                                      p_crawledEntries(0),
+                                      p_crawledBytes(0),
+                                      p_hashedBytes(0),
                                       p_hasher(0),
-                                      p_connection(dbConnection),
+                                      p_backend(backend),
+                                      p_pool(0),
                                       p_prepQueryFileById(0),
                                       p_prepQueryFileByName(0),
                                       p_prepQueryFilesByParent(0),
@@ -41,11 +69,14 @@ worker::worker(MYSQL* dbConnection) : p_databaseInitialized(false),
                                       p_prepQueryParentOfDir(0),
                                       p_prepInsertDir(0),
                                       p_prepUpdateDir(0),
-                                      p_prepDeleteDir(0),
-                                      p_prepLastInsertID(0) {
+                                      p_prepDeleteDir(0) {
+  resetStatistics();
 }
 
 worker::~worker() {
+  //statements belong to the backend's connection, which outlives the worker
+  while( !p_statements.empty() )
+    delete *p_statements.begin();
 }
 
 void worker::abort() {
@@ -59,7 +90,15 @@ void worker::setDryRun(bool on) {
   p_dryRun = on;
 }
 
-string worker::ascendPath(uint32_t id, uint32_t downToId, entry_t::type_t type) {
+void worker::setExplain(bool on) {
+  p_explain = on;
+}
+
+void worker::setReadOnly(bool on) {
+  p_readOnly = on;
+}
+
+string worker::ascendPath(uint64_t id, uint64_t downToId, entry_t::type_t type) {
   if( !p_databaseInitialized )
     initDatabase();
   if( id != downToId ) {
@@ -76,41 +115,96 @@ string worker::ascendPath(uint32_t id, uint32_t downToId, entry_t::type_t type)
     return ""; //don't attach a leading slash
 }
 
-void worker::cacheDirectoryEntriesFromDB(uint32_t id, vector<entry_t*>& entryCache) {
+void worker::prefetchDirectoryEntries(uint64_t id) {
+  if( !p_pool || p_prefetches.count(id) )
+    return;
+  pair< future<queryResult_t>, future<queryResult_t> >& prefetch = p_prefetches[id];
+  const string date = p_backend->unixTime("date");
+  const vector<uint64_t> parent(1, id);
+  prefetch.first = p_pool->query("SELECT id,name,size,"+date+" FROM "+p_directoryTable+" WHERE parent=?", parent);
+  prefetch.second = p_pool->query("SELECT id,name,size,"+date+",hash FROM "+p_fileTable+" WHERE parent=?", parent);
+}
+
+void worker::cacheDirectoryEntriesFromDB(uint64_t id, vector<entry_t*>& entryCache) {
   entryCache.clear();
+  TraceSpan span("db", "load");
+  span.arg("id", id);
+
+  if( p_pool ) {
+    prefetchDirectoryEntries(id); //both queries run concurrently even if nobody prefetched them before
+    map< uint64_t, pair< future<queryResult_t>, future<queryResult_t> > >::iterator it = p_prefetches.find(id);
+    try {
+      queryResult_t dirs = it->second.first.get();
+      queryResult_t files = it->second.second.get();
+      p_prefetches.erase(it);
+      for( queryResult_t::const_iterator row = dirs.begin(); row != dirs.end(); row++ ) {
+        entry_t* entry = new entry_t;
+        entry->type = entry_t::directory;
+        entry->state = entry_t::entryUnknown;
+        entry->id = stoull((*row)[0]);
+        entry->parent = id;
+        entry->name = (*row)[1];
+        entry->size = stoull((*row)[2]);
+        entry->mtime = stoul((*row)[3]);
+        entryCache.push_back(entry);
+      }
+      for( queryResult_t::const_iterator row = files.begin(); row != files.end(); row++ ) {
+        entry_t* entry = new entry_t;
+        entry->type = entry_t::file;
+        entry->state = entry_t::entryUnknown;
+        entry->id = stoull((*row)[0]);
+        entry->parent = id;
+        entry->name = (*row)[1];
+        entry->size = stoull((*row)[2]);
+        entry->mtime = stoul((*row)[3]);
+        entry->hash = p_binaryHashes ? Hasher::toPrinted((*row)[4]) : (*row)[4];
+        entryCache.push_back(entry);
+      }
+      LOG(logDebug) << "cache: got " << entryCache.size() << " entries of dir " << id << " from the connection pool";
+      span.arg("entries", entryCache.size()).arg("source", "pool");
+      return;
+    } catch( exception& e ) {
+      LOG(logWarning) << "Pooled lookup of directory " << id << " failed (" << e.what() << "), falling back to the main connection";
+      p_prefetches.erase(it);
+      for( vector<entry_t*>::iterator entry = entryCache.begin(); entry != entryCache.end(); entry++ )
+        delete *entry;
+      entryCache.clear();
+    }
+  }
 
-  p_prepQueryDirsByParent->setUInt(1,id);
+  p_prepQueryDirsByParent->setUInt64(1,id);
   p_prepQueryDirsByParent->executeQuery();
   while( p_prepQueryDirsByParent->next() ) {
     entry_t* entry = new entry_t;
     entry->type = entry_t::directory;
     entry->state = entry_t::entryUnknown;
-    entry->id = p_prepQueryDirsByParent->getUInt(1);
+    entry->id = p_prepQueryDirsByParent->getUInt64(1);
     entry->parent = id;
     entry->name = p_prepQueryDirsByParent->getString(2);
     entry->size = p_prepQueryDirsByParent->getUInt64(3);
-    entry->mtime = p_prepQueryDirsByParent->getUInt(4);
+    entry->mtime = p_prepQueryDirsByParent->getUInt64(4);
     entryCache.push_back(entry);
     LOG(logDebug) << "cache: got dir id " << entry->id << " parent " << entry->parent << " name " << entry->name << " size " << entry->size << " mtime " << entry->mtime;
   }
   p_prepQueryDirsByParent->release();
 
-  p_prepQueryFilesByParent->setUInt(1,id);
+  p_prepQueryFilesByParent->setUInt64(1,id);
   p_prepQueryFilesByParent->executeQuery();
   while( p_prepQueryFilesByParent->next() ) {
     entry_t* entry = new entry_t;
     entry->type = entry_t::file;
     entry->state = entry_t::entryUnknown;
-    entry->id = p_prepQueryFilesByParent->getUInt(1);
+    entry->id = p_prepQueryFilesByParent->getUInt64(1);
     entry->parent = id;
     entry->name = p_prepQueryFilesByParent->getString(2);
     entry->size = p_prepQueryFilesByParent->getUInt64(3);
-    entry->mtime = p_prepQueryFilesByParent->getUInt(4);
-    entry->hash = p_prepQueryFilesByParent->getString(5);
+    entry->mtime = p_prepQueryFilesByParent->getUInt64(4);
+    entry->hash = p_prepQueryFilesByParent->getHash(5);
     entryCache.push_back(entry);
     LOG(logDebug) << "cache: got file id " << entry->id << " parent " << entry->parent << " name " << entry->name << " size " << entry->size << " mtime " << entry->mtime;
   }
   p_prepQueryFilesByParent->release();
+  span.arg("entries", entryCache.size());
 }
 
 void worker::clearDatabase() {
@@ -125,42 +219,53 @@ void worker::clearDatabase() {
   p_databaseInitialized = false;
 }
 
-void worker::deleteDirectory(uint32_t id) { //completely delete directory "id" including all subdirs/files
+//catalog rows written by the crawler and watcher, by table and operation
+static Counter& rowCounter(const char* table, const char* operation) {
+  return METRICS.counter("fscrawl_catalog_rows_total", "Catalog entries inserted, updated or deleted, files deleted along with their directory are not counted",
+                         Metrics::label("table", table)+','+Metrics::label("operation", operation));
+}
+
+void worker::deleteDirectory(uint64_t id) { //completely delete directory "id" including all subdirs/files
   if( !p_databaseInitialized )
     initDatabase();
   LOG(logDebug) << "deleting directory id " << id;
-  p_prepQueryDirsByParent->setUInt(1,id);
+  p_prepQueryDirsByParent->setUInt64(1,id);
   p_prepQueryDirsByParent->executeQuery();
-  vector<uint32_t> childIds( p_prepQueryDirsByParent->rowsCount() );
-  vector<uint32_t>::iterator childIdsIt = childIds.begin();
-  while( p_prepQueryDirsByParent->next() && childIdsIt != childIds.end() ) {
-    *childIdsIt = p_prepQueryDirsByParent->getUInt(1);
-    childIdsIt++;
-  }
+  vector<uint64_t> childIds;
+  while( p_prepQueryDirsByParent->next() )
+    childIds.push_back( p_prepQueryDirsByParent->getUInt64(1) );
   p_prepQueryDirsByParent->release();
   LOG(logDebug) << "got " << childIds.size() << " children of directory " << id;
   if (!p_dryRun) {
-    p_prepDeleteFiles->setUInt(1,id);
+    p_prepDeleteFiles->setUInt64(1,id);
     p_prepDeleteFiles->execute(); //now, delete every file in this directory
-    p_prepDeleteDir->setUInt(1,id);
+    p_prepDeleteDir->setUInt64(1,id);
     p_prepDeleteDir->execute(); //finally, delete this directory
+    static Counter& deleted = rowCounter("directories", "delete");
+    deleted.add();
+    for( vector<CatalogObserver*>::iterator it = p_observers.begin(); it != p_observers.end(); it++ )
+      (*it)->directoryDeleted(id);
   }
-  for( vector<uint32_t>::iterator it = childIds.begin(); it != childIds.end(); it++ )
+  for( vector<uint64_t>::iterator it = childIds.begin(); it != childIds.end(); it++ )
     deleteDirectory( *it );
 }
 
-void worker::deleteFile(uint32_t id) {
+void worker::deleteFile(uint64_t id) {
   if( !p_databaseInitialized )
     initDatabase();
   LOG(logDebug) << "deleting file id " << id;
   if (p_dryRun)
     return;
-  p_prepDeleteFile->setUInt(1,id);
+  p_prepDeleteFile->setUInt64(1,id);
   p_prepDeleteFile->execute();
+  static Counter& deleted = rowCounter("files", "delete");
+  deleted.add();
+  for( vector<CatalogObserver*>::iterator it = p_observers.begin(); it != p_observers.end(); it++ )
+    (*it)->fileDeleted(id);
 }
 
-uint32_t worker::descendPath(string path, entry_t::type_t type, bool createDirectory) {
-  uint32_t pathId = 0;
+uint64_t worker::descendPath(string path, entry_t::type_t type, bool createDirectory) {
+  uint64_t pathId = 0;
   if( !p_databaseInitialized )
     initDatabase();
   if( !path.empty() ) {
@@ -188,66 +293,112 @@ uint32_t worker::descendPath(string path, entry_t::type_t type, bool createDirec
   return pathId;
 }
 
+void worker::loadDirectoryPaths(uint64_t parent, unordered_map<uint64_t,string>& paths) {
+  unordered_multimap< uint64_t, pair<uint64_t,string> > children; //parent -> (id, name)
+  PreparedStatementWrapper* stmt = PreparedStatementWrapper::create(this, "SELECT id,parent,name FROM "+p_directoryTable);
+  stmt->executeQuery();
+  while( p_run && stmt->next() )
+    children.insert(make_pair(stmt->getUInt64(2), make_pair(stmt->getUInt64(1), stmt->getString(3))));
+  stmt->release();
+  delete stmt;
+
+  paths.clear();
+  paths[parent] = string();
+  vector<uint64_t> pending(1, parent);
+  while( !pending.empty() ) {
+    uint64_t id = pending.back();
+    pending.pop_back();
+    const string& path = paths[id];
+    auto range = children.equal_range(id);
+    for( auto it = range.first; it != range.second; it++ ) {
+      if( paths.count(it->second.first) ) //loop in the tree, verifyTree will clean it up
+        continue;
+      paths[it->second.first] = path+'/'+it->second.second;
+      pending.push_back(it->second.first);
+    }
+  }
+}
+
+string worker::jsonString(const string& s) {
+  ostringstream os;
+  os << '"';
+  for( string::const_iterator it = s.begin(); it != s.end(); it++ ) {
+    switch( *it ) {
+      case '"' : os << "\\\""; break;
+      case '\\' : os << "\\\\"; break;
+      case '\n' : os << "\\n"; break;
+      case '\t' : os << "\\t"; break;
+      default :
+        if( (unsigned char)*it < 0x20 )
+          os << "\\u" << hex << setw(4) << setfill('0') << (int)(unsigned char)*it << dec;
+        else
+          os << *it;
+    }
+  }
+  os << '"';
+  return os.str();
+}
+
 string worker::errnoString() {
    char* e = strerror(errno);
    return e ? e : "";
 }
 
-worker::entry_t worker::getDirectoryById(uint32_t id) {
+worker::entry_t worker::getDirectoryById(uint64_t id) {
   entry_t e = { .id = id, .mtime = 0, .name = string(), .parent = 0, .size = 0, .subSize = 0, .state = entry_t::entryUnknown, .type = entry_t::directory, .hash = string() };
-  p_prepQueryDirById->setUInt(1,id);
+  p_prepQueryDirById->setUInt64(1,id);
   p_prepQueryDirById->executeQuery();
-  if( p_prepQueryDirsByParent->next() ) {
-    e.name = p_prepQueryDirsByParent->getString(1);
-    e.parent = p_prepQueryDirsByParent->getUInt(2);
-    e.size = p_prepQueryDirsByParent->getUInt64(3);
-    e.mtime = p_prepQueryDirsByParent->getUInt(4);
+  if( p_prepQueryDirById->next() ) {
+    e.name = p_prepQueryDirById->getString(1);
+    e.parent = p_prepQueryDirById->getUInt64(2);
+    e.size = p_prepQueryDirById->getUInt64(3);
+    e.mtime = p_prepQueryDirById->getUInt64(4);
   } else if (id == 0) {
     e.name = "<ROOT>";
   }
-  p_prepQueryDirsByParent->release();
+  p_prepQueryDirById->release();
   return e;
 }
 
-worker::entry_t worker::getDirectoryByName(const string& name, uint32_t parent) {
+worker::entry_t worker::getDirectoryByName(const string& name, uint64_t parent) {
   entry_t e = { .id = 0, .mtime = 0, .name = name, .parent = parent, .size = 0, .subSize = 0, .state = entry_t::entryUnknown, .type = entry_t::directory, .hash = string() };
-  p_prepQueryDirByName->setUInt(1,parent);
+  p_prepQueryDirByName->setUInt64(1,parent);
   p_prepQueryDirByName->setString(2,name);
   p_prepQueryDirByName->executeQuery();
   if( p_prepQueryDirByName->next() ) {
-    e.id = p_prepQueryDirByName->getUInt(1);
+    e.id = p_prepQueryDirByName->getUInt64(1);
     e.size = p_prepQueryDirByName->getUInt64(2);
-    e.mtime = p_prepQueryDirByName->getUInt(3);
+    e.mtime = p_prepQueryDirByName->getUInt64(3);
   }
   p_prepQueryDirByName->release();
   return e;
 }
 
-worker::entry_t worker::getFileById(uint32_t id) {
+worker::entry_t worker::getFileById(uint64_t id) {
   entry_t e = { .id = id, .mtime = 0, .name = string(), .parent = 0, .size = 0, .subSize = 0, .state = entry_t::entryUnknown, .type = entry_t::file, .hash = string() };
-  p_prepQueryFileById->setUInt(1,id);
+  p_prepQueryFileById->setUInt64(1,id);
   p_prepQueryFileById->executeQuery();
   if( p_prepQueryFileById->next() ) {
     e.name = p_prepQueryFileById->getString(1);
-    e.parent = p_prepQueryFileById->getUInt(2);
+    e.parent = p_prepQueryFileById->getUInt64(2);
     e.size = p_prepQueryFileById->getUInt64(3);
-    e.mtime = p_prepQueryFileById->getUInt(4);
-    e.hash = p_prepQueryFileById->getString(5);
+    e.mtime = p_prepQueryFileById->getUInt64(4);
+    e.hash = p_prepQueryFileById->getHash(5);
   }
   p_prepQueryFileById->release();
   return e;
 }
 
-worker::entry_t worker::getFileByName(const string& name, uint32_t parent) {
+worker::entry_t worker::getFileByName(const string& name, uint64_t parent) {
   entry_t e = { .id = 0, .mtime = 0, .name = name, .parent = parent, .size = 0, .subSize = 0, .state = entry_t::entryUnknown, .type = entry_t::file, .hash = string() };
-  p_prepQueryFileByName->setUInt(1,parent);
+  p_prepQueryFileByName->setUInt64(1,parent);
   p_prepQueryFileByName->setString(2,name);
   p_prepQueryFileByName->executeQuery();
   if( p_prepQueryFileByName->next() ) {
-    e.id = p_prepQueryFileByName->getUInt(1);
+    e.id = p_prepQueryFileByName->getUInt64(1);
     e.size = p_prepQueryFileByName->getUInt64(2);
-    e.mtime = p_prepQueryFileByName->getUInt(3);
-    e.hash = p_prepQueryFileByName->getString(4);
+    e.mtime = p_prepQueryFileByName->getUInt64(3);
+    e.hash = p_prepQueryFileByName->getHash(4);
   }
   p_prepQueryFileByName->release();
   return e;
@@ -257,121 +408,787 @@ bool worker::getForceHashing() const {
   return p_forceHashing;
 }
 
+void worker::addObserver(CatalogObserver* observer) {
+  p_observers.push_back(observer);
+}
+
+void worker::removeObserver(CatalogObserver* observer) {
+  p_observers.erase(remove(p_observers.begin(), p_observers.end(), observer), p_observers.end());
+}
+
+bool worker::binaryHashes() const {
+  return p_binaryHashes;
+}
+
 const worker::statistics& worker::getStatistics() const {
   return p_statistics;
 }
 
-void worker::hashFile(entry_t* entry, const string& path) const {
+void worker::hashFile(entry_t* entry, const string& path) {
   if( !p_hasher )
     return;
+  TraceSpan span("hash", "hash");
+  span.arg("path", path).arg("bytes", entry->size);
   Hasher::hashStatus_t status = p_hasher->hash(path, entry->hash);
   if( status != Hasher::hashSuccess ) {
     LOG(logError) << "Failed to hash entry " << entry->id;
     entry->hash.clear();
+  } else
+    p_hashedBytes += entry->size;
+}
+
+//runs job(i) for every i < count on up to "threads" threads, stops early once run is cleared
+static void runParallel(size_t count, unsigned int threads, const atomic<bool>& run, const function<void(size_t)>& job) {
+  atomic<size_t> next(0);
+  auto loop = [&]() {
+    size_t i;
+    while( run && (i = next++) < count )
+      job(i);
+  };
+  vector<thread> pool;
+  for( unsigned int t = 1; t < min<size_t>(threads, count); t++ )
+    pool.push_back(thread(loop));
+  loop();
+  for( vector<thread>::iterator it = pool.begin(); it != pool.end(); it++ )
+    it->join();
+}
+
+//calls report with the elapsed seconds every interval seconds on a background thread until destroyed
+class PeriodicReporter {
+public:
+  PeriodicReporter(unsigned int interval, const function<void(double)>& report)
+    : p_finished(false),
+      p_start(chrono::steady_clock::now()),
+      p_thread([this, interval, report]() {
+        unique_lock<mutex> lock(p_mutex);
+        while( !p_condition.wait_for(lock, chrono::seconds(interval), [this] { return p_finished; }) )
+          report(elapsed());
+      }) {}
+  ~PeriodicReporter() {
+    {
+      lock_guard<mutex> lock(p_mutex);
+      p_finished = true;
+    }
+    p_condition.notify_one();
+    p_thread.join();
+  }
+  double elapsed() const {
+    return max(chrono::duration<double>(chrono::steady_clock::now()-p_start).count(), 0.001);
   }
+private:
+  mutex p_mutex;
+  condition_variable p_condition;
+  bool p_finished;
+  chrono::steady_clock::time_point p_start;
+  thread p_thread;
+};
+
+//formats seconds as 1h2m3s
+static string formatDuration(double seconds) {
+  uint64_t s = seconds;
+  ostringstream os;
+  if( s >= 3600 )
+    os << s/3600 << 'h';
+  if( s >= 60 )
+    os << s/60%60 << 'm';
+  os << s%60 << 's';
+  return os.str();
 }
 
-void worker::hashCheck(const string& path, uint32_t parent) {
+//reports the progress of a crawl against the catalog's totals of the crawled subtree, to the log and a JSON status file
+class CrawlProgress {
+public:
+  CrawlProgress(const string& path, const worker::subtreeTotals_t& expected, bool hashing, const atomic<uint64_t>& entries,
+                const atomic<uint64_t>& bytes, const atomic<uint64_t>& hashedBytes, const string& statusFile)
+    : p_path(path), p_expected(expected), p_hashing(hashing), p_entries(entries), p_bytes(bytes), p_hashedBytes(hashedBytes),
+      p_statusFile(statusFile), p_lastSeconds(0), p_lastEntries(0), p_lastHashedBytes(0) {}
+
+  //called every interval by the reporter thread and once more by the crawl when it is finished
+  void report(double seconds, bool finished) {
+    lock_guard<mutex> lock(p_mutex);
+    const uint64_t entries = p_entries, bytes = p_bytes, hashedBytes = p_hashedBytes;
+    const uint64_t expectedEntries = p_expected.files+p_expected.directories;
+    //hashing dominates the time of a crawl, so it progresses with the bytes of the files if they are hashed
+    double done = -1;
+    if( p_hashing && p_expected.bytes > 0 )
+      done = (double)bytes/p_expected.bytes;
+    else if( expectedEntries > 0 )
+      done = (double)entries/expectedEntries;
+    //the ETA assumes the average rate so far, the current rates cover the last interval
+    double eta = done > 0 && done < 1 ? seconds*(1-done)/done : -1;
+    double interval = max(seconds-p_lastSeconds, 0.001);
+    double entryRate = (entries-p_lastEntries)/interval;
+    double hashRate = (hashedBytes-p_lastHashedBytes)/interval;
+    p_lastSeconds = seconds;
+    p_lastEntries = entries;
+    p_lastHashedBytes = hashedBytes;
+
+    if( !finished ) {
+      ostringstream os;
+      os << "Crawled " << entries;
+      if( expectedEntries > 0 )
+        os << " of " << expectedEntries;
+      os << " entries";
+      if( done >= 0 )
+        os << " (" << fixed << setprecision(1) << min(done, 1.0)*100 << "%)";
+      os << ", " << fixed << setprecision(1) << entryRate << " entries/s";
+      if( p_hashing )
+        os << ", hashed " << hashedBytes/1048576 << " MB (" << hashRate/1048576 << " MB/s)";
+      if( eta >= 0 )
+        os << ", ETA " << formatDuration(eta);
+      LOG(logInfo) << os.str();
+    }
+    if( !p_statusFile.empty() )
+      writeStatus(seconds, finished, entries, bytes, hashedBytes, done, eta, entryRate, hashRate);
+  }
+
+private:
+  void writeStatus(double seconds, bool finished, uint64_t entries, uint64_t bytes, uint64_t hashedBytes, double done, double eta,
+                   double entryRate, double hashRate) const {
+    //written to a temporary file renamed over the status file, so readers never see a partial one
+    const string temporary = p_statusFile+".tmp";
+    ofstream os(temporary.c_str(), ios_base::out | ios_base::trunc);
+    os << fixed << setprecision(3)
+       << "{\"path\":" << worker::jsonString(p_path)
+       << ",\"state\":\"" << (finished ? "finished" : "crawling") << '"'
+       << ",\"updated\":" << time(0)
+       << ",\"elapsed_seconds\":" << seconds
+       << ",\"entries\":" << entries
+       << ",\"expected_entries\":" << p_expected.files+p_expected.directories
+       << ",\"bytes\":" << bytes
+       << ",\"expected_bytes\":" << p_expected.bytes
+       << ",\"hashed_bytes\":" << hashedBytes
+       << ",\"entries_per_second\":" << entryRate
+       << ",\"hashed_bytes_per_second\":" << hashRate
+       << ",\"progress\":";
+    if( done >= 0 )
+      os << min(done, 1.0);
+    else
+      os << "null";
+    os << ",\"eta_seconds\":";
+    if( eta >= 0 && !finished )
+      os << eta;
+    else
+      os << "null";
+    os << "}\n";
+    os.close();
+    if( os.fail() || rename(temporary.c_str(), p_statusFile.c_str()) != 0 ) {
+      LOG(logWarning) << "Failed to write status file " << p_statusFile << ": " << worker::errnoString();
+      unlink(temporary.c_str());
+    }
+  }
+
+  string p_path;
+  worker::subtreeTotals_t p_expected;
+  bool p_hashing;
+  const atomic<uint64_t>& p_entries;
+  const atomic<uint64_t>& p_bytes;
+  const atomic<uint64_t>& p_hashedBytes;
+  string p_statusFile;
+  mutex p_mutex;
+  double p_lastSeconds;
+  uint64_t p_lastEntries;
+  uint64_t p_lastHashedBytes;
+};
+
+struct checkJob_t {
+  uint64_t id;
+  string path;
+  string expected;
+  uint64_t size;
+};
+
+enum checkStatus_t { checkOk, checkFailed, checkMissing, checkError, checkNoHash };
+
+//aggregates verification results of check and scrub, optionally writing them to a JSON lines report
+class checkResults_t {
+public:
+  checkResults_t(const string& reportFile) : ok(0), failed(0), missing(0), errors(0), noHash(0), bytes(0) {
+    if( reportFile.empty() )
+      return;
+    p_report.open(reportFile.c_str(), ios_base::out | ios_base::trunc);
+    if( !p_report.is_open() )
+      throw runtime_error("failed to open check report "+reportFile);
+  }
+
+  void add(const checkJob_t& job, checkStatus_t status, const string& actual) {
+    static const char* const names[] = { "ok", "failed", "missing", "error", "nohash" };
+    atomic<uint64_t>* counters[] = { &ok, &failed, &missing, &errors, &noHash };
+    (*counters[status])++;
+    if( !p_report.is_open() )
+      return;
+    lock_guard<mutex> lock(p_mutex);
+    p_report << "{\"status\":\"" << names[status] << "\",\"id\":" << job.id << ",\"path\":" << worker::jsonString(job.path)
+             << ",\"expected\":" << worker::jsonString(job.expected) << ",\"actual\":" << worker::jsonString(actual) << "}\n";
+  }
+
+  uint64_t files() const {
+    return ok+failed+missing+errors;
+  }
+
+  void logProgress(const char* verb, double seconds) const {
+    LOG(logInfo) << verb << ' ' << files() << " files (" << fixed << setprecision(1) << files()/seconds << " files/s), "
+                 << bytes/1048576 << " MB (" << bytes/1048576.0/seconds << " MB/s)";
+  }
+
+  void logSummary(double seconds) const {
+    LOG(logInfo) << "Check summary: " << ok << " OK, " << failed << " FAILED, " << missing << " missing, "
+                 << errors << " unreadable, " << noHash << " without hash";
+    LOG(logInfo) << "Verified " << bytes/1048576 << " MB at " << fixed << setprecision(1) << bytes/1048576.0/seconds << " MB/s";
+  }
+
+  atomic<uint64_t> ok, failed, missing, errors, noHash, bytes;
+
+private:
+  ofstream p_report;
+  mutex p_mutex;
+};
+
+//stats and hashes the file of job and compares it to the expected hash, called concurrently by the readers
+static checkStatus_t verifyFile(Hasher* hasher, const checkJob_t& job, checkResults_t& results) {
+  struct stat64 entryStat;
+  if( job.expected.empty() ) {
+    LOG(logWarning) << "Database does not contain a hash for " << job.path;
+    results.add(job, checkNoHash, string());
+    return checkNoHash;
+  }
+  THROTTLE.operation();
+  if( stat64(job.path.c_str(), &entryStat) ) {
+    LOG(logError) << "Hash FAILED, file does not exist: " << job.path;
+    results.add(job, checkMissing, string());
+    return checkMissing;
+  }
+  string actual;
+  if( hasher->hash(job.path, actual) != Hasher::hashSuccess ) {
+    LOG(logError) << "Failed to hash " << job.path;
+    results.add(job, checkError, string());
+    return checkError;
+  }
+  transform(actual.begin(), actual.end(), actual.begin(), ::tolower);
+  results.bytes += entryStat.st_size;
+  if( actual != job.expected ) {
+    LOG(logError) << "Hash FAILED for file " << job.path << ": Expected " << job.expected << ", got " << actual;
+    results.add(job, checkFailed, actual);
+    return checkFailed;
+  }
+  LOG(logInfo) << "Hash OK: " << job.path;
+  results.add(job, checkOk, actual);
+  return checkOk;
+}
+
+void worker::hashCheck(const string& path, uint64_t parent, const string& reportFile) {
   if( !p_databaseInitialized )
     initDatabase();
 
-  struct stat entryStat;
-  vector<entry_t*> entryCache;
-  LOG(logDebug) << "fetching directory entries from db for caching";
-  cacheDirectoryEntriesFromDB(parent, entryCache);
-
-  for( vector<entry_t*>::iterator it = entryCache.begin(); it != entryCache.end(); it++ ) {
-    string subpath = path+"/"+(*it)->name;
-    if( (*it)->type == entry_t::file ) {
-      LOG(logDebug) << "start hashing file " << subpath;
-      string dbHash = (*it)->hash;
-      transform(dbHash.begin(), dbHash.end(), dbHash.begin(), ::tolower);
-      if( dbHash.length() > 0 ) {
-        if( stat(subpath.c_str(), &entryStat) == 0 ) {
-          hashFile(*it, subpath);
-          if( (*it)->hash.length() ) { //skip empty hash results, error has been reported by hashFile
-            if( (*it)->hash != dbHash )
-              LOG(logError) << "Hash FAILED for file " << subpath << ": Expected " << dbHash << ", got " << (*it)->hash;
-            else
-              LOG(logInfo) << "Hash OK: " << subpath;
-          }
-        } else
-          LOG(logError) << "Hash FAILED, file does not exist: " << subpath;
-      } else
-        LOG(logWarning) << "Database does not contain a hash for " << subpath;
-      p_statistics.files++;
-    } else {
-      LOG(logDetailed) << "Entering subdirectory " << subpath;
-      hashCheck(subpath, (*it)->id);
+  checkFiles(reportFile, [&](const checkFile_t& check) {
+    LOG(logDetailed) << "Loading directory tree";
+    unordered_map<uint64_t,string> dirPaths;
+    loadDirectoryPaths(parent, dirPaths);
+    p_statistics.directories += dirPaths.size();
+
+    //single ordered catalog scan producing the jobs, files of one directory are adjacent
+    PreparedStatementWrapper* stmt = PreparedStatementWrapper::create(this, "SELECT id,parent,name,hash,size FROM "+p_fileTable+" ORDER BY parent");
+    stmt->executeQuery();
+    uint64_t lastParent = ~0;
+    const string* dirPath = 0;
+    while( p_run && stmt->next() ) {
+      uint64_t fileParent = stmt->getUInt64(2);
+      if( fileParent != lastParent ) {
+        lastParent = fileParent;
+        unordered_map<uint64_t,string>::const_iterator it = dirPaths.find(fileParent);
+        dirPath = it == dirPaths.end() ? 0 : &it->second; //not below the requested parent
+      }
+      if( dirPath )
+        check(path+*dirPath, stmt->getUInt64(1), stmt->getString(3), stmt->getHash(4), stmt->getUInt64(5));
+    }
+    stmt->release();
+    delete stmt;
+  });
+}
+
+void worker::hashCheck(const string& path, const Snapshot& snapshot, uint32_t root, const string& reportFile) {
+  checkFiles(reportFile, [&](const checkFile_t& check) {
+    //depth first, the files of a directory are checked before its subdirectories
+    vector< pair<uint32_t,string> > pending(1, make_pair(root, path));
+    while( p_run && !pending.empty() ) {
+      uint32_t dir = pending.back().first;
+      string dirPath = pending.back().second;
+      pending.pop_back();
       p_statistics.directories++;
+      for( uint32_t node = snapshot.firstChild(dir); node != Snapshot::none; node = snapshot.nextSibling(node) ) {
+        if( snapshot.isDirectory(node) )
+          pending.push_back(make_pair(node, dirPath+'/'+snapshot.name(node)));
+        else
+          check(dirPath, snapshot.id(node), snapshot.name(node), snapshot.hash(node), snapshot.size(node));
+      }
     }
-    if (!p_run) //break loop on global abort condition
-      break;
+  });
+}
+
+void worker::checkFiles(const string& reportFile, const function<void(const checkFile_t&)>& producer) {
+  checkResults_t results(reportFile);
+  atomic<bool> failed(false); //the producer threw, the readers only drain their queues
+
+  auto reader = [&](JobQueue<checkJob_t>* queue) {
+    checkJob_t job;
+    while( queue->pop(job) )
+      if( p_run && !failed ) //drain the queue on abort
+        verifyFile(p_hasher, job, results);
+  };
+
+  //every device gets its own queue and readers, so slow disks do not stall the others
+  map< dev_t, pair<JobQueue<checkJob_t>*, vector<thread>*> > devices;
+  auto deviceQueue = [&](dev_t device) {
+    map< dev_t, pair<JobQueue<checkJob_t>*, vector<thread>*> >::iterator it = devices.find(device);
+    if( it != devices.end() )
+      return it->second.first;
+    LOG(logDetailed) << "Starting " << p_threads << " readers for device " << device;
+    JobQueue<checkJob_t>* queue = new JobQueue<checkJob_t>(16*p_threads);
+    vector<thread>* readers = new vector<thread>;
+    for( unsigned int t = 0; t < p_threads; t++ )
+      readers->push_back(thread(reader, queue));
+    devices[device] = make_pair(queue, readers);
+    return queue;
+  };
+
+  //the readers have to be joined before unwinding, a joinable thread terminates the process when destroyed
+  auto stopReaders = [&]() {
+    for( map< dev_t, pair<JobQueue<checkJob_t>*, vector<thread>*> >::iterator it = devices.begin(); it != devices.end(); it++ ) {
+      it->second.first->close();
+      for( vector<thread>::iterator t = it->second.second->begin(); t != it->second.second->end(); t++ )
+        t->join();
+      delete it->second.first;
+      delete it->second.second;
+    }
+    devices.clear();
+  };
+
+  PeriodicReporter progress(p_progressInterval, [&](double seconds) { results.logProgress("Checked", seconds); });
+
+  string lastDirPath;
+  JobQueue<checkJob_t>* queue = 0;
+  try {
+    producer([&](const string& dirPath, uint64_t id, const string& name, const string& hash, uint64_t size) {
+      if( !queue || dirPath != lastDirPath ) { //the device is looked up once per directory
+        lastDirPath = dirPath;
+        struct stat64 dirStat;
+        THROTTLE.operation();
+        queue = deviceQueue(stat64(dirPath.c_str(), &dirStat) ? 0 : dirStat.st_dev);
+      }
+      checkJob_t job = { .id = id, .path = dirPath+'/'+name, .expected = hash, .size = size };
+      transform(job.expected.begin(), job.expected.end(), job.expected.begin(), ::tolower);
+      p_statistics.files++;
+      if( job.expected.empty() )
+        verifyFile(p_hasher, job, results); //only records the missing hash
+      else
+        queue->push(job);
+    });
+  } catch( ... ) {
+    failed = true;
+    stopReaders();
+    throw;
+  }
+  stopReaders();
+
+  results.logSummary(progress.elapsed());
+}
+
+void worker::scrub(const string& path, uint64_t parent, uint64_t timeBudget, uint64_t byteBudget, const string& reportFile) {
+  if( !p_databaseInitialized )
+    initDatabase();
+
+  checkResults_t results(reportFile);
+
+  LOG(logDetailed) << "Loading directory tree";
+  unordered_map<uint64_t,string> dirPaths;
+  loadDirectoryPaths(parent, dirPaths);
+
+  PeriodicReporter progress(p_progressInterval, [&](double seconds) { results.logProgress("Scrubbed", seconds); });
+  atomic<uint64_t> bytesReserved(0);
+  auto budgetLeft = [&]() {
+    return p_run && (timeBudget == 0 || progress.elapsed() < timeBudget) && (byteBudget == 0 || bytesReserved < byteBudget);
+  };
+
+  //files that have never been verified come first, then the ones verified longest ago
+  //both are paged by keyset on (last_verified, id), so files outside of parent and files failing the check are passed once
+  const uint32_t batchSize = 256*p_threads;
+  const time_t start = time(0);
+  PreparedStatementWrapper* selectUnverified = PreparedStatementWrapper::create(this, "SELECT id,parent,name,hash,size FROM "+p_fileTable+" "
+                                                                                      "WHERE last_verified IS NULL AND id>? ORDER BY id "+p_backend->limit());
+  PreparedStatementWrapper* selectVerified = PreparedStatementWrapper::create(this, "SELECT id,parent,name,hash,size,"+p_backend->unixTime("last_verified")+" FROM "+p_fileTable+" "
+                                                                                    "WHERE last_verified<"+p_backend->fromUnixTime("?")+" AND "
+                                                                                    "(last_verified>"+p_backend->fromUnixTime("?")+" OR (last_verified="+p_backend->fromUnixTime("?")+" AND id>?)) "
+                                                                                    "ORDER BY last_verified,id "+p_backend->limit());
+  PreparedStatementWrapper* update = PreparedStatementWrapper::create(this, "UPDATE "+p_fileTable+" SET last_verified="+p_backend->fromUnixTime("?")+" WHERE id=?");
+  bool unverified = true;
+  uint64_t lastId = 0;
+  uint64_t lastVerified = 0;
+  vector<checkJob_t> batch;
+  while( budgetLeft() ) {
+    batch.clear();
+    PreparedStatementWrapper* select = unverified ? selectUnverified : selectVerified;
+    unsigned int index = 1;
+    if( !unverified ) {
+      select->setUInt64(index++,start);
+      select->setUInt64(index++,lastVerified);
+      select->setUInt64(index++,lastVerified);
+    }
+    select->setUInt64(index++,lastId);
+    select->setUInt64(index++,0);
+    select->setUInt64(index++,batchSize);
+    uint32_t rows = 0;
+    select->executeQuery();
+    while( select->next() ) {
+      rows++;
+      lastId = select->getUInt64(1);
+      if( !unverified )
+        lastVerified = select->getUInt64(6);
+      unordered_map<uint64_t,string>::const_iterator it = dirPaths.find(select->getUInt64(2));
+      if( it == dirPaths.end() ) //not below the requested parent
+        continue;
+      checkJob_t job = { .id = select->getUInt64(1), .path = path+it->second+'/'+select->getString(3), .expected = select->getHash(4), .size = select->getUInt64(5) };
+      transform(job.expected.begin(), job.expected.end(), job.expected.begin(), ::tolower);
+      batch.push_back(job);
+    }
+    select->release();
+    if( rows == 0 ) {
+      if( !unverified )
+        break;
+      unverified = false;
+      lastId = 0;
+      continue;
+    }
+
+    //only files that passed (or have no hash to compare) count as verified, the others stay at the front of the order
+    vector<char> processed(batch.size(), false), passed(batch.size(), false);
+    runParallel(batch.size(), p_threads, p_run, [&](size_t i) {
+      if( !budgetLeft() )
+        return;
+      bytesReserved += batch[i].size;
+      checkStatus_t status = verifyFile(p_hasher, batch[i], results);
+      processed[i] = true;
+      passed[i] = status == checkOk || status == checkNoHash;
+    });
+
+    for( size_t i = 0; i < batch.size(); i++ ) {
+      if( !processed[i] )
+        continue;
+      p_statistics.files++;
+      if( passed[i] && !p_dryRun ) {
+        update->setUInt64(1,time(0));
+        update->setUInt64(2,batch[i].id);
+        update->execute();
+      }
+    }
+  }
+  delete selectUnverified;
+  delete selectVerified;
+  delete update;
+
+  results.logSummary(progress.elapsed());
+
+  //report how far the rolling cycle below parent has come, the catalog is summed up per directory
+  PreparedStatementWrapper* stmt = PreparedStatementWrapper::create(this, "SELECT parent,COUNT(*),COALESCE(SUM(size),0),COUNT(*)-COUNT(last_verified),"
+                                                                          "COALESCE("+p_backend->unixTime("MIN(last_verified)")+",0) FROM "+p_fileTable+" GROUP BY parent");
+  uint64_t totalFiles = 0, totalBytes = 0, neverVerified = 0;
+  time_t oldest = 0;
+  stmt->executeQuery();
+  while( stmt->next() ) {
+    if( !dirPaths.count(stmt->getUInt64(1)) )
+      continue;
+    totalFiles += stmt->getUInt64(2);
+    totalBytes += stmt->getUInt64(3);
+    neverVerified += stmt->getUInt64(4);
+    time_t verified = stmt->getUInt64(5);
+    if( verified && (!oldest || verified < oldest) )
+      oldest = verified;
+  }
+  stmt->release();
+  delete stmt;
+  LOG(logInfo) << "Scrub progress: " << neverVerified << " of " << totalFiles << " files never verified";
+  if( oldest ) {
+    char buffer[32];
+    strftime(buffer, sizeof(buffer), "%F %T", localtime(&oldest));
+    LOG(logInfo) << "Oldest verification of a file dates from " << buffer;
+  }
+  if( results.bytes > 0 ) {
+    LOG(logInfo) << "At this rate, a complete cycle takes " << totalBytes/results.bytes+1 << " runs";
+  }
+}
+
+struct duplicate_t {
+  uint64_t id;
+  uint64_t size;
+  string path;
+  string hash;
+  bool complete; //hash covers the whole file
+};
+
+//sorts candidates by size and hash and drops every candidate that has no partner with equal size and hash
+static void pruneUnique(vector<duplicate_t>& candidates) {
+  sort(candidates.begin(), candidates.end(), [](const duplicate_t& a, const duplicate_t& b) {
+    return a.size < b.size || (a.size == b.size && a.hash < b.hash);
+  });
+  vector<duplicate_t> kept;
+  for( size_t begin = 0, end; begin < candidates.size(); begin = end ) {
+    for( end = begin+1; end < candidates.size() && candidates[end].size == candidates[begin].size && candidates[end].hash == candidates[begin].hash; end++ );
+    if( end-begin > 1 )
+      move(candidates.begin()+begin, candidates.begin()+end, back_inserter(kept));
+  }
+  candidates.swap(kept);
+}
+
+void worker::findDuplicates(const string& path, uint64_t parent, uint64_t sampleSize) {
+  if( !p_databaseInitialized )
+    initDatabase();
+
+  //stage 1: every file sharing its size with another file is a candidate
+  LOG(logDetailed) << "Fetching files of colliding sizes";
+  vector<duplicate_t> candidates;
+  vector< pair<uint64_t,duplicate_t> > rows; //parent and candidate, paths are resolved after the scan
+  PreparedStatementWrapper* stmt = PreparedStatementWrapper::create(this, "SELECT f.id,f.parent,f.name,f.size FROM "+p_fileTable+" f "
+                                                                          "JOIN (SELECT size FROM "+p_fileTable+" WHERE size>0 GROUP BY size HAVING COUNT(*)>1) d "
+                                                                          "ON f.size=d.size");
+  stmt->executeQuery();
+  while( p_run && stmt->next() ) {
+    duplicate_t d = { .id = stmt->getUInt64(1), .size = stmt->getUInt64(4), .path = stmt->getString(3), .hash = string(), .complete = false };
+    rows.push_back(make_pair(stmt->getUInt64(2), d));
+  }
+  stmt->release();
+  delete stmt;
+
+  //the paths of all directories below the fakepath in one scan, candidates in any other directory are skipped
+  unordered_map<uint64_t,string> dirPaths;
+  loadDirectoryPaths(parent, dirPaths);
+  for( vector< pair<uint64_t,duplicate_t> >::iterator it = rows.begin(); p_run && it != rows.end(); it++ ) {
+    unordered_map<uint64_t,string>::const_iterator dirPath = dirPaths.find(it->first);
+    if( dirPath == dirPaths.end() ) //not below the requested fakepath
+      continue;
+    it->second.path = path+dirPath->second+'/'+it->second.path;
+    candidates.push_back(it->second);
   }
+  rows.clear();
+  pruneUnique(candidates);
+
+  uint64_t totalBytes = 0;
+  for( vector<duplicate_t>::const_iterator it = candidates.begin(); it != candidates.end(); it++ )
+    totalBytes += it->size;
+  LOG(logInfo) << "Stage 1: " << candidates.size() << " files with colliding sizes (" << totalBytes << " bytes)";
+
+  //stage 2: hash head and tail samples, files no larger than both samples are hashed completely
+  atomic<uint64_t> bytesRead(0);
+  runParallel(candidates.size(), p_threads, p_run, [&](size_t i) {
+    duplicate_t& d = candidates[i];
+    if( p_hasher->hashSample(d.path, sampleSize, d.hash) != Hasher::hashSuccess ) {
+      LOG(logError) << "Failed to sample " << d.path << ", skipping";
+      d.hash.clear();
+      return;
+    }
+    d.complete = d.size <= 2*sampleSize;
+    bytesRead += min(d.size, 2*sampleSize);
+  });
+  candidates.erase(remove_if(candidates.begin(), candidates.end(), [](const duplicate_t& d) { return d.hash.empty(); }), candidates.end());
+  pruneUnique(candidates);
+  LOG(logInfo) << "Stage 2: " << candidates.size() << " candidates left after sampling, read " << bytesRead << " bytes";
+
+  //stage 3: fully hash the remaining candidates
+  vector<size_t> incomplete;
+  for( size_t i = 0; i < candidates.size(); i++ )
+    if( !candidates[i].complete )
+      incomplete.push_back(i);
+  runParallel(incomplete.size(), p_threads, p_run, [&](size_t i) {
+    duplicate_t& d = candidates[incomplete[i]];
+    if( p_hasher->hash(d.path, d.hash) != Hasher::hashSuccess ) {
+      LOG(logError) << "Failed to hash " << d.path << ", skipping";
+      d.hash.clear();
+      return;
+    }
+    d.complete = true;
+    bytesRead += d.size;
+  });
+  candidates.erase(remove_if(candidates.begin(), candidates.end(), [](const duplicate_t& d) { return !d.complete; }), candidates.end());
+  pruneUnique(candidates);
+  LOG(logInfo) << "Stage 3: " << incomplete.size() << " files hashed completely, read " << bytesRead << " bytes in total";
+
+  if (!p_run)
+    return;
+
+  PreparedStatementWrapper* insert = 0;
+  if (!p_dryRun) {
+    p_backend->createDuplicatesTable(p_duplicatesTable);
+    p_backend->clearTable(p_duplicatesTable);
+    insert = PreparedStatementWrapper::create(this, "INSERT INTO "+p_duplicatesTable+" (grp,id,size,hash) VALUES (?, ?, ?, ?)");
+  }
+
+  uint32_t groups = 0;
+  uint64_t wastedBytes = 0;
+  for( size_t begin = 0, end; begin < candidates.size(); begin = end ) {
+    groups++;
+    for( end = begin+1; end < candidates.size() && candidates[end].size == candidates[begin].size && candidates[end].hash == candidates[begin].hash; end++ );
+    cout << "# group " << groups << ": " << end-begin << " files of " << candidates[begin].size << " bytes, " << Hasher::hashTypeToString(p_hasher->getHashType()) << ' ' << candidates[begin].hash << '\n';
+    for( size_t i = begin; i < end; i++ ) {
+      cout << candidates[i].path << '\n';
+      p_statistics.files++;
+      if (insert) {
+        insert->setUInt64(1,groups);
+        insert->setUInt64(2,candidates[i].id);
+        insert->setUInt64(3,candidates[i].size);
+        insert->setHash(4,candidates[i].hash);
+        insert->execute();
+      }
+    }
+    cout << '\n';
+    wastedBytes += (end-begin-1)*candidates[begin].size;
+  }
+  cout.flush();
+  delete insert;
+
+  LOG(logInfo) << "Found " << groups << " groups with " << candidates.size() << " duplicate files wasting " << wastedBytes << " bytes";
+  LOG(logInfo) << "Read " << bytesRead << " of " << totalBytes << " candidate bytes";
+}
+
+void worker::copyCatalog(worker* target) {
+  if( !p_databaseInitialized )
+    initDatabase();
+  if( !target->p_databaseInitialized )
+    target->initDatabase();
+
+  //ids are kept, so rows already in the target would collide with the copied ones
+  for( int files = 0; files < 2; files++ ) {
+    const string& targetTable = files ? target->p_fileTable : target->p_directoryTable;
+    PreparedStatementWrapper* stmt = PreparedStatementWrapper::create(target, "SELECT id FROM "+targetTable);
+    stmt->executeQuery();
+    bool empty = !stmt->next();
+    stmt->release();
+    delete stmt;
+    if( !empty )
+      throw runtime_error(string("the ")+target->p_backend->name()+" catalog to convert into is not empty, "+targetTable+" has rows");
+  }
+
+  //directories first, so a target checking references always finds the parent
+  for( int files = 0; files < 2; files++ ) {
+    const string& table = files ? p_fileTable : p_directoryTable;
+    const string& targetTable = files ? target->p_fileTable : target->p_directoryTable;
+    string select = "SELECT id,name,parent,size,"+p_backend->unixTime("date");
+    string insert = "INSERT INTO "+targetTable+" (id,name,parent,size,date";
+    string values = "?, ?, ?, ?, "+target->p_backend->fromUnixTime("?");
+    if( files ) {
+      select += ",hash,"+p_backend->unixTime("last_verified");
+      insert += ",hash,last_verified";
+      values += ", ?, "+target->p_backend->fromUnixTime("?");
+    }
+    PreparedStatementWrapper* src = PreparedStatementWrapper::create(this, select+" FROM "+table);
+    PreparedStatementWrapper* dst = PreparedStatementWrapper::create(target, insert+") VALUES ("+values+")");
+    uint32_t copied = 0;
+    src->executeQuery();
+    while( p_run && src->next() ) {
+      dst->setUInt64(1,src->getUInt64(1));
+      dst->setString(2,src->getString(2));
+      dst->setUInt64(3,src->getUInt64(3));
+      dst->setUInt64(4,src->getUInt64(4));
+      dst->setUInt64(5,src->getUInt64(5));
+      if( files ) {
+        string hash = src->getHash(6);
+        if( hash.empty() )
+          dst->setNull(6,0);
+        else
+          dst->setHash(6,hash);
+        uint64_t lastVerified = src->getUInt64(7);
+        if( lastVerified )
+          dst->setUInt64(7,lastVerified);
+        else
+          dst->setNull(7,0);
+      }
+      if( !p_dryRun )
+        dst->execute();
+      copied++;
+    }
+    src->release();
+    delete src;
+    delete dst;
+    LOG(logInfo) << "Copied " << copied << (files ? " files" : " directories") << " into the " << target->p_backend->name() << " catalog";
+    if( files )
+      p_statistics.files = copied;
+    else
+      p_statistics.directories = copied;
+  }
+  target->p_backend->flush();
 }
 
 void worker::initDatabase() {
   LOG(logDebug) << "create tables if not exists"; //create database tables in case they do not exist
-  if (!p_dryRun) {
-    query("CREATE TABLE IF NOT EXISTS "+p_directoryTable+" "
-          "(id INT UNSIGNED NOT NULL AUTO_INCREMENT KEY, "
-          "name VARCHAR(255) NOT NULL, "
-          "parent INT UNSIGNED DEFAULT NULL, "
-          "size BIGINT UNSIGNED, "
-          "date DATETIME DEFAULT NULL, "
-          "INDEX(parent)) "
-          "DEFAULT CHARACTER SET utf8 "
-          "COLLATE utf8_bin"); //utf8_bin collation against errors with umlauts, e.g. two directories named "Moo" and "Möo"
-    query("CREATE TABLE IF NOT EXISTS "+p_fileTable+" "
-          "(id INT UNSIGNED NOT NULL AUTO_INCREMENT KEY,"
-          "name VARCHAR(255) NOT NULL, "
-          "parent INT UNSIGNED DEFAULT NULL, "
-          "size BIGINT UNSIGNED, "
-          "date DATETIME DEFAULT NULL, "
-          "hash VARCHAR(40) DEFAULT NULL, " //use VARCHAR instead of BINARY due to TTH hash support (encoded 39chars base32), md5 and sha1 are encoded hex
-          "INDEX(parent)) "
-          "DEFAULT CHARACTER SET utf8 "
-          "COLLATE utf8_bin"); //utf8_bin collation against errors with umlauts, e.g. two files named "Moo" and "Möo"
+  p_backend->useTables(p_directoryTable, p_fileTable);
+  if (!p_dryRun && !p_readOnly)
+    p_backend->createTables(p_directoryTable, p_fileTable);
+  p_binaryHashes = p_backend->binaryHashes(p_fileTable);
+  if (p_binaryHashes) {
+    LOG(logDebug) << "hashes of " << p_fileTable << " are stored in binary";
   }
 
   prepareStatements();
+  if (p_explain)
+    explainStatements();
 
   resetStatistics();
 
   p_databaseInitialized = true;
 }
 
+bool worker::reconnect() {
+  if (!p_backend->reconnect())
+    return false;
+  LOG(logInfo) << "Reconnected to database";
+  databaseReconnected();
+  return true;
+}
+
 void worker::databaseReconnected() {
-  prepareStatements();
+  LOG(logDebug) << "re-preparing " << p_statements.size() << " statements";
+  for( set<PreparedStatementWrapper*>::iterator it = p_statements.begin(); it != p_statements.end(); it++ ) {
+    if( (*it)->hasOpenResult() ) //an outer loop is still reading it, it is reprepared once released
+      (*it)->connectionLost();
+    else
+      (*it)->reprepare();
+  }
+}
+
+void worker::registerStatement(PreparedStatementWrapper* statement) {
+  p_statements.insert(statement);
+}
+
+void worker::unregisterStatement(PreparedStatementWrapper* statement) {
+  p_statements.erase(statement);
 }
 
 void worker::prepareStatements() {
   LOG(logDebug) << "preparing statements";
+  const string date = p_backend->unixTime("date");
+  const string setDate = p_backend->fromUnixTime("?");
 
   if (p_prepQueryFileById)
     p_prepQueryFileById->reprepare();
   else
-    p_prepQueryFileById = PreparedStatementWrapper::create(this, "SELECT name,parent,size,UNIX_TIMESTAMP(date),hash FROM "+p_fileTable+" WHERE id=?");
+    p_prepQueryFileById = PreparedStatementWrapper::create(this, "SELECT name,parent,size,"+date+",hash FROM "+p_fileTable+" WHERE id=?");
 
   if( p_prepQueryFileByName)
     p_prepQueryFileByName->reprepare();
   else
-    p_prepQueryFileByName = PreparedStatementWrapper::create(this, "SELECT id,size,UNIX_TIMESTAMP(date),hash FROM "+p_fileTable+" WHERE parent=? AND name=?");
+    p_prepQueryFileByName = PreparedStatementWrapper::create(this, "SELECT id,size,"+date+",hash FROM "+p_fileTable+" WHERE parent=? AND name=?");
 
   if( p_prepQueryFilesByParent)
     p_prepQueryFilesByParent->reprepare();
   else
-    p_prepQueryFilesByParent = PreparedStatementWrapper::create(this, "SELECT id,name,size,UNIX_TIMESTAMP(date),hash FROM "+p_fileTable+" WHERE parent=?");
+    p_prepQueryFilesByParent = PreparedStatementWrapper::create(this, "SELECT id,name,size,"+date+",hash FROM "+p_fileTable+" WHERE parent=?");
 
   if( p_prepInsertFile)
     p_prepInsertFile->reprepare();
   else
-    p_prepInsertFile = PreparedStatementWrapper::create(this, "INSERT INTO "+p_fileTable+" (name,parent,size,date,hash) VALUES (?, ?, ?, FROM_UNIXTIME(?), ?)");
+    p_prepInsertFile = PreparedStatementWrapper::create(this, "INSERT INTO "+p_fileTable+" (name,parent,size,date,hash) VALUES (?, ?, ?, "+setDate+", ?)");
 
   if( p_prepUpdateFile)
     p_prepUpdateFile->reprepare();
   else
-    p_prepUpdateFile = PreparedStatementWrapper::create(this, "UPDATE "+p_fileTable+" SET size=?, date=FROM_UNIXTIME(?), hash=? WHERE id=?");
+    p_prepUpdateFile = PreparedStatementWrapper::create(this, "UPDATE "+p_fileTable+" SET size=?, date="+setDate+", hash=? WHERE id=?");
 
   if( p_prepDeleteFile)
     p_prepDeleteFile->reprepare();
@@ -386,17 +1203,17 @@ void worker::prepareStatements() {
   if( p_prepQueryDirById)
     p_prepQueryDirById->reprepare();
   else
-    p_prepQueryDirById = PreparedStatementWrapper::create(this, "SELECT name,parent,size,UNIX_TIMESTAMP(date) FROM "+p_directoryTable+" WHERE id=?");
+    p_prepQueryDirById = PreparedStatementWrapper::create(this, "SELECT name,parent,size,"+date+" FROM "+p_directoryTable+" WHERE id=?");
 
   if( p_prepQueryDirByName)
     p_prepQueryDirByName->reprepare();
   else
-    p_prepQueryDirByName = PreparedStatementWrapper::create(this, "SELECT id,size,UNIX_TIMESTAMP(date) FROM "+p_directoryTable+" WHERE parent=? AND name=?");
+    p_prepQueryDirByName = PreparedStatementWrapper::create(this, "SELECT id,size,"+date+" FROM "+p_directoryTable+" WHERE parent=? AND name=?");
 
   if( p_prepQueryDirsByParent)
     p_prepQueryDirsByParent->reprepare();
   else
-    p_prepQueryDirsByParent = PreparedStatementWrapper::create(this, "SELECT id,name,size,UNIX_TIMESTAMP(date) FROM "+p_directoryTable+" WHERE parent=?");
+    p_prepQueryDirsByParent = PreparedStatementWrapper::create(this, "SELECT id,name,size,"+date+" FROM "+p_directoryTable+" WHERE parent=?");
 
   if (p_prepQueryParentOfDir)
     p_prepQueryParentOfDir->reprepare();
@@ -406,22 +1223,44 @@ void worker::prepareStatements() {
   if( p_prepInsertDir)
     p_prepInsertDir->reprepare();
   else
-    p_prepInsertDir = PreparedStatementWrapper::create(this, "INSERT INTO "+p_directoryTable+" (name,parent,size,date) VALUES (?, ?, ?, FROM_UNIXTIME(?))");
+    p_prepInsertDir = PreparedStatementWrapper::create(this, "INSERT INTO "+p_directoryTable+" (name,parent,size,date) VALUES (?, ?, ?, "+setDate+")");
 
   if( p_prepUpdateDir)
     p_prepUpdateDir->reprepare();
   else
-    p_prepUpdateDir = PreparedStatementWrapper::create(this, "UPDATE "+p_directoryTable+" SET size=?, date=FROM_UNIXTIME(?) WHERE id=?");
+    p_prepUpdateDir = PreparedStatementWrapper::create(this, "UPDATE "+p_directoryTable+" SET size=?, date="+setDate+" WHERE id=?");
 
   if( p_prepDeleteDir)
     p_prepDeleteDir->reprepare();
   else
     p_prepDeleteDir = PreparedStatementWrapper::create(this, "DELETE FROM "+p_directoryTable+" WHERE id=?");
+}
 
-  if( p_prepLastInsertID)
-    p_prepLastInsertID->reprepare();
-  else
-    p_prepLastInsertID = PreparedStatementWrapper::create(this, "SELECT LAST_INSERT_ID()");
+void worker::explainStatements() {
+  set<string> explained; //statements sharing their SQL are explained once
+  for( set<PreparedStatementWrapper*>::iterator it = p_statements.begin(); it != p_statements.end(); it++ ) {
+    const string& sql = (*it)->getQuery();
+    if( !explained.insert(sql).second )
+      continue;
+    vector<string> plan;
+    try {
+      if( !p_backend->explain(sql, plan) ) {
+        LOG(logInfo) << "The " << p_backend->name() << " backend has no query plans to explain";
+        return;
+      }
+    } catch( SQLException& e ) {
+      LOG(logWarning) << "Failed to explain " << sql << ": " << e.what();
+      continue;
+    }
+    if( plan.empty() ) {
+      LOG(logInfo) << "No query plan for " << sql;
+      continue;
+    }
+    LOG(logInfo) << "Query plan of " << sql << ':';
+    for( vector<string>::iterator line = plan.begin(); line != plan.end(); line++ ) {
+      LOG(logInfo) << "  " << *line;
+    }
+  }
 }
 
 void worker::inheritProperties(entry_t* parent, const entry_t* entry) const {
@@ -433,61 +1272,101 @@ void worker::inheritProperties(entry_t* parent, const entry_t* entry) const {
   }
 }
 
-uint32_t worker::insertDirectory(uint32_t parent, const string& name, uint64_t size, time_t mtime) {
+uint64_t worker::insertDirectory(uint64_t parent, const string& name, uint64_t size, time_t mtime) {
   LOG(logDebug) << "inserting dir " << name << " size " << size << " mtime " << mtime << " parent " << parent;
   if (p_dryRun)
     return ~0;
   p_prepInsertDir->setString(1,name);
-  p_prepInsertDir->setUInt(2,parent);
+  p_prepInsertDir->setUInt64(2,parent);
   p_prepInsertDir->setUInt64(3,size);
-  p_prepInsertDir->setUInt(4,mtime);
+  p_prepInsertDir->setUInt64(4,mtime);
   p_prepInsertDir->execute();
+  static Counter& inserted = rowCounter("directories", "insert");
+  inserted.add();
 
-  uint32_t id = 0;
-  p_prepLastInsertID->executeQuery();
-  if( p_prepLastInsertID->next() )
-    id = p_prepLastInsertID->getUInt(1);
-  else
+  uint64_t id = p_prepInsertDir->lastInsertId();
+  if( id == 0 ) {
     LOG(logError) << "Insert statement failed for " << name;
-  p_prepLastInsertID->release();
+  } else {
+    for( vector<CatalogObserver*>::iterator it = p_observers.begin(); it != p_observers.end(); it++ )
+      (*it)->directoryInserted(id, parent, name, size, mtime);
+  }
   return id;
 }
 
-uint32_t worker::insertFile(uint32_t parent, const string& name, uint64_t size, time_t mtime, const string& hash) {
+uint64_t worker::insertFile(uint64_t parent, const string& name, uint64_t size, time_t mtime, const string& hash) {
   LOG(logDebug) << "inserting file " << name << " size " << size << " mtime " << mtime << " hash " << hash << " parent " << parent;
   if (p_dryRun)
     return ~0;
   p_prepInsertFile->setString(1,name);
-  p_prepInsertFile->setUInt(2,parent);
+  p_prepInsertFile->setUInt64(2,parent);
   p_prepInsertFile->setUInt64(3,size);
-  p_prepInsertFile->setUInt(4,mtime);
+  p_prepInsertFile->setUInt64(4,mtime);
   if( hash.length() )
-    p_prepInsertFile->setString(5,hash);
+    p_prepInsertFile->setHash(5,hash);
   else
     p_prepInsertFile->setNull(5,0);
   p_prepInsertFile->execute();
+  static Counter& inserted = rowCounter("files", "insert");
+  inserted.add();
 
-  uint32_t id = 0;
-  p_prepLastInsertID->executeQuery();
-  if( p_prepLastInsertID->next() )
-    id = p_prepLastInsertID->getUInt(1);
-  else
+  uint64_t id = p_prepInsertFile->lastInsertId();
+  if( id == 0 ) {
     LOG(logError) << "Insert statement failed for " << name;
-  p_prepLastInsertID->release();
+  } else {
+    for( vector<CatalogObserver*>::iterator it = p_observers.begin(); it != p_observers.end(); it++ )
+      (*it)->fileInserted(id, parent, name, size, mtime, hash);
+  }
   return id;
 }
 
-void worker::parseDirectory(const string& path, uint32_t id) {
+void worker::parseDirectory(const string& path, uint64_t id) {
   if( !p_databaseInitialized )
     initDatabase();
 
   entry_t e = getDirectoryById(id);
-  parseDirectory(path, &e);
-  if( e.id != 0 && e.state == entry_t::entryPropertiesChanged ) //don't write a directory id 0 (no fakepath)
-    updateDirectory(e.id, e.size, e.mtime);
+  p_crawledEntries = 0;
+  p_crawledBytes = 0;
+  p_hashedBytes = 0;
+  CrawlProgress progress(path, countSubtree(id, e), p_hasher != 0, p_crawledEntries, p_crawledBytes, p_hashedBytes, p_statusFile);
+  {
+    PeriodicReporter reporter(p_progressInterval, [&](double seconds) { progress.report(seconds, false); });
+    parseDirectory(path, &e);
+    if( e.id != 0 && e.state == entry_t::entryPropertiesChanged ) //don't write a directory id 0 (no fakepath)
+      updateDirectory(e.id, e.size, e.mtime);
+    progress.report(reporter.elapsed(), true);
+  }
+}
+
+worker::subtreeTotals_t worker::countSubtree(uint64_t id, const entry_t& root) {
+  subtreeTotals_t totals = { 0, 0, root.size };
+  if( !p_progress && p_statusFile.empty() ) //the stored size is enough for the progress of hashing crawls
+    return totals;
+  //a recursive query walks the subtree in the database instead of a lookup per directory
+  const string subtree = "WITH RECURSIVE subtree(id) AS (SELECT id FROM "+p_directoryTable+" WHERE parent=? "
+                         "UNION ALL SELECT d.id FROM "+p_directoryTable+" d JOIN subtree s ON d.parent=s.id) ";
+  PreparedStatementWrapper* stmt = 0;
+  try {
+    stmt = PreparedStatementWrapper::create(this, subtree+"SELECT (SELECT COUNT(*) FROM subtree),COUNT(*),COALESCE(SUM(size),0) FROM "+p_fileTable+" "
+                                                          "WHERE parent=? OR parent IN (SELECT id FROM subtree)");
+    stmt->setUInt64(1, id);
+    stmt->setUInt64(2, id);
+    stmt->executeQuery();
+    if( stmt->next() ) {
+      totals.directories = stmt->getUInt64(1);
+      totals.files = stmt->getUInt64(2);
+      totals.bytes = stmt->getUInt64(3);
+    }
+    stmt->release();
+  } catch( exception& e ) {
+    LOG(logDebug) << "counting the entries below " << id << " failed: " << e.what();
+  }
+  delete stmt;
+  LOG(logDebug) << "the catalog holds " << totals.files << " files and " << totals.directories << " directories with " << totals.bytes << " bytes below " << id;
+  return totals;
 }
 
-void worker::parseDirectory(const string& path, entry_t* ownEntry) {
+void worker::parseDirectory(const string& path, entry_t* ownEntry, bool isNew) {
   if( !p_databaseInitialized )
     initDatabase();
 
@@ -496,23 +1375,51 @@ void worker::parseDirectory(const string& path, entry_t* ownEntry) {
   struct stat64 dirEntryStat; //directory's stat
   vector<entry_t*> entryCache;
 
+  static Histogram& statLatency = METRICS.histogram("fscrawl_stat_seconds", "Latency of stat calls on directory entries");
+  static Histogram& readdirLatency = METRICS.histogram("fscrawl_readdir_seconds", "Time spent in opendir and readdir per directory, excluding the processing of its entries");
+  static Counter& crawledFiles = METRICS.counter("fscrawl_crawled_entries_total", "Directory entries crawled", Metrics::label("type", "file"));
+  static Counter& crawledDirectories = METRICS.counter("fscrawl_crawled_entries_total", "Directory entries crawled", Metrics::label("type", "directory"));
+
   LOG(logDetailed) << "Processing directory " << path;
+  TraceSpan span("crawl", "directory");
+  span.arg("path", path);
 
+  THROTTLE.operation();
+  chrono::steady_clock::time_point listingStart = chrono::steady_clock::now();
   dir = opendir(path.c_str());
+  chrono::steady_clock::time_point opened = chrono::steady_clock::now();
+  if( Tracer::enabled() )
+    TRACER.record("crawl", "opendir", listingStart, opened, string());
   if( dir == NULL ) {
     LOG(logError) << "failed to read directory " << path << ": " << errnoString();
     return;
   }
 
-  LOG(logDebug) << "fetching directory entries from db for caching";
-  cacheDirectoryEntriesFromDB(ownEntry->id, entryCache);
+  if( !isNew ) {
+    LOG(logDebug) << "fetching directory entries from db for caching";
+    cacheDirectoryEntriesFromDB(ownEntry->id, entryCache);
+  }
 
-  while( p_run && ( dirEntry = readdir(dir) ) ) { //readdir returns NULL when "end" of directory is reached
+  chrono::steady_clock::time_point scanStart = chrono::steady_clock::now(); //readdir, stat and comparison with the cache
+  chrono::steady_clock::duration listing = opened-listingStart;
+  while( p_run ) {
+    listingStart = chrono::steady_clock::now();
+    dirEntry = readdir(dir);
+    chrono::steady_clock::time_point listingEnd = chrono::steady_clock::now();
+    listing += listingEnd-listingStart;
+    if( !dirEntry ) //readdir returns NULL when "end" of directory is reached
+      break;
     if( strcmp(dirEntry->d_name,".") == 0 || strcmp(dirEntry->d_name,"..") == 0 ) //don't process . and .. for obvious reasons
       continue;
     string dirEntryPath = path + '/' + dirEntry->d_name;
     LOG(logDebug) << "processing dirEntry " << dirEntryPath;
-    if( stat64(dirEntryPath.c_str(), &dirEntryStat) ) {
+    THROTTLE.operation();
+    int statResult = stat64(dirEntryPath.c_str(), &dirEntryStat);
+    chrono::steady_clock::time_point statEnd = chrono::steady_clock::now();
+    statLatency.observe(statEnd-listingEnd);
+    if( Tracer::enabled() )
+      TRACER.record("crawl", "stat", listingEnd, statEnd, Tracer::arg("name", dirEntry->d_name));
+    if( statResult ) {
       LOG(logError) << "stat() on " << dirEntryPath << " failed: " << errnoString();
       continue;
     }
@@ -572,13 +1479,26 @@ void worker::parseDirectory(const string& path, entry_t* ownEntry) {
         entry->state = entry_t::entryOk;
     }
 
-    if( entry->type == entry_t::file )
+    p_crawledEntries++;
+    if( entry->type == entry_t::file ) {
       p_statistics.files++;
-    else
+      p_crawledBytes += dirEntryStat.st_size;
+      crawledFiles.add();
+    } else {
       p_statistics.directories++;
+      crawledDirectories.add();
+    }
   }
   closedir(dir);
-
+  readdirLatency.observe(listing);
+  if( Tracer::enabled() )
+    TRACER.record("crawl", "scan", scanStart, chrono::steady_clock::now(), "\"entries\":"+to_string(entryCache.size()));
+  span.arg("entries", entryCache.size());
+
+  set<entry_t*> newDirectories; //whole new subtrees are written without a single lookup
+  for( vector<entry_t*>::iterator it = entryCache.begin(); it != entryCache.end(); it++ )
+    if( (*it)->type == entry_t::directory && (*it)->state == entry_t::entryNew )
+      newDirectories.insert(*it);
   processChangedEntries(entryCache, ownEntry); //add new files, also insert directories (but not yet mtime/size)
   for( vector<entry_t*>::iterator it = entryCache.begin(); it != entryCache.end(); ) { //we do not need any file entry_t anymore, just keep directories to lower the recursion's memory footprint
     if( (*it)->type != entry_t::directory || (*it)->state == entry_t::entryDeleted ) {
@@ -587,12 +1507,20 @@ void worker::parseDirectory(const string& path, entry_t* ownEntry) {
     } else
       it++;
   }
-  for( vector<entry_t*>::iterator it = entryCache.begin(); it != entryCache.end(); it++ ) { //only directories left
-    parseDirectory(path + '/' + (*it)->name, *it);
-    inheritProperties(ownEntry, *it); //copies size and mtime info (size to subSize for later comparison)
+  //keep the lookups of the next few subdirectories in flight while descending into the current one
+  size_t prefetched = 0;
+  const size_t prefetchWindow = p_pool ? 2*p_pool->size() : 0;
+  for( size_t i = 0; i < entryCache.size(); i++ ) { //only directories left
+    for( ; prefetched < min(entryCache.size(), i+prefetchWindow); prefetched++ )
+      if( !newDirectories.count(entryCache[prefetched]) )
+        prefetchDirectoryEntries(entryCache[prefetched]->id);
+    parseDirectory(path + '/' + entryCache[i]->name, entryCache[i], newDirectories.count(entryCache[i]) > 0);
+    inheritProperties(ownEntry, entryCache[i]); //copies size and mtime info (size to subSize for later comparison)
     if (!p_run) //break loop on global abort condition
       break;
   }
+  for( size_t i = 0; i < prefetched; i++ ) //drop prefetches that have not been picked up after an abort
+    p_prefetches.erase(entryCache[i]->id);
   processChangedEntries(entryCache, ownEntry);
   for( vector<entry_t*>::iterator it = entryCache.begin(); it != entryCache.end(); it++ ) //we do not need any file entry_t anymore, just keep directories
     delete *it; //do not have to call entryCache::erase, it will be deleted anyway
@@ -606,34 +1534,417 @@ void worker::parseDirectory(const string& path, entry_t* ownEntry) {
   LOG(logDebug) << "leaving directory " << path;
 }
 
-void worker::printTree(uint32_t parent, const string& path) {
+void worker::printTree(PrintWriter& out, uint64_t parent) {
   if( !p_databaseInitialized )
     initDatabase();
 
-  vector<entry_t*> entryCache;
-  LOG(logDebug) << "fetching directory entries from db for caching";
-  cacheDirectoryEntriesFromDB(parent, entryCache);
-
-  for( vector<entry_t*>::iterator it = entryCache.begin(); it != entryCache.end(); it++ ) {
-    string subpath = path+"/"+(*it)->name;
-    if( (*it)->type == entry_t::file ) {
-      if (options::getInstance().count("print-sums"))
-        cout << (*it)->hash << "  ";
-      cout << subpath << endl;
+  LOG(logDetailed) << "Reading directories";
+  unordered_map< uint64_t, pair<uint64_t,string> > directories; //id -> parent, name
+  PreparedStatementWrapper* stmt = PreparedStatementWrapper::create(this, "SELECT id,parent,name FROM "+p_directoryTable, PreparedStatementWrapper::resultStreamed);
+  stmt->executeQuery();
+  while( p_run && stmt->next() ) {
+    pair<uint64_t,string>& dir = directories[stmt->getUInt64(1)];
+    dir.first = stmt->getUInt64(2);
+    dir.second = stmt->getString(3);
+  }
+  stmt->release();
+  delete stmt;
+
+  //paths of the directories below parent, relative to it. Directories elsewhere or without a complete chain of
+  //ancestors (which verifyTree would remove) are marked false until they are dropped.
+  unordered_map< uint64_t, pair<bool,string> > paths;
+  paths[parent] = make_pair(true, string());
+  vector<uint64_t> chain;
+  for( auto it = directories.begin(); p_run && it != directories.end(); it++ ) {
+    chain.clear();
+    uint64_t id = it->first;
+    auto known = paths.find(id);
+    while( known == paths.end() && chain.size() <= directories.size() ) {
+      chain.push_back(id);
+      auto dir = directories.find(id);
+      if( id == 0 || dir == directories.end() )
+        break;
+      id = dir->second.first;
+      known = paths.find(id);
+    }
+    pair<bool,string> path = known == paths.end() ? make_pair(false, string()) : known->second;
+    for( auto link = chain.rbegin(); link != chain.rend(); link++ ) {
+      if( path.first )
+        path.second += '/'+directories[*link].second;
+      paths[*link] = path;
+    }
+  }
+  directories.clear();
+  for( auto it = paths.begin(); it != paths.end(); )
+    if( it->second.first )
+      it++;
+    else
+      it = paths.erase(it);
+  p_statistics.directories += paths.size()-1;
+
+  LOG(logDetailed) << "Printing files";
+  uint64_t skipped = 0;
+  stmt = PreparedStatementWrapper::create(this, "SELECT parent,name,size,"+p_backend->unixTime("date")+",hash FROM "+p_fileTable, PreparedStatementWrapper::resultStreamed);
+  stmt->executeQuery();
+  string path;
+  while( p_run && stmt->next() ) {
+    auto dir = paths.find(stmt->getUInt64(1));
+    if( dir == paths.end() )
+      continue;
+    path.assign(dir->second.second).append(1, '/').append(stmt->getString(2));
+    if( !out.add(path, stmt->getUInt64(3), stmt->getUInt64(4), stmt->getHash(5)) )
+      skipped++;
+    p_statistics.files++;
+  }
+  stmt->release();
+  delete stmt;
+  out.close();
+  if( skipped ) {
+    LOG(logWarning) << "Omitted " << skipped << " files without hash";
+  }
+}
+
+void worker::printSnapshot(PrintWriter& out, const Snapshot& snapshot, uint32_t root) {
+  uint64_t skipped = 0;
+  vector< pair<uint32_t,string> > pending(1, make_pair(root, string()));
+  while( p_run && !pending.empty() ) {
+    uint32_t dir = pending.back().first;
+    string path = pending.back().second;
+    pending.pop_back();
+    for( uint32_t node = snapshot.firstChild(dir); node != Snapshot::none; node = snapshot.nextSibling(node) ) {
+      if( snapshot.isDirectory(node) ) {
+        pending.push_back(make_pair(node, path+'/'+snapshot.name(node)));
+        p_statistics.directories++;
+        continue;
+      }
+      if( !out.add(path+'/'+snapshot.name(node), snapshot.size(node), snapshot.mtime(node), snapshot.hash(node)) )
+        skipped++;
       p_statistics.files++;
-    } else {
-      LOG(logDetailed) << "Entering subdirectory " << subpath;
-      printTree((*it)->id, subpath);
-      p_statistics.directories++;
     }
-    if (!p_run) //break loop on global abort condition
-      break;
   }
+  out.close();
+  if( skipped ) {
+    LOG(logWarning) << "Omitted " << skipped << " files without hash";
+  }
+}
+
+//pair of directories to compare, collecting the records of everything below them
+struct diffTask_t {
+  diffTask_t(uint32_t oldNode, uint32_t newNode, const string& path) : oldNode(oldNode), newNode(newNode), path(path), modified(0), files(0), directories(0) {}
+  uint32_t oldNode;
+  uint32_t newNode;
+  string path;
+  string output; //records of modified files
+  vector< pair<uint32_t,string> > removed, added; //subtrees only present in the old or the new snapshot
+  uint64_t modified, files, directories;
+};
+
+//JSON members with the properties of node, sizes of directories are the sum of all files below
+static string diffProperties(const Snapshot& snapshot, uint32_t node, const char* prefix = "") {
+  ostringstream os;
+  os << ",\"" << prefix << "size\":" << snapshot.size(node) << ",\"" << prefix << "mtime\":" << snapshot.mtime(node);
+  string hash = snapshot.hash(node);
+  if( !hash.empty() )
+    os << ",\"" << prefix << "hash\":\"" << hash << '"';
+  return os.str();
+}
+
+static string diffRecord(const char* change, const Snapshot& snapshot, uint32_t node, const string& path) {
+  return string("{\"change\":\"")+change+"\",\"type\":\""+(snapshot.isDirectory(node) ? "directory" : "file")+"\",\"path\":"+
+         worker::jsonString(path)+diffProperties(snapshot, node)+"}\n";
+}
+
+//merge walk over the sorted children of both directories of task. Changed subdirectories are queued in subtasks if
+//given, otherwise they are compared right away.
+static void diffWalk(const Snapshot& o, const Snapshot& n, diffTask_t& task, deque<diffTask_t>* subtasks, const atomic<bool>& run) {
+  const bool compareHashes = o.hashType() == n.hashType();
+  vector<diffTask_t> pending(1, diffTask_t(task.oldNode, task.newNode, task.path));
+  while( run && !pending.empty() ) {
+    uint32_t oldDir = pending.back().oldNode, newDir = pending.back().newNode;
+    string path = pending.back().path;
+    pending.pop_back();
+    task.directories++;
+    uint32_t a = o.firstChild(oldDir), b = n.firstChild(newDir);
+    string nameA = a != Snapshot::none ? o.name(a) : string(), nameB = b != Snapshot::none ? n.name(b) : string();
+    while( a != Snapshot::none || b != Snapshot::none ) {
+      int cmp; //siblings are sorted by name, directories before files of the same name
+      if( a == Snapshot::none )
+        cmp = 1;
+      else if( b == Snapshot::none )
+        cmp = -1;
+      else if( !(cmp = nameA.compare(nameB)) )
+        cmp = (int)n.isDirectory(b)-(int)o.isDirectory(a);
+
+      if( cmp < 0 )
+        task.removed.push_back(make_pair(a, path+'/'+nameA));
+      else if( cmp > 0 )
+        task.added.push_back(make_pair(b, path+'/'+nameB));
+      else if( o.isDirectory(a) ) {
+        if( o.size(a) != n.size(b) || o.entries(a) != n.entries(b) || o.latest(a) != n.latest(b) ) {
+          if( subtasks )
+            subtasks->push_back(diffTask_t(a, b, path+'/'+nameA));
+          else
+            pending.push_back(diffTask_t(a, b, path+'/'+nameA));
+        }
+      } else {
+        task.files++;
+        string oldHash = o.hash(a), newHash = n.hash(b);
+        bool hashChanged = compareHashes && !oldHash.empty() && !newHash.empty() && oldHash != newHash;
+        if( o.size(a) != n.size(b) || o.mtime(a) != n.mtime(b) || hashChanged ) {
+          task.output += "{\"change\":\"modified\",\"type\":\"file\",\"path\":"+worker::jsonString(path+'/'+nameA)+
+                         diffProperties(n, b)+diffProperties(o, a, "old_")+"}\n";
+          task.modified++;
+        }
+      }
+
+      if( cmp <= 0 && (a = o.nextSibling(a)) != Snapshot::none )
+        nameA = o.name(a);
+      if( cmp >= 0 && (b = n.nextSibling(b)) != Snapshot::none )
+        nameB = n.name(b);
+    }
+  }
+}
+
+//all nodes of the subtrees in roots with their paths, in depth first order, so the subtree of every directory directly
+//follows it
+static vector< pair<uint32_t,string> > expandSubtrees(const Snapshot& snapshot, const vector< pair<uint32_t,string> >& roots) {
+  vector< pair<uint32_t,string> > nodes, pending;
+  for( vector< pair<uint32_t,string> >::const_reverse_iterator it = roots.rbegin(); it != roots.rend(); it++ )
+    pending.push_back(*it);
+  while( !pending.empty() ) {
+    nodes.push_back(pending.back());
+    pending.pop_back();
+    const pair<uint32_t,string>& current = nodes.back();
+    size_t first = pending.size();
+    for( uint32_t child = snapshot.firstChild(current.first); child != Snapshot::none; child = snapshot.nextSibling(child) )
+      pending.push_back(make_pair(child, current.second+'/'+snapshot.name(child)));
+    reverse(pending.begin()+first, pending.end());
+  }
+  return nodes;
+}
+
+//keys identifying moved entries of expandSubtrees: files by size, mtime and hash, directories by their aggregates and a
+//digest of the relative paths and keys of everything below them, so directories of equal size are told apart
+static vector<string> moveKeys(const Snapshot& snapshot, const vector< pair<uint32_t,string> >& nodes) {
+  vector<string> keys(nodes.size());
+  for( size_t i = 0; i < nodes.size(); i++ ) {
+    uint32_t node = nodes[i].first;
+    if( snapshot.isDirectory(node) )
+      continue;
+    ostringstream os;
+    os << 'f' << snapshot.size(node) << ' ' << snapshot.mtime(node) << ' ' << snapshot.hash(node);
+    keys[i] = os.str();
+  }
+  hash<string> hasher;
+  for( size_t i = 0; i < nodes.size(); i++ ) {
+    uint32_t node = nodes[i].first;
+    if( !snapshot.isDirectory(node) )
+      continue;
+    size_t digest = 0, prefix = nodes[i].second.length();
+    for( size_t j = i+1; j <= i+snapshot.entries(node); j++ )
+      digest = digest*31+hasher(nodes[j].second.substr(prefix)+'\0'+keys[j]);
+    ostringstream os;
+    os << 'd' << snapshot.size(node) << ' ' << snapshot.entries(node) << ' ' << snapshot.latest(node) << ' ' << digest;
+    keys[i] = os.str();
+  }
+  return keys;
+}
+
+void worker::diffSnapshots(const Snapshot& oldSnapshot, uint32_t oldRoot, const Snapshot& newSnapshot, uint32_t newRoot) {
+  //the upper levels are split into subtrees until there is enough work for all threads
+  deque<diffTask_t> tasks(1, diffTask_t(oldRoot, newRoot, string()));
+  size_t walked = 0;
+  while( p_run && walked < tasks.size() && tasks.size()-walked < 4*p_threads )
+    diffWalk(oldSnapshot, newSnapshot, tasks[walked++], &tasks, p_run);
+  LOG(logDetailed) << "Comparing " << tasks.size()-walked << " subtrees on " << p_threads << " threads";
+  runParallel(tasks.size()-walked, p_threads, p_run, [&](size_t i) {
+    diffWalk(oldSnapshot, newSnapshot, tasks[walked+i], 0, p_run);
+  });
+  if( !p_run )
+    return;
+
+  uint64_t modified = 0;
+  vector< pair<uint32_t,string> > removedRoots, addedRoots;
+  for( deque<diffTask_t>::iterator it = tasks.begin(); it != tasks.end(); it++ ) {
+    cout << it->output;
+    modified += it->modified;
+    p_statistics.files += it->files;
+    p_statistics.directories += it->directories;
+    removedRoots.insert(removedRoots.end(), it->removed.begin(), it->removed.end());
+    addedRoots.insert(addedRoots.end(), it->added.begin(), it->added.end());
+  }
+
+  //an entry removed in one place and added in another with the same key has been moved, unless the key is ambiguous.
+  //Directories are paired first, everything below a moved directory is moved along with it.
+  //Empty files and directories carry too little information to be told apart and are never paired.
+  vector< pair<uint32_t,string> > removed = expandSubtrees(oldSnapshot, removedRoots);
+  vector< pair<uint32_t,string> > added = expandSubtrees(newSnapshot, addedRoots);
+  vector<string> removedKeys = moveKeys(oldSnapshot, removed), addedKeys = moveKeys(newSnapshot, added);
+  const size_t unpaired = (size_t)-1, ambiguous = (size_t)-2;
+  vector<size_t> movedTo(removed.size(), unpaired), movedFrom(added.size(), unpaired);
+  vector<char> removedCovered(removed.size(), 0), addedCovered(added.size(), 0); //below a moved directory
+  uint64_t moved = 0;
+  for( int directories = 1; directories >= 0; directories-- ) {
+    unordered_map< string, pair<size_t,size_t> > candidates; //key -> index in removed and added
+    for( size_t i = 0; i < removed.size(); i++ ) {
+      uint32_t node = removed[i].first;
+      if( removedCovered[i] || oldSnapshot.isDirectory(node) != (bool)directories ||
+          (directories ? oldSnapshot.entries(node) : oldSnapshot.size(node)) == 0 )
+        continue;
+      pair<unordered_map< string, pair<size_t,size_t> >::iterator,bool> inserted =
+        candidates.insert(make_pair(removedKeys[i], make_pair(i, unpaired)));
+      if( !inserted.second )
+        inserted.first->second.first = ambiguous;
+    }
+    for( size_t i = 0; i < added.size(); i++ ) {
+      uint32_t node = added[i].first;
+      if( addedCovered[i] || newSnapshot.isDirectory(node) != (bool)directories )
+        continue;
+      unordered_map< string, pair<size_t,size_t> >::iterator it = candidates.find(addedKeys[i]);
+      if( it != candidates.end() )
+        it->second.second = it->second.second == unpaired ? i : ambiguous;
+    }
+    //in depth first order, so directories below a moved directory are covered before they are looked at
+    vector< pair<size_t,size_t> > pairs;
+    for( unordered_map< string, pair<size_t,size_t> >::const_iterator it = candidates.begin(); it != candidates.end(); it++ )
+      if( it->second.first < ambiguous && it->second.second < ambiguous )
+        pairs.push_back(it->second);
+    sort(pairs.begin(), pairs.end());
+    for( vector< pair<size_t,size_t> >::const_iterator it = pairs.begin(); it != pairs.end(); it++ ) {
+      size_t from = it->first, to = it->second;
+      if( removedCovered[from] || addedCovered[to] )
+        continue;
+      movedTo[from] = to;
+      movedFrom[to] = from;
+      moved++;
+      if( directories ) {
+        fill(removedCovered.begin()+from+1, removedCovered.begin()+from+1+oldSnapshot.entries(removed[from].first), 1);
+        fill(addedCovered.begin()+to+1, addedCovered.begin()+to+1+newSnapshot.entries(added[to].first), 1);
+      }
+    }
+  }
+
+  uint64_t removedCount = 0, addedCount = 0;
+  for( size_t i = 0; i < removed.size(); i++ ) {
+    if( removedCovered[i] )
+      continue;
+    if( movedTo[i] == unpaired ) {
+      cout << diffRecord("removed", oldSnapshot, removed[i].first, removed[i].second);
+      removedCount++;
+      continue;
+    }
+    const pair<uint32_t,string>& target = added[movedTo[i]];
+    cout << "{\"change\":\"moved\",\"type\":\"" << (newSnapshot.isDirectory(target.first) ? "directory" : "file") << "\",\"from\":"
+         << jsonString(removed[i].second) << ",\"path\":" << jsonString(target.second) << diffProperties(newSnapshot, target.first) << "}\n";
+  }
+  for( size_t i = 0; i < added.size(); i++ ) {
+    if( !addedCovered[i] && movedFrom[i] == unpaired ) {
+      cout << diffRecord("added", newSnapshot, added[i].first, added[i].second);
+      addedCount++;
+    }
+  }
+  cout.flush();
+  LOG(logInfo) << "Diff summary: " << addedCount << " added, " << removedCount << " removed, " << modified << " modified, " << moved << " moved";
+}
+
+void worker::exportSnapshot(const string& file, uint64_t parent) {
+  if( !p_databaseInitialized )
+    initDatabase();
+
+  SnapshotWriter writer;
+  for( int files = 0; files < 2; files++ ) {
+    string select = "SELECT id,parent,name,size,"+p_backend->unixTime("date");
+    if( files )
+      select += ",hash";
+    PreparedStatementWrapper* stmt = PreparedStatementWrapper::create(this, select+" FROM "+(files ? p_fileTable : p_directoryTable));
+    stmt->executeQuery();
+    while( p_run && stmt->next() ) {
+      writer.add(stmt->getUInt64(1), stmt->getUInt64(2), !files, stmt->getString(3), stmt->getUInt64(4), stmt->getUInt64(5), files ? stmt->getHash(6) : string());
+      if( files )
+        p_statistics.files++;
+      else
+        p_statistics.directories++;
+    }
+    stmt->release();
+    delete stmt;
+  }
+  if( !p_run )
+    return;
+  uint32_t written = writer.write(file, parent);
+  LOG(logInfo) << "Wrote " << written << " entries to snapshot " << file;
+}
+
+void worker::loadIndex(TreeIndex& index) {
+  if( !p_databaseInitialized )
+    initDatabase();
+
+  index.clear();
+  for( int files = 0; files < 2; files++ ) {
+    string select = "SELECT id,parent,name,size,"+p_backend->unixTime("date");
+    if( files )
+      select += ",hash";
+    PreparedStatementWrapper* stmt = PreparedStatementWrapper::create(this, select+" FROM "+(files ? p_fileTable : p_directoryTable));
+    stmt->executeQuery();
+    while( p_run && stmt->next() ) {
+      if( files )
+        index.addFile(stmt->getUInt64(1), stmt->getUInt64(2), stmt->getString(3), stmt->getUInt64(4), stmt->getUInt64(5), stmt->getHash(6));
+      else
+        index.addDirectory(stmt->getUInt64(1), stmt->getUInt64(2), stmt->getString(3), stmt->getUInt64(4), stmt->getUInt64(5));
+    }
+    stmt->release();
+    delete stmt;
+  }
+  index.link();
+  LOG(logInfo) << "Indexed " << index.files() << " files and " << index.directories() << " directories";
+}
+
+bool worker::loadNames(NameIndexWriter& names) {
+  if( !p_databaseInitialized )
+    initDatabase();
+
+  names.clear();
+  for( int files = 0; files < 2; files++ ) {
+    PreparedStatementWrapper* stmt = PreparedStatementWrapper::create(this, "SELECT id,parent,name FROM "+(files ? p_fileTable : p_directoryTable));
+    stmt->executeQuery();
+    while( p_run && stmt->next() )
+      names.add(stmt->getUInt64(1), stmt->getUInt64(2), !files, stmt->getString(3));
+    stmt->release();
+    delete stmt;
+  }
+  return p_run;
+}
+
+bool worker::countCatalog(catalogCounts_t& counts) {
+  if( !p_databaseInitialized )
+    initDatabase();
+
+  catalogCounts_t none = { 0, 0, 0, 0 };
+  counts = none;
+  for( int files = 0; files < 2; files++ ) {
+    PreparedStatementWrapper* stmt = 0;
+    try {
+      stmt = PreparedStatementWrapper::create(this, "SELECT COUNT(*),COALESCE(MAX(id),0) FROM "+(files ? p_fileTable : p_directoryTable));
+      stmt->executeQuery();
+      if( stmt->next() ) {
+        (files ? counts.files : counts.directories) = stmt->getUInt64(1);
+        (files ? counts.maxFileId : counts.maxDirectoryId) = stmt->getUInt64(2);
+      }
+      stmt->release();
+    } catch( exception& e ) {
+      LOG(logDebug) << "counting the rows of the catalog failed: " << e.what();
+      delete stmt;
+      return false;
+    }
+    delete stmt;
+  }
+  return true;
 }
 
 void worker::processChangedEntries(vector<entry_t*>& entries, entry_t* parentEntry) {
   if (!p_run)
     return;
+  TraceSpan span("db", "write");
+  span.arg("entries", entries.size());
   vector<entry_t*>::iterator it = entries.begin();
   while( it != entries.end() ) {
 
@@ -709,7 +2020,14 @@ worker::entry_t worker::readPath(const string& path) {
   struct stat64 entryStat; //entry's stat
   entry_t entry = { .id = 0, .mtime = 0, .name = string(), .parent = 0, .size = 0, .subSize = 0, .state = entry_t::entryUnknown, .type = entry_t::any, .hash = string() };
 
-  if( stat64(path.c_str(), &entryStat) ) {
+  static Histogram& statLatency = METRICS.histogram("fscrawl_stat_seconds", "Latency of stat calls on directory entries");
+  THROTTLE.operation();
+  int statResult;
+  {
+    ScopedTimer timer(statLatency);
+    statResult = stat64(path.c_str(), &entryStat);
+  }
+  if( statResult ) {
     LOG(logError) << "stat64() on " << path << " failed: " << errnoString();
     return entry;
   }
@@ -728,17 +2046,17 @@ worker::entry_t worker::readPath(const string& path) {
   return entry;
 }
 
-void worker::removeWatches(uint32_t id) {
-  p_prepQueryDirsByParent->setUInt(1,id);
+void worker::removeWatches(uint64_t id) {
+  p_prepQueryDirsByParent->setUInt64(1,id);
   p_prepQueryDirsByParent->executeQuery();
-  vector<uint32_t> cache;
+  vector<uint64_t> cache;
   while( p_prepQueryDirsByParent->next() )
-    cache.push_back(p_prepQueryDirsByParent->getUInt(1));
+    cache.push_back(p_prepQueryDirsByParent->getUInt64(1));
   p_prepQueryDirsByParent->release();
-  for( vector<uint32_t>::iterator it = cache.begin(); it != cache.end(); it++ )
+  for( vector<uint64_t>::iterator it = cache.begin(); it != cache.end(); it++ )
     removeWatches(*it);
   LOG(logDebug) << "removing watch of id " << id;
-  for(map< int, pair<uint32_t,string> >::iterator it = p_watches.begin(); it != p_watches.end(); it++)
+  for(map< int, pair<uint64_t,string> >::iterator it = p_watches.begin(); it != p_watches.end(); it++)
     if( it->second.first == id )
       inotify_rm_watch(p_watchDescriptor, it->first);
 }
@@ -748,13 +2066,39 @@ void worker::resetStatistics() {
   p_statistics.directories = 0;
 }
 
-void worker::setConnection(MYSQL* dbConnection) {
-  p_connection = dbConnection;
+void worker::setBackend(Backend* backend) {
+  p_backend = backend;
   p_databaseInitialized = false;
 }
 
-MYSQL* worker::getConnection() const {
-  return p_connection;
+Backend* worker::getBackend() const {
+  return p_backend;
+}
+
+void worker::setConnectionPool(QueryPool* pool) {
+  p_pool = pool;
+  p_prefetches.clear();
+}
+
+void worker::setDuplicatesTable(const string& duplicatesTable) {
+  if( !duplicatesTable.empty() )
+    p_duplicatesTable = duplicatesTable;
+}
+
+void worker::setProgressInterval(unsigned int seconds) {
+  p_progressInterval = max(seconds, 1u);
+}
+
+void worker::setStatusFile(const string& file) {
+  p_statusFile = file;
+}
+
+void worker::setProgress(bool countEntries) {
+  p_progress = countEntries;
+}
+
+void worker::setThreads(unsigned int threads) {
+  p_threads = max(threads, 1u);
 }
 
 void worker::setForceHashing(bool force) {
@@ -778,14 +2122,14 @@ void worker::setTables(const string& directoryTable, const string& fileTable) {
   p_databaseInitialized = false;
 }
 
-void worker::setupWatches(const string& path, uint32_t id) {
-  p_prepQueryDirsByParent->setUInt(1,id);
+void worker::setupWatches(const string& path, uint64_t id) {
+  p_prepQueryDirsByParent->setUInt64(1,id);
   p_prepQueryDirsByParent->executeQuery();
-  vector< pair<uint32_t, string> > cache;
+  vector< pair<uint64_t, string> > cache;
   while( p_prepQueryDirsByParent->next() )
-    cache.push_back( make_pair(p_prepQueryDirsByParent->getUInt(1), p_prepQueryDirsByParent->getString(2)) );
+    cache.push_back( make_pair(p_prepQueryDirsByParent->getUInt64(1), p_prepQueryDirsByParent->getString(2)) );
   p_prepQueryDirsByParent->release();
-  for( vector< pair<uint32_t, string> >::iterator it = cache.begin(); it != cache.end(); it++ )
+  for( vector< pair<uint64_t, string> >::iterator it = cache.begin(); it != cache.end(); it++ )
     setupWatches(path+'/'+it->second, it->first);
   LOG(logDetailed) << "Setting up watch for \"" << path << "\" (id " << id << ')';
   int dirWatchDescriptor = inotify_add_watch( p_watchDescriptor, path.c_str(), IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ONLYDIR);
@@ -795,31 +2139,39 @@ void worker::setupWatches(const string& path, uint32_t id) {
     LOG(logError) << "Unable to setup watch for id " << id << " with path \"" << path << '\"';
 }
 
-void worker::updateDirectory(uint32_t id, uint64_t size, time_t mtime) {
+void worker::updateDirectory(uint64_t id, uint64_t size, time_t mtime) {
   LOG(logDebug) << "updating dir id " << id << " size " << size << " mtime " << mtime;
   if (p_dryRun)
     return;
   p_prepUpdateDir->setUInt64(1,size);
-  p_prepUpdateDir->setUInt(2,mtime);
-  p_prepUpdateDir->setUInt(3,id);
+  p_prepUpdateDir->setUInt64(2,mtime);
+  p_prepUpdateDir->setUInt64(3,id);
   p_prepUpdateDir->execute();
+  static Counter& updated = rowCounter("directories", "update");
+  updated.add();
+  for( vector<CatalogObserver*>::iterator it = p_observers.begin(); it != p_observers.end(); it++ )
+    (*it)->directoryUpdated(id, size, mtime);
 }
 
-void worker::updateFile(uint32_t id, uint64_t size, time_t mtime, const string& hash) {
+void worker::updateFile(uint64_t id, uint64_t size, time_t mtime, const string& hash) {
   LOG(logDebug) << "updating file id " << id << " size " << size << " mtime " << mtime << " hash " << hash;
   if (p_dryRun)
     return;
   p_prepUpdateFile->setUInt64(1,size);
-  p_prepUpdateFile->setUInt(2,mtime);
+  p_prepUpdateFile->setUInt64(2,mtime);
   if( hash.length() )
-    p_prepUpdateFile->setString(3,hash);
+    p_prepUpdateFile->setHash(3,hash);
   else
     p_prepUpdateFile->setNull(3,0);
-  p_prepUpdateFile->setUInt(4,id);
+  p_prepUpdateFile->setUInt64(4,id);
   p_prepUpdateFile->execute();
+  static Counter& updated = rowCounter("files", "update");
+  updated.add();
+  for( vector<CatalogObserver*>::iterator it = p_observers.begin(); it != p_observers.end(); it++ )
+    (*it)->fileUpdated(id, size, mtime, hash);
 }
 
-void worker::updateTreeProperties(uint32_t firstParent, int64_t sizeDiff, time_t newMTime) {
+void worker::updateTreeProperties(uint64_t firstParent, int64_t sizeDiff, time_t newMTime) {
   LOG(logDetailed) << "Updating directory id " << firstParent << " recursively";
   if (p_dryRun)
     return;
@@ -837,29 +2189,29 @@ void worker::verifyTree() {
   if( !p_databaseInitialized )
     initDatabase();
 
-  list<uint32_t>* idCache = new list<uint32_t>; //contains valid ids that have a connection to parent 0
-  list<uint32_t>::iterator cacheIterator;
+  list<uint64_t>* idCache = new list<uint64_t>; //contains valid ids that have a connection to parent 0
+  list<uint64_t>::iterator cacheIterator;
 
   LOG(logDetailed) << "Verifying directories";
   PreparedStatementWrapper* stmt = PreparedStatementWrapper::create(this, "SELECT id,parent FROM "+p_directoryTable);
   stmt->executeQuery();
   while( p_run && stmt->next() ) { //loop through all directories
-    uint32_t id = stmt->getUInt(1);
-    uint32_t parent = stmt->getUInt(2);
-    uint32_t tempId = id; //id-parent pairs used to trace up until they are either found in idCache or tempParentId gets zero
-    uint32_t tempParentId = parent;
-    list<uint32_t> tempIdCache;
+    uint64_t id = stmt->getUInt64(1);
+    uint64_t parent = stmt->getUInt64(2);
+    uint64_t tempId = id; //id-parent pairs used to trace up until they are either found in idCache or tempParentId gets zero
+    uint64_t tempParentId = parent;
+    list<uint64_t> tempIdCache;
     LOG(logDebug) << "Verify: id " << id << " parent " << parent;
     tempIdCache.push_back(id); //pre-cache id in case it may be valid
     //now we check if we can find the given parent of id
     while( p_run && tempParentId != 0 && find(idCache->begin(), idCache->end(), tempParentId) == idCache->end() ) {
       LOG(logDebug) << "Ancestor: id " << tempId << " parent " << tempParentId;
-      p_prepQueryParentOfDir->setUInt(1,tempParentId);
+      p_prepQueryParentOfDir->setUInt64(1,tempParentId);
       p_prepQueryParentOfDir->executeQuery();
       if( p_prepQueryParentOfDir->next() ) {
         LOG(logDebug) << "found ancestor id " << tempParentId << " of id " << id << " in database, continueing trace";
         tempId = tempParentId;
-        tempParentId = p_prepQueryParentOfDir->getUInt(1);
+        tempParentId = p_prepQueryParentOfDir->getUInt64(1);
         tempIdCache.push_back(tempId); //tempId was found in the database, so it's a valid parent (if we are able to complete the trace)
       } else {
         LOG(logWarning) << "Parent " << tempParentId << " of directory " << tempId << " does not exist. Deleting that subtree!";
@@ -880,29 +2232,31 @@ void worker::verifyTree() {
       idCache->merge(tempIdCache); //cache all temporary ids as the trace is okay
     p_statistics.directories++;
   }
+  stmt->release();
   delete stmt;
 
   LOG(logDetailed) << "Verifying files";
   stmt = PreparedStatementWrapper::create(this, "SELECT id,parent FROM "+p_fileTable);
   stmt->executeQuery();
   while( p_run && stmt->next() ) {
-    uint32_t id = stmt->getUInt(1);
-    uint32_t parent = stmt->getUInt(2);
+    uint64_t id = stmt->getUInt64(1);
+    uint64_t parent = stmt->getUInt64(2);
     if( parent == 0 || find(idCache->begin(), idCache->end(), parent) == idCache->end() ) {
       LOG(logWarning) << "Parent " << parent << " of file " << id << " does not exist. Deleting that file";
       if (!p_dryRun) {
-        p_prepDeleteFile->setUInt(1,id);
+        p_prepDeleteFile->setUInt64(1,id);
         p_prepDeleteFile->execute();
       }
     }
     p_statistics.files++;
   }
+  stmt->release();
   delete stmt;
   delete idCache;
 }
 
 //TODO signal handler to clean up on ctrl+c/SIGTERM
-void worker::watch(const string& path, uint32_t id) {
+void worker::watch(const string& path, uint64_t id) {
   if( !p_databaseInitialized )
     initDatabase();
 
@@ -916,6 +2270,10 @@ void worker::watch(const string& path, uint32_t id) {
   const int eventSize = sizeof(struct inotify_event) + NAME_MAX + 1;
 
   struct pollfd fds = { .fd = p_watchDescriptor, .events = POLLIN, .revents = 0 };
+  Gauge& queueDepth = METRICS.gauge("fscrawl_inotify_queue_bytes", "Bytes of inotify events waiting to be read");
+  Counter& eventCount = METRICS.counter("fscrawl_inotify_events_total", "inotify events handled");
+  Counter& overflows = METRICS.counter("fscrawl_inotify_overflows_total", "Overflows of the inotify event queue, each one lost events");
+  Histogram& eventLag = METRICS.histogram("fscrawl_inotify_event_lag_seconds", "Time from reading a batch of inotify events until it is written to the catalog");
 
   while( p_run ) {
     poll(&fds, 1, 1000); //poll for new events every second
@@ -923,6 +2281,10 @@ void worker::watch(const string& path, uint32_t id) {
       continue;
     char* buffer = new char[eventSize];
     int len = read(p_watchDescriptor, buffer, eventSize);
+    chrono::steady_clock::time_point received = chrono::steady_clock::now();
+    int pending = 0;
+    if( ioctl(p_watchDescriptor, FIONREAD, &pending) == 0 )
+      queueDepth.set(pending);
     int offset = 0;
     while( offset < len ) {
       struct inotify_event* event = (struct inotify_event*)(buffer+offset);
@@ -933,7 +2295,7 @@ void worker::watch(const string& path, uint32_t id) {
         }
         case IN_ATTRIB | IN_ISDIR : { //directory's mtime changed
           LOG(logDebug) << "got inotify event IN_ATTRIB for dir \"" << event->name << "\" cookie " << event->cookie << " wd " << event->wd << " dir " << p_watches[event->wd].first;
-          const pair<uint32_t,string> p = p_watches[event->wd];
+          const pair<uint64_t,string> p = p_watches[event->wd];
           const string path = p.second + '/' + event->name;
           entry_t fsEntry = readPath(path);
           if( fsEntry.state == entry_t::entryUnknown ) { //readPath failed
@@ -956,26 +2318,37 @@ void worker::watch(const string& path, uint32_t id) {
         }
         case IN_CREATE : {
           LOG(logDebug) << "got inotify event IN_CREATE for file \"" << event->name << "\" cookie " << event->cookie << " wd " << event->wd << " dir " << p_watches[event->wd].first;
-          const pair<uint32_t,string> p = p_watches[event->wd];
+          const pair<uint64_t,string> p = p_watches[event->wd];
           const string path = p.second + '/' + event->name;
           entry_t e = readPath( path );
           if( e.state == entry_t::entryOk ) { //readPath successful
             //insert a blank hash because the file may not be written out completely
             //hashing will be done by IN_CLOSE_WRITE when the file is closed after writing
-            insertFile(p.first, event->name, e.size, e.mtime, string());
-            updateTreeProperties(p.first, e.size, e.mtime);
+            entry_t dbEntry = getFileByName(event->name, p.first);
+            if( dbEntry.id != 0 ) { //late event for a file already added by IN_CLOSE_WRITE or a crawl
+              updateFile(dbEntry.id, e.size, e.mtime, string());
+              updateTreeProperties(p.first, e.size - dbEntry.size, e.mtime);
+            } else {
+              insertFile(p.first, event->name, e.size, e.mtime, string());
+              updateTreeProperties(p.first, e.size, e.mtime);
+            }
           } else
             LOG(logError) << "failed to read path \"" << path << '\"';
           break;
         }
         case IN_CREATE | IN_ISDIR : {
           LOG(logDebug) << "got inotify event IN_CREATE for dir \"" << event->name << "\" cookie " << event->cookie << " wd " << event->wd << " dir " << p_watches[event->wd].first;
-          const pair<uint32_t,string> p = p_watches[event->wd];
+          const pair<uint64_t,string> p = p_watches[event->wd];
           const string path = p.second + '/' + event->name;
           entry_t e = readPath( path );
           if( e.state == entry_t::entryOk ) { //readPath successful
-            e.id = insertDirectory(p.first, event->name, e.size, e.mtime);
-            updateTreeProperties(p.first, e.size, e.mtime);
+            entry_t dbEntry = getDirectoryByName(event->name, p.first);
+            if( dbEntry.id != 0 ) //late event for a directory already added by a crawl
+              e.id = dbEntry.id;
+            else {
+              e.id = insertDirectory(p.first, event->name, e.size, e.mtime);
+              updateTreeProperties(p.first, e.size, e.mtime);
+            }
             setupWatches(path, e.id);
           } else
             LOG(logError) << "failed to read path \"" << path << '\"';
@@ -983,7 +2356,7 @@ void worker::watch(const string& path, uint32_t id) {
         }
         case IN_CLOSE_WRITE : { //covers newly created files as well as modified existing files
           LOG(logDebug) << "got inotify event IN_CLOSE_WRITE for file \"" << event->name << "\" cookie " << event->cookie << " wd " << event->wd << " dir " << p_watches[event->wd].first;
-          const pair<uint32_t,string> p = p_watches[event->wd];
+          const pair<uint64_t,string> p = p_watches[event->wd];
           const string path = p.second + '/' + event->name;
           entry_t fsEntry = readPath(path);
           if( fsEntry.state == entry_t::entryUnknown ) { //readPath failed
@@ -1010,23 +2383,37 @@ void worker::watch(const string& path, uint32_t id) {
         }
         case IN_MOVED_TO : {
           LOG(logDebug) << "got inotify event IN_MOVED_TO for file \"" << event->name << "\" cookie " << event->cookie << " wd " << event->wd << " dir " << p_watches[event->wd].first;
-          const pair<uint32_t,string> p = p_watches[event->wd];
+          const pair<uint64_t,string> p = p_watches[event->wd];
           const string path = p.second + '/' + event->name;
           entry_t e = readPath( path );
           if( e.state == entry_t::entryOk ) { //readPath successful
             hashFile(&e, path);
-            insertFile(p.first, event->name, e.size, e.mtime, e.hash);
-            updateTreeProperties(p.first, e.size, e.mtime);
+            entry_t dbEntry = getFileByName(event->name, p.first);
+            if( dbEntry.id != 0 ) { //moved over an existing file, which keeps its row
+              LOG(logInfo) << "Replacing file " << event->name;
+              updateFile(dbEntry.id, e.size, e.mtime, e.hash);
+              updateTreeProperties(p.first, e.size - dbEntry.size, e.mtime);
+            } else {
+              insertFile(p.first, event->name, e.size, e.mtime, e.hash);
+              updateTreeProperties(p.first, e.size, e.mtime);
+            }
           } else
             LOG(logError) << "failed to read path \"" << path << '\"';
           break;
         }
         case IN_MOVED_TO | IN_ISDIR : {
           LOG(logDebug) << "got inotify event IN_MOVED_TO for dir \"" << event->name << "\" cookie " << event->cookie << " wd " << event->wd << " dir " << p_watches[event->wd].first;
-          const pair<uint32_t,string> p = p_watches[event->wd];
+          const pair<uint64_t,string> p = p_watches[event->wd];
           const string path = p.second + '/' + event->name;
           entry_t e = readPath( path );
           if( e.state == entry_t::entryOk ) { //readPath successful
+            entry_t dbEntry = getDirectoryByName(event->name, p.first);
+            if( dbEntry.id != 0 ) { //moved over an empty directory, the replaced one gets no event of its own
+              LOG(logInfo) << "Replacing directory " << event->name;
+              removeWatches(dbEntry.id);
+              deleteDirectory(dbEntry.id);
+              updateTreeProperties(p.first, (int64_t)-1*dbEntry.size, 0);
+            }
             e.id = insertDirectory(p.first, event->name, e.size, e.mtime);
             parseDirectory(path, &e);
             setupWatches(path, e.id);
@@ -1039,7 +2426,7 @@ void worker::watch(const string& path, uint32_t id) {
         case IN_MOVED_FROM :
         case IN_DELETE : {
           LOG(logDebug) << "got inotify event IN_DELETE/IN_MOVED_FROM for file \"" << event->name << "\" cookie " << event->cookie << " wd " << event->wd << " dir " << p_watches[event->wd].first;
-          const pair<uint32_t,string> p = p_watches[event->wd];
+          const pair<uint64_t,string> p = p_watches[event->wd];
           entry_t e = getFileByName(event->name, p.first);
           if( e.id != 0 ) {
             LOG(logInfo) << "Removing file " << event->name;
@@ -1052,7 +2439,7 @@ void worker::watch(const string& path, uint32_t id) {
         case IN_MOVED_FROM | IN_ISDIR :
         case IN_DELETE | IN_ISDIR : {
           LOG(logDebug) << "got inotify event IN_DELETE/IN_MOVED_FROM for dir \"" << event->name << "\" cookie " << event->cookie << " wd " << event->wd << " dir " << p_watches[event->wd].first;
-          const pair<uint32_t,string> p = p_watches[event->wd];
+          const pair<uint64_t,string> p = p_watches[event->wd];
           entry_t e = getDirectoryByName(event->name, p.first);
           if( e.id != 0 ) {
             removeWatches(e.id);
@@ -1063,14 +2450,22 @@ void worker::watch(const string& path, uint32_t id) {
             LOG(logError) << "Failed to get directory \"" << event->name << "\" from db for removal, already deleted.";
           break;
         }
+        case IN_Q_OVERFLOW : { //carries no watch descriptor
+          LOG(logWarning) << "inotify event queue overflowed, changes were lost until the next crawl";
+          overflows.add();
+          break;
+        }
         default : {
           LOG(logDebug) << "unhandled inotify event " << event->mask << " for file \"" << event->name << "\" cookie " << event->cookie << " wd " << event->wd << " dir " << p_watches[event->wd].first;
           break;
         }
       }
       offset += sizeof(inotify_event)+event->len;
+      eventCount.add();
     }
     delete[] buffer;
+    p_backend->flush(); //make the changes visible to other readers of the catalog without waiting for more events
+    eventLag.observe(chrono::steady_clock::now()-received);
   }
 
   //program cannot reach that point till now
@@ -1079,7 +2474,11 @@ void worker::watch(const string& path, uint32_t id) {
 }
 
 void worker::query(const string& query) {
-  int ret = mysql_query(p_connection, query.c_str());
-  if (ret)
-    throw SQLException("mysql_query failed: "+string(mysql_error(p_connection)));
+  for( unsigned int attempt = 0; !p_backend->query(query); attempt++ ) {
+    if( attempt >= PreparedStatementWrapper::maxRetries() )
+      throw SQLException("giving up on query after "+to_string(attempt)+" reconnects: "+query);
+    LOG(logWarning) << "Reconnecting to database, attempt " << attempt+1;
+    this_thread::sleep_for(chrono::seconds(attempt));
+    reconnect();
+  }
 }
@@ -1,34 +1,69 @@
 #ifndef WORKER_H
 #define WORKER_H
 
+#include <atomic>
+#include <functional>
+#include <future>
 #include <map>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
-#include <mysql.h>
 #include <stdint.h>
 
+#include "backend.h"
 #include "prepared_statement_wrapper.h"
+#include "print_writer.h"
+#include "query_pool.h"
+#include "snapshot.h"
 
 using namespace std;
 
 class Hasher;
+class NameIndexWriter;
+class TreeIndex;
+
+//Receives every change the worker writes to the catalog, after it has been written. Not called in dry runs.
+class CatalogObserver {
+public:
+  virtual ~CatalogObserver() {}
+  virtual void directoryInserted(uint64_t id, uint64_t parent, const string& name, uint64_t size, time_t mtime) = 0;
+  virtual void fileInserted(uint64_t id, uint64_t parent, const string& name, uint64_t size, time_t mtime, const string& hash) = 0;
+  virtual void directoryUpdated(uint64_t id, uint64_t size, time_t mtime) = 0;
+  virtual void fileUpdated(uint64_t id, uint64_t size, time_t mtime, const string& hash) = 0;
+  virtual void directoryDeleted(uint64_t id) = 0; //including everything below it
+  virtual void fileDeleted(uint64_t id) = 0;
+};
 
 class worker {
 public:
-  worker(MYSQL* dbConnection = 0);
+  worker(Backend* backend = 0);
   ~worker();
 
   struct statistics {
     uint32_t files;
     uint32_t directories;
   };
+  //size of a subtree as stored in the catalog, the expected work of crawling it again
+  struct subtreeTotals_t {
+    uint64_t files;
+    uint64_t directories;
+    uint64_t bytes; //sizes of the files
+  };
+  //rows and highest id of both tables, changes with every insert and delete
+  struct catalogCounts_t {
+    uint64_t directories;
+    uint64_t maxDirectoryId;
+    uint64_t files;
+    uint64_t maxFileId;
+  };
   struct entry_t {
-    uint32_t id;
+    uint64_t id;
     time_t mtime;
     string name;
-    uint32_t parent;
+    uint64_t parent;
     uint64_t size;
     uint64_t subSize; //used to calculate the size of directories
     enum state_t { entryUnknown, entryOk, entryDeleted, entryPropertiesChanged, entryNew } state;
@@ -42,91 +77,170 @@ public:
     string hash; //only valid for files
   };
 
-  void setConnection(MYSQL* dbConnection);
-  MYSQL* getConnection() const;
+  void setBackend(Backend* backend);
+  Backend* getBackend() const;
+  //reads of directory entries are pipelined through the pool while crawling, only for server backends
+  void setConnectionPool(QueryPool* pool);
   void setInheritance(bool inheritSize, bool inheritMTime);
   void setDryRun(bool on);
+  //logs the query plan of every prepared statement once the database is initialized
+  void setExplain(bool on);
+  //the catalog is only read, e.g. from a replica, so its tables are not created
+  void setReadOnly(bool on);
   void setTables(const string& directoryTable, const string& fileTable);
+  void setDuplicatesTable(const string& duplicatesTable);
+  void setThreads(unsigned int threads);
+  void setProgressInterval(unsigned int seconds);
+  //crawls write their progress as JSON object to file every progress interval, implies setProgress(true)
+  void setStatusFile(const string& file);
+  //count the entries of the crawled subtree before a crawl instead of only taking the stored size of its root
+  void setProgress(bool countEntries);
   void setHasher(Hasher* hasher);
   Hasher* getHasher() const;
   void setForceHashing(bool force);
   bool getForceHashing() const;
+  //observers of all catalog changes, called in the order they were added
+  void addObserver(CatalogObserver* observer);
+  void removeObserver(CatalogObserver* observer);
+
+  //the file table stores hashes as digests (schema v3), statements convert them with getHash and setHash
+  bool binaryHashes() const;
 
   const statistics& getStatistics() const;
   void resetStatistics();
 
   //The worker traces the path from "id" up the id "upToId", its name is not appended to the returned path anymore.
-  string ascendPath(uint32_t id, uint32_t upToId = 0, entry_t::type_t type = entry_t::file);
+  string ascendPath(uint64_t id, uint64_t upToId = 0, entry_t::type_t type = entry_t::file);
   //The worker descends to the specified path and returns its id, creates a directory if not specified different
-  uint32_t descendPath(string path, entry_t::type_t type = entry_t::directory, bool createDirectory = true);
+  uint64_t descendPath(string path, entry_t::type_t type = entry_t::directory, bool createDirectory = true);
   //Clear all database contents
   void clearDatabase();
   //Delete directory by id recursively
-  void deleteDirectory(uint32_t id);
+  void deleteDirectory(uint64_t id);
   //Delete file by id
-  void deleteFile(uint32_t id);
+  void deleteFile(uint64_t id);
   //Start to parse the directory path. path will be stripped from the files' path. Will be inserted under parent "id".
-  void parseDirectory(const string& path, uint32_t id = 0);
+  void parseDirectory(const string& path, uint64_t id = 0);
   //Verify the tree consistency. Resource hungry!
   void verifyTree();
-  //Prints all files and directories in the tree below parent
-  void printTree(uint32_t parent = 0, const string& path = "");
+  //Prints all files in the tree below parent to out. The file table is read in a single streamed scan, paths are put
+  //together from the directories held in memory, so the files come in catalog order instead of tree order.
+  void printTree(PrintWriter& out, uint64_t parent = 0);
   //Watches the directory id including subdirectories
-  void watch(const string& path, uint32_t id = 0);
+  void watch(const string& path, uint64_t id = 0);
   //Check the hash of all files under directory "parent", prepending "path" to the files relative path from the database
   //Only files existing in the database will be crawled, the filesystem path is built from database information.
-  void hashCheck(const string& path, uint32_t parent = 0);
-  //Called by PreparedStatementWrapper if the connection has been reconnected and thus all prepared statements have to be re-prepared
+  //Files are verified in parallel by p_threads readers per device, results are optionally written to reportFile as JSON lines.
+  void hashCheck(const string& path, uint64_t parent = 0, const string& reportFile = string());
+  //Like hashCheck, but the files below node "root" are taken from a snapshot instead of the database
+  void hashCheck(const string& path, const Snapshot& snapshot, uint32_t root, const string& reportFile = string());
+  //Prints all files below node "root" of a snapshot to out, like printTree without accessing the database
+  void printSnapshot(PrintWriter& out, const Snapshot& snapshot, uint32_t root = 0);
+  //Prints the differences between the trees below oldRoot and newRoot of two snapshots as JSON lines of added, removed,
+  //modified and moved entries. Subtrees with equal size, number of entries and latest mtime are skipped without descending.
+  void diffSnapshots(const Snapshot& oldSnapshot, uint32_t oldRoot, const Snapshot& newSnapshot, uint32_t newRoot);
+  //Writes the tree below parent to a snapshot file
+  void exportSnapshot(const string& file, uint64_t parent = 0);
+  //Fills index with the whole catalog, read in one scan of each table
+  void loadIndex(TreeIndex& index);
+  //Fills names with the names of the whole catalog, returns false if aborted before all were read
+  bool loadNames(NameIndexWriter& names);
+  //Counts the rows of both tables, returns false if the backend can not count them
+  bool countCatalog(catalogCounts_t& counts);
+  //Verify files below "parent" in order of their last verification until timeBudget seconds or byteBudget bytes (0 = unlimited) are used up.
+  //Every file that passed gets its last_verified timestamp updated, so subsequent runs continue with the files verified longest ago.
+  void scrub(const string& path, uint64_t parent = 0, uint64_t timeBudget = 0, uint64_t byteBudget = 0, const string& reportFile = string());
+  //Find duplicate files under directory "parent" by grouping on size, then on a hash of sampleSize bytes of head and tail, then on the full hash.
+  //Groups are written to the duplicates table and printed to standard output.
+  void findDuplicates(const string& path, uint64_t parent = 0, uint64_t sampleSize = 65536);
+  //Copies all directories and files into the (empty) catalog of target, keeping their ids
+  void copyCatalog(worker* target);
+  //Called by PreparedStatementWrapper if the connection has been lost, returns true if it has been reestablished
+  bool reconnect();
+  //Called after the connection has been reconnected and thus all prepared statements have to be re-prepared
   void databaseReconnected();
+  //Every PreparedStatementWrapper registers itself, so it can be re-prepared after a reconnect
+  void registerStatement(PreparedStatementWrapper* statement);
+  void unregisterStatement(PreparedStatementWrapper* statement);
   //Sets internal conditions to abort crawling, hashing or watching
   void abort();
 
   //returns strerror as std::string
   static string errnoString();
+  //returns s quoted and escaped as a JSON string
+  static string jsonString(const string& s);
 
 private:
-  void cacheDirectoryEntriesFromDB(uint32_t id, vector<entry_t*>& entryCache);
-  void cacheParent(uint32_t id, uint32_t parent);
+  void cacheDirectoryEntriesFromDB(uint64_t id, vector<entry_t*>& entryCache);
+  //queues the queries for the entries of directory id on the connection pool, cacheDirectoryEntriesFromDB picks up the results
+  void prefetchDirectoryEntries(uint64_t id);
+  void cacheParent(uint64_t id, uint64_t parent);
+  //loads all directories below "parent" with a single table scan and maps their ids to their path relative to parent
+  void loadDirectoryPaths(uint64_t parent, unordered_map<uint64_t,string>& paths);
+  //receives a file to check: directory path, id, name, expected hash and size
+  typedef function<void(const string&, uint64_t, const string&, const string&, uint64_t)> checkFile_t;
+  //verifies the files the producer passes to its argument in parallel, used by both variants of hashCheck
+  void checkFiles(const string& reportFile, const function<void(const checkFile_t&)>& producer);
   //These functions access the database and get their stored properties.
-  entry_t getDirectoryById(uint32_t id); //returns an empty entry_t.name on failure
-  entry_t getDirectoryByName(const string& name, uint32_t parent); //returns entry_t.id = 0 on failure
-  entry_t getFileById(uint32_t id); //returns an empty entry_t.name on failure
-  entry_t getFileByName(const string& name, uint32_t parent); //returns entry_t.id = 0 on failure
+  entry_t getDirectoryById(uint64_t id); //returns an empty entry_t.name on failure
+  entry_t getDirectoryByName(const string& name, uint64_t parent); //returns entry_t.id = 0 on failure
+  entry_t getFileById(uint64_t id); //returns an empty entry_t.name on failure
+  entry_t getFileByName(const string& name, uint64_t parent); //returns entry_t.id = 0 on failure
   void initDatabase();
   void prepareStatements();
+  void explainStatements();
   void inheritProperties(entry_t* parent, const entry_t* entry) const;
-  uint32_t insertDirectory(uint32_t parent, const string& name, uint64_t size, time_t mtime);
-  uint32_t insertFile(uint32_t parent, const string& name, uint64_t size, time_t mtime, const string& hash);
+  uint64_t insertDirectory(uint64_t parent, const string& name, uint64_t size, time_t mtime);
+  uint64_t insertFile(uint64_t parent, const string& name, uint64_t size, time_t mtime, const string& hash);
   //parses everything inside path, uses the id specified in ownEntry. size and mtime of contents will be updates into ownEntry as well. does not change the directory itself in the db
-  void parseDirectory(const string& path, entry_t* ownEntry);
+  //isNew: ownEntry has just been inserted, so there is nothing below it in the database to look up
+  void parseDirectory(const string& path, entry_t* ownEntry, bool isNew = false);
   void processChangedEntries(vector<entry_t*>& entries, entry_t* parentEntry);
   //tries to read a file or directory at the specified path and returns its properties (name, size, mtime) in an entry_t
   entry_t readPath(const string& path); //returns entry_t.state = entry_t::entryOk/entryUnknown on success/failure
-  void removeWatches(uint32_t id);
-  void setupWatches(const string& path, uint32_t id);
-  void updateDirectory(uint32_t id, uint64_t size, time_t mtime);
-  void updateFile(uint32_t id, uint64_t size, time_t mtime, const string& hash);
-  void updateTreeProperties(uint32_t firstParent, int64_t sizeDiff, time_t newMTime);
-  void hashFile(entry_t* entry, const string& path) const;
+  void removeWatches(uint64_t id);
+  void setupWatches(const string& path, uint64_t id);
+  void updateDirectory(uint64_t id, uint64_t size, time_t mtime);
+  void updateFile(uint64_t id, uint64_t size, time_t mtime, const string& hash);
+  void updateTreeProperties(uint64_t firstParent, int64_t sizeDiff, time_t newMTime);
+  void hashFile(entry_t* entry, const string& path);
+  //counts the subtree below directory id if progress or a status file asks for it, the bytes are taken from the stored
+  //size of root if it is not counted or the backend can not count
+  subtreeTotals_t countSubtree(uint64_t id, const entry_t& root);
 
   void query(const string& query);
 
   string p_basePath;
   bool p_databaseInitialized;
+  bool p_binaryHashes;
   string p_directoryTable;
   string p_fileTable;
+  string p_duplicatesTable;
   bool p_inheritMTime;
   bool p_inheritSize;
   statistics p_statistics;
   int p_watchDescriptor;
-  map< int, pair<uint32_t,string> > p_watches; //stores inotify watch descriptors and their corresponding ids and paths
+  map< int, pair<uint64_t,string> > p_watches; //stores inotify watch descriptors and their corresponding ids and paths
   bool p_forceHashing;
-  bool p_run;
+  atomic<bool> p_run;
   bool p_dryRun;
+  bool p_explain;
+  bool p_readOnly;
+  unsigned int p_threads;
+  unsigned int p_progressInterval;
+  string p_statusFile;
+  bool p_progress;
+  //progress of the running crawl, read by the progress reporter thread
+  atomic<uint64_t> p_crawledEntries;
+  atomic<uint64_t> p_crawledBytes;
+  atomic<uint64_t> p_hashedBytes;
 
   Hasher* p_hasher;
+  vector<CatalogObserver*> p_observers;
 
-  MYSQL* p_connection;
+  Backend* p_backend;
+  QueryPool* p_pool;
+  map< uint64_t, pair< future<queryResult_t>, future<queryResult_t> > > p_prefetches; //directory id -> pending (directories, files)
   PreparedStatementWrapper* p_prepQueryFileById;
   PreparedStatementWrapper* p_prepQueryFileByName;
   PreparedStatementWrapper* p_prepQueryFilesByParent;
@@ -141,7 +255,7 @@ private:
   PreparedStatementWrapper* p_prepInsertDir;
   PreparedStatementWrapper* p_prepUpdateDir;
   PreparedStatementWrapper* p_prepDeleteDir;
-  PreparedStatementWrapper* p_prepLastInsertID;
+  set<PreparedStatementWrapper*> p_statements; //all living statements, including temporary ones
 };
 
 #endif //WORKER_H